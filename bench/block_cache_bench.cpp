@@ -0,0 +1,171 @@
+// Random reads with a zipfian (s = 0.99) block popularity, the skew you get from many clients
+// sharing a few hot regions of an image. Compares plain O_DIRECT preads against the block
+// cache, and reports the cache's hit rate and evictions.
+//
+// Usage: mndb-block-cache-bench <file> [secs] [threads] [cache MiB]
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "block_cache.hpp"
+
+namespace
+{
+
+const uint64_t read_size = 4096;
+
+// Draws ranks 0..n-1 with probability proportional to 1 / (rank + 1)^s, by binary search
+// over the cumulative distribution.
+class zipfian
+{
+public:
+
+    zipfian(uint64_t n, double s)
+        : cdf_(n)
+    {
+        double total = 0;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            total += 1.0 / std::pow(static_cast<double>(i + 1), s);
+            cdf_[i] = total;
+        }
+        for (double& c : cdf_)
+        {
+            c /= total;
+        }
+    }
+
+    template <typename Rng>
+    uint64_t operator()(Rng& rng)
+    {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+    }
+
+private:
+
+    std::vector<double> cdf_;
+};
+
+template <typename F>
+double run(const char* name, size_t threads, double seconds, uint64_t pages, F read)
+{
+    zipfian popularity(pages, 0.99);
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> total(0);
+    std::atomic<uint64_t> failed(0);
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]
+        {
+            std::mt19937_64 rng(t + 1);
+            // Scatter the ranks so the hot pages aren't all at the start of the file.
+            const uint64_t stride = 2654435761ull;
+            void* buffer;
+            if (posix_memalign(&buffer, 4096, read_size) != 0)
+            {
+                return;
+            }
+            uint64_t done = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                uint64_t page = popularity(rng) * stride % pages;
+                if (read(page * read_size, static_cast<char*>(buffer)) != 0)
+                {
+                    failed++;
+                }
+                done++;
+            }
+            total += done;
+            free(buffer);
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+
+    double rate = total / seconds;
+    std::cout << name << "\t" << static_cast<uint64_t>(rate) << " reads/s\t"
+              << rate * read_size / (1024 * 1024) << " MiB/s";
+    if (failed)
+    {
+        std::cout << "\t(" << failed << " failed)";
+    }
+    std::cout << std::endl;
+    return rate;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <file> [secs] [threads] [cache MiB]" << std::endl;
+        return 1;
+    }
+    const char* path = argv[1];
+    double seconds = argc > 2 ? std::atof(argv[2]) : 5;
+    size_t threads = argc > 3 ? std::atoi(argv[3]) : 8;
+    size_t cache_mib = argc > 4 ? std::atoi(argv[4]) : 16;
+
+    int fd = ::open(path, O_RDONLY | O_DIRECT);
+    bool direct = fd >= 0;
+    if (!direct)
+    {
+        // tmpfs and friends don't do O_DIRECT.
+        fd = ::open(path, O_RDONLY);
+    }
+    if (fd < 0)
+    {
+        std::cerr << "Can't open " << path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    uint64_t pages = lseek(fd, 0, SEEK_END) / read_size;
+    if (pages == 0)
+    {
+        std::cerr << path << " is too small" << std::endl;
+        return 1;
+    }
+
+    std::cout << pages * read_size / (1024 * 1024) << " MiB file, " << threads << " threads, "
+              << cache_mib << " MiB cache" << (direct ? "" : " (no O_DIRECT)") << std::endl;
+
+    run(direct ? "pread (O_DIRECT)" : "pread", threads, seconds, pages, [fd](uint64_t offset, char* dest)
+    {
+        return pread(fd, dest, read_size, offset) == static_cast<ssize_t>(read_size) ? 0 : EIO;
+    });
+    ::close(fd);
+
+    block_cache::options opts;
+    opts.memory_budget = cache_mib * 1024 * 1024;
+    block_cache cache(opts);
+    int cached_fd = cache.open(path, false);
+    run("block_cache", threads, seconds, pages, [&](uint64_t offset, char* dest)
+    {
+        return cache.read(cached_fd, offset, read_size, dest);
+    });
+
+    block_cache::stats s = cache.get_stats();
+    std::cout << "hits " << s.hits << "\tmisses " << s.misses << "\thit rate "
+              << 100.0 * s.hits / std::max<uint64_t>(1, s.hits + s.misses) << "%\tevictions " << s.evictions << std::endl;
+    cache.close(cached_fd);
+    return 0;
+}
@@ -0,0 +1,224 @@
+// Opens a crowd of connections to a running server all at once and negotiates every one of
+// them into transmission with NBD_OPT_GO, then reports how long the whole crowd took and
+// the handshake rate. Each connection finishes its greeting before any sends its option,
+// so the server has them all mid-negotiation together.
+//
+// Before the crowd arrives, some clients connect and then say nothing. A server that
+// negotiates synchronously stalls behind them; one that doesn't carries on regardless.
+//
+// Usage: mndb-connection-storm-bench <host> [port] [export] [stalled clients]
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/endian/conversion.hpp>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "nbd.hpp"
+
+namespace
+{
+
+struct settings
+{
+    std::string host;
+    std::string port = "10809";
+    std::string export_name;
+    size_t stalled = 16;
+};
+
+bool send_all(int sock, const void* data, size_t length)
+{
+    const char* p = static_cast<const char*>(data);
+    while (length > 0)
+    {
+        ssize_t res = send(sock, p, length, MSG_NOSIGNAL);
+        if (res <= 0)
+        {
+            return false;
+        }
+        p += res;
+        length -= res;
+    }
+    return true;
+}
+
+bool recv_all(int sock, void* data, size_t length)
+{
+    char* p = static_cast<char*>(data);
+    while (length > 0)
+    {
+        ssize_t res = recv(sock, p, length, 0);
+        if (res <= 0)
+        {
+            return false;
+        }
+        p += res;
+        length -= res;
+    }
+    return true;
+}
+
+int open_connection(const settings& s)
+{
+    addrinfo hints = {};
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses;
+    if (getaddrinfo(s.host.c_str(), s.port.c_str(), &hints, &addresses) != 0)
+    {
+        return -1;
+    }
+    int sock = socket(addresses->ai_family, SOCK_STREAM, 0);
+    if (sock >= 0 && connect(sock, addresses->ai_addr, addresses->ai_addrlen) != 0)
+    {
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addresses);
+    if (sock >= 0)
+    {
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return sock;
+}
+
+// Reads the greeting and sends the client flags and NBD_OPT_GO.
+bool send_go(const settings& s, int sock)
+{
+    initial_message initial;
+    if (!recv_all(sock, &initial, sizeof(initial)))
+    {
+        return false;
+    }
+
+    uint32_t client_flags = boost::endian::native_to_big(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES);
+
+    std::vector<char> data(4 + s.export_name.size() + 2, 0);
+    uint32_t name_length = boost::endian::native_to_big(static_cast<uint32_t>(s.export_name.size()));
+    memcpy(data.data(), &name_length, 4);
+    memcpy(data.data() + 4, s.export_name.data(), s.export_name.size());
+
+    client_option option;
+    option.optmagic = boost::endian::native_to_big(optmagic);
+    option.option = boost::endian::native_to_big(NBD_OPT_GO);
+    option.length_of_data = boost::endian::native_to_big(static_cast<uint32_t>(data.size()));
+    return send_all(sock, &client_flags, sizeof(client_flags)) && send_all(sock, &option, sizeof(option))
+        && send_all(sock, data.data(), data.size());
+}
+
+// Reads replies to NBD_OPT_GO up to the final one. True if it took us into transmission.
+bool finish_go(int sock)
+{
+    for (;;)
+    {
+        server_negotiation_response response;
+        if (!recv_all(sock, &response, sizeof(response)))
+        {
+            return false;
+        }
+        uint32_t type = boost::endian::big_to_native(response.reply_type);
+        std::vector<char> payload(boost::endian::big_to_native(response.reply_length));
+        if (!recv_all(sock, payload.data(), payload.size()))
+        {
+            return false;
+        }
+        if (type == NBD_REP_ACK)
+        {
+            return true;
+        }
+        if (type != NBD_REP_INFO)
+        {
+            return false;
+        }
+    }
+}
+
+void disconnect(int sock)
+{
+    request_message request = {};
+    request.nbd_request_magic = boost::endian::native_to_big(NBD_REQUEST_MAGIC);
+    request.type = boost::endian::native_to_big(NBD_CMD_DISC);
+    send_all(sock, &request, sizeof(request));
+    close(sock);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <host> [port] [export] [stalled clients]" << std::endl;
+        return 1;
+    }
+
+    settings s;
+    s.host = argv[1];
+    if (argc > 2) s.port = argv[2];
+    if (argc > 3) s.export_name = argv[3];
+    if (argc > 4) s.stalled = std::stoul(argv[4]);
+
+    std::vector<int> stalled;
+    for (size_t i = 0; i < s.stalled; i++)
+    {
+        int sock = open_connection(s);
+        if (sock >= 0)
+        {
+            stalled.push_back(sock);
+        }
+    }
+    std::cout << stalled.size() << " stalled client(s) connected" << std::endl;
+
+    for (size_t clients : {100, 1000, 4000})
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<int> sockets;
+        for (size_t i = 0; i < clients; i++)
+        {
+            int sock = open_connection(s);
+            if (sock < 0)
+            {
+                std::cerr << "Couldn't connect after " << i << " client(s): " << strerror(errno) << std::endl;
+                break;
+            }
+            sockets.push_back(sock);
+        }
+
+        size_t negotiated = 0;
+        std::vector<bool> sent(sockets.size());
+        for (size_t i = 0; i < sockets.size(); i++)
+        {
+            sent[i] = send_go(s, sockets[i]);
+        }
+        for (size_t i = 0; i < sockets.size(); i++)
+        {
+            negotiated += sent[i] && finish_go(sockets[i]);
+        }
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (int sock : sockets)
+        {
+            disconnect(sock);
+        }
+
+        std::cout << clients << " clients\t" << negotiated << " negotiated in " << elapsed * 1000 << " ms\t"
+                  << static_cast<uint64_t>(negotiated / elapsed) << " handshakes/s" << std::endl;
+    }
+
+    for (int sock : stalled)
+    {
+        close(sock);
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+// What deduplication costs a write, on one thread with 4 KiB blocks:
+//
+//   hash, portable       block_hash a lane at a time
+//   hash                 block_hash as the store uses it, with SSE2 where there is any
+//   pwrite               writing the blocks to a plain file, for comparison
+//   put, unique          storing blocks the store hasn't seen: a hash, a lookup and an append
+//   put, duplicate       the same blocks again: a hash, a lookup and a read to check the match
+//
+// The hashes are shown as time per GiB as well as throughput.
+//
+// Usage: mndb-dedup-bench <scratch directory> [MiB per test]
+//
+// The store and the plain file go in the directory, which should be empty. Neither is synced,
+// so it's the CPU cost that's measured rather than the disk's.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "block_hash.hpp"
+#include "dedup_store.hpp"
+#include "io_worker_pool.hpp"
+
+namespace
+{
+
+const uint64_t block_size = 4096;
+
+// Runs f on every block of data, and prints how fast it went.
+void run(const char* label, const std::vector<char>& data, std::function<int(const char*, uint64_t)> f)
+{
+    uint64_t blocks = data.size() / block_size;
+    uint64_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t b = 0; b < blocks; b++)
+    {
+        int result = f(data.data() + b * block_size, b);
+        if (result < 0)
+        {
+            std::cerr << label << ": failed" << std::endl;
+            exit(1);
+        }
+        sink += result;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double gib = static_cast<double>(data.size()) / (1 << 30);
+    std::cout << label << "\t" << static_cast<uint64_t>(gib * 1024 / elapsed) << " MiB/s\t"
+        << static_cast<uint64_t>(elapsed * 1e3 / gib) << " ms/GiB\t"
+        << static_cast<uint64_t>(elapsed * 1e9 / blocks) << " ns/block" << (sink == 1 ? " " : "") << std::endl;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <scratch directory> [MiB per test]" << std::endl;
+        return 1;
+    }
+    boost::filesystem::path scratch = argv[1];
+    uint64_t total = (argc > 2 ? std::atoll(argv[2]) : 256) << 20;
+    boost::filesystem::create_directories(scratch);
+
+    std::vector<char> data(total);
+    std::mt19937_64 rng(1);
+    for (uint64_t i = 0; i < total; i += sizeof(uint64_t))
+    {
+        uint64_t v = rng();
+        memcpy(data.data() + i, &v, sizeof(v));
+    }
+
+    // What the hashes return has to go somewhere, or they'd be optimised away.
+    run("hash, portable", data, [](const char* block, uint64_t)
+    {
+        return static_cast<int>(hash_block_portable(block, block_size).low & 1);
+    });
+    run("hash", data, [](const char* block, uint64_t)
+    {
+        return static_cast<int>(hash_block(block, block_size).low & 1);
+    });
+
+    std::string raw_path = (scratch / "raw.img").string();
+    int raw = open(raw_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (raw == -1)
+    {
+        std::cerr << "Unable to create " << raw_path << std::endl;
+        return 1;
+    }
+    run("pwrite", data, [raw](const char* block, uint64_t b)
+    {
+        int error = io_worker_pool::positional_io(io_request{io_op::write, raw, b * block_size, block_size, const_cast<char*>(block), nullptr});
+        return error ? -1 : 0;
+    });
+    close(raw);
+
+    dedup_store::options opts;
+    opts.block_size = block_size;
+    dedup_store store((scratch / "store").string(), opts);
+    auto put = [&store](const char* block, uint64_t)
+    {
+        uint64_t id;
+        return store.put(block, id) ? -1 : 0;
+    };
+    run("put, unique", data, put);
+    run("put, duplicate", data, put);
+
+    dedup_store::stats s = store.get_stats();
+    std::cout << s.chunks << " chunks stored for " << s.blocks_written << " blocks written, "
+        << s.collisions << " collisions" << std::endl;
+    return 0;
+}
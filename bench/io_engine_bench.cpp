@@ -0,0 +1,153 @@
+// Random 4 KiB reads against a file through an I/O engine at queue depths 1 through 128.
+//
+// Usage: mndb-io-engine-bench <file> [seconds per depth] [threads|uring|uring-fixed|uring-sqpoll]
+//
+// uring-fixed registers the read buffers with the kernel first.
+//
+// Use a file that's larger than RAM (or drop the page cache first) to measure the device
+// rather than memory.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "io_worker_pool.hpp"
+#include "uring_io_engine.hpp"
+
+namespace
+{
+
+const uint64_t block_size = 4096;
+
+struct depth_run
+{
+    io_engine& engine;
+    int fd;
+    uint64_t blocks;
+    std::chrono::steady_clock::time_point deadline;
+
+    std::mutex mutex;
+    std::condition_variable idle_cv;
+    size_t outstanding = 0;
+    std::atomic<uint64_t> completed{0};
+    std::atomic<uint64_t> errors{0};
+
+    void issue(char* buffer, std::mt19937_64& rng)
+    {
+        uint64_t offset = (rng() % blocks) * block_size;
+        engine.submit({io_op::read, fd, offset, block_size, buffer,
+            [this, buffer, &rng](int error)
+            {
+                if (error)
+                {
+                    errors++;
+                }
+                completed++;
+                if (std::chrono::steady_clock::now() < deadline)
+                {
+                    // Keep the queue depth constant by replacing each completion.
+                    issue(buffer, rng);
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--outstanding == 0)
+                {
+                    idle_cv.notify_all();
+                }
+            }});
+    }
+};
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <file> [seconds per depth] [threads|uring|uring-fixed|uring-sqpoll]" << std::endl;
+        return 1;
+    }
+
+    int seconds = argc > 2 ? std::atoi(argv[2]) : 3;
+    std::string engine_name = argc > 3 ? argv[3] : "threads";
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1)
+    {
+        std::cerr << "Unable to open " << argv[1] << std::endl;
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    uint64_t blocks = st.st_size / block_size;
+    if (blocks == 0)
+    {
+        std::cerr << "File is smaller than one block" << std::endl;
+        return 1;
+    }
+
+    const size_t max_depth = 128;
+    std::vector<char> buffers(max_depth * block_size);
+
+    std::unique_ptr<io_engine> engine;
+    if (engine_name == "threads")
+    {
+        engine.reset(new io_worker_pool(16));
+    }
+    else
+    {
+        uring_io_engine::options opts;
+        opts.sqpoll = engine_name == "uring-sqpoll";
+        auto uring = new uring_io_engine(opts);
+        engine.reset(uring);
+        if (engine_name == "uring-fixed")
+        {
+            uring->register_buffers({{buffers.data(), buffers.size()}});
+        }
+    }
+
+    std::cout << engine->name() << std::endl;
+    std::cout << "depth\tIOPS" << std::endl;
+    for (size_t depth = 1; depth <= max_depth; depth *= 2)
+    {
+        auto start = std::chrono::steady_clock::now();
+        depth_run run{*engine, fd, blocks, start + std::chrono::seconds(seconds), {}, {}, 0, {0}, {0}};
+
+        std::vector<std::mt19937_64> rngs;
+        for (size_t i = 0; i < depth; i++)
+        {
+            rngs.emplace_back(i + 1);
+        }
+
+        run.outstanding = depth;
+        for (size_t i = 0; i < depth; i++)
+        {
+            run.issue(buffers.data() + i * block_size, rngs[i]);
+        }
+
+        std::unique_lock<std::mutex> lock(run.mutex);
+        run.idle_cv.wait(lock, [&run] { return run.outstanding == 0; });
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << depth << "\t" << static_cast<uint64_t>(run.completed / elapsed);
+        if (run.errors)
+        {
+            std::cout << "\t(" << run.errors << " errors)";
+        }
+        std::cout << std::endl;
+    }
+
+    close(fd);
+    return 0;
+}
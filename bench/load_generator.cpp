@@ -0,0 +1,370 @@
+// mndb-bench: a load generator for NBD servers. Each connection gets its own thread, which
+// negotiates with NBD_OPT_GO and then keeps a fixed number of requests in flight for the length
+// of the run. Once the warm-up is over, every reply's latency is recorded, and at the end we
+// report throughput and latency percentiles over all the connections.
+//
+// Requests go to whole blocks of the export, chosen sequentially (each connection has its own
+// stretch of the export to walk through), uniformly at random, or from a scrambled zipfian
+// distribution, where a few blocks get most of the traffic.
+//
+// Run it with --help for the options.
+
+#include <boost/endian/conversion.hpp>
+#include <boost/program_options.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nbd.hpp"
+#include "nbd_client.hpp"
+#include "stats.hpp"
+
+namespace
+{
+
+struct settings
+{
+    std::string host = "127.0.0.1";
+    std::string port = "10809";
+    std::string export_name;
+    size_t connections = 1;
+    size_t queue_depth = 16;
+    uint32_t block_size = 4096;
+    unsigned read_percent = 100;
+    std::string pattern = "random";
+    double zipf_theta = 0.99;
+    double seconds = 10;
+    double warm_up = 1;
+    bool fua = false;
+};
+
+// The scrambled zipfian generator from YCSB (after Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases"). Popular items are hashed across the range rather than
+// bunched up at the start of it.
+class zipfian
+{
+public:
+
+    zipfian(uint64_t items, double theta)
+        : items_(items)
+        , theta_(theta)
+        , zeta_n_(zeta(items, theta))
+        , alpha_(1 / (1 - theta))
+        , eta_((1 - std::pow(2.0 / items, 1 - theta)) / (1 - zeta(2, theta) / zeta_n_))
+    {
+    }
+
+    template <typename Rng>
+    uint64_t operator()(Rng& rng) const
+    {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zeta_n_;
+        uint64_t rank = uz < 1 ? 0
+            : uz < 1 + std::pow(0.5, theta_) ? 1
+            : static_cast<uint64_t>(items_ * std::pow(eta_ * u - eta_ + 1, alpha_));
+        return fnv1a(std::min(rank, items_ - 1)) % items_;
+    }
+
+private:
+
+    static double zeta(uint64_t n, double theta)
+    {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++)
+        {
+            sum += 1 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+    static uint64_t fnv1a(uint64_t value)
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (int i = 0; i < 8; i++)
+        {
+            hash ^= value & 0xff;
+            hash *= 0x100000001b3ULL;
+            value >>= 8;
+        }
+        return hash;
+    }
+
+    const uint64_t items_;
+    const double theta_;
+    const double zeta_n_;
+    const double alpha_;
+    const double eta_;
+};
+
+struct connection_result
+{
+    latency_histogram latency; // Nanoseconds, both kinds of request
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t max_latency = 0;
+    bool failed = false;
+};
+
+struct run_state
+{
+    std::chrono::steady_clock::time_point measure_from;
+    std::atomic<bool> stop{false};
+};
+
+void drive(const settings& s, int sock, uint64_t size, size_t index, const zipfian* zipf, const run_state& state,
+    connection_result& result)
+{
+    std::mt19937_64 rng(index + 1);
+    uint64_t blocks = size / s.block_size;
+
+    // Sequential connections each walk their own stretch of the export, so they don't all
+    // read the same blocks one after another.
+    uint64_t stretch = std::max<uint64_t>(blocks / s.connections, 1);
+    uint64_t next_block = stretch * index % blocks;
+
+    std::vector<char> payload(s.block_size, 'x');
+    std::vector<char> sink(s.block_size);
+
+    struct slot
+    {
+        std::chrono::steady_clock::time_point sent;
+        bool read;
+    };
+    std::vector<slot> slots(s.queue_depth);
+
+    auto send_request = [&](size_t i)
+    {
+        uint64_t block;
+        if (s.pattern == "sequential")
+        {
+            block = next_block;
+            next_block = (next_block + 1) % blocks;
+        }
+        else if (zipf)
+        {
+            block = (*zipf)(rng);
+        }
+        else
+        {
+            block = rng() % blocks;
+        }
+        bool read = rng() % 100 < s.read_percent;
+
+        slots[i].sent = std::chrono::steady_clock::now();
+        slots[i].read = read;
+        return nbd_send_request(sock, read ? NBD_CMD_READ : NBD_CMD_WRITE, !read && s.fua ? NBD_CMD_FLAG_FUA : 0, i,
+            block * s.block_size, s.block_size, payload.data());
+    };
+
+    size_t outstanding = 0;
+    for (; outstanding < s.queue_depth; outstanding++)
+    {
+        if (!send_request(outstanding))
+        {
+            result.failed = true;
+            return;
+        }
+    }
+    while (outstanding > 0)
+    {
+        reply_message reply;
+        if (!recv_all(sock, &reply, sizeof(reply)) || reply.handle >= slots.size())
+        {
+            result.failed = true;
+            return;
+        }
+        if (reply.error != 0)
+        {
+            std::cerr << "Request failed with " << boost::endian::big_to_native(reply.error) << std::endl;
+            result.failed = true;
+            return;
+        }
+        slot& sl = slots[reply.handle];
+        if (sl.read && !recv_all(sock, sink.data(), sink.size()))
+        {
+            result.failed = true;
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= state.measure_from)
+        {
+            uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(now - sl.sent).count();
+            result.latency.record(latency);
+            result.max_latency = std::max(result.max_latency, latency);
+            (sl.read ? result.reads : result.writes)++;
+        }
+
+        outstanding--;
+        if (!state.stop.load(std::memory_order_relaxed))
+        {
+            if (!send_request(reply.handle))
+            {
+                result.failed = true;
+                return;
+            }
+            outstanding++;
+        }
+    }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    settings s;
+    uint32_t block_kib = s.block_size / 1024;
+
+    namespace po = boost::program_options;
+    po::options_description description("Options");
+    description.add_options()
+        ("help,h", "Show this message")
+        ("host", po::value<std::string>(&s.host)->default_value(s.host), "Server to connect to")
+        ("port,p", po::value<std::string>(&s.port)->default_value(s.port), "Its port")
+        ("export,e", po::value<std::string>(&s.export_name), "Export to use. By default the server's default export")
+        ("connections,c", po::value<size_t>(&s.connections)->default_value(s.connections), "Connections, a thread each")
+        ("queue-depth,q", po::value<size_t>(&s.queue_depth)->default_value(s.queue_depth), "Requests in flight per connection")
+        ("block-kib,b", po::value<uint32_t>(&block_kib)->default_value(block_kib), "Request size")
+        ("read-percent,r", po::value<unsigned>(&s.read_percent)->default_value(s.read_percent),
+            "Percentage of requests that are reads. The rest are writes")
+        ("pattern", po::value<std::string>(&s.pattern)->default_value(s.pattern), "sequential, random or zipfian")
+        ("zipf-theta", po::value<double>(&s.zipf_theta)->default_value(s.zipf_theta),
+            "Skew of the zipfian pattern, between 0 and 1. Higher is more skewed")
+        ("fua", po::bool_switch(&s.fua), "Send writes with NBD_CMD_FLAG_FUA")
+        ("seconds,t", po::value<double>(&s.seconds)->default_value(s.seconds), "Length of the measured run")
+        ("warm-up", po::value<double>(&s.warm_up)->default_value(s.warm_up), "Seconds to run before measuring");
+
+    po::variables_map vm;
+    try
+    {
+        po::store(po::parse_command_line(argc, argv, description), vm);
+        po::notify(vm);
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (vm.count("help"))
+    {
+        std::cout << "Usage: " << argv[0] << " [options]" << std::endl << description;
+        return 0;
+    }
+    s.block_size = block_kib * 1024;
+    if (s.pattern != "sequential" && s.pattern != "random" && s.pattern != "zipfian")
+    {
+        std::cerr << "Unknown pattern " << s.pattern << std::endl;
+        return 1;
+    }
+    if (s.connections == 0 || s.queue_depth == 0 || s.block_size == 0 || s.read_percent > 100
+        || s.zipf_theta <= 0 || s.zipf_theta >= 1)
+    {
+        std::cerr << "Bad options. See --help" << std::endl;
+        return 1;
+    }
+
+    nbd_client_options client;
+    client.host = s.host;
+    client.port = s.port;
+    client.export_name = s.export_name;
+    std::vector<int> sockets;
+    nbd_export_info info;
+    for (size_t i = 0; i < s.connections; i++)
+    {
+        std::string error;
+        int sock = nbd_connect(client, info, error);
+        if (sock < 0)
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        sockets.push_back(sock);
+    }
+    uint64_t size = info.size;
+    uint16_t flags = info.flags;
+    if (size < s.block_size)
+    {
+        std::cerr << "The export is smaller than one request" << std::endl;
+        return 1;
+    }
+    if (s.read_percent < 100 && (flags & NBD_FLAG_READ_ONLY))
+    {
+        std::cerr << "The export is read-only" << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<zipfian> zipf;
+    if (s.pattern == "zipfian")
+    {
+        zipf.reset(new zipfian(size / s.block_size, s.zipf_theta));
+    }
+
+    std::cout << s.connections << " connection(s), queue depth " << s.queue_depth << ", " << s.block_size
+              << "-byte " << s.pattern << " requests, " << s.read_percent << "% reads" << (s.fua ? ", FUA writes" : "")
+              << std::endl;
+
+    run_state state;
+    auto start = std::chrono::steady_clock::now();
+    state.measure_from = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(s.warm_up));
+
+    std::vector<std::unique_ptr<connection_result>> results;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < s.connections; i++)
+    {
+        results.emplace_back(new connection_result());
+        workers.emplace_back(drive, std::cref(s), sockets[i], size, i, zipf.get(), std::cref(state), std::ref(*results.back()));
+    }
+    std::this_thread::sleep_until(state.measure_from + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(s.seconds)));
+    state.stop = true;
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - state.measure_from).count();
+
+    for (int sock : sockets)
+    {
+        nbd_disconnect(sock);
+    }
+
+    latency_histogram::snapshot latency;
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t max_latency = 0;
+    bool failed = false;
+    for (auto& r : results)
+    {
+        latency.add(r->latency);
+        reads += r->reads;
+        writes += r->writes;
+        max_latency = std::max(max_latency, r->max_latency);
+        failed = failed || r->failed;
+    }
+    if (failed)
+    {
+        std::cerr << "A connection failed part way through. The numbers are for what completed." << std::endl;
+    }
+
+    uint64_t requests = reads + writes;
+    std::cout << std::fixed << std::setprecision(1)
+              << requests / elapsed << " IOPS (" << reads / elapsed << " reads, " << writes / elapsed << " writes), "
+              << requests * s.block_size / elapsed / (1024 * 1024) << " MiB/s" << std::endl;
+    std::cout << "Latency (us): mean " << (requests ? latency.sum / 1e3 / requests : 0);
+    for (auto q : {std::make_pair("p50", 0.5), std::make_pair("p90", 0.9), std::make_pair("p99", 0.99),
+            std::make_pair("p99.9", 0.999)})
+    {
+        std::cout << ", " << q.first << " " << latency.quantile(q.second) / 1e3;
+    }
+    std::cout << ", max " << max_latency / 1e3 << std::endl;
+    return failed ? 1 : 0;
+}
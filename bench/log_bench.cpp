@@ -0,0 +1,142 @@
+// Measures what logging adds to each request. Every thread runs a stand-in for a request's own
+// work in a loop and logs one line per iteration the way the request path does, then the time
+// per iteration is compared with the same loop logging nothing. The ways of logging are:
+//
+//   compiled out   a level below MNDB_LOG_LEVEL, which should cost nothing
+//   turned off     a level compiled in but below the logger's level, one relaxed load
+//   async          a level that's on, written to a ring and formatted by the logger's thread
+//   cout           std::cout << ... << std::endl, as the server used to
+//
+// Output goes to /dev/null, so this measures the logging and not the terminal.
+//
+// Usage: mndb-log-bench [iterations per thread]
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log.hpp"
+
+namespace
+{
+
+// About as much work as the server does for a small request between log lines.
+uint64_t work(uint64_t seed)
+{
+    for (int i = 0; i < 64; i++)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    return seed;
+}
+
+enum class mode
+{
+    none,
+    compiled_out,
+    turned_off,
+    async,
+    cout
+};
+
+const char* const mode_names[] = {"none", "compiled out", "turned off", "async", "cout"};
+
+void run(mode m, uint64_t iterations, uint64_t seed, std::atomic<uint64_t>& sink)
+{
+    uint64_t value = seed;
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        value = work(value);
+        uint16_t type = value & 7;
+        uint64_t offset = value >> 20;
+        switch (m)
+        {
+        case mode::none:
+            break;
+        case mode::compiled_out:
+            LOG_TRACE("Request type {} ({},{})", type, offset, i);
+            break;
+        case mode::turned_off:
+        case mode::async:
+            LOG_INFO("Request type {} ({},{})", type, offset, i);
+            break;
+        case mode::cout:
+            std::cout << "Request type " << type << " (" << offset << "," << i << ")" << std::endl;
+            break;
+        }
+    }
+    sink += value;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200000;
+
+    FILE* null_file = fopen("/dev/null", "w");
+    std::ofstream null_stream("/dev/null");
+    if (!null_file || !null_stream)
+    {
+        std::cerr << "Can't open /dev/null" << std::endl;
+        return 1;
+    }
+    logger::instance().set_output(null_file);
+    std::streambuf* terminal = std::cout.rdbuf();
+
+    std::cout << "Built with MNDB_LOG_LEVEL " << MNDB_LOG_LEVEL << std::endl;
+
+    // Warm up, so the first baseline isn't paying for page faults and frequency scaling.
+    std::atomic<uint64_t> warm_up(0);
+    run(mode::none, iterations, 0, warm_up);
+
+    for (size_t threads : {1, 4})
+    {
+        double baseline = 0;
+        for (mode m : {mode::none, mode::compiled_out, mode::turned_off, mode::async, mode::cout})
+        {
+            logger::instance().set_level(m == mode::turned_off ? log_level::warn : log_level::info);
+            std::cout.rdbuf(null_stream.rdbuf());
+            auto before = logger::instance().get_stats();
+
+            std::atomic<uint64_t> sink(0);
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> workers;
+            for (size_t t = 0; t < threads; t++)
+            {
+                workers.emplace_back(run, m, iterations, t + 1, std::ref(sink));
+            }
+            for (auto& w : workers)
+            {
+                w.join();
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            logger::instance().flush();
+            auto after = logger::instance().get_stats();
+            std::cout.rdbuf(terminal);
+
+            double per_op = elapsed * 1e9 / (iterations * threads);
+            if (m == mode::none)
+            {
+                baseline = per_op;
+            }
+            std::cout << threads << " thread(s)\t" << mode_names[static_cast<int>(m)] << "\t"
+                      << per_op << " ns/op\t+" << per_op - baseline << " ns for logging";
+            if (m == mode::async)
+            {
+                std::cout << "\t" << after.written - before.written << " written, "
+                          << after.dropped - before.dropped << " dropped";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    logger::instance().set_output(stdout);
+    fclose(null_file);
+    return 0;
+}
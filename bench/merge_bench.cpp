@@ -0,0 +1,153 @@
+// Sequential 4 KiB reads or writes through each engine at a queue depth of 32, with merging off
+// and then on, the way a client streaming through an export with a deep queue drives them.
+// The file is opened with O_DIRECT so every operation reaches the device, and the number of
+// operations the engine actually issued is shown next to the number of requests.
+//
+// Usage: mndb-merge-bench <file> [read|write] [seconds per test]
+//
+// Writes go to the file, so use a scratch one for them. Merging pays off most on devices with a
+// high per-operation cost, like spinning disks.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "io_worker_pool.hpp"
+#include "uring_io_engine.hpp"
+
+namespace
+{
+
+const uint64_t block_size = 4096;
+const size_t depth = 32;
+const uint64_t max_merge = 1024 * 1024;
+
+struct stream_run
+{
+    io_engine& engine;
+    io_op op;
+    int fd;
+    uint64_t size;
+    std::chrono::steady_clock::time_point deadline;
+
+    std::mutex mutex;
+    std::condition_variable idle_cv;
+    uint64_t next = 0; // Guarded by mutex
+    size_t outstanding = 0; // Guarded by mutex
+    std::atomic<uint64_t> completed{0};
+    std::atomic<uint64_t> errors{0};
+
+    void issue(char* buffer)
+    {
+        uint64_t offset;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            offset = next;
+            next = next + block_size < size ? next + block_size : 0;
+        }
+        engine.submit({op, fd, offset, block_size, buffer,
+            [this, buffer](int error)
+            {
+                if (error)
+                {
+                    errors++;
+                }
+                completed++;
+                if (std::chrono::steady_clock::now() < deadline)
+                {
+                    issue(buffer);
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--outstanding == 0)
+                {
+                    idle_cv.notify_all();
+                }
+            }});
+    }
+};
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <file> [read|write] [seconds per test]" << std::endl;
+        return 1;
+    }
+
+    io_op op = argc > 2 && std::string(argv[2]) == "write" ? io_op::write : io_op::read;
+    int seconds = argc > 3 ? std::atoi(argv[3]) : 3;
+
+    int fd = open(argv[1], (op == io_op::write ? O_RDWR : O_RDONLY) | O_DIRECT);
+    if (fd == -1)
+    {
+        std::cerr << "Unable to open " << argv[1] << " with O_DIRECT" << std::endl;
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    uint64_t size = st.st_size / block_size * block_size;
+    if (size == 0)
+    {
+        std::cerr << "File is smaller than one block" << std::endl;
+        return 1;
+    }
+
+    // O_DIRECT needs aligned buffers.
+    std::unique_ptr<char, decltype(&free)> buffers(static_cast<char*>(aligned_alloc(block_size, depth * block_size)), &free);
+
+    std::cout << "engine\tmerging\tMiB/s\trequests\toperations" << std::endl;
+    for (bool uring : {false, true})
+    {
+        for (bool merge : {false, true})
+        {
+            std::unique_ptr<io_engine> engine;
+            if (uring)
+            {
+                engine.reset(new uring_io_engine(uring_io_engine::options()));
+            }
+            else
+            {
+                engine.reset(new io_worker_pool(16));
+            }
+            engine->set_max_merge(merge ? max_merge : 0);
+
+            auto start = std::chrono::steady_clock::now();
+            stream_run run{*engine, op, fd, size, start + std::chrono::seconds(seconds), {}, {}, 0, 0, {0}, {0}};
+            run.outstanding = depth;
+            for (size_t i = 0; i < depth; i++)
+            {
+                run.issue(buffers.get() + i * block_size);
+            }
+
+            std::unique_lock<std::mutex> lock(run.mutex);
+            run.idle_cv.wait(lock, [&run] { return run.outstanding == 0; });
+
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            auto merges = engine->get_merge_stats();
+            uint64_t requests = run.completed;
+            std::cout << engine->name() << "\t" << (merge ? "on" : "off") << "\t"
+                << static_cast<uint64_t>(requests * block_size / elapsed / (1 << 20)) << "\t"
+                << requests << "\t" << requests - merges.merged + merges.vectored;
+            if (run.errors)
+            {
+                std::cout << "\t(" << run.errors << " errors)";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,174 @@
+// What mirroring costs a write's latency. Random 4 KiB writes go one at a time through a
+// thread pool engine, like the server's, and the mirror, and we report their latency in
+// each mode:
+//
+//   none    the primary alone
+//   async   acknowledged once the primary has them, with the replica catching up behind
+//   sync    acknowledged once the replica has them too
+//
+// Usage: mndb-mirror-bench <primary image> <replica file or nbd://host:port/name> [writes]
+//
+// The primary is written to, and so is the replica, which is brought up to date with the
+// primary before each mode is timed, so the initial copy isn't counted.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "io_worker_pool.hpp"
+#include "stats.hpp"
+#include "write_mirror.hpp"
+
+namespace
+{
+
+const uint64_t block_size = 4096;
+
+// Waits for every part of a write, the primary's and the mirror's.
+class parts
+{
+public:
+
+    void start(int count)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        left_ = count;
+    }
+
+    void done()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--left_ == 0)
+        {
+            cv_.notify_one();
+        }
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return left_ == 0; });
+    }
+
+private:
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    int left_ = 0;
+};
+
+void run(const char* label, io_engine& engine, int fd, uint64_t size, write_mirror* mirror, uint64_t writes)
+{
+    if (mirror)
+    {
+        // Until the initial copy's done, nothing is queued for the replica.
+        for (;;)
+        {
+            write_mirror::stats s = mirror->get_stats();
+            if (s.connected && s.dirty_bytes == 0 && s.lag_bytes == 0)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    std::mt19937_64 rng(1);
+    std::vector<char> block(block_size);
+    latency_histogram latencies;
+    parts waiting;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < writes; i++)
+    {
+        uint64_t offset = rng() % (size / block_size) * block_size;
+        for (auto& c : block)
+        {
+            c = static_cast<char>(rng());
+        }
+
+        auto began = std::chrono::steady_clock::now();
+        waiting.start(mirror ? 2 : 1);
+        engine.submit({io_op::write, fd, offset, block_size, block.data(),
+            [&waiting](int error)
+            {
+                if (error)
+                {
+                    std::cerr << "Write failed: " << error << std::endl;
+                    std::exit(1);
+                }
+                waiting.done();
+            }});
+        if (mirror)
+        {
+            mirror->write(offset, block_size, block.data(), [&waiting] { waiting.done(); });
+        }
+        waiting.wait();
+        latencies.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - began).count());
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Async mode isn't done until the replica's caught up.
+    double catch_up = 0;
+    if (mirror)
+    {
+        auto behind = std::chrono::steady_clock::now();
+        while (mirror->get_stats().lag_bytes > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        catch_up = std::chrono::duration<double>(std::chrono::steady_clock::now() - behind).count();
+    }
+
+    latency_histogram::snapshot s;
+    s.add(latencies);
+    std::cout << label << "\t" << static_cast<uint64_t>(writes / elapsed) << " writes/s\tp50 " << s.quantile(0.5) / 1000.0
+        << " us\tp99 " << s.quantile(0.99) / 1000.0 << " us\tmean " << s.sum / s.count / 1000.0 << " us";
+    if (mirror)
+    {
+        std::cout << "\treplica caught up " << catch_up * 1000 << " ms later";
+    }
+    std::cout << std::endl;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <primary image> <replica file or nbd://host:port/name> [writes]" << std::endl;
+        return 1;
+    }
+    uint64_t writes = argc > 3 ? std::atoll(argv[3]) : 20000;
+
+    int fd = open(argv[1], O_RDWR);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < block_size)
+    {
+        std::cerr << "Can't use " << argv[1] << std::endl;
+        return 1;
+    }
+    uint64_t size = st.st_size;
+
+    io_worker_pool engine(4);
+    run("none", engine, fd, size, nullptr, writes);
+    for (auto mode : {write_mirror::mode::async, write_mirror::mode::sync})
+    {
+        write_mirror::options options;
+        options.sync = mode;
+        write_mirror mirror(argv[2], engine, fd, size, options);
+        run(mode == write_mirror::mode::sync ? "sync" : "async", engine, fd, size, &mirror, writes);
+    }
+    engine.stop();
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,194 @@
+// Compares serving an export through a descriptor with serving it from a mapping, one request
+// at a time, the way the server does each:
+//
+//   reads   fd: the engine reads into a buffer, which is sent over loopback TCP
+//           mmap: a fence orders the read against writes, and it's sent from the mapping
+//   writes  fd: the engine pwrites the buffer
+//           mmap: the engine copies the buffer into the mapping
+//
+// Usage: mndb-mmap-bench <file> [MiB per test]
+//
+// Writes go to the file, so use a scratch one. It should fit in RAM, which is what mapped
+// exports are for; everything's read in before the timing starts.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "io_worker_pool.hpp"
+#include "mmap_io_engine.hpp"
+
+namespace
+{
+
+bool send_all(int sock, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t res = send(sock, data, length, MSG_NOSIGNAL);
+        if (res <= 0)
+        {
+            return false;
+        }
+        data += res;
+        length -= res;
+    }
+    return true;
+}
+
+void drain(int sock)
+{
+    std::vector<char> sink(1 << 20);
+    while (recv(sock, sink.data(), sink.size(), 0) > 0)
+    {
+    }
+}
+
+// Returns a connected pair of loopback TCP sockets.
+bool connect_loopback(int& sender, int& receiver)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+        || listen(listener, 1) != 0
+        || getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+    {
+        close(listener);
+        return false;
+    }
+
+    sender = socket(AF_INET, SOCK_STREAM, 0);
+    bool ok = connect(sender, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+    receiver = ok ? accept(listener, nullptr, nullptr) : -1;
+    close(listener);
+    return receiver != -1;
+}
+
+// Submits the request and waits for it. Returns the fence for fences, which the caller
+// releases.
+io_engine::operation* run(io_engine& engine, io_op op, int fd, uint64_t offset, uint64_t length, char* data, int& error)
+{
+    std::promise<int> done;
+    io_engine::operation* fence = engine.submit({op, fd, offset, length, data,
+        [&done](int e)
+        {
+            done.set_value(e);
+        }});
+    error = done.get_future().get();
+    return op == io_op::fence ? fence : nullptr;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <file> [MiB per test]" << std::endl;
+        return 1;
+    }
+
+    uint64_t total = (argc > 2 ? std::atoll(argv[2]) : 256) << 20;
+
+    int fd = open(argv[1], O_RDWR);
+    if (fd == -1)
+    {
+        std::cerr << "Unable to open " << argv[1] << std::endl;
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    uint64_t file_size = st.st_size;
+
+    auto mapping = std::make_shared<mapped_file>(fd, file_size, false, mapped_file::options());
+    io_worker_pool fd_engine(4);
+    mmap_io_engine mmap_engine(mapping);
+
+    std::cout << "size\tfd read MiB/s\tmmap read MiB/s\tfd write MiB/s\tmmap write MiB/s" << std::endl;
+    for (uint64_t size = 4096; size <= 1024 * 1024; size *= 16)
+    {
+        if (file_size < size)
+        {
+            break;
+        }
+
+        std::cout << (size >> 10) << "K";
+        for (bool write : {false, true})
+        {
+            for (bool mapped : {false, true})
+            {
+                int sender = -1, receiver = -1;
+                std::thread reader;
+                if (!write)
+                {
+                    if (!connect_loopback(sender, receiver))
+                    {
+                        std::cerr << "Unable to set up a loopback connection" << std::endl;
+                        return 1;
+                    }
+                    reader = std::thread(drain, receiver);
+                }
+
+                std::mt19937_64 rng(1);
+                std::vector<char> buffer(size, 'x');
+                uint64_t done = 0;
+                auto start = std::chrono::steady_clock::now();
+                while (done < total)
+                {
+                    uint64_t offset = rng() % (file_size / size) * size;
+                    int error = 0;
+                    bool ok = true;
+                    if (write)
+                    {
+                        run(mapped ? static_cast<io_engine&>(mmap_engine) : fd_engine, io_op::write, fd, offset, size, buffer.data(), error);
+                    }
+                    else if (mapped)
+                    {
+                        io_engine::operation* fence = run(mmap_engine, io_op::fence, fd, offset, size, nullptr, error);
+                        ok = send_all(sender, mapping->data() + offset, size);
+                        mmap_engine.release(fence);
+                    }
+                    else
+                    {
+                        run(fd_engine, io_op::read, fd, offset, size, buffer.data(), error);
+                        ok = send_all(sender, buffer.data(), size);
+                    }
+                    if (error || !ok)
+                    {
+                        std::cerr << "I/O failed" << std::endl;
+                        return 1;
+                    }
+                    done += size;
+                }
+                if (!write)
+                {
+                    shutdown(sender, SHUT_WR);
+                    reader.join();
+                    close(sender);
+                    close(receiver);
+                }
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                std::cout << "\t" << static_cast<uint64_t>((done >> 20) / elapsed);
+            }
+        }
+        std::cout << std::endl;
+    }
+
+    close(fd);
+    return 0;
+}
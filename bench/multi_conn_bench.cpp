@@ -0,0 +1,306 @@
+// Drives a running server over 1, 2, 4, 8 and 16 connections to the same export, the way the
+// Linux client stripes one device when the export has NBD_FLAG_CAN_MULTI_CONN, and reports
+// the aggregate throughput for each. Every connection keeps a fixed number of requests in
+// flight.
+//
+// fua sends writes with NBD_CMD_FLAG_FUA, so each one waits for a sync. With a queue depth
+// of 1 that's the sync-write IOPS a database would see, and how well the server's group
+// commit holds up as clients are added.
+//
+// Usage: mndb-multi-conn-bench <host> [port] [export] [secs] [request KiB] [queue depth] [read|write|fua]
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/endian/conversion.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nbd.hpp"
+
+namespace
+{
+
+struct settings
+{
+    std::string host;
+    std::string port = "10809";
+    std::string export_name;
+    double seconds = 5;
+    uint32_t request_size = 64 * 1024;
+    size_t queue_depth = 16;
+    bool writes = false;
+    bool fua = false;
+};
+
+bool send_all(int sock, const void* data, size_t length)
+{
+    const char* p = static_cast<const char*>(data);
+    while (length > 0)
+    {
+        ssize_t res = send(sock, p, length, MSG_NOSIGNAL);
+        if (res <= 0)
+        {
+            return false;
+        }
+        p += res;
+        length -= res;
+    }
+    return true;
+}
+
+bool recv_all(int sock, void* data, size_t length)
+{
+    char* p = static_cast<char*>(data);
+    while (length > 0)
+    {
+        ssize_t res = recv(sock, p, length, 0);
+        if (res <= 0)
+        {
+            return false;
+        }
+        p += res;
+        length -= res;
+    }
+    return true;
+}
+
+// Connects and negotiates with NBD_OPT_GO. Returns -1 on failure.
+int connect_to_export(const settings& s, uint64_t& size, uint16_t& flags)
+{
+    addrinfo hints = {};
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses;
+    if (getaddrinfo(s.host.c_str(), s.port.c_str(), &hints, &addresses) != 0)
+    {
+        return -1;
+    }
+    int sock = socket(addresses->ai_family, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, addresses->ai_addr, addresses->ai_addrlen) != 0)
+    {
+        freeaddrinfo(addresses);
+        if (sock >= 0)
+        {
+            close(sock);
+        }
+        return -1;
+    }
+    freeaddrinfo(addresses);
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    initial_message initial;
+    uint32_t client_flags = boost::endian::native_to_big(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES);
+    if (!recv_all(sock, &initial, sizeof(initial)) || !send_all(sock, &client_flags, sizeof(client_flags)))
+    {
+        close(sock);
+        return -1;
+    }
+
+    std::vector<char> data(4 + s.export_name.size() + 2, 0);
+    uint32_t name_length = boost::endian::native_to_big(static_cast<uint32_t>(s.export_name.size()));
+    memcpy(data.data(), &name_length, 4);
+    memcpy(data.data() + 4, s.export_name.data(), s.export_name.size());
+
+    client_option option;
+    option.optmagic = boost::endian::native_to_big(optmagic);
+    option.option = boost::endian::native_to_big(NBD_OPT_GO);
+    option.length_of_data = boost::endian::native_to_big(static_cast<uint32_t>(data.size()));
+    if (!send_all(sock, &option, sizeof(option)) || !send_all(sock, data.data(), data.size()))
+    {
+        close(sock);
+        return -1;
+    }
+
+    for (;;)
+    {
+        server_negotiation_response response;
+        if (!recv_all(sock, &response, sizeof(response)))
+        {
+            break;
+        }
+        uint32_t type = boost::endian::big_to_native(response.reply_type);
+        std::vector<char> payload(boost::endian::big_to_native(response.reply_length));
+        if (!recv_all(sock, payload.data(), payload.size()))
+        {
+            break;
+        }
+        if (type == NBD_REP_INFO && payload.size() >= sizeof(nbd_info_export))
+        {
+            nbd_info_export info;
+            memcpy(&info, payload.data(), sizeof(info));
+            if (boost::endian::big_to_native(info.information_type) == NBD_INFO_EXPORT)
+            {
+                size = boost::endian::big_to_native(info.size_of_export_in_bytes);
+                flags = boost::endian::big_to_native(info.transmission_flags);
+            }
+        }
+        else if (type == NBD_REP_ACK)
+        {
+            return sock;
+        }
+        else
+        {
+            std::cerr << "Negotiation failed with reply type " << std::hex << type << std::dec << std::endl;
+            break;
+        }
+    }
+    close(sock);
+    return -1;
+}
+
+// Keeps queue_depth random requests in flight until stop is set. Returns bytes transferred.
+uint64_t drive(const settings& s, int sock, uint64_t size, unsigned seed, std::atomic<bool>& stop, uint64_t& requests)
+{
+    std::mt19937_64 rng(seed);
+    uint64_t slots = size / s.request_size;
+    std::vector<char> payload(s.request_size, 'x');
+    uint64_t handle = 0;
+    uint64_t transferred = 0;
+
+    auto send_request = [&]()
+    {
+        request_message request;
+        request.nbd_request_magic = boost::endian::native_to_big(NBD_REQUEST_MAGIC);
+        request.command_flags = boost::endian::native_to_big<uint16_t>(s.fua ? NBD_CMD_FLAG_FUA : 0);
+        request.type = boost::endian::native_to_big(s.writes ? NBD_CMD_WRITE : NBD_CMD_READ);
+        request.handle = handle++;
+        request.offset = boost::endian::native_to_big(rng() % slots * s.request_size);
+        request.length = boost::endian::native_to_big(s.request_size);
+        return send_all(sock, &request, sizeof(request)) && (!s.writes || send_all(sock, payload.data(), payload.size()));
+    };
+
+    size_t outstanding = 0;
+    for (; outstanding < s.queue_depth; outstanding++)
+    {
+        if (!send_request())
+        {
+            return transferred;
+        }
+    }
+    while (outstanding > 0)
+    {
+        reply_message reply;
+        if (!recv_all(sock, &reply, sizeof(reply)))
+        {
+            break;
+        }
+        if (reply.error != 0)
+        {
+            std::cerr << "Request failed with " << boost::endian::big_to_native(reply.error) << std::endl;
+            break;
+        }
+        if (!s.writes && !recv_all(sock, payload.data(), payload.size()))
+        {
+            break;
+        }
+        transferred += s.request_size;
+        requests++;
+        outstanding--;
+        if (!stop.load(std::memory_order_relaxed))
+        {
+            if (!send_request())
+            {
+                break;
+            }
+            outstanding++;
+        }
+    }
+    return transferred;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <host> [port] [export] [secs] [request KiB] [queue depth] [read|write|fua]" << std::endl;
+        return 1;
+    }
+    settings s;
+    s.host = argv[1];
+    if (argc > 2) s.port = argv[2];
+    if (argc > 3) s.export_name = argv[3];
+    if (argc > 4) s.seconds = std::atof(argv[4]);
+    if (argc > 5) s.request_size = std::atoi(argv[5]) * 1024;
+    if (argc > 6) s.queue_depth = std::atoi(argv[6]);
+    if (argc > 7)
+    {
+        s.fua = std::string(argv[7]) == "fua";
+        s.writes = s.fua || std::string(argv[7]) == "write";
+    }
+
+    for (size_t connections : {1, 2, 4, 8, 16})
+    {
+        std::vector<int> sockets;
+        uint64_t size = 0;
+        uint16_t flags = 0;
+        for (size_t i = 0; i < connections; i++)
+        {
+            int sock = connect_to_export(s, size, flags);
+            if (sock < 0)
+            {
+                std::cerr << "Can't connect to " << s.host << ":" << s.port << std::endl;
+                return 1;
+            }
+            sockets.push_back(sock);
+        }
+        if (connections > 1 && !(flags & NBD_FLAG_CAN_MULTI_CONN))
+        {
+            std::cout << "(the export doesn't advertise NBD_FLAG_CAN_MULTI_CONN)" << std::endl;
+        }
+        if (size < s.request_size)
+        {
+            std::cerr << "The export is smaller than one request" << std::endl;
+            return 1;
+        }
+
+        std::atomic<bool> stop(false);
+        std::atomic<uint64_t> total(0);
+        std::atomic<uint64_t> requests(0);
+        std::vector<std::thread> workers;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < connections; i++)
+        {
+            workers.emplace_back([&, i]
+            {
+                uint64_t done = 0;
+                total += drive(s, sockets[i], size, i + 1, stop, done);
+                requests += done;
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(s.seconds));
+        stop = true;
+        for (auto& w : workers)
+        {
+            w.join();
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        for (int sock : sockets)
+        {
+            request_message disconnect = {};
+            disconnect.nbd_request_magic = boost::endian::native_to_big(NBD_REQUEST_MAGIC);
+            disconnect.type = boost::endian::native_to_big(NBD_CMD_DISC);
+            send_all(sock, &disconnect, sizeof(disconnect));
+            close(sock);
+        }
+
+        std::cout << connections << " connection(s)\t" << total / elapsed / (1024 * 1024) << " MiB/s\t"
+                  << static_cast<uint64_t>(requests / elapsed) << " IOPS" << std::endl;
+    }
+    return 0;
+}
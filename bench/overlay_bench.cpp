@@ -0,0 +1,149 @@
+// Measures what going through an overlay costs over reading and writing a raw image, with
+// random 4 KiB requests on one thread:
+//
+//   raw                 pread and pwrite on the base image, or a sparse scratch copy of it
+//   overlay, empty      reads all fall through to the base, writes all copy a cluster up
+//   overlay, written    every cluster is in the top layer already
+//   overlay, 100 deep   the same after 100 snapshots, which lookups shouldn't notice
+//
+// Usage: mndb-overlay-bench <base image> <scratch directory> [MiB per test]
+//
+// The base is only read. The overlay and the scratch copy go in the directory, which should
+// be empty. Everything is in the page cache, so it's the overhead that's measured rather than
+// the disk.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "io_worker_pool.hpp"
+#include "overlay_image.hpp"
+
+namespace
+{
+
+const uint64_t block_size = 4096;
+
+// Runs requests at random offsets until total bytes have gone, and prints MiB/s.
+void run(const char* label, uint64_t size, uint64_t total, std::function<int(uint64_t)> request)
+{
+    std::mt19937_64 rng(1);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t done = 0; done < total; done += block_size)
+    {
+        if (request(rng() % (size / block_size) * block_size) != 0)
+        {
+            std::cerr << label << ": I/O failed" << std::endl;
+            exit(1);
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << label << "\t" << static_cast<uint64_t>((total >> 20) / elapsed) << " MiB/s\t"
+        << static_cast<uint64_t>(elapsed * 1e9 / (total / block_size)) << " ns/op" << std::endl;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <base image> <scratch directory> [MiB per test]" << std::endl;
+        return 1;
+    }
+    std::string base_path = argv[1];
+    boost::filesystem::path scratch = argv[2];
+    uint64_t total = (argc > 3 ? std::atoll(argv[3]) : 256) << 20;
+
+    int base = open(base_path.c_str(), O_RDONLY);
+    if (base == -1)
+    {
+        std::cerr << "Unable to open " << base_path << std::endl;
+        return 1;
+    }
+    struct stat st;
+    fstat(base, &st);
+    uint64_t size = st.st_size;
+    if (size < block_size)
+    {
+        std::cerr << "The base image is smaller than one block" << std::endl;
+        return 1;
+    }
+
+    boost::filesystem::create_directories(scratch);
+    std::string raw_path = (scratch / "raw.img").string();
+    int raw = open(raw_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (raw == -1 || ftruncate(raw, size) != 0)
+    {
+        std::cerr << "Unable to create " << raw_path << std::endl;
+        return 1;
+    }
+
+    std::vector<char> buffer(block_size, 'x');
+    auto pread_from = [&buffer](int fd)
+    {
+        return [fd, &buffer](uint64_t offset)
+        {
+            return io_worker_pool::positional_io(io_request{io_op::read, fd, offset, block_size, buffer.data(), nullptr});
+        };
+    };
+
+    // Read everything in first, so no test pays for the disk.
+    for (uint64_t offset = 0; offset < size; offset += 1 << 20)
+    {
+        pread_from(base)(offset);
+    }
+
+    overlay_image::options opts;
+    overlay_image image(base_path, (scratch / "overlay").string(), opts);
+    auto overlay_read = [&image, &buffer](uint64_t offset)
+    {
+        return image.read(offset, block_size, buffer.data());
+    };
+    auto overlay_write = [&image, &buffer](uint64_t offset)
+    {
+        return image.write(offset, block_size, buffer.data());
+    };
+
+    run("raw read", size, total, pread_from(base));
+    run("raw write", size, total, [raw, &buffer](uint64_t offset)
+    {
+        return io_worker_pool::positional_io(io_request{io_op::write, raw, offset, block_size, buffer.data(), nullptr});
+    });
+    run("overlay read, empty", size, total, overlay_read);
+
+    // Copy-up needs clusters that haven't been written yet, so this one's limited to a pass
+    // over the image.
+    uint64_t first_writes = std::min(total, size / opts.cluster_size * block_size);
+    uint64_t cluster = 0;
+    run("overlay write, copying up", first_writes, first_writes, [&](uint64_t)
+    {
+        return image.write(cluster++ * opts.cluster_size, block_size, buffer.data());
+    });
+
+    run("overlay read, written", size, total, overlay_read);
+    run("overlay write, written", size, total, overlay_write);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 100; i++)
+    {
+        image.snapshot();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "snapshot\t" << static_cast<uint64_t>(elapsed * 1e6 / 100) << " us each" << std::endl;
+
+    run("overlay read, 100 deep", size, total, overlay_read);
+
+    close(raw);
+    close(base);
+    return 0;
+}
@@ -0,0 +1,103 @@
+// Per-request allocation cost: a heap command plus a zero-filled std::vector payload (what
+// tcp_connection used to do) against object_pool commands with buffer_pool payloads, for
+// a 4 KiB-dominated mix of request sizes. Reports mean and p99 per request.
+//
+// Usage: mndb-pool-bench [requests]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "object_pool.hpp"
+
+namespace
+{
+
+struct heap_command
+{
+    uint64_t handle;
+    std::vector<char> buffer;
+};
+
+struct pooled_command
+    : pooled<pooled_command>
+{
+    uint64_t handle;
+    buffer_pool::buffer buffer;
+};
+
+template <typename F>
+void measure(const char* name, const std::vector<size_t>& sizes, F allocate_and_touch)
+{
+    std::vector<double> nanos;
+    nanos.reserve(sizes.size());
+    for (size_t size : sizes)
+    {
+        auto start = std::chrono::steady_clock::now();
+        allocate_and_touch(size);
+        nanos.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    double total = 0;
+    for (double n : nanos)
+    {
+        total += n;
+    }
+    std::sort(nanos.begin(), nanos.end());
+    std::cout << name << "\tmean " << static_cast<uint64_t>(total / nanos.size()) << "ns"
+              << "\tp99 " << static_cast<uint64_t>(nanos[nanos.size() * 99 / 100]) << "ns" << std::endl;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    size_t requests = argc > 1 ? std::atoi(argv[1]) : 200000;
+
+    // Mostly 4 KiB, with the occasional larger request the kernel client merges.
+    std::mt19937 rng(1);
+    std::vector<size_t> sizes;
+    for (size_t i = 0; i < requests; i++)
+    {
+        unsigned r = rng() % 100;
+        sizes.push_back(r < 90 ? 4096 : r < 98 ? 65536 : 1024 * 1024);
+    }
+
+    // Keep a window of requests "in flight" so allocations and frees interleave.
+    const size_t depth = 32;
+
+    std::vector<std::shared_ptr<heap_command>> heap_window(depth);
+    size_t next = 0;
+    measure("heap", sizes, [&](size_t size)
+    {
+        auto c = std::make_shared<heap_command>();
+        c->buffer = std::vector<char>(size);
+        c->buffer[0] = 1;
+        heap_window[next++ % depth] = c;
+    });
+    heap_window.clear();
+
+    auto commands = std::make_shared<object_pool<pooled_command>>();
+    auto buffers = buffer_pool::create(buffer_pool::options());
+    std::vector<boost::intrusive_ptr<pooled_command>> pool_window(depth);
+    next = 0;
+    measure("pooled", sizes, [&](size_t size)
+    {
+        auto c = commands->acquire();
+        c->buffer = buffers->allocate(size);
+        c->buffer.data()[0] = 1;
+        pool_window[next++ % depth] = c;
+    });
+    pool_window.clear();
+
+    auto command_stats = commands->get_stats();
+    auto buffer_stats = buffers->get_stats();
+    std::cout << "commands: " << command_stats.hits << " hits, " << command_stats.misses << " misses" << std::endl;
+    std::cout << "buffers: " << buffer_stats.hits << " hits, " << buffer_stats.misses << " misses" << std::endl;
+    return 0;
+}
@@ -0,0 +1,105 @@
+// Parse throughput of request_parser on a pipelined stream of small requests, fed to it in
+// socket-read-sized chunks the way tcp_connection does.
+//
+// Usage: mndb-request-parser-bench [percent writes] [write size] [chunk size]
+
+#include <boost/endian/conversion.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "nbd.hpp"
+#include "request_parser.hpp"
+
+int main(int argc, char** argv)
+{
+    int write_percent = argc > 1 ? std::atoi(argv[1]) : 25;
+    uint32_t write_size = argc > 2 ? std::atoi(argv[2]) : 4096;
+    size_t chunk_size = argc > 3 ? std::atoi(argv[3]) : 256 * 1024;
+
+    // Build a stream of requests to replay.
+    std::mt19937 rng(1);
+    std::vector<char> stream;
+    size_t requests = 0;
+    while (stream.size() < 64 * 1024 * 1024)
+    {
+        bool write = static_cast<int>(rng() % 100) < write_percent;
+
+        request_message header;
+        header.nbd_request_magic = boost::endian::native_to_big(NBD_REQUEST_MAGIC);
+        header.command_flags = 0;
+        header.type = boost::endian::native_to_big(write ? NBD_CMD_WRITE : NBD_CMD_READ);
+        header.handle = requests;
+        header.offset = boost::endian::native_to_big(static_cast<uint64_t>(rng()) * 4096);
+        header.length = boost::endian::native_to_big(static_cast<uint32_t>(4096));
+
+        const char* bytes = reinterpret_cast<const char*>(&header);
+        stream.insert(stream.end(), bytes, bytes + sizeof(header));
+        if (write)
+        {
+            stream.resize(stream.size() + write_size);
+        }
+        requests++;
+    }
+
+    request_parser parser(chunk_size);
+    std::vector<char> payload(write_size);
+    size_t parsed = 0;
+    int passes = 5;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        size_t fed = 0;
+        while (fed < stream.size())
+        {
+            // Stands in for async_read_some filling the buffer.
+            boost::asio::mutable_buffer space = parser.prepare();
+            size_t n = std::min(space.size(), stream.size() - fed);
+            memcpy(space.data(), stream.data() + fed, n);
+            parser.commit(n);
+            fed += n;
+
+            request_parser::request request;
+            request_parser::result result;
+            while ((result = parser.parse(request)) == request_parser::result::request)
+            {
+                if (request.type == NBD_CMD_WRITE)
+                {
+                    size_t copied = parser.take(payload.data(), write_size);
+                    while (copied < write_size)
+                    {
+                        // The payload straddles the chunk, as it would across socket reads.
+                        space = parser.prepare();
+                        n = std::min(space.size(), stream.size() - fed);
+                        memcpy(space.data(), stream.data() + fed, n);
+                        parser.commit(n);
+                        fed += n;
+                        copied += parser.take(payload.data() + copied, write_size - copied);
+                    }
+                }
+                parsed++;
+            }
+            if (result == request_parser::result::bad_magic)
+            {
+                std::cerr << "Lost framing after " << parsed << " requests" << std::endl;
+                return 1;
+            }
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (parsed != requests * passes)
+    {
+        std::cerr << "Parsed " << parsed << " requests, expected " << requests * passes << std::endl;
+        return 1;
+    }
+    std::cout << parsed << " requests in " << elapsed << "s: "
+              << static_cast<uint64_t>(parsed / elapsed) << " requests/s" << std::endl;
+    return 0;
+}
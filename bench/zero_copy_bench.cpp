@@ -0,0 +1,175 @@
+// Compares sending file data over a loopback TCP connection by copying it through a buffer
+// (pread + send, the way buffered NBD_CMD_READ replies work) with sendfile, for the read
+// sizes a guest issues during large sequential reads.
+//
+// Usage: mndb-zero-copy-bench <file> [MiB per size]
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+bool send_all(int sock, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t res = send(sock, data, length, MSG_NOSIGNAL);
+        if (res <= 0)
+        {
+            return false;
+        }
+        data += res;
+        length -= res;
+    }
+    return true;
+}
+
+bool send_buffered(int sock, int fd, uint64_t offset, uint64_t length, std::vector<char>& buffer)
+{
+    // A fresh, zero-filled buffer per request is what the buffered read path does.
+    buffer.assign(length, 0);
+    uint64_t done = 0;
+    while (done < length)
+    {
+        ssize_t res = pread(fd, buffer.data() + done, length - done, offset + done);
+        if (res <= 0)
+        {
+            return false;
+        }
+        done += res;
+    }
+    return send_all(sock, buffer.data(), length);
+}
+
+bool send_zero_copy(int sock, int fd, uint64_t offset, uint64_t length)
+{
+    off_t off = offset;
+    uint64_t done = 0;
+    while (done < length)
+    {
+        ssize_t res = sendfile(sock, fd, &off, length - done);
+        if (res <= 0)
+        {
+            return false;
+        }
+        done += res;
+    }
+    return true;
+}
+
+void drain(int sock)
+{
+    std::vector<char> sink(1 << 20);
+    while (recv(sock, sink.data(), sink.size(), 0) > 0)
+    {
+    }
+}
+
+// Returns a connected pair of loopback TCP sockets.
+bool connect_loopback(int& sender, int& receiver)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+        || listen(listener, 1) != 0
+        || getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+    {
+        close(listener);
+        return false;
+    }
+
+    sender = socket(AF_INET, SOCK_STREAM, 0);
+    bool ok = connect(sender, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+    receiver = ok ? accept(listener, nullptr, nullptr) : -1;
+    close(listener);
+    return receiver != -1;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <file> [MiB per size]" << std::endl;
+        return 1;
+    }
+
+    uint64_t total = (argc > 2 ? std::atoll(argv[2]) : 1024) << 20;
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1)
+    {
+        std::cerr << "Unable to open " << argv[1] << std::endl;
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+
+    std::cout << "size\tbuffered MiB/s\tzero-copy MiB/s" << std::endl;
+    for (uint64_t size = 512 * 1024; size <= 32 * 1024 * 1024; size *= 2)
+    {
+        if (static_cast<uint64_t>(st.st_size) < size)
+        {
+            break;
+        }
+
+        std::cout << (size >> 10) << "K";
+        for (bool zero_copy : {false, true})
+        {
+            int sender, receiver;
+            if (!connect_loopback(sender, receiver))
+            {
+                std::cerr << "Unable to set up a loopback connection" << std::endl;
+                return 1;
+            }
+            std::thread reader(drain, receiver);
+
+            std::vector<char> buffer;
+            uint64_t sent = 0;
+            uint64_t offset = 0;
+            auto start = std::chrono::steady_clock::now();
+            while (sent < total)
+            {
+                if (offset + size > static_cast<uint64_t>(st.st_size))
+                {
+                    offset = 0;
+                }
+                bool ok = zero_copy ? send_zero_copy(sender, fd, offset, size) : send_buffered(sender, fd, offset, size, buffer);
+                if (!ok)
+                {
+                    std::cerr << "Send failed" << std::endl;
+                    return 1;
+                }
+                sent += size;
+                offset += size;
+            }
+            shutdown(sender, SHUT_WR);
+            reader.join();
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            close(sender);
+            close(receiver);
+            std::cout << "\t" << static_cast<uint64_t>((sent >> 20) / elapsed);
+        }
+        std::cout << std::endl;
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,42 @@
+// How fast each zero scanner this CPU can run gets through buffers of zeroes, which is the
+// case that has to look at every byte. 4 KiB is a block of a WRITE payload, and 1 MiB is a
+// whole one, mostly out of cache.
+//
+// Usage: mndb-zero-scan-bench [MiB per test]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "zero_scan.hpp"
+
+int main(int argc, char** argv)
+{
+    uint64_t total = (argc > 1 ? std::atoll(argv[1]) : 4096) << 20;
+    std::cout << "is_zero() uses " << best_zero_scanner().name << std::endl;
+
+    for (uint64_t size : {uint64_t(4096), uint64_t(1 << 20)})
+    {
+        // Lots of buffers at 1 MiB, so they don't all fit in cache.
+        std::vector<char> zeroes(size == 4096 ? size : 64 << 20);
+        for (auto& s : zero_scanners())
+        {
+            uint64_t found = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (uint64_t done = 0; done < total; done += size)
+            {
+                found += s.scan(zeroes.data() + done % zeroes.size(), size);
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (found != total / size)
+            {
+                std::cerr << s.name << " got it wrong" << std::endl;
+                return 1;
+            }
+            std::cout << s.name << ", " << size / 1024 << " KiB\t" << static_cast<uint64_t>((total >> 20) / elapsed) << " MiB/s\t"
+                << static_cast<uint64_t>(elapsed * 1e9 / (total / size)) << " ns each" << std::endl;
+        }
+    }
+    return 0;
+}
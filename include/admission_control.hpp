@@ -0,0 +1,74 @@
+#ifndef ADMISSION_CONTROL_HPP
+#define ADMISSION_CONTROL_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+// Server-wide limits on the commands in flight and the payload bytes they hold, shared by
+// every connection. A connection asks to let each request in before allocating anything for
+// it, and stops reading from its socket while it waits, so clients that send more than the
+// server can take are held back by TCP rather than by the server's memory.
+//
+// Waiting requests are let in first come, first served, so a connection with a big request
+// isn't starved by others with small ones. Connections cap what a request can hold at their
+// max_payload, but if the limit's set lower than that, a request bigger than the whole limit
+// is let in on its own once everything else has finished.
+//
+// Thread-safe.
+class admission_control
+    : private boost::noncopyable
+{
+public:
+
+    struct options
+    {
+        uint64_t max_bytes = 256 * 1024 * 1024;
+        uint64_t max_commands = 4096;
+    };
+
+    struct stats
+    {
+        uint64_t bytes = 0; // In flight
+        uint64_t commands = 0;
+        uint64_t waiting = 0;
+        uint64_t waits = 0; // Requests that have had to wait, ever
+    };
+
+    typedef std::function<void()> handler;
+
+    explicit admission_control(const options& opts);
+
+    // Lets in a command holding length bytes and returns true if there's room and nothing's
+    // waiting ahead of it. Otherwise returns false, and on_admitted is called once it's been
+    // let in, from whichever thread made room for it.
+    bool admit(uint64_t length, handler on_admitted);
+
+    // Gives back what commands that were let in held, once they've finished.
+    void release(uint64_t length, uint64_t commands = 1);
+
+    stats get_stats() const;
+
+private:
+
+    struct waiter
+    {
+        uint64_t length;
+        handler on_admitted;
+    };
+
+    bool fits(uint64_t length) const;
+
+    const options options_;
+
+    mutable std::mutex mutex_;
+    std::deque<waiter> waiting_; // Guarded by mutex_
+    uint64_t bytes_ = 0; // Guarded by mutex_
+    uint64_t commands_ = 0; // Guarded by mutex_
+    uint64_t waits_ = 0; // Guarded by mutex_
+};
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef BLOCK_CACHE_HPP
+#define BLOCK_CACHE_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// A server-wide cache of backing file blocks, shared by every connection. The cache opens
+// the backing files itself, with O_DIRECT where the filesystem supports it, so this is the
+// only copy of the data in memory and the budget below is all the memory it'll take.
+//
+// Blocks are spread over shards by hash, each with its own lock and CLOCK eviction. Disk
+// I/O happens outside the shard lock; a block being loaded or written is marked busy and
+// anyone else who wants it waits for that to finish.
+//
+// All the I/O is synchronous, so it's meant to be driven from io_worker_pool threads.
+class block_cache
+    : private boost::noncopyable
+{
+public:
+
+    enum class write_mode
+    {
+        // Writes go to disk before they complete. Blocks that aren't cached are written
+        // around the cache rather than loaded.
+        write_through,
+
+        // Writes complete once they're in the cache. Dirty blocks are written when they're
+        // evicted or flushed.
+        write_back
+    };
+
+    struct options
+    {
+        size_t memory_budget = 1024 * 1024 * 1024;
+        size_t block_size = 64 * 1024;
+        size_t shards = 16;
+        write_mode mode = write_mode::write_through;
+    };
+
+    struct stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t writebacks = 0;
+    };
+
+    explicit block_cache(const options& opts);
+    ~block_cache();
+
+    // Opens a backing file for use with the cache, O_RDONLY if read_only is set. Opening the
+    // same file again returns the same descriptor, so every connection shares its cached
+    // blocks; a writable open of a file only open read-only so far reopens it read-write
+    // under the same number. Throws on failure.
+    int open(const std::string& path, bool read_only);
+    void close(int fd);
+
+    uint64_t file_size(int fd);
+
+    // These return 0 or an errno value, like io_worker_pool's executors.
+    int read(int fd, uint64_t offset, uint64_t length, char* dest);
+    int write(int fd, uint64_t offset, uint64_t length, const char* src);
+
+    // Loads whatever of the range isn't cached, for read-ahead. The engine running these has
+    // to order them against overlapping zeroes (io_engine::set_ordered_prefetch()), or what a
+    // zero throws away could be loaded again from before it.
+    int prefetch(int fd, uint64_t offset, uint64_t length);
+
+    // Zeroes the range on disk with zero_range() (punching a hole if punch is set) and in
+    // whatever's cached, so nothing gets written through the cache. Like the engines, this
+    // expects nothing else to be reading or writing the range at the same time.
+    int zero(int fd, uint64_t offset, uint64_t length, bool punch);
+
+    // Writes every dirty block of the file back to it.
+    int flush(int fd);
+
+    // Flushes the file and then fdatasyncs it, for io_op::sync.
+    int sync(int fd);
+
+    stats get_stats() const;
+
+    const options& get_options() const
+    {
+        return options_;
+    }
+
+private:
+
+    struct block_key
+    {
+        int fd;
+        uint64_t block;
+
+        bool operator==(const block_key& other) const
+        {
+            return fd == other.fd && block == other.block;
+        }
+    };
+
+    struct block_key_hash
+    {
+        size_t operator()(const block_key& k) const;
+    };
+
+    struct entry
+    {
+        block_key key = {-1, 0};
+        char* data = nullptr;
+        bool used = false;
+        bool busy = false; // Being loaded or written, outside the lock
+        bool dirty = false;
+        bool referenced = false;
+    };
+
+    struct shard
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<entry> entries;
+        std::unordered_map<block_key, size_t, block_key_hash> index;
+        std::unordered_set<block_key, block_key_hash> writing_around;
+        size_t hand = 0;
+        char* memory = nullptr;
+        stats counters;
+    };
+
+    struct file
+    {
+        uint64_t size;
+        bool direct; // Opened with O_DIRECT, so I/O has to be aligned
+        bool read_only; // Opened O_RDONLY, so it can't be handed to a writable export
+        size_t references;
+        std::pair<dev_t, ino_t> id;
+    };
+
+    shard& shard_for(const block_key& key);
+
+    // Returns the entry for key, loading it if needed, with the shard lock held and the entry
+    // not busy. Returns nullptr and sets error if the load, or making room for it, failed.
+    entry* acquire(shard& s, std::unique_lock<std::mutex>& lock, const block_key& key, bool load, int& error);
+
+    // Picks an entry to reuse, writing it back first if it's dirty. Returns nullptr and sets
+    // error if the only entries it could have used couldn't be written back.
+    entry* evict(shard& s, std::unique_lock<std::mutex>& lock, int& error);
+
+    int write_back(shard& s, std::unique_lock<std::mutex>& lock, entry& e);
+
+    // Forgets the block if it's cached, once nobody's using it.
+    void drop(shard& s, std::unique_lock<std::mutex>& lock, const block_key& key);
+
+    file file_info(int fd);
+
+    // The valid length of a block, which is short at the end of the file.
+    uint64_t block_length(const file& f, uint64_t block) const;
+
+    int load_block(int fd, uint64_t block, char* data);
+
+    // Writes straight to the file, bouncing through an aligned buffer if O_DIRECT needs it.
+    int store(int fd, uint64_t offset, uint64_t length, const char* src);
+
+    const options options_;
+    const size_t entries_per_shard_;
+    std::vector<std::unique_ptr<shard>> shards_;
+
+    std::shared_mutex files_mutex_;
+    std::unordered_map<int, file> files_; // By descriptor. Guarded by files_mutex_
+    std::map<std::pair<dev_t, ino_t>, int> open_files_; // Guarded by files_mutex_
+};
+
+#endif
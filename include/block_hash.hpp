@@ -0,0 +1,37 @@
+#ifndef BLOCK_HASH_HPP
+#define BLOCK_HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// A 128-bit hash of a block of data, for deduplicating blocks. It's built like XXH3: eight
+// 64-bit lanes each take a word of every 64-byte stripe, mixed with a key by a 32x32-bit
+// multiply, which SSE2 does two lanes at a time. It's fast rather than cryptographic, so
+// anything that matters has to compare the data when two digests match.
+struct block_digest
+{
+    uint64_t low;
+    uint64_t high;
+
+    bool operator==(const block_digest& other) const
+    {
+        return low == other.low && high == other.high;
+    }
+};
+
+// For unordered containers, which only need one word of it.
+struct block_digest_hasher
+{
+    size_t operator()(const block_digest& d) const
+    {
+        return static_cast<size_t>(d.low);
+    }
+};
+
+block_digest hash_block(const char* data, size_t length);
+
+// The same hash a lane at a time, without vector instructions. hash_block() gives the same
+// results; this is here to compare it with.
+block_digest hash_block_portable(const char* data, size_t length);
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Hands out uninitialized payload buffers in power-of-two size classes from 4 KiB to 32 MiB.
+// Classes smaller than a slab are carved out of 2 MiB slabs, larger ones are mapped one at a
+// time, and anything bigger than the largest class is mapped and unmapped on demand. Freed
+// buffers go back on their class's freelist so a steady workload stops touching the kernel.
+class buffer_pool
+    : public std::enable_shared_from_this<buffer_pool>
+    , private boost::noncopyable
+{
+public:
+
+    struct options
+    {
+        // Back slabs with explicit huge pages when the system has some reserved, or
+        // ask for transparent huge pages when it doesn't.
+        bool huge_pages = false;
+
+        // Freed buffers from the large classes are unmapped once the freelists hold
+        // this much. Slab memory is kept until the pool goes away.
+        size_t max_cached_bytes = 64 * 1024 * 1024;
+    };
+
+    struct stats
+    {
+        uint64_t hits = 0;   // Served from a freelist
+        uint64_t misses = 0; // Had to map more memory
+        uint64_t cached_bytes = 0;
+    };
+
+    // Move-only handle to a buffer, returned to the pool when destroyed.
+    class buffer
+    {
+    public:
+
+        buffer() = default;
+        buffer(buffer&& other);
+        buffer& operator=(buffer&& other);
+        ~buffer();
+
+        char* data() const
+        {
+            return data_;
+        }
+
+        size_t size() const
+        {
+            return size_;
+        }
+
+    private:
+        friend class buffer_pool;
+
+        void reset();
+
+        std::shared_ptr<buffer_pool> pool_;
+        char* data_ = nullptr;
+        size_t size_ = 0;
+        int size_class_ = -1;
+    };
+
+    static std::shared_ptr<buffer_pool> create(const options& opts)
+    {
+        return std::shared_ptr<buffer_pool>(new buffer_pool(opts));
+    }
+
+    ~buffer_pool();
+
+    // The contents are whatever the last user left there.
+    buffer allocate(size_t size);
+
+    stats get_stats() const;
+
+private:
+
+    static const int min_class_shift = 12; // 4 KiB
+    static const int max_class_shift = 25; // 32 MiB
+    static const int num_classes = max_class_shift - min_class_shift + 1;
+    static const int oversize_class = num_classes;
+    static const size_t slab_size = 2 * 1024 * 1024;
+
+    explicit buffer_pool(const options& opts);
+
+    static int size_class_for(size_t size);
+    static size_t class_size(int size_class);
+
+    char* map(size_t size);
+    void release(char* data, size_t size, int size_class);
+
+    const options options_;
+
+    mutable std::mutex mutex_;
+    std::array<std::vector<char*>, num_classes> free_;
+    std::vector<char*> slabs_;
+    stats stats_;
+};
+
+#endif
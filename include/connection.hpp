@@ -3,13 +3,24 @@
 
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <boost/core/noncopyable.hpp>
 #include <boost/endian/conversion.hpp>
 #include <boost/filesystem.hpp>
 
+#include <chrono>
 #include <deque>
-#include <set>
+#include <memory>
 
+#include "admission_control.hpp"
+#include "buffer_pool.hpp"
+#include "export_registry.hpp"
+#include "inflight_table.hpp"
+#include "io_engine.hpp"
 #include "nbd.hpp"
+#include "object_pool.hpp"
+#include "request_parser.hpp"
+#include "stream_detector.hpp"
+#include "throttle.hpp"
 
 using namespace boost; // TODO: Don't do this in a header
 
@@ -21,19 +32,128 @@ class tcp_connection
 {
 public:
 
+    // The most chunks we'll split one piece of a structured read into.
+    static const size_t max_read_chunks = 16;
+
+    // Whichever header a reply (or one chunk of it) starts with.
+    union reply_header
+    {
+        reply_message simple;
+        offset_data_chunk offset_data;
+        offset_hole_chunk offset_hole;
+        block_status_chunk block_status;
+        error_chunk error;
+    };
+
     struct command
+        : pooled<command>
     {
+        uint16_t flags;
         uint16_t type;
         uint64_t handle;
         uint64_t offset;
         uint64_t length;
+        uint32_t error = 0; // errno from the backing I/O, sent back in the reply
+        uint64_t admitted_bytes = 0; // Counted against the in-flight limits until the reply's written
+
+        // export_stats::now() when the request was parsed and when its backing I/O completed.
+        uint64_t received = 0;
+        uint64_t completed = 0;
+
+        // Reads with this set have no buffer. The payload goes straight from the backing
+        // file to the socket with sendfile when the reply is written.
+        bool zero_copy = false;
+        io_engine::operation* fence = nullptr; // Held until the payload has been sent
+
+        // Reads of mapped exports have no buffer either. The payload is sent from the mapping.
+        bool mapped = false;
+
+        buffer_pool::buffer buffer;
+
+        // Structured reads are split into pieces at holes and every read_chunk_size bytes,
+        // and each piece is sent as soon as it's been read. Pieces point back at the command
+        // the client sent, which counts the pieces that haven't been sent yet.
+        boost::intrusive_ptr<command> parent;
+        size_t pieces_left = 0;
+        bool last_piece = false; // Its last chunk carries NBD_REPLY_FLAG_DONE
+
+        // A piece's reply has a chunk for each run of data or zeroes in it. A write to a sparse
+        // export is split into runs the same way, and done as a write or a hole punch for each.
+        struct run
+        {
+            uint32_t offset; // From the start of the piece
+            uint32_t length;
+            bool hole;
+        };
+        run runs[max_read_chunks];
+        size_t run_count = 0;
+        // Parts of the request still to finish: the runs of a split write, and the mirror's copy.
+        std::atomic<size_t> parts_left{0};
+        std::atomic<uint32_t> part_error{0}; // The first error any of them had
+
+        reply_header reply[max_read_chunks]; // Have to live until the reply has been written
+    };
+
+    typedef boost::intrusive_ptr<command> command_ptr;
+
+    struct options
+    {
+        // Reads at least zero_copy_threshold bytes long skip the copy through a buffer.
+        bool zero_copy_reads = true;
+        uint64_t zero_copy_threshold = 64 * 1024;
+
+        // The most replies we'll gather into one write.
+        size_t reply_batch_limit = 32;
+
+        // How much we read from the socket at a time when parsing requests.
+        size_t receive_buffer_size = 256 * 1024;
 
-        std::vector<char> buffer;
+        // The most extents we'll describe in one NBD_CMD_BLOCK_STATUS reply.
+        size_t max_block_status_extents = 1024;
+
+        // With structured replies, holes in the backing file and zeroed runs at least
+        // hole_granularity long (and aligned to it) are sent as hole chunks with no payload.
+        bool sparse_reads = true;
+        uint64_t hole_granularity = 4096;
+
+        // Structured reads longer than this are read and sent in pieces this long.
+        uint64_t read_chunk_size = 1024 * 1024;
+
+        // Read ahead of sequential and strided reads.
+        bool read_ahead = true;
+        stream_detector::options streams;
+
+        // The longest read or write we'll take, advertised to clients as the maximum block
+        // size. Longer ones fail without anything being allocated for them, and a write's
+        // payload is read and thrown away. Has to fit in 32 bits.
+        uint64_t max_payload = 32 * 1024 * 1024;
+
+        // Limits on this connection's commands in flight and the payload they hold. Nothing
+        // more is read from the socket while it's at either. A request bigger than the byte
+        // limit (which can only happen if it's set below max_payload) is let in once nothing
+        // else is in flight. Requests that are going to fail hold no payload.
+        size_t max_inflight_commands = 256;
+        uint64_t max_inflight_bytes = 64 * 1024 * 1024;
+
+        // Limits on every connection put together. Null for none.
+        std::shared_ptr<admission_control> admission;
+
+        // Each connection's own IOPS and bandwidth limits. Exports can have their own as well.
+        throttle::options qos;
+
+        // Clients that haven't reached transmission by then are disconnected.
+        std::chrono::milliseconds handshake_timeout = std::chrono::seconds(10);
+
+        buffer_pool::options buffers;
     };
   
     typedef std::shared_ptr<tcp_connection> pointer;
 
-    tcp_connection(std::shared_ptr<asio::io_service> io_service, connection_manager& manager);
+    // The export is picked by the client during negotiation. If exports are opened through
+    // a block cache, the engine has to be one whose I/O goes through the cache too.
+    tcp_connection(std::shared_ptr<asio::io_service> io_service, connection_manager& manager, io_engine& engine,
+        const export_registry& exports, const options& opts);
+    ~tcp_connection();
 
     //static pointer create(std::shared_ptr<asio::io_service> io_service)
     //{
@@ -45,83 +165,194 @@ public:
         return socket_;
     }
 
+    // Starts negotiation. Every step of it is asynchronous, so a slow client only holds up itself.
     void start();
 
     void read_request();
+
+    void parse_requests();
+
+    // Starts the command for a request that's been let in. Returns false if parsing has to
+    // stop, because the rest of a write's payload or the disconnect is being waited for.
+    bool dispatch_request(const request_parser::request& request);
     
-    void on_read_data_for_write_request(std::shared_ptr<command> c, const boost::system::error_code& error, size_t bytes_transferred);
+    void on_read_data_for_write_request(command_ptr c, const boost::system::error_code& error, size_t bytes_transferred);
+
+    // Reads the rest of a failed write's payload, left bytes of it, into nowhere, then
+    // replies and carries on reading requests.
+    void discard_payload(command_ptr c, uint64_t left);
 
-    void handle_disconnect_request(std::shared_ptr<command> c);
+    void handle_disconnect_request(command_ptr c);
     
     void on_response_complete(const boost::system::error_code& error, size_t bytes_transferred);
     
     void write_response();
+
+    void finish_batch();
     
-    void finish_request(std::shared_ptr<command> c);
+    void finish_request(command_ptr c);
     
-    void read_data_from_backing(std::shared_ptr<command> c)
-    {
-        off_t off = lseek(backing_file_, c->offset, SEEK_SET);
-        if (off == -1)
-        {
-            throw std::runtime_error("Failed to seek to the given offset");
-        }
-        size_t remaining = c->length;
-        while (remaining > 0)
-        {
-            ssize_t res = read(backing_file_, c->buffer.data() + (c->length - remaining), remaining);
-            if (res == -1)
-            {
-                throw std::runtime_error("Read failed");
-            }
-            remaining -= res;
-        }
-        
-        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::finish_request, shared_from_this(), c)));
-    }
+    void read_data_from_backing(command_ptr c);
 
-    void write_data_to_backing(std::shared_ptr<command> c)
-    {
-        ssize_t off = lseek(backing_file_, c->offset, SEEK_SET);
-        if (off == -1)
-        {
-            throw std::runtime_error("Failed to seek to the given offset");	
-        }
-        size_t remaining = c->length;
-        while (remaining > 0)
-        {
-            ssize_t res = write(backing_file_, c->buffer.data() + (c->length - remaining), c->length);
-            if (res == -1)
-            {
-            throw std::runtime_error("Write failed");
-            }
-            remaining -= res;
-        }
-        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::finish_request, shared_from_this(), c)));
-    }
+    // Splits a structured read into pieces and starts reading them.
+    void read_in_pieces(command_ptr c);
+
+    // Tells the stream detector about a read and prefetches whatever it asks for.
+    void read_ahead(const command& c);
+
+    void write_data_to_backing(command_ptr c);
+
+    // Writes the data runs of a split write and punches out its zero runs.
+    void write_runs(command_ptr c);
+
+    // Counts down c's parts_left, and calls next with the first error any part had once
+    // they've all finished. Can be called from any thread.
+    void part_done(command_ptr c, int error, void (tcp_connection::*next)(command_ptr, int));
+
+    // Forgets what the export's extent map knew about a range, from the completion of the
+    // engine's write or zeroing of it. That's before the engine retires the operation, and
+    // before the mirror's part has necessarily finished.
+    void changed(uint64_t offset, uint64_t length);
+
+    // Once a write, TRIM or WRITE_ZEROES has completed, on the primary and the mirror.
+    // Called on the engine's threads.
+    void written(command_ptr c, int error);
+
+    // TRIM and WRITE_ZEROES. Neither has a payload either way.
+    void zero_backing(command_ptr c);
+
+    // FLUSH, and FUA writes once the write itself has completed. Can be called from any thread.
+    void flush_backing(command_ptr c);
+
+    // Once a flush has completed, on the primary and the mirror, if it's waited for.
+    void flushed(command_ptr c, int error);
+
+    void block_status(command_ptr c);
+
+    void send_file_payload(command_ptr c, uint64_t sent);
+
+    void release_fences_when_acked(command_ptr c);
     
 private:
 
+    // Negotiation goes read_option, handle_option, send_option_replies and around again,
+    // until an option ends it with start_transmission or end_negotiation.
+    void read_option();
+    void on_option_header(const boost::system::error_code& error);
+    void drain_option(uint32_t left); // Discards option data too long for data_
+    void handle_option(uint32_t data_len);
+    void send_option_replies(void (tcp_connection::*next)());
+    void start_transmission();
+    void end_negotiation();
+
+    // Queues a reply to the option being handled. send_option_replies() sends them.
+    void append_option_reply(uint32_t option, uint32_t reply_type, const void* data, uint32_t length);
+
+    // NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT, with the option data in data_.
+    void negotiate_meta_context(uint32_t option, uint32_t data_len);
+
+    // NBD_OPT_INFO and NBD_OPT_GO. Returns the export if the client can go on to use it.
+    export_registry::pointer negotiate_export(uint32_t option, uint32_t data_len);
+
+    // Adds the reply for the command, headers and payload, to write_buffers_.
+    void append_reply(command& c);
+
+    // Counts a command whose reply has been written, at time now.
+    void record_stats(const command& c, uint64_t now);
+
+    // Takes held_ as far as it can through the in-flight limits and the throttles. Returns
+    // true once it can be dispatched. Otherwise it'll be picked up again by finish_batch(),
+    // admission control or the throttle timer.
+    bool admit_held();
+
+    // Gives back what a finished command was let in with.
+    void release_admission(command& c);
+
     std::shared_ptr<asio::io_service> io_service_;
     asio::ip::tcp::socket socket_;
     connection_manager& connection_manager_;
 
-    // We'll do network IO in one strand and file io in the other strand. 
+    // Network IO happens in the strand. File IO goes to the engine, which runs as
+    // many of our commands at once as it can and posts the results back to the strand.
+    // Mapped exports have engines of their own, which replace the server's in transmission.
     asio::io_service::strand socket_strand_;
-    asio::io_service::strand file_io_strand_;
+    io_engine* engine_;
 
-    const size_t max_length_ = 1024;
-    char data_[1024];
+    // Only used during negotiation, and for throwing away the payloads of writes that have
+    // already failed. Requests are read through parser_.
+    // Big enough for the longest export name plus the option's other fields.
+    const size_t max_length_ = 8192;
+    char data_[8192];
+    initial_message initial_;
+    uint32_t client_flags_;
+    client_option option_header_; // The option being handled
+    std::vector<char> option_replies_;
+    asio::steady_timer handshake_timer_;
+
+    request_parser parser_;
 
     uint64_t disk_size_;
 
-    // TODO: We need to put this on the command-line
-    const char* backing_file_path_ = "/home/matthew/backing.img";
-    int backing_file_;
+    const options options_;
+
+    // Anything that has to look at or change read data on its way out has to clear
+    // this, and so does a client on this machine (see start()).
+    bool zero_copy_reads_;
+
+    // Fences for zero-copy reads are held until the client has acked everything up to the
+    // end of the payload. Positions count bytes written to the socket since negotiation.
+    uint64_t bytes_written_ = 0;
+    std::deque<std::pair<uint64_t, io_engine::operation*>> unacked_fences_;
+    asio::steady_timer ack_timer_;
+    bool ack_timer_running_ = false;
+
+    const export_registry& exports_;
+    export_registry::pointer export_; // Chosen during negotiation
+    int backing_file_; // export_'s, shared with every other connection to it
+    const char* mapping_ = nullptr; // export_'s mapping, if it has one
+
+    // Negotiated with NBD_OPT_STRUCTURED_REPLY. Reads and block status get chunked replies.
+    bool structured_replies_ = false;
+
+    // Set by NBD_OPT_SET_META_CONTEXT, for the export it named.
+    bool base_allocation_ = false;
+    export_registry::pointer meta_context_export_;
+    std::vector<extent_map::extent> extents_; // Scratch space for block_status() and read_in_pieces()
+
+    uint64_t hole_bytes_ = 0; // Read as holes rather than sent
+
+    std::unique_ptr<stream_detector> streams_; // Null with read-ahead off
+
+    // A request that's been parsed waits in held_ until the limits let it in, and nothing
+    // more is read or parsed until it's been dispatched.
+    enum class hold
+    {
+        none,
+        parsed, // Waiting for this connection's commands to finish, if it's at its limits
+        waiting, // For room under the server's limits
+        admitted, // Through the limits, not yet through the throttles
+        ready // Waiting for throttle_timer_, if anything
+    };
+    hold hold_ = hold::none;
+    request_parser::request held_;
+    bool held_back_ = false; // held_ has had to wait, and been counted in the stats
+    uint64_t inflight_bytes_ = 0; // Let in and not finished
+    size_t inflight_commands_ = 0;
+    std::unique_ptr<throttle> qos_; // Null without limits
+    asio::steady_timer throttle_timer_;
+
+    // This thread's share of export_'s stats, once we're in transmission.
+    export_stats::shard* stats_ = nullptr;
 
     // Synchronized by socket_strand_, so long as outbox_ is only accessed from that strand. 
-    std::deque<std::shared_ptr<command>> outbox_;
-    std::set<std::shared_ptr<command>> commands_; // Contains all currently running commands
+    std::deque<command_ptr> outbox_;
+    std::vector<command_ptr> writing_; // The batch being written, if any
+    std::vector<asio::const_buffer> write_buffers_;
+    inflight_table<command_ptr> commands_; // Contains all currently running commands, by handle
+
+    // Commands and their payload buffers are recycled rather than going back to the heap.
+    std::shared_ptr<object_pool<command>> command_pool_;
+    std::shared_ptr<buffer_pool> buffer_pool_;
 };
 
 #endif
\ No newline at end of file
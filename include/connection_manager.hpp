@@ -3,6 +3,8 @@
 
 #include <boost/core/noncopyable.hpp>
 
+#include <set>
+
 #include "connection.hpp"
 
 class connection_manager 
@@ -0,0 +1,108 @@
+#ifndef DEDUP_IMAGE_HPP
+#define DEDUP_IMAGE_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dedup_store.hpp"
+#include "mapped_file.hpp"
+
+// A deduplicated export: a map from each of its blocks to the chunk in a dedup_store that
+// holds its data. Writing a block stores it (or finds it already stored) and points the map
+// at it. Reading looks the block up, and a run of blocks that were stored one after another
+// is read in one go, as an image imported in order mostly is.
+//
+// The map is a file of its own: a header page and then a chunk id for every block, which is
+// memory mapped. It's made when the export is first opened, by importing an image into the
+// store. As with overlay_image's bitmaps, blocks are only updated in it once a sync has made
+// the chunks they point at durable, and until then the map in memory is the one that counts.
+//
+// The I/O functions block, and can be called from many threads at once so long as
+// overlapping writes aren't, which is what io_engine sees to. They return 0 or an errno value.
+class dedup_image
+    : private boost::noncopyable
+{
+public:
+
+    // Opens the map at map_path. If there isn't one yet, it's made from the image at
+    // seed_path, every block of which goes into store. Throws std::runtime_error on failure.
+    dedup_image(std::shared_ptr<dedup_store> store, const std::string& seed_path, const std::string& map_path);
+    ~dedup_image();
+
+    uint64_t size() const
+    {
+        return size_;
+    }
+
+    const std::shared_ptr<dedup_store>& store() const
+    {
+        return store_;
+    }
+
+    // Blocks that aren't zeroes, each of which refers to a chunk. Adding these up over every
+    // export and comparing with the store's chunks gives the deduplication ratio.
+    uint64_t mapped_blocks() const
+    {
+        return mapped_.load(std::memory_order_relaxed);
+    }
+
+    int read(uint64_t offset, uint64_t length, char* data);
+    int write(uint64_t offset, uint64_t length, const char* data);
+
+    // Whole blocks just point at the zero block. Anything left at either end is written.
+    int zero(uint64_t offset, uint64_t length);
+
+    int prefetch(uint64_t offset, uint64_t length);
+
+    // Makes what's been written so far durable: the chunks, and then the map.
+    int sync();
+
+private:
+
+    // Reads the image at seed_path into the store, and writes a new map for it at path.
+    void import(const std::string& seed_path, const std::string& path);
+
+    // Calls f(first, count, offset, length) for each run of the range whose blocks are in
+    // consecutive chunks (or are all zeroes), where first is the first chunk and the run
+    // covers length bytes from offset. A block the range only covers part of is a run on
+    // its own. Stops at the first error.
+    template <typename F>
+    int for_each_run(uint64_t offset, uint64_t length, F f);
+
+    // Points block at chunk id.
+    void assign(uint64_t block, uint64_t id);
+
+    std::shared_ptr<dedup_store> store_;
+    uint64_t block_size_ = 0;
+    uint64_t size_ = 0;
+    uint64_t blocks_ = 0;
+
+    int map_fd_ = -1;
+    std::unique_ptr<mapped_file> map_;
+    uint64_t* entries_ = nullptr; // In map_, after the header
+
+    // The chunk each block reads from, 0 for zeroes.
+    std::unique_ptr<std::atomic<uint64_t>[]> index_;
+    std::atomic<uint64_t> mapped_{0};
+
+    // Writes that only cover part of a block read the rest of it and store the whole thing.
+    // Two of them landing in the same block at once would each lose the other's part, so
+    // they take its lock.
+    std::array<std::mutex, 64> block_locks_;
+
+    // Blocks changed since the last sync, which the map doesn't have yet, and the chunks they
+    // were pointed at, in order. A block changed again while a sync is going on is left for
+    // the next one, since its new chunk might not be durable yet.
+    std::mutex pending_mutex_;
+    std::vector<std::pair<uint64_t, uint64_t>> pending_; // Guarded by pending_mutex_
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef DEDUP_STORE_HPP
+#define DEDUP_STORE_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "block_hash.hpp"
+
+// A content-addressed store of fixed-size blocks, which every deduplicated export keeps its
+// data in. Each distinct block is stored once, however many exports or offsets hold it, so
+// cloned images cost next to nothing, and reads of the same block anywhere share its pages in
+// the page cache.
+//
+// Blocks are appended to a single chunks file in the store's directory, and are known by
+// their place in it: chunk n is at n * block_size. Id 0 is never a chunk (that's where the
+// header is), and stands for a block of zeroes, which isn't stored at all. An index from
+// each block's hash to its chunk finds duplicates. It's only kept in memory, and is rebuilt
+// by hashing the file when the store is opened. Hashes that match are checked against the
+// stored data before a block is shared, so a collision costs a read rather than corruption.
+//
+// Nothing is ever removed. A chunk that nothing refers to any more stays in the file.
+//
+// Thread-safe. The I/O functions block, and return 0 or an errno value.
+class dedup_store
+    : private boost::noncopyable
+{
+public:
+
+    struct options
+    {
+        // For new stores. An existing one keeps whatever it was made with. A power of two,
+        // at least 512.
+        uint64_t block_size = 4096;
+
+        // Worker threads for each export's engine
+        size_t threads = 8;
+    };
+
+    struct stats
+    {
+        uint64_t chunks = 0; // In the file, from this run or before
+
+        // Every block put, and which of the three things happened to it
+        uint64_t blocks_written = 0;
+        uint64_t unique_blocks = 0; // Stored as a new chunk
+        uint64_t duplicate_blocks = 0; // Found already stored
+        uint64_t zero_blocks = 0; // All zeroes, so not stored
+
+        uint64_t collisions = 0; // Hashes that matched a chunk with different data
+        uint64_t put_nanoseconds = 0; // Spent in put(), for write throughput
+    };
+
+    // Opens the store in directory, making it if it isn't there. Throws std::runtime_error
+    // on failure.
+    dedup_store(const std::string& directory, const options& opts);
+    ~dedup_store();
+
+    const std::string& directory() const
+    {
+        return directory_;
+    }
+
+    uint64_t block_size() const
+    {
+        return block_size_;
+    }
+
+    const options& get_options() const
+    {
+        return options_;
+    }
+
+    // Stores the block_size bytes at block, or finds them already stored, and sets id to the
+    // chunk they're in.
+    int put(const char* block, uint64_t& id);
+
+    // Reads count chunks from first on, which are next to each other in the file, into data.
+    // Id 0 reads as zeroes, however many are asked for.
+    int read(uint64_t first, uint64_t count, char* data);
+
+    int prefetch(uint64_t first, uint64_t count);
+
+    // Makes every chunk stored so far durable.
+    int sync();
+
+    stats get_stats() const;
+
+private:
+
+    // Hashes the chunks already in the file into the index.
+    void load_index();
+
+    struct shard
+    {
+        std::mutex mutex;
+        std::unordered_multimap<block_digest, uint64_t, block_digest_hasher> chunks;
+    };
+
+    shard& shard_for(const block_digest& digest)
+    {
+        return shards_[digest.high % shards_.size()];
+    }
+
+    const std::string directory_;
+    const options options_;
+    uint64_t block_size_ = 0;
+    int fd_ = -1;
+
+    // Each shard looks after the hashes that land in it, and holds its lock while it stores a
+    // new chunk, so two copies of a block can't both get one.
+    std::array<shard, 64> shards_;
+
+    std::atomic<uint64_t> next_id_{1};
+
+    std::atomic<uint64_t> blocks_written_{0};
+    std::atomic<uint64_t> unique_blocks_{0};
+    std::atomic<uint64_t> duplicate_blocks_{0};
+    std::atomic<uint64_t> zero_blocks_{0};
+    std::atomic<uint64_t> collisions_{0};
+    std::atomic<uint64_t> put_nanoseconds_{0};
+};
+
+#endif
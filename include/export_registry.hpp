@@ -0,0 +1,134 @@
+#ifndef EXPORT_REGISTRY_HPP
+#define EXPORT_REGISTRY_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dedup_image.hpp"
+#include "extent_map.hpp"
+#include "group_commit.hpp"
+#include "mapped_file.hpp"
+#include "overlay_image.hpp"
+#include "stats.hpp"
+#include "throttle.hpp"
+#include "write_mirror.hpp"
+
+class block_cache;
+
+// Every export the server offers, by name. Each backing file is opened once, when it's
+// added, and the handle is shared by every connection to that export. That's what lets
+// us advertise NBD_FLAG_CAN_MULTI_CONN: all connections go through the same descriptor
+// (and the same engine and cache), so a write completed on one is seen by all the others.
+class export_registry
+    : private boost::noncopyable
+{
+public:
+
+    struct entry
+    {
+        std::string name;
+        std::string path;
+        bool read_only = false;
+
+        // Zero blocks in writes are punched out of the file rather than written, or skipped
+        // when they're holes already.
+        bool sparse_writes = false;
+
+        int fd = -1;
+        uint64_t size = 0;
+
+        // Opened through the block cache, so I/O has to go through it too.
+        bool cached = false;
+
+        // Set for exports served from memory. Their I/O goes through engine rather than the
+        // server's, and reads are sent straight from the mapping.
+        std::shared_ptr<mapped_file> mapping;
+        std::shared_ptr<io_engine> engine;
+
+        // Set for copy-on-write exports, whose path is the base image. Their I/O goes through
+        // engine too, which reads and writes the overlay's layers. fd is the base's, opened
+        // read-only, and isn't used for I/O.
+        std::shared_ptr<overlay_image> overlay;
+
+        // Set for deduplicated exports, whose data is in the server's dedup_store. Their I/O
+        // goes through engine as well. path is the image they were first imported from, and
+        // fd is that, opened read-only and not used for I/O.
+        std::shared_ptr<dedup_image> dedup;
+
+        // What's allocated, for NBD_CMD_BLOCK_STATUS. Null when the file can't tell us, which
+        // is the case when writes sit in a write-back cache before they reach it.
+        std::shared_ptr<extent_map> extents;
+
+        // FLUSH and FUA from every connection to the export share its syncs.
+        std::shared_ptr<group_commit> commits;
+
+        // Request counts and latencies from every connection to the export.
+        std::shared_ptr<export_stats> stats;
+
+        // Limits the requests and bytes of every connection to the export, put together. Null
+        // when there are no limits.
+        std::shared_ptr<throttle> qos;
+
+        // Copies writes to a replica, when the export has one.
+        std::shared_ptr<write_mirror> mirror;
+    };
+
+    typedef std::shared_ptr<const entry> pointer;
+
+    // Backing files are opened through the cache when there is one. Flushes go through engine,
+    // which has to be the one the connections use. Exports added with mmap set are mapped with
+    // mapping, and get an engine of their own, whatever the others use. So do overlays, and
+    // deduplicated exports, which can only be added when there's a dedup store. Each export
+    // gets its own throttle with the qos limits, and mirrors with the mirrors options.
+    explicit export_registry(io_engine& engine, block_cache* cache = nullptr,
+        const mapped_file::options& mapping = mapped_file::options(), const throttle::options& qos = throttle::options(),
+        const overlay_image::options& overlays = overlay_image::options(), std::shared_ptr<dedup_store> dedup = nullptr,
+        const write_mirror::options& mirrors = write_mirror::options());
+    ~export_registry();
+
+    // Opens the backing file and adds it under name. The first export added is the default,
+    // which is what a client gets when it asks for the empty name. With an overlay directory,
+    // path is the base image of a copy-on-write export whose layers are kept there. With dedup,
+    // the export's blocks are kept in the dedup store, and path is only read the first time,
+    // to import it. With sparse, writes of zeroes make holes. With a mirror target (a file, or
+    // nbd://host:port/name), writes are copied to it. Throws on failure.
+    void add(const std::string& name, const std::string& path, bool read_only = false, bool mmap = false,
+        const std::string& overlay = std::string(), bool dedup = false, bool sparse = false,
+        const std::string& mirror = std::string());
+
+    // Parses "name=path[:ro][:mmap][:overlay=directory][:dedup][:sparse][:mirror=target]" (or
+    // just a path, named after its file) and adds it.
+    void add(const std::string& spec);
+
+    // Snapshots every overlay export. Throws if any can't be.
+    void snapshot_overlays() const;
+
+    // Returns nullptr if there's no such export.
+    pointer find(const std::string& name) const;
+
+    std::vector<pointer> list() const;
+
+    bool empty() const
+    {
+        return exports_.empty();
+    }
+
+private:
+
+    io_engine& engine_;
+    block_cache* cache_;
+    const mapped_file::options mapping_;
+    const throttle::options qos_;
+    const overlay_image::options overlays_;
+    const std::shared_ptr<dedup_store> dedup_;
+    const write_mirror::options mirrors_;
+    std::map<std::string, pointer> exports_;
+    std::string default_name_;
+};
+
+#endif
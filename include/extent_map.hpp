@@ -0,0 +1,59 @@
+#ifndef EXTENT_MAP_HPP
+#define EXTENT_MAP_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// Which parts of a backing file are allocated, as far as we've asked the filesystem with
+// SEEK_DATA/SEEK_HOLE. What we learn is kept so repeated NBD_CMD_BLOCK_STATUS queries over
+// the same ranges don't have to go back to the filesystem; writes invalidate what they touch.
+class extent_map
+    : private boost::noncopyable
+{
+public:
+
+    struct extent
+    {
+        uint64_t length;
+        bool data; // Otherwise it's a hole, and reads as zeroes
+    };
+
+    // The map can't grow past max_segments. If it would, it starts over.
+    extent_map(int fd, uint64_t size, size_t max_segments = 64 * 1024);
+
+    // Appends up to max_extents extents covering [offset, offset + length) to out, merging
+    // neighbours of the same kind. The range has to be inside the file.
+    void query(uint64_t offset, uint64_t length, size_t max_extents, std::vector<extent>& out);
+
+    // Forgets the range. Call this once a write or discard over it has completed.
+    void invalidate(uint64_t offset, uint64_t length);
+
+private:
+
+    struct segment
+    {
+        uint64_t end;
+        bool data;
+    };
+
+    // Asks the filesystem about the run of data or hole that starts at offset.
+    segment seek(uint64_t offset);
+
+    // Both of these expect mutex_ to be held.
+    void insert(uint64_t start, const segment& s);
+    void trim(uint64_t start, uint64_t end);
+
+    const int fd_;
+    const uint64_t size_;
+    const size_t max_segments_;
+
+    std::mutex mutex_;
+    std::map<uint64_t, segment> segments_; // By start. Guarded by mutex_
+    uint64_t generation_ = 0; // Bumped by every invalidate(). Guarded by mutex_
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef GROUP_COMMIT_HPP
+#define GROUP_COMMIT_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "io_engine.hpp"
+
+// Makes completed writes to a file durable, sharing each fdatasync between every flush that
+// asks for one at about the same time. A flush that comes in while a sync is running can't
+// join it (its writes may have completed after the sync started), so it waits for the next
+// one along with everyone else who turned up meanwhile. The running sync is the window.
+//
+// One of these per export is shared by all its connections, so FLUSH and FUA from any of
+// them land in the same group.
+class group_commit
+    : private boost::noncopyable
+{
+public:
+
+    struct stats
+    {
+        uint64_t flushes = 0;
+        uint64_t syncs = 0;
+    };
+
+    group_commit(io_engine& engine, int fd);
+
+    // Calls on_durable, from an engine thread, with 0 or an errno value once everything
+    // that completed before the call is on stable storage.
+    void flush(std::function<void(int error)> on_durable);
+
+    stats get_stats() const;
+
+private:
+
+    void start_sync();
+
+    io_engine& engine_;
+    const int fd_;
+
+    mutable std::mutex mutex_;
+    bool syncing_ = false;
+    std::vector<std::function<void(int)>> waiting_; // For the next sync. Guarded by mutex_
+    stats stats_;
+};
+
+#endif
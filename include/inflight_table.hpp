@@ -0,0 +1,143 @@
+#ifndef INFLIGHT_TABLE_HPP
+#define INFLIGHT_TABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The commands a connection has in flight, keyed by the client's handle. It's an open
+// addressed table with linear probing, so lookups are a hash and usually one slot, and once
+// it's grown to the connection's queue depth inserting and erasing never allocate.
+template <typename T>
+class inflight_table
+{
+public:
+
+    explicit inflight_table(size_t initial_capacity = 256)
+    {
+        size_t capacity = 16;
+        while (capacity < initial_capacity)
+        {
+            capacity *= 2;
+        }
+        slots_.resize(capacity);
+    }
+
+    // Returns false without inserting if the handle is already in flight.
+    bool insert(uint64_t handle, T value)
+    {
+        if ((size_ + 1) * 2 > slots_.size())
+        {
+            grow();
+        }
+
+        size_t i = index_for(handle);
+        while (slots_[i].used)
+        {
+            if (slots_[i].handle == handle)
+            {
+                return false;
+            }
+            i = (i + 1) & mask();
+        }
+        slots_[i].used = true;
+        slots_[i].handle = handle;
+        slots_[i].value = std::move(value);
+        size_++;
+        return true;
+    }
+
+    // Only erases the entry if it's the one we expect, since a command that was rejected for
+    // reusing an in-flight handle mustn't remove the original.
+    bool erase(uint64_t handle, const T& expected)
+    {
+        size_t i = index_for(handle);
+        while (slots_[i].used)
+        {
+            if (slots_[i].handle == handle)
+            {
+                if (!(slots_[i].value == expected))
+                {
+                    return false;
+                }
+                remove_at(i);
+                return true;
+            }
+            i = (i + 1) & mask();
+        }
+        return false;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+private:
+
+    struct slot
+    {
+        uint64_t handle = 0;
+        T value = T();
+        bool used = false;
+    };
+
+    size_t mask() const
+    {
+        return slots_.size() - 1;
+    }
+
+    size_t index_for(uint64_t handle) const
+    {
+        // Handles are often sequential or pointers, so mix the bits before masking.
+        handle ^= handle >> 33;
+        handle *= 0xff51afd7ed558ccdULL;
+        handle ^= handle >> 33;
+        return handle & mask();
+    }
+
+    void remove_at(size_t i)
+    {
+        slots_[i] = slot();
+        size_--;
+
+        // Shift later entries in the probe run back so lookups don't stop at the hole.
+        size_t j = i;
+        for (;;)
+        {
+            j = (j + 1) & mask();
+            if (!slots_[j].used)
+            {
+                return;
+            }
+            size_t home = index_for(slots_[j].handle);
+            bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if (!stays)
+            {
+                slots_[i] = std::move(slots_[j]);
+                slots_[j] = slot();
+                i = j;
+            }
+        }
+    }
+
+    void grow()
+    {
+        std::vector<slot> old;
+        old.swap(slots_);
+        slots_.resize(old.size() * 2);
+        size_ = 0;
+        for (auto& s : old)
+        {
+            if (s.used)
+            {
+                insert(s.handle, std::move(s.value));
+            }
+        }
+    }
+
+    std::vector<slot> slots_;
+    size_t size_ = 0;
+};
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef IO_ENGINE_HPP
+#define IO_ENGINE_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "object_pool.hpp"
+
+enum class io_op
+{
+    read,
+    write,
+
+    // No I/O. Completes once every earlier overlapping write has, for callers that are
+    // going to read the range themselves (e.g. with sendfile). The range stays held until
+    // the caller releases the fence, so later overlapping writes wait for them.
+    fence,
+
+    // Zero the range without sending any data. discard may deallocate it (punch a hole);
+    // write_zeroes leaves it allocated. Both are ordered like writes, and data is unused.
+    discard,
+    write_zeroes,
+
+    // fdatasync the file. Covers writes that completed before it was submitted; it isn't
+    // ordered against anything in flight.
+    sync,
+
+    // A hint that the range will be read soon, so the engine can start bringing it into
+    // memory. Whether it did any good isn't reported, only errors in asking. It isn't ordered
+    // against anything unless the engine's been told to order prefetches (see
+    // set_ordered_prefetch()).
+    prefetch
+};
+
+// Whether the operation changes the file, and so has to be ordered against anything
+// overlapping it.
+inline bool modifies(io_op op)
+{
+    return op == io_op::write || op == io_op::discard || op == io_op::write_zeroes;
+}
+
+// Zeroes a range of fd with fallocate, punching a hole if punch is set and allocating zeroed
+// blocks otherwise, so no data gets written. Filesystems that can't do that get zeroes
+// written the slow way. Blocks. Returns 0 or an errno value.
+int zero_range(int fd, uint64_t offset, uint64_t length, bool punch);
+
+// preadv or pwritev (op is read or write) of the buffers, starting at offset, going around
+// again after short transfers. Blocks. Returns 0 or an errno value.
+int vectored_io(int fd, io_op op, uint64_t offset, std::vector<iovec> buffers);
+
+struct io_request
+{
+    io_op op;
+    int fd;
+    uint64_t offset;
+    uint64_t length;
+    char* data;
+
+    // Called from an engine thread with 0 on success or an errno value.
+    std::function<void(int error)> on_complete;
+};
+
+// Runs backing file I/O asynchronously. Any number of requests can be in flight at once;
+// the only ordering kept is between requests whose ranges overlap on the same fd where at
+// least one of them is a write. Those are handed to the engine in submission order.
+//
+// Engines implement dispatch() to start an operation and call complete() once it's done.
+// Those that queue operations can use take_adjacent() to merge contiguous reads or writes into
+// a single vectored one, like an elevator. Anything dispatched at the same time is already free
+// of conflicts, so merging never changes what a read sees.
+class io_engine
+    : private boost::noncopyable
+{
+    struct file;
+
+public:
+
+    // Pooled, and held by a single reference from submission until release().
+    struct operation
+        : public pooled<operation>
+    {
+        io_request request;
+        uint64_t transferred = 0; // For the engine's use with short reads and writes
+
+    private:
+        friend class io_engine;
+
+        size_t blockers = 0; // Earlier overlapping operations that have to finish first
+        std::vector<operation*> dependents;
+        file* owner = nullptr;
+        std::multimap<uint64_t, operation*>::iterator position; // In owner's reads or writes
+    };
+
+    struct merge_stats
+    {
+        uint64_t merged = 0; // Reads and writes that went out as part of a vectored operation
+        uint64_t vectored = 0; // The vectored operations they made up
+    };
+
+    io_engine();
+    virtual ~io_engine() {}
+
+    // The longest a merged operation can get. 0, the default, leaves everything unmerged. Set
+    // it before submitting anything.
+    void set_max_merge(uint64_t bytes)
+    {
+        max_merge_ = bytes;
+    }
+
+    // Orders prefetches like reads, after any earlier overlapping write, discard or write
+    // zeroes, instead of not at all. Engines whose prefetch loads data into a cache of their
+    // own need that, or a prefetch can cache what a zero has just thrown away. Set it before
+    // submitting anything.
+    void set_ordered_prefetch(bool ordered)
+    {
+        ordered_prefetch_ = ordered;
+    }
+
+    merge_stats get_merge_stats() const
+    {
+        return merge_stats{merged_.load(std::memory_order_relaxed), vectored_.load(std::memory_order_relaxed)};
+    }
+
+    // The returned operation is only good for passing to release(), and only for fences.
+    operation* submit(io_request request);
+
+    void release(operation* fence);
+
+    // Whether a write, discard or write zeroes overlapping the range has been submitted and
+    // hasn't completed yet. Its completion handler has returned by the time this says no.
+    bool modifying(int fd, uint64_t offset, uint64_t length);
+
+    // Finishes whatever has been submitted and shuts the engine down.
+    virtual void stop() = 0;
+
+    virtual const char* name() const = 0;
+
+protected:
+
+    // Called without any engine locks held, from whichever thread submitted the request or
+    // completed the operation it was waiting on.
+    virtual void dispatch(operation* op) = 0;
+
+    void complete(operation* op, int error);
+
+    // Takes the reads or writes out of queue that carry on contiguously from op, on either side
+    // of it, and returns them in offset order with op among them. Ones that have started
+    // transferring are left where they are. Returns just op if there's nothing to merge it with.
+    std::vector<operation*> take_adjacent(operation* op, std::deque<operation*>& queue);
+
+private:
+
+    // In-flight operations on one file, by offset. The longest length seen since the map was
+    // last empty bounds how far back from a range an operation overlapping it can start.
+    struct ranges
+    {
+        std::multimap<uint64_t, operation*> by_offset;
+        uint64_t longest = 0;
+
+        std::multimap<uint64_t, operation*>::iterator insert(operation* op);
+        void erase(std::multimap<uint64_t, operation*>::iterator it);
+
+        // Calls f with each operation overlapping the range, until it returns false.
+        template <typename F>
+        void overlapping(uint64_t offset, uint64_t length, F f) const;
+    };
+
+    // Everything in flight on an fd. Operations on different files never conflict, so each
+    // file is looked after under its own lock. Reads, fences, prefetches and syncs are kept
+    // apart from the operations that modify the file, since they only ever have to look for
+    // the latter.
+    struct file
+    {
+        std::mutex mutex;
+        ranges reads; // Guarded by mutex
+        ranges writes; // Guarded by mutex
+    };
+
+    bool conflicts(const io_request& a, const io_request& b) const;
+
+    // Never null. Once made, a file stays for the life of the engine.
+    file* file_for(int fd);
+
+    void start(operation* op);
+
+    std::shared_ptr<object_pool<operation>> operations_;
+
+    std::shared_mutex files_mutex_;
+    std::unordered_map<int, std::unique_ptr<file>> files_; // Guarded by files_mutex_
+
+    uint64_t max_merge_ = 0;
+    bool ordered_prefetch_ = false;
+    std::atomic<uint64_t> merged_{0};
+    std::atomic<uint64_t> vectored_{0};
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef IO_WORKER_POOL_HPP
+#define IO_WORKER_POOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "io_engine.hpp"
+
+// The synchronous engine: a pool of threads issuing blocking pread/pwrite calls. It works
+// everywhere, so it's the fallback when the kernel doesn't give us anything better.
+//
+// The workers can run something other than pread/pwrite by passing in an executor, which
+// is how synchronous layers like the block cache get their own threads.
+//
+// With pread/pwrite, a worker taking a read or write off the queue takes any queued behind it
+// that are contiguous with it too, and does them all with one preadv or pwritev. The queue
+// only builds up while every worker is busy, which is when there's most to merge.
+class io_worker_pool
+    : public io_engine
+{
+public:
+
+    // Does the I/O for a read or write request and returns 0 or an errno value.
+    typedef std::function<int(const io_request&)> executor;
+
+    static int positional_io(const io_request& request);
+
+    explicit io_worker_pool(size_t num_threads, executor execute = positional_io);
+    ~io_worker_pool();
+
+    void stop() override;
+
+    const char* name() const override
+    {
+        return "threads";
+    }
+
+protected:
+
+    void dispatch(operation* op) override;
+
+private:
+
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable ready_cv_;
+    bool stopping_ = false;
+    std::deque<operation*> ready_; // Guarded by mutex_
+
+    executor execute_;
+    bool vectored_; // Whether the executor is positional_io, so merging can replace it
+    std::vector<std::thread> threads_;
+};
+
+#endif
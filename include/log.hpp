@@ -0,0 +1,260 @@
+#ifndef LOG_HPP
+#define LOG_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Levels below this are compiled out, arguments and all. 0 is trace, 4 is error.
+#ifndef MNDB_LOG_LEVEL
+#define MNDB_LOG_LEVEL 2
+#endif
+
+enum class log_level : int
+{
+    trace,
+    debug,
+    info,
+    warn,
+    error
+};
+
+// An asynchronous logger. Each thread that logs gets its own ring of fixed-size records, which
+// only it writes and only the logger's thread reads, so logging takes no locks and makes no
+// system calls. The record keeps the format string and the arguments as they were passed; the
+// logger's thread formats them, "{}" for each argument in turn, and writes them out in batches.
+//
+// If a thread logs faster than its ring is drained, records are dropped rather than making the
+// thread wait, and the logger says how many were lost.
+//
+// Use it through the LOG_* macros, which skip everything for levels that are compiled out or
+// turned off. Format strings have to outlive the logger, so they must be literals.
+class logger
+    : private boost::noncopyable
+{
+public:
+
+    static const size_t max_arguments = 8;
+    static const size_t text_capacity = 96; // For string arguments, which are copied
+    static const size_t ring_capacity = 2048; // Records per thread. A power of two
+
+    struct argument
+    {
+        enum class kind : uint8_t
+        {
+            signed_integer,
+            unsigned_integer,
+            floating_point,
+            text
+        };
+
+        kind type;
+        union
+        {
+            int64_t i;
+            uint64_t u;
+            double d;
+            struct
+            {
+                uint16_t offset;
+                uint16_t length;
+            } s;
+        };
+    };
+
+    struct record
+    {
+        uint64_t time; // Nanoseconds since the logger started
+        const char* format;
+        log_level level;
+        uint8_t count;
+        uint16_t text_length;
+        argument arguments[max_arguments];
+        char text[text_capacity];
+    };
+
+    struct stats
+    {
+        uint64_t written = 0;
+        uint64_t dropped = 0;
+    };
+
+    static logger& instance();
+
+    ~logger();
+
+    bool enabled(log_level level) const
+    {
+        return level >= level_.load(std::memory_order_relaxed);
+    }
+
+    void set_level(log_level level);
+
+    // Where formatted records go. stdout by default.
+    void set_output(FILE* output);
+
+    // Returns once everything logged before the call has been written out.
+    void flush();
+
+    stats get_stats() const;
+
+    // "trace", "debug" and so on. Throws std::invalid_argument for anything else.
+    static log_level parse_level(const std::string& name);
+
+    template <typename... Args>
+    void write(log_level level, const char* format, const Args&... args)
+    {
+        static_assert(sizeof...(Args) <= max_arguments, "Too many arguments for one log record");
+
+        ring& r = local_ring();
+        uint64_t tail = r.tail.load(std::memory_order_relaxed);
+        if (tail - r.head.load(std::memory_order_acquire) == ring_capacity)
+        {
+            r.dropped.store(r.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+
+        record& rec = r.records[tail & (ring_capacity - 1)];
+        rec.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+        rec.format = format;
+        rec.level = level;
+        rec.count = 0;
+        rec.text_length = 0;
+        int expand[] = {0, (add(rec, args), 0)...};
+        (void)expand;
+
+        r.tail.store(tail + 1, std::memory_order_release);
+
+        // The logger's thread sleeps while every ring is empty, so a record that finds this one
+        // drained has to wake it. That's once a burst, and the lock is only taken if it's asleep.
+        if (r.head.load(std::memory_order_acquire) == tail)
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (idle_.load(std::memory_order_relaxed))
+            {
+                wake();
+            }
+        }
+    }
+
+private:
+
+    struct ring
+    {
+        alignas(64) std::atomic<uint64_t> head{0}; // Advanced by the logger's thread
+        alignas(64) std::atomic<uint64_t> tail{0}; // Advanced by the thread that owns the ring
+        std::atomic<uint64_t> dropped{0};
+        uint64_t dropped_reported = 0;
+        std::unique_ptr<record[]> records{new record[ring_capacity]};
+    };
+
+    logger();
+
+    static ring& local_ring()
+    {
+        return current_ring_ ? *current_ring_ : instance().add_ring();
+    }
+
+    ring& add_ring();
+
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type add(record& rec, const T& value)
+    {
+        argument& a = rec.arguments[rec.count++];
+        if (std::is_signed<T>::value)
+        {
+            a.type = argument::kind::signed_integer;
+            a.i = static_cast<int64_t>(value);
+        }
+        else
+        {
+            a.type = argument::kind::unsigned_integer;
+            a.u = static_cast<uint64_t>(value);
+        }
+    }
+
+    template <typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value>::type add(record& rec, const T& value)
+    {
+        argument& a = rec.arguments[rec.count++];
+        a.type = argument::kind::floating_point;
+        a.d = value;
+    }
+
+    static void add(record& rec, const char* value)
+    {
+        add_text(rec, value, strlen(value));
+    }
+
+    static void add(record& rec, const std::string& value)
+    {
+        add_text(rec, value.data(), value.size());
+    }
+
+    // Anything that doesn't fit in what's left of the record is cut off.
+    static void add_text(record& rec, const char* data, size_t length)
+    {
+        argument& a = rec.arguments[rec.count++];
+        a.type = argument::kind::text;
+        a.s.offset = rec.text_length;
+        a.s.length = std::min(length, text_capacity - rec.text_length);
+        memcpy(rec.text + a.s.offset, data, a.s.length);
+        rec.text_length += a.s.length;
+    }
+
+    void wake();
+    bool pending() const; // Under mutex_
+    void run();
+    bool drain(std::vector<const record*>& batch, std::string& out);
+    static void format(const record& rec, std::string& out);
+
+    static thread_local ring* current_ring_;
+
+    const std::chrono::steady_clock::time_point start_;
+    std::atomic<log_level> level_;
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<ring>> rings_; // Guarded by mutex_. Never shrinks
+    FILE* output_; // Guarded by mutex_
+    stats stats_; // Guarded by mutex_
+    uint64_t flushes_requested_ = 0; // Guarded by mutex_
+    uint64_t flushes_done_ = 0; // Guarded by mutex_
+    bool stopping_ = false; // Guarded by mutex_
+    bool woken_ = false; // Guarded by mutex_
+    std::atomic<bool> idle_{false}; // Set while the logger's thread waits for records
+    std::condition_variable wake_cv_;
+    std::condition_variable flushed_cv_;
+    std::thread thread_;
+};
+
+#define LOG_AT(level, min, ...) \
+    do \
+    { \
+        if constexpr (min >= MNDB_LOG_LEVEL) \
+        { \
+            if (logger::instance().enabled(level)) \
+            { \
+                logger::instance().write(level, __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+#define LOG_TRACE(...) LOG_AT(log_level::trace, 0, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(log_level::debug, 1, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(log_level::info, 2, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(log_level::warn, 3, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(log_level::error, 4, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <cstdint>
+#include <string>
+
+// A backing file mapped into memory, shared, in its entirety. It's meant for exports that fit
+// in RAM: reads are sent straight from the mapping and writes are copied into it, so neither
+// goes through a buffer or a system call. Touching a page that isn't resident blocks on the
+// disk, which is why populating the mapping up front is the default.
+class mapped_file
+    : private boost::noncopyable
+{
+public:
+
+    // How the kernel should expect the mapping to be accessed, for its readahead.
+    enum class access
+    {
+        normal,
+        sequential, // MADV_SEQUENTIAL
+        random // MADV_RANDOM
+    };
+
+    struct options
+    {
+        // Read the whole file in when it's mapped (MAP_POPULATE), so the first client doesn't
+        // take the page faults.
+        bool populate = true;
+
+        // Ask for transparent huge pages (MADV_HUGEPAGE). Only some filesystems, tmpfs for
+        // one, back file mappings with them; elsewhere it does nothing.
+        bool huge_pages = false;
+
+        access advice = access::normal;
+    };
+
+    // Maps size bytes of fd, which stays the caller's to close after this is gone. Throws on
+    // failure.
+    mapped_file(int fd, uint64_t size, bool read_only, const options& opts);
+    ~mapped_file();
+
+    char* data() const
+    {
+        return data_;
+    }
+
+    uint64_t size() const
+    {
+        return size_;
+    }
+
+    // msyncs the whole mapping, which writes back every page that's been written through it.
+    // Returns 0 or an errno value.
+    int sync();
+
+    // Parses "normal", "sequential" or "random". Throws on anything else.
+    static access parse_access(const std::string& name);
+
+private:
+    char* data_ = nullptr;
+    uint64_t size_;
+};
+
+#endif
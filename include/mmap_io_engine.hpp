@@ -0,0 +1,35 @@
+#ifndef MMAP_IO_ENGINE_HPP
+#define MMAP_IO_ENGINE_HPP
+
+#include <memory>
+
+#include "io_worker_pool.hpp"
+#include "mapped_file.hpp"
+
+// The engine for an export served from a mapped_file. Reads and writes are a memcpy out of or
+// into the mapping, done there and then on the thread that dispatches them, so they complete
+// before submit() returns unless something overlapping holds them up. Syncs (msync) and
+// zeroing can take a while, so those go to the worker threads.
+//
+// Requests must be for the mapped file's descriptor.
+class mmap_io_engine
+    : public io_worker_pool
+{
+public:
+
+    explicit mmap_io_engine(std::shared_ptr<mapped_file> file, size_t num_threads = 1);
+
+    const char* name() const override
+    {
+        return "mmap";
+    }
+
+protected:
+
+    void dispatch(operation* op) override;
+
+private:
+    std::shared_ptr<mapped_file> file_;
+};
+
+#endif
@@ -3,7 +3,7 @@
 
 #include "stdint.h"
 
-#pragma pack(1)
+#pragma pack(push, 1)
 
 // Magic numbers
 extern const uint64_t nbdmagic;// = 0x4e42444d41474943; // 'NBDMAGIC' Generally called INIT_PASSWD
@@ -11,6 +11,7 @@ extern const uint64_t optmagic;// = 0x49484156454F5054; // 'IHAVEOPT';
 extern const uint64_t negotiation_replymagic;// = 0x3e889045565a9; 
 extern const uint32_t NBD_REQUEST_MAGIC;// = 0x25609513;
 extern const uint32_t NBD_REPLY_MAGIC;// = 0x67446698;
+extern const uint32_t NBD_STRUCTURED_REPLY_MAGIC;// = 0x668e33ef;
 
 // handshake_flags 
 extern const uint16_t NBD_FLAG_FIXED_NEWSTYLE;// = 0x1; // Must be set by servers that support the fixed newstyle protocol
@@ -21,28 +22,66 @@ extern const uint32_t NBD_FLAG_C_FIXED_NEWSTYLE;// = 1<<0; // Should be set by c
 extern const uint32_t NBD_FLAG_C_NO_ZEROES;// = 1<<1;
 
 // option types
+extern const uint32_t NBD_OPT_ABORT;// = 2;
+extern const uint32_t NBD_OPT_LIST;// = 3;
 extern const uint32_t NBD_OPT_INFO;// = 6;
 extern const uint32_t NBD_OPT_GO;// = 7;
+extern const uint32_t NBD_OPT_STRUCTURED_REPLY;// = 8;
+extern const uint32_t NBD_OPT_LIST_META_CONTEXT;// = 9;
+extern const uint32_t NBD_OPT_SET_META_CONTEXT;// = 10;
 
 // Reply types (Used in the "reply type field sent by the server during option haggling")
 extern const uint32_t NBD_REP_ACK;// = 1;
+extern const uint32_t NBD_REP_SERVER;// = 2; // One export, in reply to NBD_OPT_LIST
 extern const uint32_t NBD_REP_INFO;// = 3;
+extern const uint32_t NBD_REP_META_CONTEXT;// = 4;
+extern const uint32_t NBD_REP_ERR_UNSUP;// = (1u<<31) + 1; // The option isn't known by this server
+extern const uint32_t NBD_REP_ERR_INVALID;// = (1u<<31) + 3; // The option's data is malformed
+extern const uint32_t NBD_REP_ERR_UNKNOWN;// = (1u<<31) + 6; // The chosen export doesn't exist
+extern const uint32_t NBD_REP_ERR_TOO_BIG;// = (1u<<31) + 9; // The option's data is too long to process
 
 // For use with NBD_REP_INFO
 extern const uint16_t NBD_INFO_EXPORT;// = 0;
+extern const uint16_t NBD_INFO_BLOCK_SIZE;// = 3;
 
 // Transmission flags
 extern const uint16_t NBD_FLAG_HAS_FLAGS;// = 0x01; // Must always be 1
 extern const uint16_t NBD_FLAG_READ_ONLY;// = 1<<1;
 extern const uint16_t NBD_FLAG_SEND_FLUSH;// = 1<<2; 
+extern const uint16_t NBD_FLAG_SEND_FUA;// = 1<<3;
+extern const uint16_t NBD_FLAG_SEND_TRIM;// = 1<<5;
+extern const uint16_t NBD_FLAG_SEND_WRITE_ZEROES;// = 1<<6;
+extern const uint16_t NBD_FLAG_CAN_MULTI_CONN;// = 1<<8; // Connections to the export see each other's writes
 // etc.
 
 // Request types
 extern const uint16_t NBD_CMD_READ;// = 0;
 extern const uint16_t NBD_CMD_WRITE;// = 1;
 extern const uint16_t NBD_CMD_DISC;// = 2; // A disconnect request. The server must handle outstanding requests, shut down the TLS session, and close the TCP session
+extern const uint16_t NBD_CMD_FLUSH;// = 3; // Everything that's completed has to be made durable
+extern const uint16_t NBD_CMD_TRIM;// = 4; // The client no longer needs the data. Reading it back gives undefined contents
+extern const uint16_t NBD_CMD_WRITE_ZEROES;// = 6; // Like a write of zeroes, but with no payload
+extern const uint16_t NBD_CMD_BLOCK_STATUS;// = 7; // Needs structured replies and a meta context
 // ect. 
 
+// Command flags
+extern const uint16_t NBD_CMD_FLAG_FUA;// = 1<<0; // Don't reply until the write is durable
+extern const uint16_t NBD_CMD_FLAG_NO_HOLE;// = 1<<1; // WRITE_ZEROES must leave the range allocated
+extern const uint16_t NBD_CMD_FLAG_REQ_ONE;// = 1<<3; // BLOCK_STATUS wants a single extent
+
+// Structured reply flags and types
+extern const uint16_t NBD_REPLY_FLAG_DONE;// = 1<<0; // The last chunk of the reply
+extern const uint16_t NBD_REPLY_TYPE_NONE;// = 0;
+extern const uint16_t NBD_REPLY_TYPE_OFFSET_DATA;// = 1;
+extern const uint16_t NBD_REPLY_TYPE_OFFSET_HOLE;// = 2;
+extern const uint16_t NBD_REPLY_TYPE_BLOCK_STATUS;// = 5;
+extern const uint16_t NBD_REPLY_TYPE_ERROR;// = (1<<15) + 1;
+
+// The base:allocation meta context
+extern const char* const NBD_META_BASE_ALLOCATION;// = "base:allocation";
+extern const uint32_t NBD_STATE_HOLE;// = 1<<0;
+extern const uint32_t NBD_STATE_ZERO;// = 1<<1;
+
 struct initial_message
 {
     uint64_t nbdmagic;
@@ -74,6 +113,14 @@ struct nbd_info_export
     uint16_t transmission_flags;
 };
 
+struct nbd_info_block_size
+{
+    uint16_t information_type; // NBD_INFO_BLOCK_SIZE
+    uint32_t minimum_block_size;
+    uint32_t preferred_block_size;
+    uint32_t maximum_block_size; // The longest read or write payload
+};
+
 struct reply_magic
 {
     uint32_t nbd_reply_magic;
@@ -101,6 +148,50 @@ struct reply_message
     // length bytes of data if the request is type NBD_CMD_READ
 };
 
-#pragma pop()
+// With structured replies negotiated, a reply is one or more of these chunks.
+struct structured_reply_chunk
+{
+    uint32_t nbd_structured_reply_magic;
+    uint16_t flags; // NBD_REPLY_FLAG_DONE on the last chunk
+    uint16_t type;
+    uint64_t handle;
+    uint32_t length; // Of the payload that follows
+};
+
+struct offset_data_chunk
+{
+    structured_reply_chunk header; // NBD_REPLY_TYPE_OFFSET_DATA
+    uint64_t offset;
+    // length - 8 bytes of data
+};
+
+struct offset_hole_chunk
+{
+    structured_reply_chunk header; // NBD_REPLY_TYPE_OFFSET_HOLE
+    uint64_t offset;
+    uint32_t hole_size; // Reads as that many zeroes
+};
+
+struct block_status_chunk
+{
+    structured_reply_chunk header; // NBD_REPLY_TYPE_BLOCK_STATUS
+    uint32_t context_id;
+    // Followed by block_descriptors
+};
+
+struct block_descriptor
+{
+    uint32_t length;
+    uint32_t status_flags;
+};
+
+struct error_chunk
+{
+    structured_reply_chunk header; // NBD_REPLY_TYPE_ERROR
+    uint32_t error;
+    uint16_t message_length; // We never send a message
+};
+
+#pragma pack(pop)
 
 #endif
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef NBD_CLIENT_HPP
+#define NBD_CLIENT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// The client side of NBD, just enough of it for mndb-bench and the tests. Everything blocks,
+// and works on a plain socket, so the caller is free to pipeline requests and read the
+// replies however it likes.
+
+struct nbd_client_options
+{
+    std::string host = "127.0.0.1";
+    std::string port = "10809";
+    std::string export_name; // Empty for the server's default export
+
+    // Negotiated before NBD_OPT_GO. If the server won't, connecting fails.
+    bool structured_replies = false;
+    bool base_allocation = false; // For NBD_CMD_BLOCK_STATUS. Needs structured replies
+};
+
+// What the server told us about the export it let us in to.
+struct nbd_export_info
+{
+    uint64_t size = 0;
+    uint16_t flags = 0; // Transmission flags
+    uint32_t max_block_size = 0; // Zero if the server didn't say
+    uint32_t base_allocation_id = 0; // The meta context's, if it was asked for
+};
+
+bool send_all(int sock, const void* data, size_t length);
+bool recv_all(int sock, void* data, size_t length);
+
+// Connects, negotiates with NBD_OPT_GO, and returns the socket, ready for requests. Returns
+// -1 if it can't, with what went wrong in error.
+int nbd_connect(const nbd_client_options& opts, nbd_export_info& info, std::string& error);
+
+// Sends a request, followed by length bytes of data if it's a write.
+bool nbd_send_request(int sock, uint16_t type, uint16_t flags, uint64_t handle, uint64_t offset, uint32_t length,
+    const void* data = nullptr);
+
+// Sends NBD_CMD_DISC and closes the socket.
+void nbd_disconnect(int sock);
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef OBJECT_POOL_HPP
+#define OBJECT_POOL_HPP
+
+#include <boost/core/noncopyable.hpp>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+
+template <typename T>
+class object_pool;
+
+// Base for objects handed out by object_pool<T>. It carries the intrusive reference count,
+// and dropping the last reference destroys the object and gives its memory back to the pool.
+template <typename T>
+class pooled
+{
+    friend class object_pool<T>;
+
+    friend void intrusive_ptr_add_ref(T* p)
+    {
+        p->references_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    friend void intrusive_ptr_release(T* p)
+    {
+        if (p->references_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            recycle(p);
+        }
+    }
+
+    static void recycle(T* p)
+    {
+        object_pool<T>::recycle(p);
+    }
+
+    std::atomic<unsigned> references_{0};
+    std::shared_ptr<object_pool<T>> pool_; // Keeps the pool alive while we're outstanding
+};
+
+// A freelist of T-sized blocks. Objects can be released from any thread; the lock is only
+// held long enough to push or pop a block.
+template <typename T>
+class object_pool
+    : public std::enable_shared_from_this<object_pool<T>>
+    , private boost::noncopyable
+{
+public:
+
+    struct stats
+    {
+        uint64_t hits = 0;   // Served from the freelist
+        uint64_t misses = 0; // Had to go to the heap
+    };
+
+    explicit object_pool(size_t max_free = 1024)
+        : max_free_(max_free)
+    {
+    }
+
+    ~object_pool()
+    {
+        while (free_)
+        {
+            free_block* next = free_->next;
+            ::operator delete(free_);
+            free_ = next;
+        }
+    }
+
+    boost::intrusive_ptr<T> acquire()
+    {
+        void* block = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_)
+            {
+                block = free_;
+                free_ = free_->next;
+                free_count_--;
+                stats_.hits++;
+            }
+            else
+            {
+                stats_.misses++;
+            }
+        }
+        if (!block)
+        {
+            block = ::operator new(sizeof(T) > sizeof(free_block) ? sizeof(T) : sizeof(free_block));
+        }
+
+        T* object = new (block) T();
+        object->pool_ = this->shared_from_this();
+        return boost::intrusive_ptr<T>(object);
+    }
+
+    stats get_stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    friend class pooled<T>;
+
+    struct free_block
+    {
+        free_block* next;
+    };
+
+    static void recycle(T* object)
+    {
+        // The object might hold the last reference to us, so keep the pool alive until we're done.
+        std::shared_ptr<object_pool<T>> pool = std::move(object->pool_);
+        object->~T();
+        pool->push(object);
+    }
+
+    void push(void* block)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_count_ < max_free_)
+            {
+                free_block* b = static_cast<free_block*>(block);
+                b->next = free_;
+                free_ = b;
+                free_count_++;
+                return;
+            }
+        }
+        ::operator delete(block);
+    }
+
+    mutable std::mutex mutex_;
+    free_block* free_ = nullptr;
+    size_t free_count_ = 0;
+    const size_t max_free_;
+    stats stats_;
+};
+
+#endif
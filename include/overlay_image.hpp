@@ -0,0 +1,137 @@
+#ifndef OVERLAY_IMAGE_HPP
+#define OVERLAY_IMAGE_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+// A copy-on-write image: a read-only base file with a stack of sparse delta layers over it,
+// so any number of exports can share one golden image and each only stores what it's changed.
+// Writes only ever go to the top layer. Reads come from whichever layer last wrote each
+// cluster, or from the base if none has.
+//
+// The layers live in a directory of their own, as layer-NNNN.data and layer-NNNN.map. A data
+// file is as long as the image and sparse, with each cluster at its own offset. Its map is a
+// small header and then a bitmap of the clusters the layer has, which is memory mapped. Only
+// synced clusters are in the bitmap, so after a crash a layer never claims a cluster whose
+// data didn't make it to disk. In memory, an index of the top layer for every cluster makes
+// finding it one lookup however many layers there are.
+//
+// A snapshot freezes the top layer and starts an empty one above it. Nothing is copied, so
+// it takes the same time whatever the size of the image.
+//
+// The I/O functions block, and can be called from many threads at once so long as
+// overlapping writes aren't, which is what io_engine sees to. Like block_cache's, they return
+// 0 or an errno value.
+class overlay_image
+    : private boost::noncopyable
+{
+public:
+
+    struct options
+    {
+        // For new overlays. Existing ones keep whatever they were made with. A power of two,
+        // at least 4 KiB.
+        uint64_t cluster_size = 64 * 1024;
+
+        // Worker threads for the export's engine
+        size_t threads = 8;
+    };
+
+    // Opens the layers in directory, over the base image at base_path. The directory and a
+    // first layer are made if they don't exist yet. Throws std::runtime_error on failure.
+    overlay_image(const std::string& base_path, const std::string& directory, const options& opts);
+    ~overlay_image();
+
+    uint64_t size() const
+    {
+        return size_;
+    }
+
+    uint64_t cluster_size() const
+    {
+        return cluster_size_;
+    }
+
+    // Delta layers, including the top one. Not counting the base.
+    size_t layers() const;
+
+    int read(uint64_t offset, uint64_t length, char* data);
+    int write(uint64_t offset, uint64_t length, const char* data);
+
+    // Whole clusters are punched out of the top layer, which reads back as zeroes. What's left
+    // over at either end is written with zeroes.
+    int zero(uint64_t offset, uint64_t length);
+
+    // Asks the kernel to read ahead from whichever layers hold the range.
+    int prefetch(uint64_t offset, uint64_t length);
+
+    // Makes what's been written so far durable: the top layer's data, and then its bitmap.
+    int sync();
+
+    // Syncs and freezes the top layer, and starts a new one. Waits for I/O in progress to
+    // finish first. Returns the new layer's number. Throws std::runtime_error on failure.
+    size_t snapshot();
+
+private:
+
+    struct layer
+    {
+        int fd = -1;
+        int map_fd = -1;
+        std::unique_ptr<mapped_file> map;
+        uint8_t* bits = nullptr; // In map, after the header
+
+        ~layer();
+    };
+
+    std::string layer_path(size_t number, const char* extension) const;
+
+    // Opens layer number, or makes it if create is set.
+    std::unique_ptr<layer> open_layer(size_t number, bool create);
+
+    // Calls f(fd, offset, length) for each run of the range that comes from the same layer,
+    // stopping at the first error. Callers hold layers_mutex_.
+    template <typename F>
+    int for_each_run(uint64_t offset, uint64_t length, F f);
+
+    // Brings a cluster up into the top layer, with data written over part of it. Everything
+    // else in the cluster comes from the layer it was in.
+    int copy_up(uint64_t cluster, uint64_t offset, uint64_t length, const char* data);
+
+    // Records the cluster as being in the top layer, once it's in the data file.
+    void allocate(uint64_t cluster, uint16_t top);
+
+    int sync_top();
+
+    const std::string directory_;
+    uint64_t size_ = 0;
+    uint64_t cluster_size_ = 0;
+    uint64_t clusters_ = 0;
+
+    // Shared by I/O, exclusive for snapshots, which change the top layer.
+    mutable std::shared_mutex layers_mutex_;
+    std::vector<std::unique_ptr<layer>> layers_; // Layer 0 is the base, and has no map
+
+    // The layer each cluster is read from, 0 for the base.
+    std::unique_ptr<std::atomic<uint16_t>[]> index_;
+
+    // Writes that only cover part of a cluster have to copy the rest up. Two of them landing
+    // in the same cluster at once would each copy it, so they take its lock.
+    std::array<std::mutex, 64> cluster_locks_;
+
+    // Clusters brought into the top layer since the last sync, which aren't in its bitmap yet.
+    std::mutex pending_mutex_;
+    std::vector<uint64_t> pending_; // Guarded by pending_mutex_
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef REQUEST_PARSER_HPP
+#define REQUEST_PARSER_HPP
+
+#include <boost/asio/buffer.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Pulls NBD requests out of the byte stream from the socket. We read as much as the socket
+// has into one large buffer and then take every complete request (and the write payload
+// that follows it) out of that, so a client pipelining lots of small requests costs one
+// read per buffer-full rather than one or two per request. Requests can straddle reads;
+// whatever's left over stays buffered until the rest arrives.
+class request_parser
+{
+public:
+
+    struct request
+    {
+        uint16_t flags;
+        uint16_t type;
+        uint64_t handle; // Left in network byte order since we only ever echo it back
+        uint64_t offset;
+        uint32_t length;
+    };
+
+    enum class result
+    {
+        request,   // A request header was parsed
+        need_more, // There isn't a complete header buffered
+        bad_magic  // The stream isn't NBD requests. There's no recovering from this
+    };
+
+    explicit request_parser(size_t buffer_size);
+
+    // Free space at the end of the buffer to read into, then commit() what was read.
+    boost::asio::mutable_buffer prepare();
+    void commit(size_t bytes);
+
+    result parse(request& out);
+
+    // Copies up to max_bytes of whatever's buffered after the last parsed header (the payload
+    // of a write) into dest. Returns how much was copied.
+    size_t take(char* dest, size_t max_bytes);
+
+    // Like take(), but throws the bytes away.
+    size_t skip(size_t max_bytes);
+
+    size_t buffered() const
+    {
+        return end_ - begin_;
+    }
+
+private:
+
+    std::vector<char> buffer_;
+    size_t begin_ = 0; // Start of unparsed data
+    size_t end_ = 0;   // End of data read from the socket
+};
+
+#endif
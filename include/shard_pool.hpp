@@ -0,0 +1,66 @@
+#ifndef SHARD_POOL_HPP
+#define SHARD_POOL_HPP
+
+#include <boost/asio.hpp>
+#include <boost/core/noncopyable.hpp>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The network runtime: one io_service per shard, each run by a single thread of its own,
+// optionally pinned to a CPU. A connection lives on one shard for its whole life, so its
+// handlers never move between threads and shards share nothing but the exports and the
+// I/O engine.
+class shard_pool
+    : private boost::noncopyable
+{
+public:
+
+    struct options
+    {
+        size_t shards = 1;
+
+        // Shard i is pinned to cpus[i % cpus.size()]. Empty leaves the threads unpinned.
+        std::vector<int> cpus;
+    };
+
+    // Parses a CPU list like "0-3,8,10-11". Throws std::invalid_argument if it isn't one.
+    static std::vector<int> parse_cpu_list(const std::string& list);
+
+    explicit shard_pool(const options& opts);
+    ~shard_pool();
+
+    size_t size() const
+    {
+        return shards_.size();
+    }
+
+    std::shared_ptr<boost::asio::io_service> io_service(size_t shard) const
+    {
+        return shards_[shard].io_service;
+    }
+
+    // Starts the threads and waits for them. They only return once stop() has been called.
+    void run();
+
+    void stop();
+
+private:
+
+    struct shard
+    {
+        std::shared_ptr<boost::asio::io_service> io_service;
+
+        // Keeps run() from returning while the shard has nothing to do, which it will
+        // between connections if it has no acceptor of its own.
+        std::unique_ptr<boost::asio::io_service::work> work;
+    };
+
+    const options options_;
+    std::vector<shard> shards_;
+    std::vector<std::thread> threads_;
+};
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A counter with one writer. Adding is a plain load and store, with no locked instruction,
+// and any thread can read it.
+class stats_counter
+{
+public:
+
+    void add(uint64_t n)
+    {
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const
+    {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+// A latency histogram in the style of HdrHistogram. Each power of two from 16ns to about 18
+// minutes is split into 16 buckets, so any value is known to within 1/16th. Like
+// stats_counter, it has one writer and can be read from anywhere.
+class latency_histogram
+{
+public:
+
+    static const int sub_bucket_bits = 4;
+    static const int max_bits = 40; // Anything longer lands in the last bucket
+    static const size_t bucket_count = (max_bits - sub_bucket_bits + 1) << sub_bucket_bits;
+
+    // Summed from any number of histograms, for reporting.
+    struct snapshot
+    {
+        std::array<uint64_t, bucket_count> buckets{};
+        uint64_t count = 0;
+        uint64_t sum = 0; // Nanoseconds
+
+        void add(const latency_histogram& h);
+
+        // The value q of the way through, 0 to 1, as the middle of its bucket. 0 if empty.
+        uint64_t quantile(double q) const;
+    };
+
+    void record(uint64_t nanoseconds)
+    {
+        stats_counter& bucket = buckets_[index(nanoseconds)];
+        bucket.add(1);
+        count_.add(1);
+        sum_.add(nanoseconds);
+    }
+
+    static size_t index(uint64_t value)
+    {
+        if (value < (1u << sub_bucket_bits))
+        {
+            return value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        if (msb >= max_bits)
+        {
+            return bucket_count - 1;
+        }
+        int shift = msb - sub_bucket_bits;
+        return ((shift + 1) << sub_bucket_bits) + ((value >> shift) & ((1u << sub_bucket_bits) - 1));
+    }
+
+    // The smallest value that lands in the bucket, and how many values it covers.
+    static uint64_t lowest(size_t index);
+    static uint64_t width(size_t index);
+
+private:
+    std::array<stats_counter, bucket_count> buckets_;
+    stats_counter count_;
+    stats_counter sum_;
+};
+
+// Counters for one export. Every thread that serves the export gets its own shard of them, so
+// the request path never writes to memory another thread writes to. Reports add the shards up.
+class export_stats
+    : private boost::noncopyable
+{
+public:
+
+    // Indexed by NBD command type.
+    static const size_t op_count = 8;
+
+    struct op
+    {
+        stats_counter count;
+        stats_counter errors;
+        stats_counter bytes;
+        latency_histogram backing; // From parsing the request to the backing I/O completing
+        latency_histogram total; // From parsing the request to its reply having been written
+    };
+
+    struct shard
+    {
+        op ops[op_count];
+        stats_counter bytes_in;
+        stats_counter bytes_out;
+        stats_counter read_ahead_bytes;
+        stats_counter admission_waits; // Requests held back by the in-flight limits
+        stats_counter throttled; // Requests held back by the IOPS and bandwidth limits
+
+        // Zero blocks in writes to sparse exports, which were punched out rather than
+        // written, or left alone because they were holes already.
+        stats_counter zero_bytes_punched;
+        stats_counter zero_bytes_skipped;
+
+        // Gauges, which connections can also give back to from other threads as they go away.
+        std::atomic<int64_t> inflight{0};
+        std::atomic<int64_t> outbox{0};
+    };
+
+    static uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // The calling thread's shard, made on first use. Connections look it up once, when they
+    // start transmission, rather than for every request.
+    shard& local();
+
+    // Everything added up over the shards.
+    struct totals
+    {
+        struct op_totals
+        {
+            uint64_t count = 0;
+            uint64_t errors = 0;
+            uint64_t bytes = 0;
+            latency_histogram::snapshot backing;
+            latency_histogram::snapshot total;
+        };
+
+        op_totals ops[op_count];
+        uint64_t bytes_in = 0;
+        uint64_t bytes_out = 0;
+        uint64_t read_ahead_bytes = 0;
+        uint64_t admission_waits = 0;
+        uint64_t throttled = 0;
+        uint64_t zero_bytes_punched = 0;
+        uint64_t zero_bytes_skipped = 0;
+        int64_t inflight = 0;
+        int64_t outbox = 0;
+        int64_t connections = 0;
+    };
+
+    std::unique_ptr<totals> collect() const;
+
+    std::atomic<int64_t> connections{0};
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<std::pair<std::thread::id, std::unique_ptr<shard>>> shards_; // Guarded by mutex_
+};
+
+#endif
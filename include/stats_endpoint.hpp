@@ -0,0 +1,36 @@
+#ifndef STATS_ENDPOINT_HPP
+#define STATS_ENDPOINT_HPP
+
+#include <boost/asio.hpp>
+#include <boost/core/noncopyable.hpp>
+
+#include <memory>
+#include <string>
+
+#include "export_registry.hpp"
+
+// Reports every export's stats in Prometheus' text format. Anything that connects to the
+// stats port gets them as an HTTP response, whatever it asked for, and SIGUSR1 writes them
+// to stdout.
+class stats_endpoint
+    : private boost::noncopyable
+{
+public:
+
+    // Listens on the loopback address only. A port of 0 leaves HTTP off.
+    stats_endpoint(boost::asio::io_service& io_service, const export_registry& exports, unsigned short port);
+
+    static std::string prometheus_text(const export_registry& exports);
+
+private:
+
+    void start_accept();
+    void wait_for_signal();
+
+    boost::asio::io_service& io_service_;
+    const export_registry& exports_;
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor_;
+    boost::asio::signal_set signals_;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef STREAM_DETECTOR_HPP
+#define STREAM_DETECTOR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Spots streams among one connection's reads and decides what to read ahead of them. A
+// stream is a run of reads that each start where the last one ended (sequential), or the
+// same length and a fixed distance after it (strided). A handful are tracked at once, so
+// interleaved streams each get their own read-ahead; a read that doesn't continue any of them
+// starts a new one in place of the least recently used.
+//
+// Like the kernel's readahead, more is asked for once a stream gets halfway into what it was
+// last given, and the window doubles each time if the stream was reading what had been read
+// ahead. While most recent reads don't belong to a stream, read-ahead stops and the windows
+// shrink.
+//
+// Not thread-safe. Each connection has its own.
+class stream_detector
+{
+public:
+
+    struct options
+    {
+        size_t streams = 8;
+        uint64_t min_window = 128 * 1024;
+        uint64_t max_window = 4 * 1024 * 1024; // Also the longest stride that's recognized
+
+        // Read-ahead stops while fewer than this percentage of the last 64 reads are part
+        // of a stream.
+        unsigned min_stream_percent = 25;
+    };
+
+    // Read ahead count ranges, each length long, the first at offset and each one stride after
+    // the last. A count of 0 means there's nothing to read ahead.
+    struct prefetch
+    {
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        uint64_t stride = 0;
+        size_t count = 0;
+    };
+
+    struct stats
+    {
+        uint64_t reads = 0;
+        uint64_t stream_reads = 0; // Continued a stream
+        uint64_t hits = 0; // Found their data read ahead
+        uint64_t prefetched_bytes = 0;
+    };
+
+    // size is the export's, which read-ahead stays inside.
+    stream_detector(const options& opts, uint64_t size);
+
+    // Called for every read, in the order they arrive.
+    prefetch on_read(uint64_t offset, uint64_t length);
+
+    const stats& get_stats() const
+    {
+        return stats_;
+    }
+
+private:
+
+    struct stream
+    {
+        bool used = false;
+        uint64_t last_offset = 0;
+        uint64_t last_length = 0;
+        uint64_t stride = 0; // 0 for sequential, or until a strided stream is confirmed
+        uint64_t candidate_stride = 0; // Seen once, waiting for a second read to confirm it
+        uint64_t ahead = 0; // Where read-ahead has got to
+        uint64_t window = 0;
+        uint64_t last_used = 0;
+    };
+
+    // Continues s with the read, growing or shrinking its window, and works out what to read
+    // ahead of it.
+    prefetch advance(stream& s, uint64_t offset, uint64_t length, bool throttled);
+
+    const options options_;
+    const uint64_t size_;
+    std::vector<stream> streams_;
+    uint64_t recent_ = 0; // A bit for each of the last 64 reads, set if it continued a stream
+    stats stats_;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef THROTTLE_HPP
+#define THROTTLE_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+// Token buckets limiting the rate of requests and of bytes. Taking never fails: a request
+// that finds the bucket short leaves it in debt, and is told how long to wait before going
+// ahead, which is how long the bucket takes to pay the debt off. Requests that come after
+// it wait behind it, so they go in the order they took their tokens.
+//
+// Thread-safe, since an export's throttle is shared by all its connections.
+class throttle
+    : private boost::noncopyable
+{
+public:
+
+    struct options
+    {
+        // 0 for no limit
+        uint64_t iops = 0;
+        uint64_t bytes_per_second = 0;
+
+        // How long a client that's been idle can go at full speed before the limit kicks in.
+        std::chrono::milliseconds burst = std::chrono::milliseconds(100);
+    };
+
+    explicit throttle(const options& opts);
+
+    bool enabled() const
+    {
+        return requests_.rate > 0 || bytes_.rate > 0;
+    }
+
+    // Takes the tokens for one request of length bytes, and returns how long it has to wait.
+    std::chrono::nanoseconds take(uint64_t length);
+
+private:
+
+    struct bucket
+    {
+        double rate = 0; // Tokens a second, 0 for no limit
+        double capacity = 0;
+        double tokens = 0;
+    };
+
+    // Adds what's accrued since the last call, up to capacity, then takes n. Returns the
+    // seconds until the bucket is out of debt.
+    static double take(bucket& b, double elapsed, double n);
+
+    std::mutex mutex_;
+    bucket requests_; // Guarded by mutex_
+    bucket bytes_; // Guarded by mutex_
+    std::chrono::steady_clock::time_point last_; // Guarded by mutex_
+};
+
+#endif
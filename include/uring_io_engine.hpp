@@ -0,0 +1,115 @@
+#ifndef URING_IO_ENGINE_HPP
+#define URING_IO_ENGINE_HPP
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "io_engine.hpp"
+
+// An engine that batches requests into an io_uring submission queue and reaps completions
+// on its own event loop thread. One io_uring_enter both submits everything queued since the
+// last pass and waits for completions, so a deep queue costs a fraction of a syscall per op.
+//
+// Reads or writes that are contiguous with each other and waiting in the loop's backlog at the
+// same time go out as one READV or WRITEV. They pile up while the loop is waiting for the
+// kernel, so merging costs no extra latency.
+//
+// The constructor throws std::runtime_error if the kernel doesn't support io_uring (or it's
+// been disabled, which is common in containers), so callers can fall back to io_worker_pool.
+class uring_io_engine
+    : public io_engine
+{
+public:
+
+    struct options
+    {
+        unsigned queue_depth = 256;
+
+        // Have a kernel thread poll the submission queue so submitting needs no syscall at
+        // all while it's busy. This burns a core and typically needs CAP_SYS_NICE.
+        bool sqpoll = false;
+        unsigned sqpoll_idle_ms = 1000;
+    };
+
+    explicit uring_io_engine(const options& opts);
+    ~uring_io_engine();
+
+    // Pins these buffers with the kernel so requests whose data lies inside one of them skip
+    // the per-op page mapping. Must be called before anything is submitted.
+    void register_buffers(const std::vector<iovec>& buffers);
+
+    void stop() override;
+
+    const char* name() const override
+    {
+        return "io_uring";
+    }
+
+protected:
+
+    void dispatch(operation* op) override;
+
+private:
+
+    void run();
+    void wake();
+
+    // A run of operations merged into one vectored submission
+    struct vectored
+    {
+        std::vector<operation*> ops;
+        std::vector<iovec> buffers;
+    };
+
+    bool has_room() const;
+    io_uring_sqe* next_sqe();
+    void push_sqe();
+
+    void prepare(operation* op);
+    void prepare_vectored(std::vector<operation*> ops);
+    void prepare_wakeup();
+    void handle_completion(const io_uring_cqe& cqe);
+    void handle_vectored_completion(vectored* v, int res);
+
+    io_uring_params params_;
+    int ring_fd_ = -1;
+    int event_fd_ = -1; // Written by dispatch() to wake the event loop
+
+    void* sq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    void* cq_ring_ = nullptr;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned* sq_mask_;
+    unsigned* sq_flags_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned* cq_mask_;
+    io_uring_cqe* cqes_;
+
+    std::vector<iovec> registered_;
+
+    std::mutex mutex_;
+    bool stopping_ = false; // Guarded by mutex_
+    std::deque<operation*> pending_; // Guarded by mutex_
+
+    // Only touched by the event loop
+    std::deque<operation*> backlog_; // Waiting for room in the rings
+    unsigned to_submit_ = 0;
+    size_t in_kernel_ = 0;
+    uint64_t event_count_;
+
+    std::thread thread_;
+};
+
+#endif
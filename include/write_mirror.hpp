@@ -0,0 +1,147 @@
+#ifndef WRITE_MIRROR_HPP
+#define WRITE_MIRROR_HPP
+
+#include <boost/core/noncopyable.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "io_engine.hpp"
+
+// Keeps a second copy of an export up to date, for failover. The replica is either a local
+// file or an export on another NBD server (mndb or not), given as nbd://host:port/name.
+//
+// Writes and zeroes are queued as they're submitted to the primary, and a thread of our own
+// sends them to the replica in order, a batch at a time, with every request in the batch in
+// flight at once. In sync mode a write isn't acknowledged until the replica has it too, and
+// FLUSH flushes both. In async mode it's acknowledged as soon as the primary has it, unless
+// the replica is more than max_lag bytes behind, when it waits for it like in sync mode.
+//
+// Whenever a write can't be sent (the replica's down, or it failed) the regions it covers are
+// marked dirty in a bitmap, and once the replica's back they're copied across from the primary,
+// read through the export's engine, which orders the reads after any writes already submitted.
+// Every region starts out dirty, so the first thing a new mirror does is copy the whole export.
+// A replica that's down never holds up the primary: its writes are acknowledged without it.
+class write_mirror
+    : private boost::noncopyable
+{
+public:
+
+    enum class mode
+    {
+        sync,
+        async
+    };
+
+    struct options
+    {
+        mode sync = mode::async;
+
+        // How far async mode can get ahead of the replica before writes wait for it.
+        uint64_t max_lag = 64 * 1024 * 1024;
+
+        // Granularity of the dirty bitmap, and how much is copied at a time when resyncing.
+        uint64_t region_size = 64 * 1024;
+
+        // The most requests sent to the replica before waiting for their replies.
+        size_t batch = 64;
+
+        // How long to wait between attempts to reach the replica.
+        std::chrono::milliseconds retry = std::chrono::seconds(1);
+    };
+
+    struct stats
+    {
+        bool connected = false;
+        uint64_t lag_bytes = 0; // Queued for the replica and not yet on it
+        uint64_t dirty_bytes = 0; // In dirty regions, waiting to be resynced
+        uint64_t replicated_bytes = 0;
+        uint64_t resynced_bytes = 0;
+        uint64_t disconnects = 0;
+    };
+
+    typedef std::function<void()> handler;
+
+    // Parses "sync" or "async". Throws on anything else.
+    static mode parse_mode(const std::string& name);
+
+    // Mirrors size bytes of the export that engine reads from fd. Doesn't wait to reach the
+    // replica, which is left to the mirror's thread.
+    write_mirror(const std::string& target, io_engine& engine, int fd, uint64_t size, const options& opts);
+    ~write_mirror();
+
+    const std::string& target() const
+    {
+        return target_;
+    }
+
+    bool sync_mode() const
+    {
+        return options_.sync == mode::sync;
+    }
+
+    // Call these once the primary's I/O has been submitted, from the same thread. on_done is
+    // called (maybe before they return) when the request can be acknowledged as far as the
+    // mirror's concerned. In sync mode data has to stay valid until then; async mode copies it.
+    void write(uint64_t offset, uint64_t length, const char* data, handler on_done);
+    void zero(uint64_t offset, uint64_t length, handler on_done);
+
+    // In sync mode, flushes the replica, after everything queued before it. In async mode the
+    // replica isn't waited for, and on_done is called straight away.
+    void flush(handler on_done);
+
+    stats get_stats() const;
+
+private:
+
+    struct item
+    {
+        io_op op; // write, write_zeroes or sync
+        uint64_t offset;
+        uint64_t length;
+        const char* data;
+        std::vector<char> copy; // What data points at, in async mode
+        handler on_done; // Null once it's been called
+        bool resync = false; // Copying a dirty region across
+    };
+
+    void enqueue(item i);
+
+    void run();
+
+    // Takes up to count dirty regions, clearing their bits, and reads them from the primary.
+    std::vector<item> take_dirty(size_t count, std::vector<std::vector<char>>& buffers);
+
+    void mark_dirty(uint64_t offset, uint64_t length); // Under mutex_
+
+    const std::string target_;
+    io_engine& engine_;
+    const int fd_;
+    const uint64_t size_;
+    const options options_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<item> queue_; // Guarded by mutex_, and so is everything down to the thread
+    bool connected_ = false;
+    bool stopping_ = false;
+    uint64_t lag_bytes_ = 0;
+    std::vector<uint64_t> dirty_;
+    uint64_t dirty_regions_ = 0;
+    uint64_t resync_cursor_ = 0; // The region to look for dirty ones from
+    uint64_t replicated_bytes_ = 0;
+    uint64_t resynced_bytes_ = 0;
+    uint64_t disconnects_ = 0;
+
+    std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef ZERO_SCAN_HPP
+#define ZERO_SCAN_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// One way of checking that a buffer is all zeroes.
+struct zero_scanner
+{
+    const char* name;
+    bool (*scan)(const char* data, size_t length);
+};
+
+// The one is_zero() uses: the widest of AVX-512, AVX2 and SSE2 the CPU has, picked when the
+// program starts.
+const zero_scanner& best_zero_scanner();
+
+// Every one this CPU can run, narrowest first, for benchmarks.
+std::vector<zero_scanner> zero_scanners();
+
+// Whether length bytes at data are all zero. Most non-zero data differs in its first few
+// bytes, so those are checked on their own, before paying for a call to the scanner.
+inline bool is_zero(const char* data, size_t length)
+{
+    size_t i = 0;
+    for (; i < length && i < 16; i++)
+    {
+        if (data[i] != 0)
+        {
+            return false;
+        }
+    }
+    return i == length || best_zero_scanner().scan(data + i, length - i);
+}
+
+#endif
@@ -0,0 +1,64 @@
+#include <vector>
+
+#include "admission_control.hpp"
+
+admission_control::admission_control(const options& opts)
+    : options_(opts)
+{
+}
+
+bool admission_control::fits(uint64_t length) const
+{
+    if (commands_ == 0)
+    {
+        return true;
+    }
+    return commands_ < options_.max_commands && bytes_ + length <= options_.max_bytes;
+}
+
+bool admission_control::admit(uint64_t length, handler on_admitted)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (waiting_.empty() && fits(length))
+    {
+        bytes_ += length;
+        commands_++;
+        return true;
+    }
+    waiting_.push_back(waiter{length, std::move(on_admitted)});
+    waits_++;
+    return false;
+}
+
+void admission_control::release(uint64_t length, uint64_t commands)
+{
+    // The handlers run outside the lock, since they may well come straight back to us.
+    std::vector<handler> admitted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bytes_ -= length;
+        commands_ -= commands;
+        while (!waiting_.empty() && fits(waiting_.front().length))
+        {
+            bytes_ += waiting_.front().length;
+            commands_++;
+            admitted.push_back(std::move(waiting_.front().on_admitted));
+            waiting_.pop_front();
+        }
+    }
+    for (auto& h : admitted)
+    {
+        h();
+    }
+}
+
+admission_control::stats admission_control::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats s;
+    s.bytes = bytes_;
+    s.commands = commands_;
+    s.waiting = waiting_.size();
+    s.waits = waits_;
+    return s;
+}
@@ -0,0 +1,736 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "block_cache.hpp"
+#include "io_engine.hpp"
+
+namespace
+{
+
+// O_DIRECT needs offsets, lengths and memory aligned to the device's logical block size.
+// A page covers every device we're likely to see.
+const uint64_t direct_alignment = 4096;
+
+uint64_t align_down(uint64_t v)
+{
+    return v & ~(direct_alignment - 1);
+}
+
+uint64_t align_up(uint64_t v)
+{
+    return align_down(v + direct_alignment - 1);
+}
+
+int pread_all(int fd, char* data, uint64_t length, uint64_t offset, uint64_t& done)
+{
+    done = 0;
+    while (done < length)
+    {
+        ssize_t res = pread(fd, data + done, length - done, offset + done);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno;
+        }
+        if (res == 0)
+        {
+            break;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+int pwrite_all(int fd, const char* data, uint64_t length, uint64_t offset)
+{
+    uint64_t done = 0;
+    while (done < length)
+    {
+        ssize_t res = pwrite(fd, data + done, length - done, offset + done);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+}
+
+size_t block_cache::block_key_hash::operator()(const block_key& k) const
+{
+    uint64_t h = k.block * 0x9e3779b97f4a7c15ULL ^ static_cast<uint64_t>(k.fd);
+    h ^= h >> 29;
+    return static_cast<size_t>(h);
+}
+
+block_cache::block_cache(const options& opts)
+    : options_(opts)
+    , entries_per_shard_(std::max<size_t>(opts.memory_budget / opts.block_size / std::max<size_t>(opts.shards, 1), 1))
+{
+    if (opts.block_size % direct_alignment != 0)
+    {
+        throw std::runtime_error("The cache block size has to be a multiple of 4 KiB");
+    }
+
+    for (size_t i = 0; i < std::max<size_t>(opts.shards, 1); i++)
+    {
+        std::unique_ptr<shard> s(new shard);
+        size_t bytes = entries_per_shard_ * opts.block_size;
+        void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            throw std::runtime_error("Unable to allocate memory for the block cache");
+        }
+        s->memory = static_cast<char*>(memory);
+        s->entries.resize(entries_per_shard_);
+        for (size_t e = 0; e < entries_per_shard_; e++)
+        {
+            s->entries[e].data = s->memory + e * opts.block_size;
+        }
+        s->index.reserve(entries_per_shard_);
+        shards_.push_back(std::move(s));
+    }
+}
+
+block_cache::~block_cache()
+{
+    std::vector<int> fds;
+    for (auto& f : files_)
+    {
+        fds.push_back(f.first);
+    }
+    for (int fd : fds)
+    {
+        flush(fd);
+        ::close(fd);
+    }
+
+    for (auto& s : shards_)
+    {
+        munmap(s->memory, entries_per_shard_ * options_.block_size);
+    }
+}
+
+int block_cache::open(const std::string& path, bool read_only)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        throw std::runtime_error("Unable to stat " + path);
+    }
+    auto id = std::make_pair(st.st_dev, st.st_ino);
+    int access = read_only ? O_RDONLY : O_RDWR;
+
+    std::unique_lock<std::shared_mutex> lock(files_mutex_);
+    auto existing = open_files_.find(id);
+    if (existing != open_files_.end())
+    {
+        file& f = files_[existing->second];
+        if (f.read_only && !read_only)
+        {
+            // Everyone so far only reads it. A second descriptor would have blocks of its own
+            // that the first never sees written, so the read-write one takes over the number,
+            // and the blocks cached under it stay good.
+            int fd = ::open(path.c_str(), access | (f.direct ? O_DIRECT : 0));
+            if (fd == -1)
+            {
+                throw std::runtime_error("Unable to open " + path + " for writing");
+            }
+            int res = dup2(fd, existing->second);
+            ::close(fd);
+            if (res == -1)
+            {
+                throw std::runtime_error("Unable to reopen " + path + " for writing");
+            }
+            f.read_only = false;
+        }
+        f.references++;
+        return existing->second;
+    }
+
+    // O_DIRECT only works if the file ends on an aligned boundary and the filesystem
+    // supports it (tmpfs doesn't, for one). Otherwise we fall back to the page cache.
+    bool direct = st.st_size % direct_alignment == 0;
+    int fd = direct ? ::open(path.c_str(), access | O_DIRECT) : -1;
+    if (fd == -1)
+    {
+        direct = false;
+        fd = ::open(path.c_str(), access);
+    }
+    if (fd == -1)
+    {
+        throw std::runtime_error("Unable to open " + path);
+    }
+
+    files_[fd] = file{static_cast<uint64_t>(st.st_size), direct, read_only, 1, id};
+    open_files_[id] = fd;
+    return fd;
+}
+
+void block_cache::close(int fd)
+{
+    {
+        std::unique_lock<std::shared_mutex> lock(files_mutex_);
+        auto it = files_.find(fd);
+        if (it == files_.end() || --it->second.references > 0)
+        {
+            return;
+        }
+    }
+
+    // Nobody has the file open any more, so write out what's dirty and forget its blocks.
+    flush(fd);
+    for (auto& s : shards_)
+    {
+        std::unique_lock<std::mutex> lock(s->mutex);
+        for (auto& e : s->entries)
+        {
+            if (e.used && e.key.fd == fd)
+            {
+                s->cv.wait(lock, [&e] { return !e.busy; });
+                s->index.erase(e.key);
+                e.used = false;
+                e.dirty = false;
+            }
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(files_mutex_);
+    auto it = files_.find(fd);
+    if (it != files_.end() && it->second.references == 0)
+    {
+        open_files_.erase(it->second.id);
+        files_.erase(it);
+        ::close(fd);
+    }
+}
+
+block_cache::file block_cache::file_info(int fd)
+{
+    std::shared_lock<std::shared_mutex> lock(files_mutex_);
+    auto it = files_.find(fd);
+    if (it == files_.end())
+    {
+        throw std::runtime_error("The file isn't open in the block cache");
+    }
+    return it->second;
+}
+
+uint64_t block_cache::file_size(int fd)
+{
+    return file_info(fd).size;
+}
+
+uint64_t block_cache::block_length(const file& f, uint64_t block) const
+{
+    uint64_t start = block * options_.block_size;
+    return start >= f.size ? 0 : std::min<uint64_t>(options_.block_size, f.size - start);
+}
+
+block_cache::shard& block_cache::shard_for(const block_key& key)
+{
+    return *shards_[block_key_hash()(key) % shards_.size()];
+}
+
+int block_cache::load_block(int fd, uint64_t block, char* data)
+{
+    file f = file_info(fd);
+    uint64_t length = block_length(f, block);
+    uint64_t done;
+    int error = pread_all(fd, data, length, block * options_.block_size, done);
+    if (error)
+    {
+        return error;
+    }
+    // Anything past the end of the file reads as zeros.
+    memset(data + done, 0, options_.block_size - done);
+    return 0;
+}
+
+int block_cache::store(int fd, uint64_t offset, uint64_t length, const char* src)
+{
+    file f = file_info(fd);
+    bool aligned = offset % direct_alignment == 0 && length % direct_alignment == 0
+        && reinterpret_cast<uintptr_t>(src) % direct_alignment == 0;
+    if (!f.direct || aligned)
+    {
+        return pwrite_all(fd, src, length, offset);
+    }
+
+    // Read-modify-write the aligned span around the range through a bounce buffer.
+    uint64_t start = align_down(offset);
+    uint64_t end = align_up(offset + length);
+    void* bounce;
+    if (posix_memalign(&bounce, direct_alignment, end - start) != 0)
+    {
+        return ENOMEM;
+    }
+    char* b = static_cast<char*>(bounce);
+    int error = 0;
+    uint64_t done;
+    if (start != offset)
+    {
+        error = pread_all(fd, b, direct_alignment, start, done);
+    }
+    if (!error && end != offset + length && (end - direct_alignment != start || start == offset))
+    {
+        error = pread_all(fd, b + (end - start) - direct_alignment, direct_alignment, end - direct_alignment, done);
+    }
+    if (!error)
+    {
+        memcpy(b + (offset - start), src, length);
+        error = pwrite_all(fd, b, end - start, start);
+    }
+    free(bounce);
+    return error;
+}
+
+block_cache::entry* block_cache::evict(shard& s, std::unique_lock<std::mutex>& lock, int& error)
+{
+    for (;;)
+    {
+        // Two full sweeps clear every reference bit, so if nothing's free by then everything
+        // is busy and we wait for something to finish. Unless what wasn't busy was dirty and
+        // couldn't be written back (say the disk's full), when waiting would never end.
+        int failed = 0;
+        for (size_t i = 0; i < 2 * s.entries.size(); i++)
+        {
+            entry& e = s.entries[s.hand];
+            s.hand = (s.hand + 1) % s.entries.size();
+
+            if (!e.used)
+            {
+                return &e;
+            }
+            if (e.busy)
+            {
+                continue;
+            }
+            if (e.referenced)
+            {
+                e.referenced = false;
+                continue;
+            }
+            if (e.dirty)
+            {
+                // Write it back and come around to it again. The lock was dropped while
+                // writing, so anything might have changed.
+                int res = write_back(s, lock, e);
+                failed = res ? res : failed;
+                continue;
+            }
+
+            s.index.erase(e.key);
+            e.used = false;
+            s.counters.evictions++;
+            return &e;
+        }
+
+        // The lock was dropped for write-backs, so what was busy then may be done now. Only
+        // what's busy now is sure to notify us.
+        bool busy = std::any_of(s.entries.begin(), s.entries.end(), [](const entry& e) { return e.busy; });
+        if (!busy && failed)
+        {
+            error = failed;
+            return nullptr;
+        }
+        if (busy)
+        {
+            s.cv.wait(lock);
+        }
+    }
+}
+
+int block_cache::write_back(shard& s, std::unique_lock<std::mutex>& lock, entry& e)
+{
+    e.busy = true;
+    block_key key = e.key;
+    lock.unlock();
+
+    int error = 0;
+    try
+    {
+        uint64_t length = block_length(file_info(key.fd), key.block);
+        error = store(key.fd, key.block * options_.block_size, length, e.data);
+    }
+    catch (std::runtime_error&)
+    {
+        error = EBADF;
+    }
+
+    lock.lock();
+    e.busy = false;
+    if (!error)
+    {
+        e.dirty = false;
+        s.counters.writebacks++;
+    }
+    s.cv.notify_all();
+    return error;
+}
+
+block_cache::entry* block_cache::acquire(shard& s, std::unique_lock<std::mutex>& lock, const block_key& key, bool load, int& error)
+{
+    for (;;)
+    {
+        auto it = s.index.find(key);
+        if (it != s.index.end())
+        {
+            entry& e = s.entries[it->second];
+            if (e.busy)
+            {
+                s.cv.wait(lock);
+                continue;
+            }
+            e.referenced = true;
+            s.counters.hits++;
+            return &e;
+        }
+        if (s.writing_around.count(key))
+        {
+            // Loading now could pick up the old contents from under the write.
+            s.cv.wait(lock);
+            continue;
+        }
+
+        s.counters.misses++;
+        entry* e = evict(s, lock, error);
+        if (!e)
+        {
+            return nullptr;
+        }
+        if (s.index.count(key))
+        {
+            // Someone else brought it in while evict() had the lock dropped.
+            continue;
+        }
+
+        e->key = key;
+        e->used = true;
+        e->dirty = false;
+        e->referenced = true;
+        s.index[key] = e - s.entries.data();
+        if (!load)
+        {
+            return e;
+        }
+
+        e->busy = true;
+        lock.unlock();
+        error = load_block(key.fd, key.block, e->data);
+        lock.lock();
+        e->busy = false;
+        s.cv.notify_all();
+
+        if (error)
+        {
+            s.index.erase(key);
+            e->used = false;
+            return nullptr;
+        }
+        return e;
+    }
+}
+
+int block_cache::read(int fd, uint64_t offset, uint64_t length, char* dest)
+{
+    uint64_t done = 0;
+    while (done < length)
+    {
+        uint64_t position = offset + done;
+        block_key key = {fd, position / options_.block_size};
+        uint64_t in_block = position % options_.block_size;
+        uint64_t n = std::min(length - done, options_.block_size - in_block);
+
+        shard& s = shard_for(key);
+        std::unique_lock<std::mutex> lock(s.mutex);
+        int error = 0;
+        entry* e = acquire(s, lock, key, true, error);
+        if (!e)
+        {
+            return error;
+        }
+        memcpy(dest + done, e->data + in_block, n);
+        done += n;
+    }
+    return 0;
+}
+
+int block_cache::prefetch(int fd, uint64_t offset, uint64_t length)
+{
+    uint64_t end = offset + length;
+    for (uint64_t block = offset / options_.block_size; block * options_.block_size < end; block++)
+    {
+        block_key key = {fd, block};
+        shard& s = shard_for(key);
+        std::unique_lock<std::mutex> lock(s.mutex);
+
+        // Blocks that are already here, or on their way, are left alone, so read-ahead doesn't
+        // count as a hit or keep them from being evicted.
+        if (s.index.count(key))
+        {
+            continue;
+        }
+        int error = 0;
+        if (!acquire(s, lock, key, true, error))
+        {
+            return error;
+        }
+    }
+    return 0;
+}
+
+int block_cache::write(int fd, uint64_t offset, uint64_t length, const char* src)
+{
+    bool write_back_mode = options_.mode == write_mode::write_back;
+
+    uint64_t done = 0;
+    while (done < length)
+    {
+        uint64_t position = offset + done;
+        block_key key = {fd, position / options_.block_size};
+        uint64_t in_block = position % options_.block_size;
+        uint64_t n = std::min(length - done, options_.block_size - in_block);
+        bool whole_block = n == options_.block_size;
+
+        shard& s = shard_for(key);
+        std::unique_lock<std::mutex> lock(s.mutex);
+
+        // Wait out anything touching this block so writes to it land in order.
+        for (;;)
+        {
+            auto it = s.index.find(key);
+            if ((it != s.index.end() && s.entries[it->second].busy) || s.writing_around.count(key))
+            {
+                s.cv.wait(lock);
+                continue;
+            }
+            break;
+        }
+
+        if (!write_back_mode && !s.index.count(key))
+        {
+            // Not cached, so write around the cache. Readers wait until we're done.
+            s.writing_around.insert(key);
+            lock.unlock();
+            int error = store(fd, position, n, src + done);
+            lock.lock();
+            s.writing_around.erase(key);
+            s.cv.notify_all();
+            if (error)
+            {
+                return error;
+            }
+            done += n;
+            continue;
+        }
+
+        int error = 0;
+        entry* e = acquire(s, lock, key, !whole_block, error);
+        if (!e)
+        {
+            return error;
+        }
+        memcpy(e->data + in_block, src + done, n);
+
+        if (write_back_mode)
+        {
+            e->dirty = true;
+        }
+        else
+        {
+            // Write the aligned span we touched from the cached copy, which is aligned too.
+            uint64_t start = align_down(in_block);
+            uint64_t end = std::min<uint64_t>(align_up(in_block + n), block_length(file_info(fd), key.block));
+            e->busy = true;
+            lock.unlock();
+            error = store(fd, key.block * options_.block_size + start, end - start, e->data + start);
+            lock.lock();
+            e->busy = false;
+            s.cv.notify_all();
+            if (error)
+            {
+                // The cached copy is ahead of the disk now, so drop it.
+                s.index.erase(key);
+                e->used = false;
+                return error;
+            }
+        }
+        done += n;
+    }
+    return 0;
+}
+
+void block_cache::drop(shard& s, std::unique_lock<std::mutex>& lock, const block_key& key)
+{
+    for (;;)
+    {
+        auto it = s.index.find(key);
+        if (it == s.index.end())
+        {
+            return;
+        }
+        entry& e = s.entries[it->second];
+        if (e.busy)
+        {
+            s.cv.wait(lock);
+            continue;
+        }
+        s.index.erase(it);
+        e.used = false;
+        e.dirty = false;
+        return;
+    }
+}
+
+int block_cache::zero(int fd, uint64_t offset, uint64_t length, bool punch)
+{
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    // Blocks entirely inside the range are just forgotten, dirty or not. Nothing else can
+    // load or write them meanwhile, since the engine orders overlapping I/O, prefetches
+    // included (main() sets up the cache's engine with ordered prefetches), so for a big
+    // range it's cheaper to look through what's cached than at every block in the range.
+    uint64_t end = offset + length;
+    uint64_t whole_begin = (offset + options_.block_size - 1) / options_.block_size;
+    uint64_t whole_end = end / options_.block_size;
+    if (whole_end > whole_begin && whole_end - whole_begin > entries_per_shard_ * shards_.size())
+    {
+        for (auto& s : shards_)
+        {
+            std::unique_lock<std::mutex> lock(s->mutex);
+            for (auto& e : s->entries)
+            {
+                if (e.used && e.key.fd == fd && e.key.block >= whole_begin && e.key.block < whole_end)
+                {
+                    block_key key = e.key; // drop() may wait, and e could be reused meanwhile
+                    drop(*s, lock, key);
+                }
+            }
+        }
+    }
+    else
+    {
+        for (uint64_t block = whole_begin; block < whole_end; block++)
+        {
+            block_key key = {fd, block};
+            shard& s = shard_for(key);
+            std::unique_lock<std::mutex> lock(s.mutex);
+            drop(s, lock, key);
+        }
+    }
+
+    // The blocks at either end may be shared with I/O outside the range, so they're held
+    // like a write-around while the disk is zeroed, and their cached copies zeroed first so
+    // a write-back of them can't bring the old data back.
+    std::vector<block_key> held;
+    for (uint64_t block : {offset / options_.block_size, (end - 1) / options_.block_size})
+    {
+        block_key key = {fd, block};
+        if ((block >= whole_begin && block < whole_end) || (!held.empty() && held.front() == key))
+        {
+            continue;
+        }
+
+        shard& s = shard_for(key);
+        std::unique_lock<std::mutex> lock(s.mutex);
+        for (;;)
+        {
+            auto it = s.index.find(key);
+            if ((it != s.index.end() && s.entries[it->second].busy) || s.writing_around.count(key))
+            {
+                s.cv.wait(lock);
+                continue;
+            }
+            break;
+        }
+
+        auto it = s.index.find(key);
+        if (it != s.index.end())
+        {
+            uint64_t block_start = block * options_.block_size;
+            uint64_t from = std::max(offset, block_start) - block_start;
+            uint64_t to = std::min(end, block_start + options_.block_size) - block_start;
+            memset(s.entries[it->second].data + from, 0, to - from);
+        }
+        s.writing_around.insert(key);
+        held.push_back(key);
+    }
+
+    int error = zero_range(fd, offset, length, punch);
+
+    for (auto& key : held)
+    {
+        shard& s = shard_for(key);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.writing_around.erase(key);
+        s.cv.notify_all();
+    }
+    return error;
+}
+
+int block_cache::flush(int fd)
+{
+    int result = 0;
+    for (auto& s : shards_)
+    {
+        std::unique_lock<std::mutex> lock(s->mutex);
+        for (auto& e : s->entries)
+        {
+            if (e.used && e.dirty && e.key.fd == fd)
+            {
+                s->cv.wait(lock, [&e] { return !e.busy; });
+                if (e.used && e.dirty && e.key.fd == fd)
+                {
+                    int error = write_back(*s, lock, e);
+                    result = result ? result : error;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+int block_cache::sync(int fd)
+{
+    int error = flush(fd);
+    if (error)
+    {
+        return error;
+    }
+    return fdatasync(fd) == 0 ? 0 : errno;
+}
+
+block_cache::stats block_cache::get_stats() const
+{
+    stats total;
+    for (auto& s : shards_)
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        total.hits += s->counters.hits;
+        total.misses += s->counters.misses;
+        total.evictions += s->counters.evictions;
+        total.writebacks += s->counters.writebacks;
+    }
+    return total;
+}
@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "block_hash.hpp"
+
+namespace
+{
+
+const uint64_t prime32_1 = 0x9E3779B1U;
+const uint64_t prime64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t prime64_3 = 0x165667B19E3779F9ULL;
+
+const size_t stripe_size = 64;
+
+// The accumulators are scrambled every this many stripes, so that what went into them a
+// long way back can't cancel out.
+const size_t stripes_per_round = 16;
+
+constexpr uint64_t splitmix64(uint64_t i)
+{
+    uint64_t z = (i + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Stripe n is keyed from keys[n % 16] on, so the last eight repeat the first eight to save
+// wrapping around.
+constexpr std::array<uint64_t, 24> make_keys()
+{
+    std::array<uint64_t, 24> keys{};
+    for (size_t i = 0; i < 16; i++)
+    {
+        keys[i] = splitmix64(i);
+    }
+    for (size_t i = 16; i < 24; i++)
+    {
+        keys[i] = keys[i - 16];
+    }
+    return keys;
+}
+
+constexpr std::array<uint64_t, 24> keys = make_keys();
+
+const uint64_t initial[8] = {
+    prime32_1, prime64_1, prime64_2, prime64_3, prime64_1 ^ prime64_2, prime64_2 ^ prime64_3, prime64_3 ^ prime32_1, prime64_1 ^ prime32_1,
+};
+
+uint64_t read64(const char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+void accumulate(uint64_t* acc, const char* stripe, size_t n)
+{
+    const uint64_t* key = &keys[n % stripes_per_round];
+    for (size_t i = 0; i < 8; i++)
+    {
+        uint64_t v = read64(stripe + i * 8);
+        uint64_t k = v ^ key[i];
+        acc[i ^ 1] += v;
+        acc[i] += (k & 0xFFFFFFFFU) * (k >> 32);
+    }
+}
+
+void scramble(uint64_t* acc)
+{
+    for (size_t i = 0; i < 8; i++)
+    {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= keys[i];
+        acc[i] *= prime32_1;
+    }
+}
+
+// Whatever's left after the whole stripes, padded out with zeroes. The length goes into the
+// digest separately, so the padding can't be mistaken for data.
+void accumulate_tail(uint64_t* acc, const char* data, size_t length)
+{
+    size_t stripes = length / stripe_size;
+    size_t rest = length % stripe_size;
+    if (rest)
+    {
+        char stripe[stripe_size] = {};
+        memcpy(stripe, data + stripes * stripe_size, rest);
+        accumulate(acc, stripe, stripes);
+    }
+}
+
+uint64_t mix(uint64_t a, uint64_t b)
+{
+    unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+uint64_t avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= prime64_2;
+    h ^= h >> 29;
+    h *= prime64_3;
+    return h ^ (h >> 32);
+}
+
+block_digest finish(const uint64_t* acc, size_t length)
+{
+    uint64_t low = length * prime64_1;
+    uint64_t high = ~length * prime64_2;
+    for (size_t i = 0; i < 8; i += 2)
+    {
+        low += mix(acc[i] ^ keys[i + 1], acc[i + 1] ^ keys[i + 2]);
+        high += mix(acc[i] ^ keys[i + 9], acc[i + 1] ^ keys[i + 10]);
+    }
+    return block_digest{avalanche(low), avalanche(high)};
+}
+
+}
+
+block_digest hash_block_portable(const char* data, size_t length)
+{
+    uint64_t acc[8];
+    memcpy(acc, initial, sizeof(acc));
+    size_t stripes = length / stripe_size;
+    for (size_t n = 0; n < stripes; n++)
+    {
+        accumulate(acc, data + n * stripe_size, n);
+        if ((n + 1) % stripes_per_round == 0)
+        {
+            scramble(acc);
+        }
+    }
+    accumulate_tail(acc, data, length);
+    return finish(acc, length);
+}
+
+#if defined(__SSE2__)
+
+block_digest hash_block(const char* data, size_t length)
+{
+    // Two lanes to a register. SSE2 has no 64-bit multiply, but the lanes only need 32x32,
+    // and the scramble's 64x32 is two of those.
+    __m128i acc[4];
+    for (size_t j = 0; j < 4; j++)
+    {
+        acc[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(initial + j * 2));
+    }
+    const __m128i prime = _mm_set1_epi32(static_cast<int>(prime32_1));
+
+    // A round at a time, so the keys for each stripe are known up front.
+    size_t stripes = length / stripe_size;
+    for (size_t n = 0; n < stripes; )
+    {
+        size_t round_end = std::min(stripes, (n / stripes_per_round + 1) * stripes_per_round);
+        for (; n < round_end; n++)
+        {
+            const char* stripe = data + n * stripe_size;
+            const uint64_t* key = &keys[n % stripes_per_round];
+            for (size_t j = 0; j < 4; j++)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(stripe + j * 16));
+                __m128i k = _mm_xor_si128(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + j * 2)));
+                __m128i product = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+                __m128i swapped = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+                acc[j] = _mm_add_epi64(acc[j], _mm_add_epi64(product, swapped));
+            }
+        }
+        if (n % stripes_per_round == 0)
+        {
+            for (size_t j = 0; j < 4; j++)
+            {
+                __m128i a = _mm_xor_si128(acc[j], _mm_srli_epi64(acc[j], 47));
+                a = _mm_xor_si128(a, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&keys[j * 2])));
+                __m128i low = _mm_mul_epu32(a, prime);
+                __m128i high = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+                acc[j] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+            }
+        }
+    }
+
+    uint64_t lanes[8];
+    for (size_t j = 0; j < 4; j++)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes + j * 2), acc[j]);
+    }
+    accumulate_tail(lanes, data, length);
+    return finish(lanes, length);
+}
+
+#else
+
+block_digest hash_block(const char* data, size_t length)
+{
+    return hash_block_portable(data, length);
+}
+
+#endif
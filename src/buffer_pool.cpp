@@ -0,0 +1,186 @@
+#include <sys/mman.h>
+
+#include <new>
+
+#include "buffer_pool.hpp"
+
+buffer_pool::buffer::buffer(buffer&& other)
+    : pool_(std::move(other.pool_))
+    , data_(other.data_)
+    , size_(other.size_)
+    , size_class_(other.size_class_)
+{
+    other.data_ = nullptr;
+    other.size_ = 0;
+}
+
+buffer_pool::buffer& buffer_pool::buffer::operator=(buffer&& other)
+{
+    if (this != &other)
+    {
+        reset();
+        pool_ = std::move(other.pool_);
+        data_ = other.data_;
+        size_ = other.size_;
+        size_class_ = other.size_class_;
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+buffer_pool::buffer::~buffer()
+{
+    reset();
+}
+
+void buffer_pool::buffer::reset()
+{
+    if (data_)
+    {
+        pool_->release(data_, size_, size_class_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+    pool_.reset();
+}
+
+buffer_pool::buffer_pool(const options& opts)
+    : options_(opts)
+{
+}
+
+buffer_pool::~buffer_pool()
+{
+    // Every buffer holds a reference to us, so everything's back on a freelist by now.
+    for (int c = 0; c < num_classes; c++)
+    {
+        if (class_size(c) >= slab_size)
+        {
+            for (char* block : free_[c])
+            {
+                munmap(block, class_size(c));
+            }
+        }
+    }
+    for (char* slab : slabs_)
+    {
+        munmap(slab, slab_size);
+    }
+}
+
+int buffer_pool::size_class_for(size_t size)
+{
+    int shift = min_class_shift;
+    while (shift <= max_class_shift && (size_t(1) << shift) < size)
+    {
+        shift++;
+    }
+    return shift > max_class_shift ? oversize_class : shift - min_class_shift;
+}
+
+size_t buffer_pool::class_size(int size_class)
+{
+    return size_t(1) << (size_class + min_class_shift);
+}
+
+char* buffer_pool::map(size_t size)
+{
+    void* p = MAP_FAILED;
+    if (options_.huge_pages && size % slab_size == 0)
+    {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (p == MAP_FAILED)
+    {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+        if (options_.huge_pages && size >= slab_size)
+        {
+            madvise(p, size, MADV_HUGEPAGE);
+        }
+    }
+    return static_cast<char*>(p);
+}
+
+buffer_pool::buffer buffer_pool::allocate(size_t size)
+{
+    buffer b;
+    if (size == 0)
+    {
+        return b;
+    }
+
+    int size_class = size_class_for(size);
+    b.pool_ = shared_from_this();
+    b.size_ = size;
+    b.size_class_ = size_class;
+
+    if (size_class == oversize_class)
+    {
+        b.data_ = map(size);
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.misses++;
+        return b;
+    }
+
+    size_t block_size = class_size(size_class);
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<char*>& free = free_[size_class];
+    if (!free.empty())
+    {
+        b.data_ = free.back();
+        free.pop_back();
+        stats_.hits++;
+        stats_.cached_bytes -= block_size;
+        return b;
+    }
+
+    stats_.misses++;
+    if (block_size >= slab_size)
+    {
+        b.data_ = map(block_size);
+        return b;
+    }
+
+    // Carve a new slab up. We hand out the first block and keep the rest.
+    char* slab = map(slab_size);
+    slabs_.push_back(slab);
+    for (size_t offset = slab_size - block_size; offset > 0; offset -= block_size)
+    {
+        free.push_back(slab + offset);
+        stats_.cached_bytes += block_size;
+    }
+    b.data_ = slab;
+    return b;
+}
+
+void buffer_pool::release(char* data, size_t size, int size_class)
+{
+    if (size_class == oversize_class)
+    {
+        munmap(data, size);
+        return;
+    }
+
+    size_t block_size = class_size(size_class);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (block_size < slab_size || stats_.cached_bytes + block_size <= options_.max_cached_bytes)
+        {
+            free_[size_class].push_back(data);
+            stats_.cached_bytes += block_size;
+            return;
+        }
+    }
+    munmap(data, block_size);
+}
+
+buffer_pool::stats buffer_pool::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
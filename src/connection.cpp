@@ -1,47 +1,372 @@
-#include <iostream>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
 
 #include "connection.hpp"
 #include "connection_manager.hpp"
+#include "log.hpp"
+#include "zero_scan.hpp"
+
+namespace
+{
+
+// The only meta context we offer, so its ID can be fixed.
+const uint32_t base_allocation_id = 1;
+
+// The payload a request holds while it's in flight. Reads and writes longer than max_payload
+// fail before anything's allocated for them, so they hold none.
+uint64_t admission_length(const request_parser::request& r, uint64_t max_payload)
+{
+    return (r.type == NBD_CMD_READ || r.type == NBD_CMD_WRITE) && r.length <= max_payload ? r.length : 0;
+}
+
+// Splits a piece of a read into runs of data and of zeroes, one chunk of the reply each, or a
+// write into what's written and what's punched out. Zero runs are whole blocks of granularity
+// bytes, aligned in the file.
+void find_runs(tcp_connection::command& c, const char* data, uint64_t granularity)
+{
+    c.run_count = 0;
+    uint64_t position = 0;
+    while (position < c.length)
+    {
+        uint64_t n = std::min(granularity - (c.offset + position) % granularity, c.length - position);
+        bool hole = n == granularity && is_zero(data + position, n);
+
+        tcp_connection::command::run* last = c.run_count > 0 ? &c.runs[c.run_count - 1] : nullptr;
+        if (hole && !(last && last->hole) && c.run_count + 1 >= tcp_connection::max_read_chunks)
+        {
+            // A new hole would leave no chunk for any data after it, so it goes out as data.
+            hole = false;
+        }
+        if (last && last->hole == hole)
+        {
+            last->length += n;
+        }
+        else
+        {
+            c.runs[c.run_count++] = tcp_connection::command::run{static_cast<uint32_t>(position), static_cast<uint32_t>(n), hole};
+        }
+        position += n;
+    }
+}
+
+}
 
-tcp_connection::tcp_connection(std::shared_ptr<asio::io_service> io_service, connection_manager& manager)
+tcp_connection::tcp_connection(std::shared_ptr<asio::io_service> io_service, connection_manager& manager, io_engine& engine,
+        const export_registry& exports, const options& opts)
     : io_service_(io_service)
     , socket_(*io_service)
     , connection_manager_(manager)
     , socket_strand_(*io_service)
-    , file_io_strand_(*io_service)
+    , engine_(&engine)
+    , handshake_timer_(*io_service)
+    , parser_(opts.receive_buffer_size)
+    , options_(opts)
+    , zero_copy_reads_(opts.zero_copy_reads)
+    , ack_timer_(*io_service)
+    , exports_(exports)
+    , throttle_timer_(*io_service)
+    , command_pool_(std::make_shared<object_pool<command>>())
+    , buffer_pool_(buffer_pool::create(opts.buffers))
+{
+    auto qos = std::unique_ptr<throttle>(new throttle(opts.qos));
+    if (qos->enabled())
+    {
+        qos_ = std::move(qos);
+    }
+}
+
+tcp_connection::~tcp_connection()
+{
+    // Whatever was still in flight when the connection went away won't be counted out, and
+    // this might not be the thread the stats belong to, hence the atomics.
+    if (stats_)
+    {
+        export_->stats->connections.fetch_sub(1, std::memory_order_relaxed);
+        stats_->inflight.fetch_sub(commands_.size(), std::memory_order_relaxed);
+        stats_->outbox.fetch_sub(outbox_.size(), std::memory_order_relaxed);
+    }
+
+    // Replies that never went out still hold their ranges, which would hold up every
+    // overlapping write to the export for good.
+    auto release = [this](const command_ptr& c)
+    {
+        if (c->fence)
+        {
+            engine_->release(c->fence);
+            c->fence = nullptr;
+        }
+    };
+    std::for_each(outbox_.begin(), outbox_.end(), release);
+    std::for_each(writing_.begin(), writing_.end(), release);
+
+    // And whatever hadn't finished is still counted against the server's limits.
+    if (options_.admission && inflight_commands_ > 0)
+    {
+        options_.admission->release(inflight_bytes_, inflight_commands_);
+    }
+}
+
+void tcp_connection::append_option_reply(uint32_t option, uint32_t reply_type, const void* data, uint32_t length)
+{
+    server_negotiation_response response;
+    response.reply_magic = boost::endian::native_to_big(negotiation_replymagic);
+    response.option_sent_by_client = boost::endian::native_to_big(option);
+    response.reply_type = boost::endian::native_to_big(reply_type);
+    response.reply_length = boost::endian::native_to_big(length);
+
+    const char* header = reinterpret_cast<const char*>(&response);
+    option_replies_.insert(option_replies_.end(), header, header + sizeof(response));
+    option_replies_.insert(option_replies_.end(), static_cast<const char*>(data), static_cast<const char*>(data) + length);
+}
+
+void tcp_connection::negotiate_meta_context(uint32_t option, uint32_t data_len)
+{
+    // 32 bits, length of export name
+    // String, name of export for which we wish to list metadata contexts
+    // 32 bits, number of queries
+    // Zero or more queries, each being:
+    // 32 bits, length of query
+    // String, query to list a subset of the available metadata contexts
+    uint32_t position = 0;
+    auto read_string = [&](std::string& out)
+    {
+        if (data_len - position < 4)
+        {
+            return false;
+        }
+        uint32_t length = boost::endian::big_to_native(*(uint32_t*)(data_ + position));
+        position += 4;
+        if (data_len - position < length)
+        {
+            return false;
+        }
+        out.assign(data_ + position, length);
+        position += length;
+        return true;
+    };
+
+    std::string name;
+    std::vector<std::string> queries;
+    bool valid = read_string(name) && data_len - position >= 4;
+    if (valid)
+    {
+        uint32_t count = boost::endian::big_to_native(*(uint32_t*)(data_ + position));
+        position += 4;
+        for (uint32_t i = 0; i < count && valid; i++)
+        {
+            queries.emplace_back();
+            valid = read_string(queries.back());
+        }
+        valid = valid && position == data_len;
+    }
+
+    // Meta contexts are only any use with structured replies.
+    if (!valid || !structured_replies_)
+    {
+        append_option_reply(option, NBD_REP_ERR_INVALID, nullptr, 0);
+        return;
+    }
+    export_registry::pointer e = exports_.find(name);
+    if (!e)
+    {
+        append_option_reply(option, NBD_REP_ERR_UNKNOWN, nullptr, 0);
+        return;
+    }
+
+    // base:allocation is the only context we have. Listing with no queries, or with a query
+    // for the whole base namespace, lists it too.
+    bool allocation = option == NBD_OPT_LIST_META_CONTEXT && queries.empty();
+    for (auto& query : queries)
+    {
+        if (query == NBD_META_BASE_ALLOCATION || (option == NBD_OPT_LIST_META_CONTEXT && query == "base:"))
+        {
+            allocation = true;
+        }
+    }
+    if (option == NBD_OPT_SET_META_CONTEXT)
+    {
+        base_allocation_ = allocation;
+        meta_context_export_ = e;
+    }
+
+    if (allocation)
+    {
+        // 32 bits, NBD metadata context ID. Zero when listing.
+        // String, name of the metadata context
+        size_t name_length = strlen(NBD_META_BASE_ALLOCATION);
+        std::vector<char> context(4 + name_length);
+        uint32_t id = boost::endian::native_to_big<uint32_t>(option == NBD_OPT_SET_META_CONTEXT ? base_allocation_id : 0);
+        memcpy(context.data(), &id, 4);
+        memcpy(context.data() + 4, NBD_META_BASE_ALLOCATION, name_length);
+        append_option_reply(option, NBD_REP_META_CONTEXT, context.data(), context.size());
+    }
+    append_option_reply(option, NBD_REP_ACK, nullptr, 0);
+}
+
+export_registry::pointer tcp_connection::negotiate_export(uint32_t option, uint32_t data_len)
 {
-    backing_file_ = open(backing_file_path_, O_RDWR);
-    if (backing_file_ == -1)
+    // 32 bits, length of name (unsigned); MUST be no larger than the  option data length - 6
+    // String: name of the export
+    // 16 bits, number of information requests
+    // 16 bits x n - list of NBD_INFO information requests
+    uint32_t name_length = data_len >= 6 ? boost::endian::big_to_native(*(uint32_t*)data_) : UINT32_MAX;
+    if (name_length > data_len - 6)
+    {
+        append_option_reply(option, NBD_REP_ERR_INVALID, nullptr, 0);
+        return nullptr;
+    }
+    std::string name(data_ + 4, name_length);
+
+    // If no name is specified, this specifies the default export
+    // Respond with an NBD_REP_ACK if the server accepts the chosen export.
+    // The server must send at least one NBD_REP_INFO with an NBD_INFO_EXPORT
+    // NBD_REP_ERR_UNKNOWN if the chosen export does not exist on the server (no NBD_REP_IN
+    // NBD_REP_ERR_TLS_REQD: The server requires the client to initiate TLS
+    // NBD_REP_ERR_BLOCK_SIZE_REQD: The server requires the client to request block size constraints using
+    // NBD_INFO_BLOCK_SIZE because the server will be using non-default block size.
+    export_registry::pointer e = exports_.find(name);
+    if (!e)
+    {
+        LOG_INFO("Client asked for unknown export '{}'", name);
+        append_option_reply(option, NBD_REP_ERR_UNKNOWN, nullptr, 0);
+        return nullptr;
+    }
+
+    // Every connection to an export shares its descriptor, so they all see each
+    // other's writes as soon as they complete.
+    uint16_t transmission_flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_CAN_MULTI_CONN
+        | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES;
+    if (e->read_only)
     {
-        throw std::runtime_error("Unable to open the backing file");
+        transmission_flags |= NBD_FLAG_READ_ONLY;
     }
 
-    disk_size_ = boost::filesystem::file_size(backing_file_path_);
+    nbd_info_export info_export;
+    info_export.information_type = boost::endian::native_to_big(NBD_INFO_EXPORT);
+    info_export.size_of_export_in_bytes = boost::endian::native_to_big(e->size);
+    info_export.transmission_flags = boost::endian::native_to_big(transmission_flags);
+
+    append_option_reply(option, NBD_REP_INFO, &info_export, sizeof(info_export));
+
+    // Any length and alignment will do, up to the longest payload we take.
+    nbd_info_block_size info_block_size;
+    info_block_size.information_type = boost::endian::native_to_big(NBD_INFO_BLOCK_SIZE);
+    info_block_size.minimum_block_size = boost::endian::native_to_big<uint32_t>(1);
+    info_block_size.preferred_block_size = boost::endian::native_to_big<uint32_t>(4096);
+    info_block_size.maximum_block_size = boost::endian::native_to_big<uint32_t>(options_.max_payload);
+    append_option_reply(option, NBD_REP_INFO, &info_block_size, sizeof(info_block_size));
+    append_option_reply(option, NBD_REP_ACK, nullptr, 0);
+    return e;
 }
 
 void tcp_connection::start()
 {
-    std::cout << "Kicking off the negotiation" << std::endl;
+    LOG_INFO("Kicking off the negotiation");
 
-    initial_message initial;
-    initial.nbdmagic = boost::endian::native_to_big(nbdmagic);
-    initial.optmagic = boost::endian::native_to_big(optmagic);
-    initial.handshake_flags = boost::endian::native_to_big(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROS);
+    // Closing the socket fails whatever negotiation is waiting for, which ends it.
+    auto self(shared_from_this());
+    handshake_timer_.expires_after(options_.handshake_timeout);
+    handshake_timer_.async_wait(socket_strand_.wrap([this, self](const boost::system::error_code& error)
+    {
+        if (!error)
+        {
+            LOG_INFO("Negotiation timed out");
+            boost::system::error_code ignored;
+            socket_.close(ignored);
+        }
+    }));
 
-    boost::system::error_code error;
-    boost::asio::write(socket_, asio::buffer(&initial, sizeof(initial)), error);
-    std::cout << "Sent initial message" << std::endl;
+    initial_.nbdmagic = boost::endian::native_to_big(nbdmagic);
+    initial_.optmagic = boost::endian::native_to_big(optmagic);
+    initial_.handshake_flags = boost::endian::native_to_big(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROS);
+
+    asio::async_write(socket_, asio::buffer(&initial_, sizeof(initial_)), socket_strand_.wrap(
+        [this, self](const boost::system::error_code& error, size_t)
+    {
+        if (error)
+        {
+            end_negotiation();
+            return;
+        }
+        asio::async_read(socket_, asio::buffer(&client_flags_, sizeof(client_flags_)), socket_strand_.wrap(
+            [this, self](const boost::system::error_code& error, size_t)
+        {
+            if (error)
+            {
+                end_negotiation();
+                return;
+            }
+            read_option();
+        }));
+    }));
+}
 
-    uint32_t client_flags;
-    boost::asio::read(socket_, asio::buffer(&client_flags, sizeof(client_flags)), error);
+void tcp_connection::read_option()
+{
+    // The client can keep sending options until one of them (NBD_OPT_GO) takes it into
+    // transmission, or NBD_OPT_ABORT ends it.
+    asio::async_read(socket_, asio::buffer(&option_header_, sizeof(option_header_)), socket_strand_.wrap(
+        boost::bind(&tcp_connection::on_option_header, shared_from_this(), asio::placeholders::error)));
+}
+
+void tcp_connection::on_option_header(const boost::system::error_code& error)
+{
+    if (error || boost::endian::big_to_native(option_header_.optmagic) != optmagic)
+    {
+        end_negotiation();
+        return;
+    }
 
-    client_option c_option;
-    boost::asio::read(socket_, asio::buffer(&c_option, sizeof(c_option)), error);
+    uint32_t data_len = boost::endian::big_to_native(option_header_.length_of_data);
+    if (data_len > max_length_)
+    {
+        // Nothing we understand is this long. Drain it so we can carry on.
+        drain_option(data_len);
+        return;
+    }
 
-    uint32_t option = boost::endian::big_to_native(c_option.option);
-    uint32_t data_len = boost::endian::big_to_native(c_option.length_of_data);
-    asio::read(socket_, asio::buffer(data_, data_len), error); // TODO: We're not checking bounds
+    auto self(shared_from_this());
+    asio::async_read(socket_, asio::buffer(data_, data_len), socket_strand_.wrap(
+        [this, self, data_len](const boost::system::error_code& error, size_t)
+    {
+        if (error)
+        {
+            end_negotiation();
+            return;
+        }
+        handle_option(data_len);
+    }));
+}
 
+void tcp_connection::drain_option(uint32_t left)
+{
+    auto self(shared_from_this());
+    asio::async_read(socket_, asio::buffer(data_, std::min<uint32_t>(left, max_length_)), socket_strand_.wrap(
+        [this, self, left](const boost::system::error_code& error, size_t bytes_transferred)
+    {
+        if (error)
+        {
+            end_negotiation();
+        }
+        else if (left > bytes_transferred)
+        {
+            drain_option(left - bytes_transferred);
+        }
+        else
+        {
+            append_option_reply(boost::endian::big_to_native(option_header_.option), NBD_REP_ERR_TOO_BIG, nullptr, 0);
+            send_option_replies(&tcp_connection::read_option);
+        }
+    }));
+}
+
+void tcp_connection::handle_option(uint32_t data_len)
+{
     // Server response format:
     // S: 64 bits, 0x3e889045565a9 (magic number for replies)
     // S: 32 bits, the option as sent by the client to which this is a reply
@@ -51,135 +376,468 @@ void tcp_connection::start()
     // S: 32 bits, length of the reply. This MAY be zero for some replies, in
     // which case the next field is not sent
     // S: any data as required by the reply (e.g., an export name in the case
-    // of NBD_REP_SERVER) 
-
-    if (option == NBD_OPT_GO)
-    {
-        // 32 bits, length of name (unsigned); MUST be no larger than the  option data length - 6
-        // String: name of the export
-        // 16 bits, number of information requests
-        // 16 bits x n - list of NBD_INFO information requests
-        uint32_t name_length = boost::endian::big_to_native(*(uint32_t*)data_);
-        uint16_t num_info_requests = boost::endian::big_to_native(*(uint16_t*)(data_ + 4 + name_length));
-
-        // If no name is specified, this specifies the default export
-        // Respond with an NBD_REP_ACK if the server accepts the chosen export.
-        // The server must send at least one NBD_REP_INFO with an NBD_INFO_EXPORT
-        // NBD_REP_ERR_UNKNOWN if the chosen export does not exist on the server (no NBD_REP_IN
-        // NBD_REP_ERR_TLS_REQD: The server requires the client to initiate TLS
-        // NBD_REP_ERR_BLOCK_SIZE_REQD: The server requires the client to request block size constraints using
-        // NBD_INFO_BLOCK_SIZE because the server will be using non-default block size. 
-
-        server_negotiation_response info_response;
-        info_response.reply_magic = boost::endian::native_to_big(negotiation_replymagic);
-        info_response.option_sent_by_client = boost::endian::native_to_big(option);
-        info_response.reply_type = boost::endian::native_to_big(NBD_REP_INFO);
-        info_response.reply_length = boost::endian::native_to_big(12);
-        
-        nbd_info_export info_export;
-        info_export.information_type = boost::endian::native_to_big(NBD_INFO_EXPORT);
-        info_export.size_of_export_in_bytes = boost::endian::native_to_big(disk_size_); // 1MB for now. Change this later
-        info_export.transmission_flags = boost::endian::native_to_big(NBD_FLAG_HAS_FLAGS);
-
-        server_negotiation_response ack_response;
-        ack_response.reply_magic = boost::endian::native_to_big(negotiation_replymagic);
-        ack_response.option_sent_by_client = boost::endian::native_to_big(option);
-        ack_response.reply_type = boost::endian::native_to_big(NBD_REP_ACK);
-        ack_response.reply_length = 0;
-
-        // Copy the data into the buffer so we can send it all at once
-        size_t bytes_copied = 0;
-        memcpy(data_ + bytes_copied, &info_response, sizeof(info_response));
-        bytes_copied += sizeof(info_response);
-        memcpy(data_ + bytes_copied, &info_export, sizeof(info_export));
-        bytes_copied += sizeof(info_export);
-        memcpy(data_ + bytes_copied, &ack_response, sizeof(ack_response));
-        bytes_copied += sizeof(ack_response);
-
-        asio::write(socket_, asio::buffer(data_, bytes_copied), error);
-        
-        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::read_request, shared_from_this())));
+    // of NBD_REP_SERVER)
+    uint32_t option = boost::endian::big_to_native(option_header_.option);
+    if (option == NBD_OPT_ABORT)
+    {
+        append_option_reply(option, NBD_REP_ACK, nullptr, 0);
+        send_option_replies(&tcp_connection::end_negotiation);
+        return;
+    }
+
+    if (option == NBD_OPT_LIST)
+    {
+        if (data_len != 0)
+        {
+            append_option_reply(option, NBD_REP_ERR_INVALID, nullptr, 0);
+        }
+        else
+        {
+            // 32 bits, length of name
+            // String, name of the export
+            for (auto& e : exports_.list())
+            {
+                std::vector<char> server(4 + e->name.size());
+                uint32_t length = boost::endian::native_to_big<uint32_t>(e->name.size());
+                memcpy(server.data(), &length, 4);
+                memcpy(server.data() + 4, e->name.data(), e->name.size());
+                append_option_reply(option, NBD_REP_SERVER, server.data(), server.size());
+            }
+            append_option_reply(option, NBD_REP_ACK, nullptr, 0);
+        }
+    }
+    else if (option == NBD_OPT_STRUCTURED_REPLY)
+    {
+        // No data, and nothing to say back but yes.
+        bool ok = data_len == 0;
+        structured_replies_ = structured_replies_ || ok;
+        append_option_reply(option, ok ? NBD_REP_ACK : NBD_REP_ERR_INVALID, nullptr, 0);
+    }
+    else if (option == NBD_OPT_LIST_META_CONTEXT || option == NBD_OPT_SET_META_CONTEXT)
+    {
+        negotiate_meta_context(option, data_len);
+    }
+    else if (option == NBD_OPT_INFO || option == NBD_OPT_GO)
+    {
+        export_registry::pointer e = negotiate_export(option, data_len);
+        if (e && option == NBD_OPT_GO)
+        {
+            export_ = e;
+            send_option_replies(&tcp_connection::start_transmission);
+            return;
+        }
     }
     else
     {
-    // TODO: ??
+        append_option_reply(option, NBD_REP_ERR_UNSUP, nullptr, 0);
     }
+    send_option_replies(&tcp_connection::read_option);
 }
 
-void tcp_connection::read_request()
+void tcp_connection::send_option_replies(void (tcp_connection::*next)())
+{
+    auto self(shared_from_this());
+    asio::async_write(socket_, asio::buffer(option_replies_), socket_strand_.wrap(
+        [this, self, next](const boost::system::error_code& error, size_t)
+    {
+        option_replies_.clear();
+        if (error)
+        {
+            end_negotiation();
+            return;
+        }
+        (this->*next)();
+    }));
+}
+
+void tcp_connection::start_transmission()
+{
+    handshake_timer_.cancel();
+
+    export_registry::pointer e = export_;
+    backing_file_ = e->fd;
+    if (meta_context_export_ != e)
+    {
+        // The contexts were chosen for another export, so they don't apply.
+        base_allocation_ = false;
+    }
+    disk_size_ = e->size;
+    if (e->engine)
+    {
+        engine_ = e->engine.get();
+    }
+    mapping_ = e->mapping ? e->mapping->data() : nullptr;
+    if (options_.read_ahead)
+    {
+        streams_.reset(new stream_detector(options_.streams, disk_size_));
+    }
+    LOG_INFO("Serving export '{}' ({}{})", e->name, e->path, mapping_ ? ", mapped" : "");
+
+    // sendfile works on the native handle, so it has to return EAGAIN instead of blocking
+    // the strand. Asio's own synchronous writes still wait for the socket as before.
+    boost::system::error_code error;
+    socket_.native_non_blocking(true, error);
+
+    // Replies already go out a batch at a time, so Nagle only ever holds one back, until the
+    // client acks the last, which a client that sends a batch and waits for all of it (like
+    // another server's mirror) won't do until its delayed ack fires.
+    socket_.set_option(asio::ip::tcp::no_delay(true), error);
+
+    // Over loopback the client's receive queue keeps referencing the page cache until
+    // the client reads it, long after the ack, so we can't tell when a sendfile payload
+    // is safe from overwrites. Local clients get buffered reads.
+    asio::ip::address local = socket_.local_endpoint(error).address();
+    asio::ip::address remote = socket_.remote_endpoint(error).address();
+    if (error || remote.is_loopback() || remote == local)
+    {
+        zero_copy_reads_ = false;
+    }
+
+    // The cache opens the file with O_DIRECT, so sendfile would bypass what's cached. An
+    // overlay's data is spread over its layers, and a deduplicated export's over the store,
+    // and in both fd is only the image they started from.
+    if (e->cached || e->overlay || e->dedup)
+    {
+        zero_copy_reads_ = false;
+    }
+
+    // We stay on this thread from here on, so this shard of the stats is ours alone.
+    stats_ = &e->stats->local();
+    e->stats->connections.fetch_add(1, std::memory_order_relaxed);
+
+    read_request();
+}
+
+void tcp_connection::end_negotiation()
 {
-    //std::cout << "Beginning an asynchronous command read" << std::endl;
+    handshake_timer_.cancel();
+    LOG_INFO("Negotiation ended. Terminating the connection.");
+    boost::system::error_code error;
+    socket_.close(error);
+    connection_manager_.stop(shared_from_this());
+}
 
-    auto self(shared_from_this()); // Do we need this?
-    asio::async_read(socket_, boost::asio::buffer(data_, sizeof(request_message)), 
-       socket_strand_.wrap([this, self](boost::system::error_code ec, size_t bytes_transferred)
+void tcp_connection::read_request()
+{
+    auto self(shared_from_this());
+    socket_.async_read_some(parser_.prepare(),
+       socket_strand_.wrap([this, self](const boost::system::error_code& error, size_t bytes_transferred)
        {
-            request_message* request = (request_message* ) data_;
-            uint32_t magic = boost::endian::big_to_native(request->nbd_request_magic);
-    
-            if (magic == NBD_REQUEST_MAGIC)
+            if (error)
             {
-                auto c = std::make_shared<command>();
-                commands_.insert(c);
-                
-                c->type = boost::endian::big_to_native(request->type);
-                c->handle = request->handle;
-                c->offset = boost::endian::big_to_native(request->offset);
-                c->length = boost::endian::big_to_native(request->length);
-                c->buffer = std::vector<char>(c->length);
-            
-                std::cout << "Request type " << c->type << " ("  << c->offset << "," << c->length << ")" << std::endl;   
-            
-                if (c->type == NBD_CMD_READ)
-                {
-                    io_service_->post(file_io_strand_.wrap(boost::bind(&tcp_connection::read_data_from_backing, shared_from_this(), c)));
-                    read_request();    
-                }
-                else if (c->type == NBD_CMD_WRITE)
-                {
-                    asio::async_read(socket_, asio::buffer(c->buffer.data(), c->length),
-                        socket_strand_.wrap(boost::bind(&tcp_connection::on_read_data_for_write_request, shared_from_this(), c,
-                            asio::placeholders::error,
-                            asio::placeholders::bytes_transferred)));
-                }
-                else if (c->type == NBD_CMD_DISC)
-                {
-                    // Disconnect request. 
-                    // The server must handle all outstanding requests, shut down the TLS 
-                    // session, and close the TCP session. There is no reply to an NBD_CMD_DISC. 
+                LOG_INFO("Connection closed by the client.");
+                socket_.close();
+                connection_manager_.stop(self);
+                return;
+            }
 
-                    // We won't start a new read since the client can't send anymore requests,
-                    // but we do need to handle any outstanding write requests, I think.
-                    io_service_->post(file_io_strand_.wrap(boost::bind(&tcp_connection::handle_disconnect_request, shared_from_this(), c)));
-                }
+            stats_->bytes_in.add(bytes_transferred);
+            parser_.commit(bytes_transferred);
+            parse_requests();
+       }));
+}
+
+void tcp_connection::parse_requests()
+{
+    // Everything that's complete in the buffer gets dispatched before we go back to the socket,
+    // unless the limits hold a request back, which stops us until it's let in.
+    for (;;)
+    {
+        if (hold_ == hold::none)
+        {
+            request_parser::result result = parser_.parse(held_);
+            if (result == request_parser::result::need_more)
+            {
+                read_request();
+                return;
             }
-            else
+            if (result == request_parser::result::bad_magic)
             {
-                std::cout << "Unexpected request. Terminating the connection." << std::endl; // << bytes_transferred << " bytes" << std::endl;
+                LOG_WARN("Unexpected request. Terminating the connection.");
                 socket_.close();
                 connection_manager_.stop(shared_from_this());
+                return;
             }
-       }));
+            hold_ = hold::parsed;
+            held_back_ = false;
+        }
+
+        if (!admit_held())
+        {
+            return;
+        }
+        hold_ = hold::none;
+        if (!dispatch_request(held_))
+        {
+            return;
+        }
+    }
+}
+
+bool tcp_connection::admit_held()
+{
+    uint64_t length = admission_length(held_, options_.max_payload);
+    if (hold_ == hold::parsed)
+    {
+        if (inflight_commands_ > 0 && (inflight_commands_ >= options_.max_inflight_commands
+            || inflight_bytes_ + length > options_.max_inflight_bytes))
+        {
+            // finish_batch() tries again once some of ours have finished.
+            if (!held_back_)
+            {
+                held_back_ = true;
+                stats_->admission_waits.add(1);
+            }
+            return false;
+        }
+        if (options_.admission)
+        {
+            auto self(shared_from_this());
+            hold_ = hold::waiting;
+            bool admitted = options_.admission->admit(length, [this, self]
+            {
+                io_service_->post(socket_strand_.wrap([this, self]
+                {
+                    hold_ = hold::admitted;
+                    if (socket_.is_open())
+                    {
+                        parse_requests();
+                    }
+                    else
+                    {
+                        // Counted so the destructor gives it back.
+                        inflight_bytes_ += admission_length(held_, options_.max_payload);
+                        inflight_commands_++;
+                    }
+                }));
+            });
+            if (!admitted)
+            {
+                if (!held_back_)
+                {
+                    held_back_ = true;
+                    stats_->admission_waits.add(1);
+                }
+                return false;
+            }
+        }
+        hold_ = hold::admitted;
+    }
+
+    if (hold_ == hold::admitted)
+    {
+        inflight_bytes_ += length;
+        inflight_commands_++;
+        hold_ = hold::ready;
+
+        std::chrono::nanoseconds wait(0);
+        if (qos_)
+        {
+            wait = qos_->take(length);
+        }
+        if (export_->qos)
+        {
+            wait = std::max(wait, export_->qos->take(length));
+        }
+        if (wait.count() > 0)
+        {
+            stats_->throttled.add(1);
+            auto self(shared_from_this());
+            throttle_timer_.expires_after(wait);
+            throttle_timer_.async_wait(socket_strand_.wrap([this, self](const boost::system::error_code& error)
+            {
+                if (!error && socket_.is_open())
+                {
+                    parse_requests();
+                }
+            }));
+            return false;
+        }
+    }
+    return hold_ == hold::ready;
+}
+
+void tcp_connection::release_admission(command& c)
+{
+    inflight_bytes_ -= c.admitted_bytes;
+    inflight_commands_--;
+    if (options_.admission)
+    {
+        options_.admission->release(c.admitted_bytes);
+    }
 }
 
-void tcp_connection::on_read_data_for_write_request(std::shared_ptr<command> c, const boost::system::error_code& error, size_t bytes_transferred)
+bool tcp_connection::dispatch_request(const request_parser::request& request)
 {
-    std::cout << "Received " << bytes_transferred << " bytes of data for the write request." << std::endl;
-    io_service_->post(file_io_strand_.wrap(boost::bind(&tcp_connection::write_data_to_backing, shared_from_this(), c)));
+    command_ptr c = command_pool_->acquire();
+
+    c->flags = request.flags;
+    c->type = request.type;
+    c->handle = request.handle;
+    c->offset = request.offset;
+    c->length = request.length;
+    c->admitted_bytes = admission_length(request, options_.max_payload);
+    c->received = export_stats::now();
+    if (!commands_.insert(c->handle, c))
+    {
+        // The client reused the handle of something still in flight. We'll still take the
+        // payload off the wire, but the command itself fails.
+        c->error = EINVAL;
+    }
+    else
+    {
+        stats_->inflight.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Reads and writes that are too long or go past the end fail before they get a buffer.
+    // With structured replies, a read that's too long gets the error meant for it.
+    bool payload = c->type == NBD_CMD_READ || c->type == NBD_CMD_WRITE;
+    if (payload && !c->error && c->length > options_.max_payload)
+    {
+        c->error = c->type == NBD_CMD_READ && structured_replies_ ? EOVERFLOW : EINVAL;
+    }
+    else if (payload && !c->error && (c->offset > disk_size_ || c->length > disk_size_ - c->offset))
+    {
+        c->error = EINVAL;
+    }
+
+    // Structured reads are split into pieces, which get their own buffers.
+    bool in_pieces = c->type == NBD_CMD_READ && structured_replies_;
+    bool whole_read = c->type == NBD_CMD_READ && !in_pieces && !c->error;
+    if (whole_read && mapping_)
+    {
+        c->mapped = true;
+    }
+    else if (whole_read && zero_copy_reads_ && c->length >= options_.zero_copy_threshold)
+    {
+        c->zero_copy = true;
+    }
+    else if (whole_read || (c->type == NBD_CMD_WRITE && !c->error))
+    {
+        c->buffer = buffer_pool_->allocate(c->length);
+    }
 
+    LOG_DEBUG("Request type {} ({},{})", c->type, c->offset, c->length);
+
+    if (in_pieces)
+    {
+        read_in_pieces(c);
+        read_ahead(*c);
+    }
+    else if (c->type == NBD_CMD_READ)
+    {
+        read_data_from_backing(c);
+        read_ahead(*c);
+    }
+    else if (c->type == NBD_CMD_WRITE && c->error)
+    {
+        // The payload still has to come off the wire, but there's nowhere to put it.
+        size_t skipped = parser_.skip(c->length);
+        if (skipped < c->length)
+        {
+            discard_payload(c, c->length - skipped);
+            return false;
+        }
+        finish_request(c);
+    }
+    else if (c->type == NBD_CMD_WRITE)
+    {
+        size_t copied = parser_.take(c->buffer.data(), c->length);
+        if (copied < c->length)
+        {
+            // The rest of the payload hasn't arrived yet. Read it straight into the
+            // command's buffer rather than copying it through ours.
+            asio::async_read(socket_, asio::buffer(c->buffer.data() + copied, c->length - copied),
+                socket_strand_.wrap(boost::bind(&tcp_connection::on_read_data_for_write_request, shared_from_this(), c,
+                    asio::placeholders::error,
+                    asio::placeholders::bytes_transferred)));
+            return false;
+        }
+        write_data_to_backing(c);
+    }
+    else if (c->type == NBD_CMD_TRIM || c->type == NBD_CMD_WRITE_ZEROES)
+    {
+        zero_backing(c);
+    }
+    else if (c->type == NBD_CMD_BLOCK_STATUS)
+    {
+        block_status(c);
+    }
+    else if (c->type == NBD_CMD_FLUSH)
+    {
+        flush_backing(c);
+    }
+    else if (c->type == NBD_CMD_DISC)
+    {
+        // Disconnect request. 
+        // The server must handle all outstanding requests, shut down the TLS 
+        // session, and close the TCP session. There is no reply to an NBD_CMD_DISC. 
+
+        // We won't start a new read since the client can't send anymore requests,
+        // but we do need to handle any outstanding write requests, I think.
+        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::handle_disconnect_request, shared_from_this(), c)));
+        return false;
+    }
+    else
+    {
+        c->error = EINVAL;
+        finish_request(c);
+    }
+    return true;
+}
+
+void tcp_connection::on_read_data_for_write_request(command_ptr c, const boost::system::error_code& error, size_t bytes_transferred)
+{
+    if (error)
+    {
+        LOG_INFO("Connection closed by the client.");
+        socket_.close();
+        connection_manager_.stop(shared_from_this());
+        return;
+    }
+
+    LOG_DEBUG("Received {} bytes of data for the write request.", bytes_transferred);
+    stats_->bytes_in.add(bytes_transferred);
+    write_data_to_backing(c);
+
+    // The parser's buffer was drained into the payload, so there's nothing left in it to parse.
     read_request();
 }
 
+void tcp_connection::discard_payload(command_ptr c, uint64_t left)
+{
+    auto self(shared_from_this());
+    asio::async_read(socket_, asio::buffer(data_, std::min<uint64_t>(left, max_length_)), socket_strand_.wrap(
+        [this, self, c, left](const boost::system::error_code& error, size_t bytes_transferred)
+    {
+        if (error)
+        {
+            LOG_INFO("Connection closed by the client.");
+            socket_.close();
+            connection_manager_.stop(self);
+            return;
+        }
+
+        stats_->bytes_in.add(bytes_transferred);
+        if (left > bytes_transferred)
+        {
+            discard_payload(c, left - bytes_transferred);
+            return;
+        }
+        finish_request(c);
+        read_request();
+    }));
+}
 
-void tcp_connection::handle_disconnect_request(std::shared_ptr<command> c)
+void tcp_connection::handle_disconnect_request(command_ptr c)
 {
-    if (commands_.size() > 1)
+    if (commands_.size() > 1 || !writing_.empty())
     {
-        // There are still outstanding commands other than this one that 
-        // we're supposed to handle before we close the socket. So, we'll go around 
+        // There are still outstanding commands other than this one, or replies still being
+        // written, that we're supposed to handle before we close the socket. So, we'll go around
         // again. 
         // TODO: We should probably wait some time before calling this again so we're not just spinning
-        io_service_->post(file_io_strand_.wrap(boost::bind(&tcp_connection::handle_disconnect_request, shared_from_this(), c)));
+        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::handle_disconnect_request, shared_from_this(), c)));
     }
     else
     {
@@ -189,76 +847,681 @@ void tcp_connection::handle_disconnect_request(std::shared_ptr<command> c)
         //TODO: We also need to clean up the "this" object.
         socket_.close();
         connection_manager_.stop(shared_from_this());
-        std::cout << "Closed the socket for the disconnnect request" << std::endl;
+        LOG_INFO("Closed the socket for the disconnnect request");
+
+        auto commands = command_pool_->get_stats();
+        auto buffers = buffer_pool_->get_stats();
+        LOG_INFO("Command pool {} hits, {} misses. Buffer pool {} hits, {} misses, {} bytes cached. {} bytes read as holes",
+            commands.hits, commands.misses, buffers.hits, buffers.misses, buffers.cached_bytes, hole_bytes_);
+
+        auto commits = export_->commits->get_stats();
+        LOG_INFO("Export {}: {} flushes in {} syncs", export_->name, commits.flushes, commits.syncs);
+
+        auto merges = engine_->get_merge_stats();
+        LOG_INFO("The {} engine has merged {} reads and writes into {} vectored operations", engine_->name(),
+            merges.merged, merges.vectored);
+
+        if (streams_)
+        {
+            auto streams = streams_->get_stats();
+            LOG_INFO("Read-ahead: {} of {} reads in streams, {} found read ahead, {} bytes read ahead",
+                streams.stream_reads, streams.reads, streams.hits, streams.prefetched_bytes);
+        }
     }
 }
 
 void tcp_connection::on_response_complete(const boost::system::error_code& error, size_t bytes_transferred)
 {
-    std::shared_ptr<command> c = outbox_.front();
-    outbox_.pop_front();
-    commands_.erase(c);
-    if (outbox_.size() > 0)
+    bytes_written_ += bytes_transferred;
+    stats_->bytes_out.add(bytes_transferred);
+    if (error)
+    {
+        LOG_WARN("Failed to write replies. Terminating the connection.");
+        socket_.close();
+        release_fences_when_acked(nullptr);
+        connection_manager_.stop(shared_from_this());
+        return;
+    }
+
+    // Only the last reply in a batch can be zero-copy, and its payload goes out after the headers.
+    command_ptr last = writing_.back();
+    if (last->zero_copy && last->error == 0)
     {
-        // There's another response waiting to be written so we'll queue it.
-        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::write_response, shared_from_this()))); 
+        send_file_payload(last, 0);
+        return;
+    }
+    finish_batch();
+}
+
+void tcp_connection::finish_batch()
+{
+    uint64_t now = export_stats::now();
+    for (auto& c : writing_)
+    {
+        // Unlike sendfile, writing from the mapping copied the payload into the socket, so
+        // mapped reads are done with their range as soon as the write completes.
+        if (c->fence)
+        {
+            engine_->release(c->fence);
+            c->fence = nullptr;
+        }
+
+        // A read sent in pieces is done once its last piece has gone.
+        const command_ptr* done = !c->parent ? &c : c->last_piece ? &c->parent : nullptr;
+        if (!done)
+        {
+            continue;
+        }
+        record_stats(**done, now);
+        release_admission(**done);
+    }
+    writing_.clear();
+    write_buffers_.clear();
+
+    // Anything that finished while we were writing has been waiting in the outbox.
+    write_response();
+
+    // A request held back by our own limits might fit now.
+    if (hold_ == hold::parsed)
+    {
+        parse_requests();
     }
 }
   
+void tcp_connection::append_reply(command& c)
+{
+    bool chunked = structured_replies_ && (c.type == NBD_CMD_READ || c.type == NBD_CMD_BLOCK_STATUS);
+    if (!chunked)
+    {
+        c.reply[0].simple.nbd_reply_magic = boost::endian::native_to_big(NBD_REPLY_MAGIC);
+        c.reply[0].simple.error = boost::endian::native_to_big(c.error);
+        c.reply[0].simple.handle = c.handle; // We aren't using this so we didn't switch the endianness.
+        write_buffers_.push_back(asio::buffer(&c.reply[0].simple, sizeof(c.reply[0].simple)));
+
+        // A failed read doesn't carry a payload
+        if (c.type == NBD_CMD_READ && c.error == 0 && !c.zero_copy)
+        {
+            const char* data = c.mapped ? mapping_ + c.offset : c.buffer.data();
+            write_buffers_.push_back(asio::buffer(data, c.length));
+        }
+        return;
+    }
+
+    // The last chunk of the reply carries the done flag.
+    bool done = !c.parent || c.last_piece;
+    structured_reply_chunk header;
+    header.nbd_structured_reply_magic = boost::endian::native_to_big(NBD_STRUCTURED_REPLY_MAGIC);
+    header.flags = boost::endian::native_to_big<uint16_t>(done ? NBD_REPLY_FLAG_DONE : 0);
+    header.handle = c.handle;
+
+    if (c.error)
+    {
+        header.type = boost::endian::native_to_big(NBD_REPLY_TYPE_ERROR);
+        header.length = boost::endian::native_to_big<uint32_t>(sizeof(error_chunk) - sizeof(header));
+        c.reply[0].error.header = header;
+        c.reply[0].error.error = boost::endian::native_to_big(c.error);
+        c.reply[0].error.message_length = 0;
+        write_buffers_.push_back(asio::buffer(&c.reply[0].error, sizeof(c.reply[0].error)));
+        return;
+    }
+
+    if (c.type == NBD_CMD_BLOCK_STATUS)
+    {
+        header.type = boost::endian::native_to_big(NBD_REPLY_TYPE_BLOCK_STATUS);
+        header.length = boost::endian::native_to_big<uint32_t>(sizeof(uint32_t) + c.buffer.size());
+        c.reply[0].block_status.header = header;
+        c.reply[0].block_status.context_id = boost::endian::native_to_big(base_allocation_id);
+        write_buffers_.push_back(asio::buffer(&c.reply[0].block_status, sizeof(c.reply[0].block_status)));
+        write_buffers_.push_back(asio::buffer(c.buffer.data(), c.buffer.size()));
+        return;
+    }
+
+    // A piece of a read. Zero-copy pieces weren't looked at, so they're all data.
+    if (c.zero_copy || c.run_count == 0)
+    {
+        c.runs[0] = command::run{0, static_cast<uint32_t>(c.length), false};
+        c.run_count = 1;
+    }
+    for (size_t i = 0; i < c.run_count; i++)
+    {
+        const command::run& r = c.runs[i];
+        header.flags = boost::endian::native_to_big<uint16_t>(done && i + 1 == c.run_count ? NBD_REPLY_FLAG_DONE : 0);
+        if (r.hole)
+        {
+            header.type = boost::endian::native_to_big(NBD_REPLY_TYPE_OFFSET_HOLE);
+            header.length = boost::endian::native_to_big<uint32_t>(sizeof(offset_hole_chunk) - sizeof(header));
+            c.reply[i].offset_hole.header = header;
+            c.reply[i].offset_hole.offset = boost::endian::native_to_big(c.offset + r.offset);
+            c.reply[i].offset_hole.hole_size = boost::endian::native_to_big(r.length);
+            write_buffers_.push_back(asio::buffer(&c.reply[i].offset_hole, sizeof(c.reply[i].offset_hole)));
+            hole_bytes_ += r.length;
+            continue;
+        }
+
+        header.type = boost::endian::native_to_big(NBD_REPLY_TYPE_OFFSET_DATA);
+        header.length = boost::endian::native_to_big<uint32_t>(sizeof(uint64_t) + r.length);
+        c.reply[i].offset_data.header = header;
+        c.reply[i].offset_data.offset = boost::endian::native_to_big(c.offset + r.offset);
+        write_buffers_.push_back(asio::buffer(&c.reply[i].offset_data, sizeof(c.reply[i].offset_data)));
+        if (!c.zero_copy)
+        {
+            const char* data = c.mapped ? mapping_ + c.offset : c.buffer.data();
+            write_buffers_.push_back(asio::buffer(data + r.offset, r.length));
+        }
+    }
+}
+
+void tcp_connection::record_stats(const command& c, uint64_t now)
+{
+    if (c.type >= export_stats::op_count)
+    {
+        return;
+    }
+    export_stats::op& o = stats_->ops[c.type];
+    o.count.add(1);
+    if (c.error)
+    {
+        o.errors.add(1);
+    }
+    o.bytes.add(c.length);
+    o.backing.record(c.completed - c.received);
+    o.total.record(now - c.received);
+}
+
 void tcp_connection::write_response()
 {
-    std::shared_ptr<command> c = outbox_.front();
+    if (!writing_.empty() || outbox_.empty())
+    {
+        return;
+    }
 
-    if (c->type == NBD_CMD_READ)
+    // Send as many waiting replies as we can, headers and payloads, with a single gathered
+    // write. A zero-copy read ends the batch since its payload doesn't come from memory.
+    while (!outbox_.empty() && writing_.size() < options_.reply_batch_limit)
     {
-    
-        reply_message reply;
-        reply.nbd_reply_magic = boost::endian::big_to_native(NBD_REPLY_MAGIC);
-        reply.error = 0;
-        reply.handle = c->handle;
+        command_ptr c = outbox_.front();
+        outbox_.pop_front();
+        stats_->outbox.fetch_sub(1, std::memory_order_relaxed);
+        writing_.push_back(c);
+
+        if (c->parent)
+        {
+            c->last_piece = --c->parent->pieces_left == 0;
+        }
+        append_reply(*c);
 
-        // TODO: Perhaps we want this asynchronous, although it's small?
-        boost::system::error_code error;
-        asio::write(socket_, asio::buffer(&reply, sizeof(reply)));
-        
-        std::cout << "Writing read request response data (" << c->offset << "," << c->buffer.size() << ")" << std::endl;
-        
-        asio::async_write(socket_, asio::buffer(c->buffer.data(), c->buffer.size()),
-                socket_strand_.wrap(boost::bind(&tcp_connection::on_response_complete, shared_from_this(),
-                                asio::placeholders::error,
-                                asio::placeholders::bytes_transferred)));
+        // The client may reuse a handle as soon as it has the reply, which can be before our
+        // write completes, so the handle is free once its last reply is on its way.
+        const command_ptr* done = !c->parent ? &c : c->last_piece ? &c->parent : nullptr;
+        if (done && commands_.erase((*done)->handle, *done))
+        {
+            stats_->inflight.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        if (c->zero_copy && c->error == 0)
+        {
+            break;
+        }
     }
-    else if (c->type == NBD_CMD_WRITE)
+
+    asio::async_write(socket_, write_buffers_,
+        socket_strand_.wrap(boost::bind(&tcp_connection::on_response_complete, shared_from_this(),
+                        asio::placeholders::error,
+                        asio::placeholders::bytes_transferred)));
+}
+
+void tcp_connection::read_data_from_backing(command_ptr c)
+{
+    auto self(shared_from_this());
+    if (c->error || c->offset > disk_size_ || c->length > disk_size_ - c->offset)
+    {
+        c->error = c->error ? c->error : EINVAL;
+        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::finish_request, self, c)));
+        return;
+    }
+    if (c->zero_copy || c->mapped)
     {
-        reply_message reply;
-        reply.nbd_reply_magic = boost::endian::native_to_big(NBD_REPLY_MAGIC);
-        reply.error = 0;
-        reply.handle = c->handle; // We aren't using this so we didn't switch the endianness.
+        // A zero-copy or mapped read does its I/O when the reply is sent, so all we need from
+        // the engine is to order it against overlapping writes. The fence completes on another
+        // thread, but finish_request is posted to the strand we're on, so it'll see c->fence set.
+        c->fence = engine_->submit({io_op::fence, backing_file_, c->offset, c->length, nullptr,
+            [this, self, c](int error)
+            {
+                c->error = error;
+                if (!error && c->mapped && c->parent && options_.sparse_reads && options_.hole_granularity > 0)
+                {
+                    find_runs(*c, mapping_ + c->offset, options_.hole_granularity);
+                }
+                io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::finish_request, self, c)));
+            }});
+        return;
+    }
+    engine_->submit({io_op::read, backing_file_, c->offset, c->length, c->buffer.data(),
+        [this, self, c](int error)
+        {
+            c->error = error;
+            if (c->parent && !error && options_.sparse_reads && options_.hole_granularity > 0)
+            {
+                // Scanning here keeps it off the strand.
+                find_runs(*c, c->buffer.data(), options_.hole_granularity);
+            }
+            io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::finish_request, self, c)));
+        }});
+}
 
-        // TODO: for simplicity's sake we'll make this synchronous for now since it's small
-        boost::system::error_code error;
-        asio::write(socket_, asio::buffer(&reply, sizeof(reply)), error);
-    
-        std::cout << "Write handled successfully" << std::endl;
+void tcp_connection::read_ahead(const command& c)
+{
+    // After the read itself has been submitted, so it doesn't queue behind what's read ahead.
+    if (!streams_ || c.error || c.offset > disk_size_ || c.length > disk_size_ - c.offset)
+    {
+        return;
+    }
+    stream_detector::prefetch p = streams_->on_read(c.offset, c.length);
+    for (size_t i = 0; i < p.count; i++)
+    {
+        engine_->submit({io_op::prefetch, backing_file_, p.offset + i * p.stride, p.length, nullptr, [](int) {}});
+    }
+    if (p.count > 0)
+    {
+        stats_->read_ahead_bytes.add(p.count * p.length);
+    }
+}
 
-        // It's convenient to have a single function where we do the queue popping. 
-        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::on_response_complete, shared_from_this(), error, sizeof(reply))));
+void tcp_connection::read_in_pieces(command_ptr c)
+{
+    if (c->error || c->length == 0 || c->offset > disk_size_ || c->length > disk_size_ - c->offset)
+    {
+        c->error = c->error ? c->error : EINVAL;
+        finish_request(c);
+        return;
+    }
+
+    // Holes the export knows about don't need reading at all. Whatever the extent map
+    // doesn't cover gets read.
+    extents_.clear();
+    if (options_.sparse_reads && export_->extents)
+    {
+        export_->extents->query(c->offset, c->length, max_read_chunks, extents_);
+    }
+    uint64_t covered = 0;
+    for (auto& e : extents_)
+    {
+        covered += e.length;
+    }
+    if (covered < c->length)
+    {
+        extents_.push_back(extent_map::extent{c->length - covered, true});
+    }
+
+    // Count the pieces before starting any, since the one that takes pieces_left to zero
+    // ends the reply, and hole pieces are finished straight away.
+    uint64_t chunk = std::max<uint64_t>(options_.read_chunk_size, 1);
+    size_t pieces = 0;
+    for (auto& e : extents_)
+    {
+        pieces += e.data ? (e.length + chunk - 1) / chunk : 1;
+    }
+    c->pieces_left = pieces;
+
+    uint64_t position = c->offset;
+    for (auto& e : extents_)
+    {
+        uint64_t end = position + e.length;
+        while (position < end)
+        {
+            command_ptr piece = command_pool_->acquire();
+            piece->flags = c->flags;
+            piece->type = c->type;
+            piece->handle = c->handle;
+            piece->offset = position;
+            piece->length = e.data ? std::min(chunk, end - position) : e.length;
+            piece->parent = c;
+            position += piece->length;
+
+            if (!e.data)
+            {
+                piece->runs[0] = command::run{0, static_cast<uint32_t>(piece->length), true};
+                piece->run_count = 1;
+                finish_request(piece);
+                continue;
+            }
+            if (mapping_)
+            {
+                piece->mapped = true;
+            }
+            else if (zero_copy_reads_ && piece->length >= options_.zero_copy_threshold)
+            {
+                piece->zero_copy = true;
+            }
+            else
+            {
+                piece->buffer = buffer_pool_->allocate(piece->length);
+            }
+            read_data_from_backing(piece);
+        }
     }
 }
 
-void tcp_connection::finish_request(std::shared_ptr<command> c)
+void tcp_connection::write_data_to_backing(command_ptr c)
 {
-    std::cout << "Finishing request type " << c->type << " (" << c->offset << "," << c->buffer.size() << ")" << std::endl;
+    auto self(shared_from_this());
+    if (!c->error && export_->read_only)
+    {
+        c->error = EPERM;
+    }
+    if (c->error || c->offset > disk_size_ || c->length > disk_size_ - c->offset)
+    {
+        c->error = c->error ? c->error : EINVAL;
+        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::finish_request, self, c)));
+        return;
+    }
 
-    outbox_.push_back(c);
-    if (outbox_.size() > 1)
+    // Zero blocks in a sparse export's writes become holes, and only the rest is written.
+    bool split = false;
+    if (export_->sparse_writes && options_.hole_granularity > 0 && c->length >= options_.hole_granularity)
+    {
+        find_runs(*c, c->buffer.data(), options_.hole_granularity);
+        split = c->run_count > 1 || c->runs[0].hole;
+    }
+
+    // The mirror's copy is one more part to wait for. It's queued after the primary's, so a
+    // resync reading the primary can't miss it.
+    write_mirror* mirror = export_->mirror.get();
+    c->parts_left.store((split ? c->run_count : 1) + (mirror ? 1 : 0), std::memory_order_relaxed);
+    if (split)
+    {
+        write_runs(c);
+    }
+    else
+    {
+        engine_->submit({io_op::write, backing_file_, c->offset, c->length, c->buffer.data(),
+            [this, self, c](int error)
+            {
+                changed(c->offset, c->length);
+                part_done(c, error, &tcp_connection::written);
+            }});
+    }
+    if (mirror)
     {
-        // There's already a write in progress so we don't want to start another one, 
+        mirror->write(c->offset, c->length, c->buffer.data(), [this, self, c]
+        {
+            part_done(c, 0, &tcp_connection::written);
+        });
+    }
+}
+
+void tcp_connection::write_runs(command_ptr c)
+{
+    auto self(shared_from_this());
+
+    for (size_t i = 0; i < c->run_count; i++)
+    {
+        // Every run's completion counts down, and the last part finishes the write.
+        const command::run& r = c->runs[i];
+        uint64_t offset = c->offset + r.offset;
+        uint64_t length = r.length;
+        auto run_done = [this, self, c, offset, length](int error)
+        {
+            changed(offset, length);
+            part_done(c, error, &tcp_connection::written);
+        };
+        if (!r.hole)
+        {
+            engine_->submit({io_op::write, backing_file_, offset, length, c->buffer.data() + r.offset, run_done});
+            continue;
+        }
+
+        // Blocks that are holes already needn't be touched at all, but only if nothing that's
+        // still in the engine is going to write them. The engine's asked first: once it says
+        // there's nothing, whatever was has invalidated its extents, so the map isn't stale.
+        extents_.clear();
+        if (export_->extents && !engine_->modifying(backing_file_, offset, length))
+        {
+            export_->extents->query(offset, length, 1, extents_);
+        }
+        if (extents_.size() == 1 && !extents_[0].data && extents_[0].length == length)
+        {
+            stats_->zero_bytes_skipped.add(length);
+            part_done(c, 0, &tcp_connection::written);
+            continue;
+        }
+        stats_->zero_bytes_punched.add(length);
+        engine_->submit({io_op::discard, backing_file_, offset, length, nullptr, run_done});
+    }
+}
+
+void tcp_connection::part_done(command_ptr c, int error, void (tcp_connection::*next)(command_ptr, int))
+{
+    uint32_t none = 0;
+    if (error)
+    {
+        c->part_error.compare_exchange_strong(none, error);
+    }
+    if (c->parts_left.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        (this->*next)(c, c->part_error.load());
+    }
+}
+
+void tcp_connection::changed(uint64_t offset, uint64_t length)
+{
+    if (export_->extents)
+    {
+        export_->extents->invalidate(offset, length);
+    }
+}
+
+void tcp_connection::written(command_ptr c, int error)
+{
+    c->error = error;
+    if (!error && (c->flags & NBD_CMD_FLAG_FUA))
+    {
+        // The reply has to wait until the data is durable.
+        flush_backing(c);
         return;
     }
+    io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::finish_request, shared_from_this(), c)));
+}
+
+void tcp_connection::zero_backing(command_ptr c)
+{
+    auto self(shared_from_this());
+    if (!c->error && export_->read_only)
+    {
+        c->error = EPERM;
+    }
+    if (c->error || c->offset > disk_size_ || c->length > disk_size_ - c->offset)
+    {
+        c->error = c->error ? c->error : EINVAL;
+        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::finish_request, self, c)));
+        return;
+    }
+
+    // A punched hole reads back as zeroes, so WRITE_ZEROES only avoids one when it's asked to.
+    // The mirror zeroes the range either way, so a TRIMmed range reads the same on both.
+    io_op op = c->type == NBD_CMD_WRITE_ZEROES && (c->flags & NBD_CMD_FLAG_NO_HOLE) ? io_op::write_zeroes : io_op::discard;
+    write_mirror* mirror = export_->mirror.get();
+    c->parts_left.store(mirror ? 2 : 1, std::memory_order_relaxed);
+    engine_->submit({op, backing_file_, c->offset, c->length, nullptr,
+        [this, self, c](int error)
+        {
+            changed(c->offset, c->length);
+            part_done(c, error, &tcp_connection::written);
+        }});
+    if (mirror)
+    {
+        mirror->zero(c->offset, c->length, [this, self, c]
+        {
+            part_done(c, 0, &tcp_connection::written);
+        });
+    }
+}
+
+void tcp_connection::flush_backing(command_ptr c)
+{
+    auto self(shared_from_this());
+    if (c->error)
+    {
+        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::finish_request, self, c)));
+        return;
+    }
+
+    // Shared with every other flush to the export that turns up at the same time. A mirror in
+    // sync mode is flushed alongside. A FUA write gets here with its parts all done, so they
+    // can be counted again.
+    write_mirror* mirror = export_->mirror && export_->mirror->sync_mode() ? export_->mirror.get() : nullptr;
+    c->part_error.store(0, std::memory_order_relaxed);
+    c->parts_left.store(mirror ? 2 : 1, std::memory_order_relaxed);
+    export_->commits->flush([this, self, c](int error)
+    {
+        part_done(c, error, &tcp_connection::flushed);
+    });
+    if (mirror)
+    {
+        mirror->flush([this, self, c]
+        {
+            part_done(c, 0, &tcp_connection::flushed);
+        });
+    }
+}
+
+void tcp_connection::flushed(command_ptr c, int error)
+{
+    c->error = error;
+    io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::finish_request, shared_from_this(), c)));
+}
+
+void tcp_connection::block_status(command_ptr c)
+{
+    if (!c->error && (!base_allocation_ || c->length == 0))
+    {
+        c->error = EINVAL;
+    }
+    if (c->error || c->offset > disk_size_ || c->length > disk_size_ - c->offset)
+    {
+        c->error = c->error ? c->error : EINVAL;
+        finish_request(c);
+        return;
+    }
+
+    // The extent map mostly answers from what it already knows, so this is quick enough to
+    // do here rather than going through the engine.
+    size_t max_extents = (c->flags & NBD_CMD_FLAG_REQ_ONE) ? 1 : options_.max_block_status_extents;
+    extents_.clear();
+    if (export_->extents)
+    {
+        export_->extents->query(c->offset, c->length, max_extents, extents_);
+    }
     else
     {
-        // There is no write in progress right now so we can start one
-        io_service_->post(socket_strand_.wrap(boost::bind(&tcp_connection::write_response, shared_from_this())));
+        extents_.push_back(extent_map::extent{c->length, true});
+    }
+
+    c->buffer = buffer_pool_->allocate(extents_.size() * sizeof(block_descriptor));
+    block_descriptor* descriptors = reinterpret_cast<block_descriptor*>(c->buffer.data());
+    for (size_t i = 0; i < extents_.size(); i++)
+    {
+        descriptors[i].length = boost::endian::native_to_big<uint32_t>(extents_[i].length);
+        descriptors[i].status_flags = boost::endian::native_to_big(extents_[i].data ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO);
+    }
+    finish_request(c);
+}
+
+void tcp_connection::send_file_payload(command_ptr c, uint64_t sent)
+{
+    auto self(shared_from_this());
+    while (sent < c->length)
+    {
+        off_t offset = c->offset + sent;
+        ssize_t res = sendfile(socket_.native_handle(), backing_file_, &offset, c->length - sent);
+        if (res > 0)
+        {
+            sent += res;
+            bytes_written_ += res;
+            stats_->bytes_out.add(res);
+        }
+        else if (res == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (res == -1 && errno == EAGAIN)
+        {
+            // The socket buffer is full. Pick up where we left off once it drains.
+            socket_.async_wait(asio::ip::tcp::socket::wait_write,
+                socket_strand_.wrap([this, self, c, sent](const boost::system::error_code& error)
+                {
+                    if (!error)
+                    {
+                        send_file_payload(c, sent);
+                    }
+                    else
+                    {
+                        release_fences_when_acked(c);
+                    }
+                }));
+            return;
+        }
+        else
+        {
+            // The header's already gone out, so there's no way to tell the client about
+            // this other than hanging up.
+            LOG_WARN("sendfile failed. Terminating the connection.");
+            socket_.close();
+            release_fences_when_acked(c);
+            connection_manager_.stop(self);
+            return;
+        }
+    }
+
+    release_fences_when_acked(c);
+    finish_batch();
+}
+
+void tcp_connection::release_fences_when_acked(command_ptr c)
+{
+    if (c && c->fence)
+    {
+        // sendfile hands the socket references to the page cache rather than a copy, so the
+        // payload isn't safe from overlapping writes until the client has acknowledged it.
+        unacked_fences_.push_back(std::make_pair(bytes_written_, c->fence));
+        c->fence = nullptr;
     }
+
+    int queued = 0;
+    bool open = socket_.is_open() && ioctl(socket_.native_handle(), SIOCOUTQ, &queued) == 0;
+    uint64_t acked = bytes_written_ - queued;
+    while (!unacked_fences_.empty() && (!open || unacked_fences_.front().first <= acked))
+    {
+        engine_->release(unacked_fences_.front().second);
+        unacked_fences_.pop_front();
+    }
+
+    if (!unacked_fences_.empty() && !ack_timer_running_)
+    {
+        ack_timer_running_ = true;
+        ack_timer_.expires_from_now(std::chrono::microseconds(200));
+        auto self(shared_from_this());
+        ack_timer_.async_wait(socket_strand_.wrap([this, self](const boost::system::error_code&)
+        {
+            ack_timer_running_ = false;
+            release_fences_when_acked(nullptr);
+        }));
+    }
+}
+
+void tcp_connection::finish_request(command_ptr c)
+{
+    LOG_DEBUG("Finishing request type {} ({},{})", c->type, c->offset, c->buffer.size());
+
+    // The last piece of a read to get here is when the read as a whole completed.
+    c->completed = export_stats::now();
+    if (c->parent)
+    {
+        c->parent->completed = c->completed;
+    }
+    stats_->outbox.fetch_add(1, std::memory_order_relaxed);
+
+    // If a batch is already being written this waits in the outbox for the next one.
+    outbox_.push_back(c);
+    write_response();
 }
@@ -0,0 +1,349 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+
+#include "dedup_image.hpp"
+#include "io_worker_pool.hpp"
+#include "log.hpp"
+
+namespace
+{
+
+const char map_magic[8] = {'M', 'N', 'D', 'B', 'D', 'M', 'A', 'P'};
+
+// The header gets a page to itself, so the entries after it are page-aligned.
+const uint64_t header_size = 4096;
+
+struct map_header
+{
+    char magic[8];
+    uint64_t block_size; // Has to match the store's
+    uint64_t size; // Of the image
+};
+
+void sync_directory(const std::string& directory)
+{
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd != -1)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+}
+
+dedup_image::dedup_image(std::shared_ptr<dedup_store> store, const std::string& seed_path, const std::string& map_path)
+    : store_(std::move(store))
+    , block_size_(store_->block_size())
+{
+    if (!boost::filesystem::exists(map_path))
+    {
+        import(seed_path, map_path);
+    }
+    else
+    {
+        map_fd_ = open(map_path.c_str(), O_RDWR);
+        map_header header;
+        struct stat st;
+        if (map_fd_ == -1 || pread(map_fd_, &header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header.magic, map_magic, sizeof(map_magic)) != 0 || header.block_size != block_size_
+            || fstat(map_fd_, &st) != 0)
+        {
+            if (map_fd_ != -1)
+            {
+                close(map_fd_);
+            }
+            throw std::runtime_error("Unable to open " + map_path + ", or it doesn't belong to the store in " + store_->directory());
+        }
+        size_ = header.size;
+        blocks_ = (size_ + block_size_ - 1) / block_size_;
+        uint64_t map_size = header_size + blocks_ * sizeof(uint64_t);
+        if (static_cast<uint64_t>(st.st_size) < map_size)
+        {
+            close(map_fd_);
+            throw std::runtime_error(map_path + " is too short for its image");
+        }
+        mapped_file::options mapping;
+        map_.reset(new mapped_file(map_fd_, map_size, false, mapping));
+        entries_ = reinterpret_cast<uint64_t*>(map_->data() + header_size);
+    }
+
+    index_.reset(new std::atomic<uint64_t>[blocks_]);
+    uint64_t mapped = 0;
+    for (uint64_t b = 0; b < blocks_; b++)
+    {
+        index_[b].store(entries_[b], std::memory_order_relaxed);
+        mapped += entries_[b] != 0;
+    }
+    mapped_ = mapped;
+}
+
+dedup_image::~dedup_image()
+{
+    sync();
+    map_.reset();
+    close(map_fd_);
+}
+
+void dedup_image::import(const std::string& seed_path, const std::string& path)
+{
+    int seed = open(seed_path.c_str(), O_RDONLY);
+    struct stat st;
+    if (seed == -1 || fstat(seed, &st) != 0)
+    {
+        throw std::runtime_error("Unable to open " + seed_path + ": " + strerror(errno));
+    }
+    size_ = st.st_size;
+    blocks_ = (size_ + block_size_ - 1) / block_size_;
+
+    // The map's made under another name and renamed when it's complete, so an import that
+    // doesn't finish is started again next time.
+    std::string partial = path + ".new";
+    uint64_t map_size = header_size + blocks_ * sizeof(uint64_t);
+    map_header header;
+    memcpy(header.magic, map_magic, sizeof(map_magic));
+    header.block_size = block_size_;
+    header.size = size_;
+    map_fd_ = open(partial.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (map_fd_ == -1 || ftruncate(map_fd_, map_size) != 0 || pwrite(map_fd_, &header, sizeof(header), 0) != sizeof(header))
+    {
+        int error = errno;
+        close(seed);
+        throw std::runtime_error("Unable to create " + partial + ": " + strerror(error));
+    }
+    mapped_file::options mapping;
+    map_.reset(new mapped_file(map_fd_, map_size, false, mapping));
+    entries_ = reinterpret_cast<uint64_t*>(map_->data() + header_size);
+
+    const uint64_t batch = std::max<uint64_t>(1, (4 << 20) / block_size_);
+    std::vector<char> buffer(batch * block_size_);
+    for (uint64_t b = 0; b < blocks_; b += batch)
+    {
+        uint64_t n = std::min(batch, blocks_ - b);
+        uint64_t bytes = std::min(n * block_size_, size_ - b * block_size_);
+        int error = io_worker_pool::positional_io(io_request{io_op::read, seed, b * block_size_, bytes, buffer.data(), nullptr});
+        if (error)
+        {
+            close(seed);
+            throw std::runtime_error("Unable to read " + seed_path + ": " + strerror(error));
+        }
+        // The last block may run past the end of the image, and is stored padded with zeroes.
+        memset(buffer.data() + bytes, 0, n * block_size_ - bytes);
+        for (uint64_t i = 0; i < n; i++)
+        {
+            error = store_->put(buffer.data() + i * block_size_, entries_[b + i]);
+            if (error)
+            {
+                close(seed);
+                throw std::runtime_error("Unable to store " + seed_path + ": " + strerror(error));
+            }
+        }
+    }
+    close(seed);
+
+    if (store_->sync() != 0 || map_->sync() != 0 || fsync(map_fd_) != 0 || rename(partial.c_str(), path.c_str()) != 0)
+    {
+        throw std::runtime_error("Unable to finish " + path + ": " + strerror(errno));
+    }
+    sync_directory(boost::filesystem::path(path).parent_path().string());
+    LOG_INFO("Imported {} into the deduplication store, as {}", seed_path, path);
+}
+
+template <typename F>
+int dedup_image::for_each_run(uint64_t offset, uint64_t length, F f)
+{
+    if (offset > size_ || length > size_ - offset)
+    {
+        return EINVAL;
+    }
+
+    uint64_t end = offset + length;
+    while (offset < end)
+    {
+        uint64_t block = offset / block_size_;
+        uint64_t first = index_[block].load(std::memory_order_acquire);
+        uint64_t run_end = std::min((block + 1) * block_size_, end);
+        uint64_t count = 1;
+        if (run_end - offset == block_size_)
+        {
+            while (run_end + block_size_ <= end)
+            {
+                uint64_t next = index_[block + count].load(std::memory_order_acquire);
+                if (next != (first ? first + count : 0))
+                {
+                    break;
+                }
+                count++;
+                run_end += block_size_;
+            }
+        }
+
+        int error = f(first, count, offset, run_end - offset);
+        if (error)
+        {
+            return error;
+        }
+        offset = run_end;
+    }
+    return 0;
+}
+
+int dedup_image::read(uint64_t offset, uint64_t length, char* data)
+{
+    std::vector<char> partial;
+    return for_each_run(offset, length, [this, offset, data, &partial](uint64_t first, uint64_t count, uint64_t at, uint64_t n)
+    {
+        char* out = data + (at - offset);
+        if (n == count * block_size_)
+        {
+            return store_->read(first, count, out);
+        }
+        partial.resize(block_size_);
+        int error = store_->read(first, 1, partial.data());
+        if (!error)
+        {
+            memcpy(out, partial.data() + at % block_size_, n);
+        }
+        return error;
+    });
+}
+
+int dedup_image::prefetch(uint64_t offset, uint64_t length)
+{
+    return for_each_run(offset, length, [this](uint64_t first, uint64_t count, uint64_t, uint64_t)
+    {
+        return store_->prefetch(first, count);
+    });
+}
+
+int dedup_image::write(uint64_t offset, uint64_t length, const char* data)
+{
+    if (offset > size_ || length > size_ - offset)
+    {
+        return EINVAL;
+    }
+
+    std::vector<char> merged;
+    uint64_t end = offset + length;
+    for (uint64_t position = offset; position < end; )
+    {
+        uint64_t block = position / block_size_;
+        uint64_t within = position % block_size_;
+        uint64_t n = std::min(block_size_ - within, end - position);
+        const char* in = data + (position - offset);
+        uint64_t id;
+        if (n == block_size_)
+        {
+            int error = store_->put(in, id);
+            if (error)
+            {
+                return error;
+            }
+            assign(block, id);
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(block_locks_[block % block_locks_.size()]);
+            merged.resize(block_size_);
+            int error = store_->read(index_[block].load(std::memory_order_acquire), 1, merged.data());
+            if (error)
+            {
+                return error;
+            }
+            memcpy(merged.data() + within, in, n);
+            error = store_->put(merged.data(), id);
+            if (error)
+            {
+                return error;
+            }
+            assign(block, id);
+        }
+        position += n;
+    }
+    return 0;
+}
+
+int dedup_image::zero(uint64_t offset, uint64_t length)
+{
+    if (offset > size_ || length > size_ - offset)
+    {
+        return EINVAL;
+    }
+
+    std::vector<char> zeroes;
+    uint64_t end = offset + length;
+    for (uint64_t position = offset; position < end; )
+    {
+        uint64_t block = position / block_size_;
+        uint64_t n = std::min(block_size_ - position % block_size_, end - position);
+        if (n == block_size_)
+        {
+            assign(block, 0);
+        }
+        else
+        {
+            zeroes.resize(block_size_);
+            int error = write(position, n, zeroes.data());
+            if (error)
+            {
+                return error;
+            }
+        }
+        position += n;
+    }
+    return 0;
+}
+
+void dedup_image::assign(uint64_t block, uint64_t id)
+{
+    uint64_t old = index_[block].exchange(id, std::memory_order_acq_rel);
+    if (old == id)
+    {
+        return;
+    }
+    if (old == 0)
+    {
+        mapped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if (id == 0)
+    {
+        mapped_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_.emplace_back(block, id);
+}
+
+int dedup_image::sync()
+{
+    std::vector<std::pair<uint64_t, uint64_t>> synced;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        synced.swap(pending_);
+    }
+
+    int error = store_->sync();
+    if (error)
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        pending_.insert(pending_.begin(), synced.begin(), synced.end());
+        return error;
+    }
+    if (synced.empty())
+    {
+        return 0;
+    }
+    for (auto& change : synced)
+    {
+        __atomic_store_n(&entries_[change.first], change.second, __ATOMIC_RELAXED);
+    }
+    return map_->sync();
+}
@@ -0,0 +1,217 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "dedup_store.hpp"
+#include "io_worker_pool.hpp"
+#include "log.hpp"
+#include "zero_scan.hpp"
+
+namespace
+{
+
+const char store_magic[8] = {'M', 'N', 'D', 'B', 'D', 'D', 'P', '1'};
+
+// In chunk 0, which is why no block is ever stored there.
+struct store_header
+{
+    char magic[8];
+    uint64_t block_size;
+};
+
+int positional_io(io_op op, int fd, uint64_t offset, uint64_t length, const char* data)
+{
+    return io_worker_pool::positional_io(io_request{op, fd, offset, length, const_cast<char*>(data), nullptr});
+}
+
+}
+
+dedup_store::dedup_store(const std::string& directory, const options& opts)
+    : directory_(directory)
+    , options_(opts)
+{
+    boost::system::error_code error;
+    boost::filesystem::create_directories(directory_, error);
+    if (error)
+    {
+        throw std::runtime_error("Unable to create " + directory_ + ": " + error.message());
+    }
+
+    std::string path = (boost::filesystem::path(directory_) / "chunks").string();
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd_ == -1 || fstat(fd_, &st) != 0)
+    {
+        throw std::runtime_error("Unable to open " + path + ": " + strerror(errno));
+    }
+
+    store_header header;
+    if (st.st_size == 0)
+    {
+        block_size_ = opts.block_size;
+        if (block_size_ < 512 || (block_size_ & (block_size_ - 1)) != 0)
+        {
+            close(fd_);
+            throw std::runtime_error("Deduplication block size has to be a power of two, at least 512");
+        }
+        std::vector<char> first(block_size_);
+        memcpy(header.magic, store_magic, sizeof(store_magic));
+        header.block_size = block_size_;
+        memcpy(first.data(), &header, sizeof(header));
+        if (positional_io(io_op::write, fd_, 0, block_size_, first.data()) != 0 || fsync(fd_) != 0)
+        {
+            close(fd_);
+            throw std::runtime_error("Unable to create " + path + ": " + strerror(errno));
+        }
+    }
+    else
+    {
+        if (pread(fd_, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, store_magic, sizeof(store_magic)) != 0)
+        {
+            close(fd_);
+            throw std::runtime_error(path + " isn't a deduplication store");
+        }
+        block_size_ = header.block_size;
+    }
+
+    load_index();
+}
+
+dedup_store::~dedup_store()
+{
+    fdatasync(fd_);
+    close(fd_);
+}
+
+void dedup_store::load_index()
+{
+    struct stat st;
+    fstat(fd_, &st);
+
+    // A chunk that was only partly written when we last stopped is left out, and the next
+    // one stored goes over it.
+    uint64_t chunks = st.st_size / block_size_;
+    const uint64_t batch = std::max<uint64_t>(1, (4 << 20) / block_size_);
+    std::vector<char> buffer(batch * block_size_);
+    for (uint64_t id = 1; id < chunks; id += batch)
+    {
+        uint64_t n = std::min(batch, chunks - id);
+        int error = positional_io(io_op::read, fd_, id * block_size_, n * block_size_, buffer.data());
+        if (error)
+        {
+            close(fd_);
+            throw std::runtime_error("Unable to read the chunks in " + directory_ + ": " + strerror(error));
+        }
+        for (uint64_t i = 0; i < n; i++)
+        {
+            const char* block = buffer.data() + i * block_size_;
+            block_digest digest = hash_block(block, block_size_);
+            shard_for(digest).chunks.emplace(digest, id + i);
+        }
+    }
+    next_id_ = std::max<uint64_t>(chunks, 1);
+    LOG_INFO("Deduplication store {} has {} chunk(s) of {} bytes", directory_, next_id_ - 1, block_size_);
+}
+
+int dedup_store::put(const char* block, uint64_t& id)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto finished = [this, start](std::atomic<uint64_t>& counter)
+    {
+        counter.fetch_add(1, std::memory_order_relaxed);
+        blocks_written_.fetch_add(1, std::memory_order_relaxed);
+        put_nanoseconds_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+    };
+
+    if (is_zero(block, block_size_))
+    {
+        id = 0;
+        finished(zero_blocks_);
+        return 0;
+    }
+
+    block_digest digest = hash_block(block, block_size_);
+    shard& s = shard_for(digest);
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    // Checking a match means reading it back, but it's nearly always in the page cache.
+    auto range = s.chunks.equal_range(digest);
+    if (range.first != range.second)
+    {
+        std::vector<char> stored(block_size_);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            int error = positional_io(io_op::read, fd_, it->second * block_size_, block_size_, stored.data());
+            if (error)
+            {
+                return error;
+            }
+            if (memcmp(stored.data(), block, block_size_) == 0)
+            {
+                id = it->second;
+                finished(duplicate_blocks_);
+                return 0;
+            }
+        }
+        collisions_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // If this fails the id is never used, and the file has a hole there, which does no harm.
+    uint64_t new_id = next_id_.fetch_add(1, std::memory_order_relaxed);
+    int error = positional_io(io_op::write, fd_, new_id * block_size_, block_size_, block);
+    if (error)
+    {
+        return error;
+    }
+    s.chunks.emplace(digest, new_id);
+    id = new_id;
+    finished(unique_blocks_);
+    return 0;
+}
+
+int dedup_store::read(uint64_t first, uint64_t count, char* data)
+{
+    if (first == 0)
+    {
+        memset(data, 0, count * block_size_);
+        return 0;
+    }
+    return positional_io(io_op::read, fd_, first * block_size_, count * block_size_, data);
+}
+
+int dedup_store::prefetch(uint64_t first, uint64_t count)
+{
+    if (first == 0)
+    {
+        return 0;
+    }
+    return posix_fadvise(fd_, first * block_size_, count * block_size_, POSIX_FADV_WILLNEED);
+}
+
+int dedup_store::sync()
+{
+    return fdatasync(fd_) == 0 ? 0 : errno;
+}
+
+dedup_store::stats dedup_store::get_stats() const
+{
+    stats s;
+    s.chunks = next_id_.load(std::memory_order_relaxed) - 1;
+    s.blocks_written = blocks_written_.load(std::memory_order_relaxed);
+    s.unique_blocks = unique_blocks_.load(std::memory_order_relaxed);
+    s.duplicate_blocks = duplicate_blocks_.load(std::memory_order_relaxed);
+    s.zero_blocks = zero_blocks_.load(std::memory_order_relaxed);
+    s.collisions = collisions_.load(std::memory_order_relaxed);
+    s.put_nanoseconds = put_nanoseconds_.load(std::memory_order_relaxed);
+    return s;
+}
@@ -0,0 +1,330 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+
+#include "block_cache.hpp"
+#include "export_registry.hpp"
+#include "io_worker_pool.hpp"
+#include "log.hpp"
+#include "mmap_io_engine.hpp"
+
+namespace
+{
+
+// An engine whose workers do I/O through image, an overlay_image or a dedup_image.
+template <typename Image>
+std::shared_ptr<io_engine> image_engine(std::shared_ptr<Image> image, size_t threads)
+{
+    return std::make_shared<io_worker_pool>(threads, [image](const io_request& r)
+    {
+        switch (r.op)
+        {
+        case io_op::read:
+            return image->read(r.offset, r.length, r.data);
+        case io_op::write:
+            return image->write(r.offset, r.length, r.data);
+        case io_op::sync:
+            return image->sync();
+        case io_op::prefetch:
+            return image->prefetch(r.offset, r.length);
+        default:
+            return image->zero(r.offset, r.length);
+        }
+    });
+}
+
+}
+
+export_registry::export_registry(io_engine& engine, block_cache* cache, const mapped_file::options& mapping,
+        const throttle::options& qos, const overlay_image::options& overlays, std::shared_ptr<dedup_store> dedup,
+        const write_mirror::options& mirrors)
+    : engine_(engine)
+    , cache_(cache)
+    , mapping_(mapping)
+    , qos_(qos)
+    , overlays_(overlays)
+    , dedup_(std::move(dedup))
+    , mirrors_(mirrors)
+{
+}
+
+export_registry::~export_registry()
+{
+    for (auto& e : exports_)
+    {
+        // The mirror's thread reads through the engine, so it has to stop first.
+        if (e.second->mirror)
+        {
+            std::const_pointer_cast<entry>(e.second)->mirror.reset();
+        }
+        if (e.second->cached)
+        {
+            cache_->close(e.second->fd);
+        }
+        else
+        {
+            close(e.second->fd);
+        }
+    }
+}
+
+void export_registry::add(const std::string& name, const std::string& path, bool read_only, bool mmap,
+    const std::string& overlay, bool dedup, bool sparse, const std::string& mirror)
+{
+    // The protocol caps names at 4096 bytes.
+    if (name.size() > 4096)
+    {
+        throw std::runtime_error("Export name too long: " + name);
+    }
+    if (exports_.count(name))
+    {
+        throw std::runtime_error("Duplicate export: " + name);
+    }
+    if (mmap && !overlay.empty())
+    {
+        throw std::runtime_error("An overlay export can't be mapped: " + name);
+    }
+    if (dedup && (mmap || !overlay.empty()))
+    {
+        throw std::runtime_error("A deduplicated export can't be mapped or an overlay: " + name);
+    }
+    if (dedup && !dedup_)
+    {
+        throw std::runtime_error("Export " + name + " is deduplicated, but there's no dedup store");
+    }
+    if (dedup && (name.empty() || name.find('/') != std::string::npos))
+    {
+        // Its map is named after it.
+        throw std::runtime_error("A deduplicated export's name can't be empty or have a '/' in it: " + name);
+    }
+    if (read_only && !mirror.empty())
+    {
+        throw std::runtime_error("A read-only export has nothing to mirror: " + name);
+    }
+
+    auto e = std::make_shared<entry>();
+    e->name = name;
+    e->path = path;
+    e->read_only = read_only;
+    e->sparse_writes = sparse;
+
+    // A mapped export is its own cache, and the block cache's O_DIRECT descriptor would go
+    // around the mapping's pages, so those are opened directly. Overlays and deduplicated
+    // exports do their own I/O.
+    bool own_io = !overlay.empty() || dedup;
+    if (cache_ && !mmap && !own_io)
+    {
+        e->fd = cache_->open(path, read_only);
+        e->size = cache_->file_size(e->fd);
+        e->cached = true;
+    }
+    else
+    {
+        e->fd = open(path.c_str(), read_only || own_io ? O_RDONLY : O_RDWR);
+        if (e->fd == -1)
+        {
+            throw std::runtime_error("Unable to open " + path + ": " + strerror(errno));
+        }
+
+        struct stat st;
+        if (fstat(e->fd, &st) != 0)
+        {
+            int error = errno;
+            close(e->fd);
+            throw std::runtime_error("Unable to stat " + path + ": " + strerror(error));
+        }
+        e->size = st.st_size;
+    }
+
+    if (mmap)
+    {
+        try
+        {
+            e->mapping = std::make_shared<mapped_file>(e->fd, e->size, read_only, mapping_);
+        }
+        catch (...)
+        {
+            close(e->fd);
+            throw;
+        }
+        e->engine = std::make_shared<mmap_io_engine>(e->mapping);
+    }
+
+    if (!overlay.empty())
+    {
+        try
+        {
+            e->overlay = std::make_shared<overlay_image>(path, overlay, overlays_);
+        }
+        catch (...)
+        {
+            close(e->fd);
+            throw;
+        }
+        e->engine = image_engine(e->overlay, overlays_.threads);
+    }
+
+    if (dedup)
+    {
+        try
+        {
+            std::string map_path = (boost::filesystem::path(dedup_->directory()) / (name + ".map")).string();
+            e->dedup = std::make_shared<dedup_image>(dedup_, path, map_path);
+        }
+        catch (...)
+        {
+            close(e->fd);
+            throw;
+        }
+        // Once imported, the image is the map's business, and the file it came from can
+        // change without it being any different.
+        e->size = e->dedup->size();
+        e->engine = image_engine(e->dedup, dedup_->get_options().threads);
+    }
+
+    // The file's holes say nothing about an overlay's or a deduplicated export's, so they
+    // have no extent map.
+    if (!own_io && (!e->cached || cache_->get_options().mode == block_cache::write_mode::write_through))
+    {
+        e->extents = std::make_shared<extent_map>(e->fd, e->size);
+    }
+
+    e->commits = std::make_shared<group_commit>(e->engine ? *e->engine : engine_, e->fd);
+    if (!mirror.empty())
+    {
+        try
+        {
+            e->mirror = std::make_shared<write_mirror>(mirror, e->engine ? *e->engine : engine_, e->fd, e->size, mirrors_);
+        }
+        catch (...)
+        {
+            if (e->cached)
+            {
+                cache_->close(e->fd);
+            }
+            else
+            {
+                close(e->fd);
+            }
+            throw;
+        }
+    }
+    e->stats = std::make_shared<export_stats>();
+    auto qos = std::make_shared<throttle>(qos_);
+    if (qos->enabled())
+    {
+        e->qos = qos;
+    }
+
+    if (exports_.empty())
+    {
+        default_name_ = name;
+    }
+    exports_[name] = e;
+}
+
+void export_registry::add(const std::string& spec)
+{
+    std::string name;
+    std::string path = spec;
+    std::string overlay;
+    std::string mirror;
+    bool read_only = false;
+    bool mmap = false;
+    bool dedup = false;
+    bool sparse = false;
+
+    size_t equals = spec.find('=');
+    if (equals != std::string::npos)
+    {
+        name = spec.substr(0, equals);
+        path = spec.substr(equals + 1);
+    }
+
+    // The flags can come in either order.
+    auto take_suffix = [&path](const std::string& suffix)
+    {
+        if (path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0)
+        {
+            path.resize(path.size() - suffix.size());
+            return true;
+        }
+        return false;
+    };
+    for (bool found = true; found; )
+    {
+        found = false;
+        if (!read_only && take_suffix(":ro"))
+        {
+            read_only = found = true;
+        }
+        if (!mmap && take_suffix(":mmap"))
+        {
+            mmap = found = true;
+        }
+        if (!dedup && take_suffix(":dedup"))
+        {
+            dedup = found = true;
+        }
+        if (!sparse && take_suffix(":sparse"))
+        {
+            sparse = found = true;
+        }
+        // Whichever of these comes last is taken first, since their values can have colons.
+        size_t at = path.rfind(":overlay=");
+        size_t mirror_at = path.rfind(":mirror=");
+        if (mirror.empty() && mirror_at != std::string::npos && (at == std::string::npos || mirror_at > at))
+        {
+            mirror = path.substr(mirror_at + strlen(":mirror="));
+            path.resize(mirror_at);
+            found = true;
+        }
+        else if (overlay.empty() && at != std::string::npos)
+        {
+            overlay = path.substr(at + strlen(":overlay="));
+            path.resize(at);
+            found = true;
+        }
+    }
+
+    if (equals == std::string::npos)
+    {
+        name = boost::filesystem::path(path).filename().string();
+    }
+
+    add(name, path, read_only, mmap, overlay, dedup, sparse, mirror);
+}
+
+export_registry::pointer export_registry::find(const std::string& name) const
+{
+    auto it = exports_.find(name.empty() ? default_name_ : name);
+    return it == exports_.end() ? nullptr : it->second;
+}
+
+std::vector<export_registry::pointer> export_registry::list() const
+{
+    std::vector<pointer> result;
+    for (auto& e : exports_)
+    {
+        result.push_back(e.second);
+    }
+    return result;
+}
+
+void export_registry::snapshot_overlays() const
+{
+    for (auto& e : exports_)
+    {
+        if (e.second->overlay)
+        {
+            size_t layer = e.second->overlay->snapshot();
+            LOG_INFO("Snapshotted export '{}'. Its writes go to layer {} now", e.first, layer);
+        }
+    }
+}
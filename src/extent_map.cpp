@@ -0,0 +1,157 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <iterator>
+
+#include "extent_map.hpp"
+
+extent_map::extent_map(int fd, uint64_t size, size_t max_segments)
+    : fd_(fd)
+    , size_(size)
+    , max_segments_(max_segments)
+{
+}
+
+extent_map::segment extent_map::seek(uint64_t offset)
+{
+    off_t data = lseek(fd_, offset, SEEK_DATA);
+    if (data == -1)
+    {
+        // ENXIO means there's no data after offset. Anything else means the filesystem can't
+        // tell us, so we have to call it all data.
+        return errno == ENXIO ? segment{size_, false} : segment{size_, true};
+    }
+    if (static_cast<uint64_t>(data) > offset)
+    {
+        return segment{std::min<uint64_t>(data, size_), false};
+    }
+
+    off_t hole = lseek(fd_, offset, SEEK_HOLE);
+    if (hole == -1 || static_cast<uint64_t>(hole) <= offset)
+    {
+        return segment{size_, true};
+    }
+    return segment{std::min<uint64_t>(hole, size_), true};
+}
+
+void extent_map::query(uint64_t offset, uint64_t length, size_t max_extents, std::vector<extent>& out)
+{
+    size_t first = out.size();
+    uint64_t end = std::min(offset + length, size_);
+    uint64_t position = offset;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (position < end)
+    {
+        segment s;
+        auto it = segments_.upper_bound(position);
+        if (it != segments_.begin() && std::prev(it)->second.end > position)
+        {
+            s = std::prev(it)->second;
+        }
+        else
+        {
+            // Not known yet. The lock isn't held while we ask, so if a write lands meanwhile
+            // we use the answer this once but don't keep it.
+            uint64_t generation = generation_;
+            lock.unlock();
+            s = seek(position);
+            lock.lock();
+
+            // What we already know about starts after position, so the answer can't go past it.
+            it = segments_.upper_bound(position);
+            if (it != segments_.end())
+            {
+                s.end = std::min(s.end, it->first);
+            }
+            if (generation == generation_)
+            {
+                insert(position, s);
+            }
+        }
+
+        uint64_t n = std::min(s.end, end) - position;
+        if (out.size() > first && out.back().data == s.data)
+        {
+            out.back().length += n;
+        }
+        else if (out.size() - first < max_extents)
+        {
+            out.push_back(extent{n, s.data});
+        }
+        else
+        {
+            break;
+        }
+        position += n;
+    }
+}
+
+void extent_map::invalidate(uint64_t offset, uint64_t length)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    generation_++;
+    trim(offset, offset + length);
+}
+
+void extent_map::insert(uint64_t start, const segment& s)
+{
+    if (segments_.size() >= max_segments_)
+    {
+        segments_.clear();
+    }
+
+    trim(start, s.end);
+    auto it = segments_.emplace(start, s).first;
+
+    // Merge with the neighbours if they're the same kind and touch.
+    auto next = std::next(it);
+    if (next != segments_.end() && next->first == it->second.end && next->second.data == it->second.data)
+    {
+        it->second.end = next->second.end;
+        segments_.erase(next);
+    }
+    if (it != segments_.begin())
+    {
+        auto prev = std::prev(it);
+        if (prev->second.end == it->first && prev->second.data == it->second.data)
+        {
+            prev->second.end = it->second.end;
+            segments_.erase(it);
+        }
+    }
+}
+
+void extent_map::trim(uint64_t start, uint64_t end)
+{
+    auto it = segments_.upper_bound(start);
+    if (it != segments_.begin())
+    {
+        auto prev = std::prev(it);
+        if (prev->second.end > start)
+        {
+            // Straddles the start. Keep what's before it, and what's after the end if it
+            // straddles that too.
+            segment s = prev->second;
+            prev->second.end = start;
+            if (s.end > end)
+            {
+                segments_.emplace(end, s);
+            }
+            if (prev->first == start)
+            {
+                segments_.erase(prev);
+            }
+        }
+    }
+
+    while (it != segments_.end() && it->first < end)
+    {
+        if (it->second.end > end)
+        {
+            segments_.emplace(end, it->second);
+        }
+        it = segments_.erase(it);
+    }
+}
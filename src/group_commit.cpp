@@ -0,0 +1,60 @@
+#include <memory>
+
+#include "group_commit.hpp"
+
+group_commit::group_commit(io_engine& engine, int fd)
+    : engine_(engine)
+    , fd_(fd)
+{
+}
+
+void group_commit::flush(std::function<void(int error)> on_durable)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        waiting_.push_back(std::move(on_durable));
+        stats_.flushes++;
+        if (syncing_)
+        {
+            return;
+        }
+        syncing_ = true;
+    }
+    start_sync();
+}
+
+void group_commit::start_sync()
+{
+    auto batch = std::make_shared<std::vector<std::function<void(int)>>>();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batch->swap(waiting_);
+        stats_.syncs++;
+    }
+
+    engine_.submit({io_op::sync, fd_, 0, 0, nullptr,
+        [this, batch](int error)
+        {
+            for (auto& on_durable : *batch)
+            {
+                on_durable(error);
+            }
+
+            // Whoever turned up while we were syncing goes next.
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (waiting_.empty())
+                {
+                    syncing_ = false;
+                    return;
+                }
+            }
+            start_sync();
+        }});
+}
+
+group_commit::stats group_commit::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
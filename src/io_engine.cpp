@@ -0,0 +1,307 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "io_engine.hpp"
+
+int zero_range(int fd, uint64_t offset, uint64_t length, bool punch)
+{
+    // Punching falls back to zeroing the range in place, and that to writing zeroes.
+    if (punch && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+    {
+        return 0;
+    }
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+    {
+        return 0;
+    }
+    if (errno != EOPNOTSUPP)
+    {
+        return errno;
+    }
+
+    // Aligned, so it also works for files opened with O_DIRECT.
+    const size_t chunk = 1024 * 1024;
+    void* zeroes;
+    if (posix_memalign(&zeroes, 4096, chunk) != 0)
+    {
+        return ENOMEM;
+    }
+    memset(zeroes, 0, chunk);
+
+    int error = 0;
+    uint64_t done = 0;
+    while (done < length)
+    {
+        ssize_t res = pwrite(fd, zeroes, std::min<uint64_t>(chunk, length - done), offset + done);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error = errno;
+            break;
+        }
+        done += res;
+    }
+    free(zeroes);
+    return error;
+}
+
+int vectored_io(int fd, io_op op, uint64_t offset, std::vector<iovec> buffers)
+{
+    size_t first = 0;
+    while (first < buffers.size())
+    {
+        int count = static_cast<int>(std::min<size_t>(buffers.size() - first, IOV_MAX));
+        ssize_t res = op == io_op::read ? preadv(fd, &buffers[first], count, offset) : pwritev(fd, &buffers[first], count, offset);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno;
+        }
+        if (res == 0)
+        {
+            // Ran off the end of the backing file
+            return EIO;
+        }
+
+        // Skip whatever's been transferred, which may end part way into a buffer.
+        offset += res;
+        while (res > 0)
+        {
+            size_t n = std::min<size_t>(res, buffers[first].iov_len);
+            buffers[first].iov_base = static_cast<char*>(buffers[first].iov_base) + n;
+            buffers[first].iov_len -= n;
+            res -= n;
+            if (buffers[first].iov_len == 0)
+            {
+                first++;
+            }
+        }
+    }
+    return 0;
+}
+
+std::vector<io_engine::operation*> io_engine::take_adjacent(operation* op, std::deque<operation*>& queue)
+{
+    std::deque<operation*> run{op};
+    const io_request& r = op->request;
+    if (max_merge_ == 0 || (r.op != io_op::read && r.op != io_op::write) || op->transferred > 0)
+    {
+        return std::vector<operation*>(run.begin(), run.end());
+    }
+
+    uint64_t start = r.offset;
+    uint64_t end = r.offset + r.length;
+    for (bool found = true; found && run.size() < IOV_MAX; )
+    {
+        found = false;
+        for (auto it = queue.begin(); it != queue.end(); ++it)
+        {
+            const io_request& other = (*it)->request;
+            if (other.op != r.op || other.fd != r.fd || (*it)->transferred > 0
+                || end - start + other.length > max_merge_)
+            {
+                continue;
+            }
+            if (other.offset == end)
+            {
+                run.push_back(*it);
+                end += other.length;
+            }
+            else if (other.offset + other.length == start)
+            {
+                run.push_front(*it);
+                start = other.offset;
+            }
+            else
+            {
+                continue;
+            }
+            queue.erase(it);
+            found = true;
+            break;
+        }
+    }
+
+    if (run.size() > 1)
+    {
+        merged_.fetch_add(run.size(), std::memory_order_relaxed);
+        vectored_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return std::vector<operation*>(run.begin(), run.end());
+}
+
+io_engine::io_engine()
+    : operations_(std::make_shared<object_pool<operation>>(4096))
+{
+}
+
+std::multimap<uint64_t, io_engine::operation*>::iterator io_engine::ranges::insert(operation* op)
+{
+    longest = std::max(longest, op->request.length);
+    return by_offset.emplace(op->request.offset, op);
+}
+
+void io_engine::ranges::erase(std::multimap<uint64_t, operation*>::iterator it)
+{
+    by_offset.erase(it);
+    if (by_offset.empty())
+    {
+        longest = 0;
+    }
+}
+
+template <typename F>
+void io_engine::ranges::overlapping(uint64_t offset, uint64_t length, F f) const
+{
+    if (by_offset.empty() || length == 0)
+    {
+        return;
+    }
+
+    // Nothing starting further back than the longest operation can reach us.
+    uint64_t end = offset + length;
+    for (auto it = by_offset.lower_bound(offset > longest ? offset - longest : 0); it != by_offset.end() && it->first < end; ++it)
+    {
+        const io_request& r = it->second->request;
+        if (r.offset + r.length > offset && !f(it->second))
+        {
+            return;
+        }
+    }
+}
+
+bool io_engine::conflicts(const io_request& a, const io_request& b) const
+{
+    bool prefetch = a.op == io_op::prefetch || b.op == io_op::prefetch;
+    if (a.fd != b.fd || (!modifies(a.op) && !modifies(b.op)) || (prefetch && !ordered_prefetch_))
+    {
+        return false;
+    }
+    return a.offset < b.offset + b.length && b.offset < a.offset + a.length;
+}
+
+io_engine::file* io_engine::file_for(int fd)
+{
+    {
+        std::shared_lock<std::shared_mutex> lock(files_mutex_);
+        auto it = files_.find(fd);
+        if (it != files_.end())
+        {
+            return it->second.get();
+        }
+    }
+    std::unique_lock<std::shared_mutex> lock(files_mutex_);
+    std::unique_ptr<file>& f = files_[fd];
+    if (!f)
+    {
+        f.reset(new file);
+    }
+    return f.get();
+}
+
+io_engine::operation* io_engine::submit(io_request request)
+{
+    operation* op = operations_->acquire().detach();
+    op->request = std::move(request);
+    op->owner = file_for(op->request.fd);
+    const io_request& r = op->request;
+    file& f = *op->owner;
+
+    {
+        std::lock_guard<std::mutex> lock(f.mutex);
+
+        // Anything already in flight was submitted before us, so if it overlaps it goes first.
+        // Only what modifies the file can conflict with a read, but a write has to wait for
+        // everything.
+        auto wait_for = [this, op](operation* other)
+        {
+            if (conflicts(other->request, op->request))
+            {
+                other->dependents.push_back(op);
+                op->blockers++;
+            }
+            return true;
+        };
+        f.writes.overlapping(r.offset, r.length, wait_for);
+        if (modifies(r.op))
+        {
+            f.reads.overlapping(r.offset, r.length, wait_for);
+        }
+        op->position = (modifies(r.op) ? f.writes : f.reads).insert(op);
+
+        if (op->blockers > 0)
+        {
+            return op;
+        }
+    }
+    start(op);
+    return op;
+}
+
+void io_engine::start(operation* op)
+{
+    if (op->request.op == io_op::fence)
+    {
+        // Nothing for the engine to do once we're unblocked. The caller retires it through
+        // release() once it's done with the range.
+        op->request.on_complete(0);
+        return;
+    }
+    dispatch(op);
+}
+
+void io_engine::complete(operation* op, int error)
+{
+    op->request.on_complete(error);
+    release(op);
+}
+
+bool io_engine::modifying(int fd, uint64_t offset, uint64_t length)
+{
+    file& f = *file_for(fd);
+    std::lock_guard<std::mutex> lock(f.mutex);
+    bool found = false;
+    f.writes.overlapping(offset, length, [&found](operation*)
+    {
+        found = true;
+        return false;
+    });
+    return found;
+}
+
+void io_engine::release(operation* op)
+{
+    std::vector<operation*> runnable;
+    {
+        file& f = *op->owner;
+        std::lock_guard<std::mutex> lock(f.mutex);
+        for (operation* dependent : op->dependents)
+        {
+            if (--dependent->blockers == 0)
+            {
+                runnable.push_back(dependent);
+            }
+        }
+        (modifies(op->request.op) ? f.writes : f.reads).erase(op->position);
+    }
+    intrusive_ptr_release(op);
+
+    for (operation* next : runnable)
+    {
+        start(next);
+    }
+}
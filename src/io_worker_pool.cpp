@@ -0,0 +1,132 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "io_worker_pool.hpp"
+
+io_worker_pool::io_worker_pool(size_t num_threads, executor execute)
+    : execute_(std::move(execute))
+{
+    auto target = execute_.target<int(*)(const io_request&)>();
+    vectored_ = target && *target == &io_worker_pool::positional_io;
+
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        threads_.emplace_back(&io_worker_pool::run, this);
+    }
+}
+
+io_worker_pool::~io_worker_pool()
+{
+    stop();
+}
+
+void io_worker_pool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    ready_cv_.notify_all();
+
+    for (auto& thread : threads_)
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+}
+
+void io_worker_pool::dispatch(operation* op)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ready_.push_back(op);
+    }
+    ready_cv_.notify_one();
+}
+
+int io_worker_pool::positional_io(const io_request& request)
+{
+    if (request.op == io_op::sync)
+    {
+        return fdatasync(request.fd) == 0 ? 0 : errno;
+    }
+    if (request.op == io_op::prefetch)
+    {
+        return posix_fadvise(request.fd, request.offset, request.length, POSIX_FADV_WILLNEED);
+    }
+    if (request.op == io_op::discard || request.op == io_op::write_zeroes)
+    {
+        return zero_range(request.fd, request.offset, request.length, request.op == io_op::discard);
+    }
+
+    uint64_t done = 0;
+    while (done < request.length)
+    {
+        ssize_t res;
+        if (request.op == io_op::read)
+        {
+            res = pread(request.fd, request.data + done, request.length - done, request.offset + done);
+        }
+        else
+        {
+            res = pwrite(request.fd, request.data + done, request.length - done, request.offset + done);
+        }
+
+        if (res == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno;
+        }
+        if (res == 0)
+        {
+            // Ran off the end of the backing file
+            return EIO;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+void io_worker_pool::run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;)
+    {
+        ready_cv_.wait(lock, [this] { return stopping_ || !ready_.empty(); });
+        if (ready_.empty())
+        {
+            // We only get here once we're stopping and there's no more runnable work.
+            return;
+        }
+
+        operation* op = ready_.front();
+        ready_.pop_front();
+        std::vector<operation*> run = vectored_ ? take_adjacent(op, ready_) : std::vector<operation*>{op};
+
+        lock.unlock();
+        if (run.size() == 1)
+        {
+            complete(op, execute_(op->request));
+        }
+        else
+        {
+            std::vector<iovec> buffers;
+            for (operation* o : run)
+            {
+                buffers.push_back(iovec{o->request.data, o->request.length});
+            }
+            int error = vectored_io(op->request.fd, op->request.op, run.front()->request.offset, std::move(buffers));
+            for (operation* o : run)
+            {
+                complete(o, error);
+            }
+        }
+        lock.lock();
+    }
+}
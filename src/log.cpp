@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "log.hpp"
+
+namespace
+{
+
+const char* const level_names[] = {"trace", "debug", "info", "warn", "error"};
+
+// How long the logger's thread sleeps when every ring is empty, if nothing wakes it first.
+// Records wake it as they arrive, so this only catches what would otherwise be missed.
+const std::chrono::milliseconds idle_wait(100);
+
+}
+
+thread_local logger::ring* logger::current_ring_ = nullptr;
+
+logger& logger::instance()
+{
+    static logger l;
+    return l;
+}
+
+logger::logger()
+    : start_(std::chrono::steady_clock::now())
+    , level_(log_level::info)
+    , output_(stdout)
+    , thread_(&logger::run, this)
+{
+}
+
+logger::~logger()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_cv_.notify_all();
+    thread_.join();
+}
+
+void logger::set_level(log_level level)
+{
+    level_.store(level, std::memory_order_relaxed);
+}
+
+void logger::set_output(FILE* output)
+{
+    flush();
+    std::lock_guard<std::mutex> lock(mutex_);
+    output_ = output;
+}
+
+void logger::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    uint64_t target = ++flushes_requested_;
+    wake_cv_.notify_all();
+    flushed_cv_.wait(lock, [this, target] { return flushes_done_ >= target || stopping_; });
+}
+
+logger::stats logger::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+log_level logger::parse_level(const std::string& name)
+{
+    for (int i = 0; i < 5; i++)
+    {
+        if (name == level_names[i])
+        {
+            return static_cast<log_level>(i);
+        }
+    }
+    throw std::invalid_argument("Unknown log level: " + name);
+}
+
+logger::ring& logger::add_ring()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    rings_.emplace_back(new ring());
+    current_ring_ = rings_.back().get();
+    return *current_ring_;
+}
+
+void logger::wake()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    woken_ = true;
+    wake_cv_.notify_all();
+}
+
+bool logger::pending() const
+{
+    for (auto& r : rings_)
+    {
+        if (r->head.load(std::memory_order_relaxed) != r->tail.load(std::memory_order_acquire))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void logger::run()
+{
+    std::vector<const record*> batch;
+    std::string out;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;)
+    {
+        // A flush asked for before this pass started is done once a pass finds nothing left.
+        uint64_t requested = flushes_requested_;
+        bool stopping = stopping_;
+        lock.unlock();
+        bool wrote = drain(batch, out);
+        lock.lock();
+
+        if (!wrote)
+        {
+            flushes_done_ = requested;
+            flushed_cv_.notify_all();
+            if (stopping)
+            {
+                return;
+            }
+
+            // Pairs with the fence in write(): either a record that turns up now sees we're
+            // idle and wakes us, or we see it here and don't sleep at all.
+            idle_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!pending())
+            {
+                wake_cv_.wait_for(lock, idle_wait, [this, requested]
+                {
+                    return stopping_ || woken_ || flushes_requested_ != requested;
+                });
+            }
+            idle_.store(false, std::memory_order_relaxed);
+            woken_ = false;
+        }
+    }
+}
+
+bool logger::drain(std::vector<const record*>& batch, std::string& out)
+{
+    batch.clear();
+    out.clear();
+
+    // Records are formatted where they are, and only given back to their rings afterwards.
+    std::vector<std::pair<ring*, uint64_t>> ends;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& r : rings_)
+        {
+            ends.emplace_back(r.get(), 0);
+        }
+    }
+
+    uint64_t dropped = 0;
+    for (auto& end : ends)
+    {
+        ring* r = end.first;
+        uint64_t head = r->head.load(std::memory_order_relaxed);
+        end.second = r->tail.load(std::memory_order_acquire);
+        for (; head != end.second; head++)
+        {
+            batch.push_back(&r->records[head & (ring_capacity - 1)]);
+        }
+
+        uint64_t ring_dropped = r->dropped.load(std::memory_order_relaxed);
+        dropped += ring_dropped - r->dropped_reported;
+        r->dropped_reported = ring_dropped;
+    }
+    if (batch.empty() && dropped == 0)
+    {
+        return false;
+    }
+
+    // Each ring is in order already, but the threads' records interleave.
+    std::stable_sort(batch.begin(), batch.end(), [](const record* a, const record* b)
+    {
+        return a->time < b->time;
+    });
+    for (const record* rec : batch)
+    {
+        format(*rec, out);
+    }
+    for (auto& end : ends)
+    {
+        end.first->head.store(end.second, std::memory_order_release);
+    }
+    if (dropped > 0)
+    {
+        out += "Logging fell behind. Dropped " + std::to_string(dropped) + " record(s)\n";
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    fwrite(out.data(), 1, out.size(), output_);
+    fflush(output_);
+    stats_.written += batch.size();
+    stats_.dropped += dropped;
+    return true;
+}
+
+void logger::format(const record& rec, std::string& out)
+{
+    char prefix[48];
+    snprintf(prefix, sizeof(prefix), "[%6llu.%06llu] %-5s ", static_cast<unsigned long long>(rec.time / 1000000000),
+        static_cast<unsigned long long>(rec.time / 1000 % 1000000), level_names[static_cast<int>(rec.level)]);
+    out += prefix;
+
+    size_t next = 0;
+    for (const char* p = rec.format; *p; p++)
+    {
+        if (p[0] != '{' || p[1] != '}' || next == rec.count)
+        {
+            out += *p;
+            continue;
+        }
+
+        const argument& a = rec.arguments[next++];
+        switch (a.type)
+        {
+        case argument::kind::signed_integer:
+            out += std::to_string(a.i);
+            break;
+        case argument::kind::unsigned_integer:
+            out += std::to_string(a.u);
+            break;
+        case argument::kind::floating_point:
+            out += std::to_string(a.d);
+            break;
+        case argument::kind::text:
+            out.append(rec.text + a.s.offset, a.s.length);
+            break;
+        }
+        p++;
+    }
+    out += '\n';
+}
@@ -2,82 +2,410 @@
 #include <boost/bind.hpp>
 #include <boost/endian/conversion.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
 
+#include <csignal>
 #include <iostream>
 #include <array>
+#include <fstream>
 #include <memory>
 #include <thread>
 
 #include "nbd.hpp"
 #include "connection.hpp"
+#include "block_cache.hpp"
 #include "connection_manager.hpp"
+#include "export_registry.hpp"
+#include "io_worker_pool.hpp"
+#include "log.hpp"
+#include "shard_pool.hpp"
+#include "stats_endpoint.hpp"
+#include "uring_io_engine.hpp"
+#include "zero_scan.hpp"
 
 using namespace boost;
 
-unsigned short nbd_port = 10809;
-
 class tcp_connection;
 
+// Listens on every shard's io_service with SO_REUSEPORT, so the kernel spreads new
+// connections between them, or on the first shard's only, handing connections to the
+// shards in turn. Either way a connection stays on the shard it was given.
 class tcp_server
 {
 public:
 
-    tcp_server(std::shared_ptr<asio::io_service> io_service) 
-        : io_service_(io_service)
-        , acceptor_(*io_service, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), nbd_port))
+    tcp_server(shard_pool& shards, unsigned short port, io_engine& engine, const export_registry& exports,
+            const tcp_connection::options& connection_options, bool reuse_port)
+        : engine_(engine)
+        , exports_(exports)
+        , connection_options_(connection_options)
+        , reuse_port_(reuse_port)
     {
-        acceptor_.listen(asio::socket_base::max_connections); // TODO: I don't know if this is required. It's not in the example
-        start_accept();
+        asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+        for (size_t i = 0; i < shards.size(); i++)
+        {
+            std::unique_ptr<shard> s(new shard(shards.io_service(i)));
+            if (i == 0 || reuse_port_)
+            {
+                s->acceptor.reset(new asio::ip::tcp::acceptor(*s->io_service));
+                s->acceptor->open(endpoint.protocol());
+                s->acceptor->set_option(asio::socket_base::reuse_address(true));
+                if (reuse_port_)
+                {
+                    s->acceptor->set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+                }
+                s->acceptor->bind(endpoint);
+                s->acceptor->listen(asio::socket_base::max_connections);
+            }
+            shards_.push_back(std::move(s));
+        }
+
+        for (auto& s : shards_)
+        {
+            if (s->acceptor)
+            {
+                start_accept(*s);
+            }
+        }
     }
 
 private:
-    void start_accept()
+
+    struct shard
+    {
+        explicit shard(std::shared_ptr<asio::io_service> io_service)
+            : io_service(io_service)
+        {
+        }
+
+        std::shared_ptr<asio::io_service> io_service;
+        std::unique_ptr<asio::ip::tcp::acceptor> acceptor;
+        connection_manager manager; // Only touched from the shard's thread
+    };
+
+    void start_accept(shard& listener)
     {
-        tcp_connection::pointer new_connection = std::make_shared<tcp_connection>(io_service_, connection_manager_);
-        
-        acceptor_.async_accept(new_connection->socket(), 
-            boost::bind(&tcp_server::handle_accept, this, new_connection, asio::placeholders::error));
+        shard& target = reuse_port_ ? listener : *shards_[next_shard_++ % shards_.size()];
+        tcp_connection::pointer new_connection = std::make_shared<tcp_connection>(target.io_service, target.manager,
+            engine_, exports_, connection_options_);
+
+        listener.acceptor->async_accept(new_connection->socket(),
+            boost::bind(&tcp_server::handle_accept, this, std::ref(listener), std::ref(target), new_connection,
+                asio::placeholders::error));
     }
 
-    void handle_accept(tcp_connection::pointer new_connection, const boost::system::error_code& error)
+    void handle_accept(shard& listener, shard& target, tcp_connection::pointer new_connection,
+        const boost::system::error_code& error)
     {
         if (!error)
         {
-            connection_manager_.start(new_connection);
+            // The socket was accepted into the target's io_service, but we're still on the
+            // listener's thread.
+            if (&target == &listener)
+            {
+                target.manager.start(new_connection);
+            }
+            else
+            {
+                target.io_service->post([&target, new_connection]
+                {
+                    target.manager.start(new_connection);
+                });
+            }
         }
-        start_accept();
+        start_accept(listener);
     }
-  
-    std::shared_ptr<asio::io_service> io_service_;
-    asio::ip::tcp::acceptor acceptor_;
-    connection_manager connection_manager_;
+
+    io_engine& engine_;
+    const export_registry& exports_;
+    tcp_connection::options connection_options_;
+    const bool reuse_port_;
+    std::vector<std::unique_ptr<shard>> shards_;
+    size_t next_shard_ = 0; // Only used by the first shard's listener
 };
 
+// Snapshots every overlay each time SIGUSR2 arrives.
+void snapshot_on_signal(asio::signal_set& signals, const export_registry& exports)
+{
+    signals.async_wait([&signals, &exports](const boost::system::error_code& error, int)
+    {
+        if (error)
+        {
+            return;
+        }
+        try
+        {
+            exports.snapshot_overlays();
+        }
+        catch (std::exception& e)
+        {
+            LOG_ERROR("Snapshot failed: {}", e.what());
+        }
+        snapshot_on_signal(signals, exports);
+    });
+}
+
 int main(int argc, char** argv)
 {
     try 
     {
-        // One strand for network IO and one for reading from the file.
-        // If we enable multiple connections we might need more.
-        size_t thread_pool_size = 2;
-        auto io_service = std::make_shared<asio::io_service>();
-        std::vector<boost::shared_ptr<std::thread>> threads;
-        tcp_server s(io_service);
-        for (std::size_t i = 0; i < thread_pool_size; i++)
+        // sendfile can't be told MSG_NOSIGNAL, so a client hanging up mid-reply would kill us.
+        signal(SIGPIPE, SIG_IGN);
+
+        // Network IO runs on the shards, a thread each. Backing file IO goes through its own
+        // engine so that a deep client queue turns into that many outstanding disk operations.
+        unsigned short port = 10809;
+        size_t thread_pool_size = std::max(std::thread::hardware_concurrency(), 1u);
+        std::string cpu_list;
+        bool no_reuse_port = false;
+        size_t io_pool_size = 16;
+        size_t cache_mib = 0;
+        bool write_back = false;
+        bool no_mmap_populate = false;
+        bool mmap_huge_pages = false;
+        std::string mmap_advice = "normal";
+        size_t read_ahead_kib = 4096;
+        size_t max_merge_kib = 1024;
+        size_t max_inflight_mib = 256;
+        size_t max_inflight_commands = 4096;
+        size_t connection_inflight_mib = 64;
+        size_t connection_inflight_commands = 256;
+        size_t max_payload_kib = 32 * 1024;
+        size_t connection_iops = 0;
+        size_t connection_mib_per_sec = 0;
+        size_t export_iops = 0;
+        size_t export_mib_per_sec = 0;
+        size_t overlay_cluster_kib = 64;
+        std::string dedup_dir;
+        size_t dedup_block_kib = 4;
+        std::string mirror_mode = "async";
+        size_t mirror_max_lag_mib = 64;
+        unsigned handshake_timeout = 10;
+        std::string log_level_name = "info";
+        unsigned short stats_port = 0;
+        std::vector<std::string> export_specs;
+        std::string config_file;
+
+        namespace po = boost::program_options;
+        po::options_description description("Options");
+        description.add_options()
+            ("help,h", "Show this message")
+            ("export,e", po::value<std::vector<std::string>>(&export_specs),
+                "An export, as name=path, with :ro on the end for a read-only one and :mmap for one served "
+                "from memory. :overlay=directory makes path the base image of a copy-on-write export, whose "
+                "changes are kept in layers in directory. SIGUSR2 snapshots every overlay. :dedup keeps the "
+                "export's blocks in the --dedup-dir store, starting from a copy of path. :sparse punches zero "
+                "blocks in writes out as holes. :mirror=target copies writes to a replica, a file or an "
+                "nbd://host:port/name export. Can be repeated. The first one is the default export")
+            ("config,c", po::value<std::string>(&config_file), "Read options from a file, one option=value per line")
+            ("port,p", po::value<unsigned short>(&port)->default_value(port), "Port to listen on")
+            ("threads", po::value<size_t>(&thread_pool_size)->default_value(thread_pool_size),
+                "Network threads. Each runs a shard of the connections on its own")
+            ("cpus", po::value<std::string>(&cpu_list),
+                "Pin the network threads to these CPUs, as a list like 0-3,8. By default they aren't pinned")
+            ("no-reuseport", po::bool_switch(&no_reuse_port),
+                "Accept on one socket and hand connections to the threads in turn, rather than "
+                "listening on every thread with SO_REUSEPORT")
+            ("io-threads", po::value<size_t>(&io_pool_size)->default_value(io_pool_size),
+                "Worker threads, if the thread pool engine is used")
+            ("cache-mib", po::value<size_t>(&cache_mib)->default_value(cache_mib),
+                "Size of the block cache. Zero leaves it off and relies on the kernel's page cache")
+            ("write-back", po::bool_switch(&write_back), "Let writes complete once they're in the block cache")
+            ("no-mmap-populate", po::bool_switch(&no_mmap_populate),
+                "Leave mapped exports to be read in as they're used, rather than all at startup")
+            ("mmap-huge-pages", po::bool_switch(&mmap_huge_pages),
+                "Ask for transparent huge pages for mapped exports. Only some filesystems, like tmpfs, provide them")
+            ("mmap-advice", po::value<std::string>(&mmap_advice)->default_value(mmap_advice),
+                "How mapped exports will be read, for the kernel's readahead: normal, sequential or random")
+            ("read-ahead-kib", po::value<size_t>(&read_ahead_kib)->default_value(read_ahead_kib),
+                "The most to read ahead of a sequential or strided stream of reads. Zero turns read-ahead off")
+            ("max-merge-kib", po::value<size_t>(&max_merge_kib)->default_value(max_merge_kib),
+                "The most that queued reads or writes next to each other are merged into, for one vectored "
+                "syscall. Zero leaves them unmerged. The block cache never merges")
+            ("max-payload-kib", po::value<size_t>(&max_payload_kib)->default_value(max_payload_kib),
+                "The longest read or write a client can send, advertised to them as the maximum block size. "
+                "Between 4 and 4194303")
+            ("max-inflight-mib", po::value<size_t>(&max_inflight_mib)->default_value(max_inflight_mib),
+                "Payload the server holds for requests in flight, over all connections. Connections stop "
+                "reading requests while it's reached. Zero for no limit")
+            ("max-inflight-commands", po::value<size_t>(&max_inflight_commands)->default_value(max_inflight_commands),
+                "Requests in flight over all connections. Zero for no limit")
+            ("connection-inflight-mib", po::value<size_t>(&connection_inflight_mib)->default_value(connection_inflight_mib),
+                "Payload held for one connection's requests in flight")
+            ("connection-inflight-commands", po::value<size_t>(&connection_inflight_commands)->default_value(connection_inflight_commands),
+                "Requests in flight on one connection")
+            ("connection-iops", po::value<size_t>(&connection_iops)->default_value(connection_iops),
+                "Requests a second each connection can make. Zero for no limit")
+            ("connection-mib-per-sec", po::value<size_t>(&connection_mib_per_sec)->default_value(connection_mib_per_sec),
+                "Read and write bandwidth for each connection. Zero for no limit")
+            ("export-iops", po::value<size_t>(&export_iops)->default_value(export_iops),
+                "Requests a second to each export, from all its connections. Zero for no limit")
+            ("export-mib-per-sec", po::value<size_t>(&export_mib_per_sec)->default_value(export_mib_per_sec),
+                "Read and write bandwidth for each export. Zero for no limit")
+            ("overlay-cluster-kib", po::value<size_t>(&overlay_cluster_kib)->default_value(overlay_cluster_kib),
+                "Cluster size for new overlays, the unit they copy up from the layers below")
+            ("dedup-dir", po::value<std::string>(&dedup_dir),
+                "Directory of the deduplicating block store, which :dedup exports share")
+            ("dedup-block-kib", po::value<size_t>(&dedup_block_kib)->default_value(dedup_block_kib),
+                "Block size for a new deduplicating store, the unit it finds duplicates in")
+            ("mirror-mode", po::value<std::string>(&mirror_mode)->default_value(mirror_mode),
+                "sync to acknowledge writes only once replicas have them, and flush replicas with the exports; "
+                "async to let replicas fall behind, up to --mirror-max-lag-mib")
+            ("mirror-max-lag-mib", po::value<size_t>(&mirror_max_lag_mib)->default_value(mirror_max_lag_mib),
+                "How far an async replica can fall behind before writes wait for it")
+            ("handshake-timeout", po::value<unsigned>(&handshake_timeout)->default_value(handshake_timeout),
+                "Seconds a client has to finish negotiating before it's disconnected")
+            ("stats-port", po::value<unsigned short>(&stats_port)->default_value(stats_port),
+                "Serve stats in Prometheus format over HTTP on this port, on the loopback address. "
+                "Zero leaves it off. SIGUSR1 writes them to stdout either way")
+            ("log-level", po::value<std::string>(&log_level_name)->default_value(log_level_name),
+                "trace, debug, info, warn or error. Levels below the one the server was built with (MNDB_LOG_LEVEL) are left out");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, description), vm);
+        if (vm.count("config"))
+        {
+            std::ifstream config(vm["config"].as<std::string>());
+            if (!config)
+            {
+                std::cerr << "Can't read " << vm["config"].as<std::string>() << std::endl;
+                return 1;
+            }
+            po::store(po::parse_config_file(config, description), vm);
+        }
+        po::notify(vm);
+
+        if (vm.count("help") || export_specs.empty())
+        {
+            std::cout << "Usage: " << argv[0] << " --export [name=]path[:ro][:mmap][:overlay=directory][:dedup][:sparse][:mirror=target] [options]" << std::endl << description;
+            return vm.count("help") ? 0 : 1;
+        }
+
+        logger::instance().set_level(logger::parse_level(log_level_name));
+
+        block_cache::options cache_options;
+        cache_options.memory_budget = cache_mib * 1024 * 1024;
+        cache_options.mode = write_back ? block_cache::write_mode::write_back : block_cache::write_mode::write_through;
+
+        std::unique_ptr<block_cache> cache;
+        std::unique_ptr<io_engine> engine;
+        if (cache_options.memory_budget > 0)
+        {
+            // The cache does its own (synchronous) I/O, so it gets the worker pool.
+            cache.reset(new block_cache(cache_options));
+            block_cache* c = cache.get();
+            engine.reset(new io_worker_pool(io_pool_size, [c](const io_request& r)
+            {
+                switch (r.op)
+                {
+                case io_op::read:
+                    return c->read(r.fd, r.offset, r.length, r.data);
+                case io_op::write:
+                    return c->write(r.fd, r.offset, r.length, r.data);
+                case io_op::sync:
+                    return c->sync(r.fd);
+                case io_op::prefetch:
+                    return c->prefetch(r.fd, r.offset, r.length);
+                default:
+                    return c->zero(r.fd, r.offset, r.length, r.op == io_op::discard);
+                }
+            }));
+        }
+        else
+        {
+            try
+            {
+                engine.reset(new uring_io_engine(uring_io_engine::options()));
+            }
+            catch (std::runtime_error& e)
+            {
+                LOG_WARN("{}. Falling back to the thread pool engine.", e.what());
+                engine.reset(new io_worker_pool(io_pool_size));
+            }
+        }
+        engine->set_max_merge(max_merge_kib * 1024);
+        engine->set_ordered_prefetch(cache != nullptr);
+        LOG_INFO("Using the {} I/O engine{}. Zero blocks are found with {}", engine->name(), cache ? " with the block cache" : "",
+            best_zero_scanner().name);
+
+        mapped_file::options mapping_options;
+        mapping_options.populate = !no_mmap_populate;
+        mapping_options.huge_pages = mmap_huge_pages;
+        mapping_options.advice = mapped_file::parse_access(mmap_advice);
+
+        // Declared after the cache, so the exports are closed before it goes away.
+        throttle::options export_qos;
+        export_qos.iops = export_iops;
+        export_qos.bytes_per_second = export_mib_per_sec * 1024 * 1024;
+        overlay_image::options overlay_options;
+        overlay_options.cluster_size = overlay_cluster_kib * 1024;
+        std::shared_ptr<dedup_store> dedup;
+        if (!dedup_dir.empty())
+        {
+            dedup_store::options dedup_options;
+            dedup_options.block_size = dedup_block_kib * 1024;
+            dedup = std::make_shared<dedup_store>(dedup_dir, dedup_options);
+        }
+        write_mirror::options mirror_options;
+        mirror_options.sync = write_mirror::parse_mode(mirror_mode);
+        mirror_options.max_lag = mirror_max_lag_mib * 1024 * 1024;
+        export_registry exports(*engine, cache.get(), mapping_options, export_qos, overlay_options, dedup, mirror_options);
+        for (auto& spec : export_specs)
+        {
+            exports.add(spec);
+        }
+        for (auto& e : exports.list())
         {
-            boost::shared_ptr<std::thread> thread(new std::thread(boost::bind(&asio::io_service::run, io_service.get())));
-            threads.push_back(thread);
+            LOG_INFO("Exporting '{}': {}, {} bytes{}{}{}", e->name, e->path, e->size, e->read_only ? ", read-only" : "",
+                e->mapping ? ", mapped" : "", e->sparse_writes ? ", sparse" : "");
+            if (e->overlay)
+            {
+                LOG_INFO("Export '{}' is an overlay of {} layer(s) with {}-byte clusters", e->name,
+                    e->overlay->layers(), e->overlay->cluster_size());
+            }
+            if (e->dedup)
+            {
+                LOG_INFO("Export '{}' is deduplicated, with {} block(s) in the store", e->name, e->dedup->mapped_blocks());
+            }
+            if (e->mirror)
+            {
+                LOG_INFO("Export '{}' is mirrored to {} ({})", e->name, e->mirror->target(), mirror_mode);
+            }
         }
-        
-        for (auto& thread : threads)
+
+        shard_pool::options shard_options;
+        shard_options.shards = thread_pool_size;
+        shard_options.cpus = shard_pool::parse_cpu_list(cpu_list);
+        shard_pool shards(shard_options);
+
+        tcp_connection::options connection_options;
+        connection_options.handshake_timeout = std::chrono::seconds(handshake_timeout);
+        connection_options.read_ahead = read_ahead_kib > 0;
+        connection_options.streams.max_window = read_ahead_kib * 1024;
+        connection_options.streams.min_window = std::min(connection_options.streams.min_window, connection_options.streams.max_window);
+        connection_options.max_payload = std::min<uint64_t>(std::max<size_t>(max_payload_kib, 4), UINT32_MAX / 1024) * 1024;
+        connection_options.max_inflight_bytes = connection_inflight_mib * 1024 * 1024;
+        connection_options.max_inflight_commands = std::max<size_t>(connection_inflight_commands, 1);
+        connection_options.qos.iops = connection_iops;
+        connection_options.qos.bytes_per_second = connection_mib_per_sec * 1024 * 1024;
+        if (max_inflight_mib > 0 || max_inflight_commands > 0)
         {
-            thread->join();
-            std::cout << "Thread is joined" << std::endl;
+            admission_control::options admission;
+            admission.max_bytes = max_inflight_mib > 0 ? max_inflight_mib * 1024 * 1024 : UINT64_MAX;
+            admission.max_commands = max_inflight_commands > 0 ? max_inflight_commands : UINT64_MAX;
+            connection_options.admission = std::make_shared<admission_control>(admission);
         }
+
+        tcp_server s(shards, port, *engine, exports, connection_options, !no_reuse_port);
+        stats_endpoint stats(*shards.io_service(0), exports, stats_port);
+        asio::signal_set snapshot_signals(*shards.io_service(0), SIGUSR2);
+        snapshot_on_signal(snapshot_signals, exports);
+        LOG_INFO("Running {} shard(s){}", shards.size(), no_reuse_port ? "" : ", each listening with SO_REUSEPORT");
+        shards.run();
     }
     catch(std::exception& e)
     {
-        std::cerr << "Exception: " << e.what() << std::endl;
+        LOG_ERROR("Exception: {}", e.what());
     }
     return 0;
 }
@@ -0,0 +1,73 @@
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "log.hpp"
+#include "mapped_file.hpp"
+
+mapped_file::mapped_file(int fd, uint64_t size, bool read_only, const options& opts)
+    : size_(size)
+{
+    // There's nothing to map in an empty file, and mmap won't take a length of 0.
+    if (size == 0)
+    {
+        return;
+    }
+
+    int protection = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+    void* p = mmap(nullptr, size, protection, MAP_SHARED | (opts.populate ? MAP_POPULATE : 0), fd, 0);
+    if (p == MAP_FAILED)
+    {
+        throw std::runtime_error(std::string("Unable to map the backing file: ") + strerror(errno));
+    }
+    data_ = static_cast<char*>(p);
+
+    // The hints are only hints, so failing to give them isn't fatal.
+    if (opts.huge_pages && madvise(data_, size_, MADV_HUGEPAGE) != 0)
+    {
+        LOG_WARN("Unable to ask for huge pages: {}", strerror(errno));
+    }
+    int advice = opts.advice == access::sequential ? MADV_SEQUENTIAL
+        : opts.advice == access::random ? MADV_RANDOM
+        : MADV_NORMAL;
+    if (advice != MADV_NORMAL && madvise(data_, size_, advice) != 0)
+    {
+        LOG_WARN("Unable to advise the kernel on the mapping: {}", strerror(errno));
+    }
+}
+
+mapped_file::~mapped_file()
+{
+    if (data_)
+    {
+        munmap(data_, size_);
+    }
+}
+
+int mapped_file::sync()
+{
+    if (!data_)
+    {
+        return 0;
+    }
+    return msync(data_, size_, MS_SYNC) == 0 ? 0 : errno;
+}
+
+mapped_file::access mapped_file::parse_access(const std::string& name)
+{
+    if (name == "normal")
+    {
+        return access::normal;
+    }
+    if (name == "sequential")
+    {
+        return access::sequential;
+    }
+    if (name == "random")
+    {
+        return access::random;
+    }
+    throw std::runtime_error("Unknown access pattern: " + name);
+}
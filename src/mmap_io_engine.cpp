@@ -0,0 +1,41 @@
+#include <cerrno>
+#include <cstring>
+
+#include "mmap_io_engine.hpp"
+
+mmap_io_engine::mmap_io_engine(std::shared_ptr<mapped_file> file, size_t num_threads)
+    : io_worker_pool(num_threads, [file](const io_request& r)
+        {
+            // Zeroing goes through the descriptor. fallocate keeps the mapping coherent, and
+            // it can punch holes where a memset can't.
+            return r.op == io_op::sync ? file->sync() : positional_io(r);
+        })
+    , file_(std::move(file))
+{
+}
+
+void mmap_io_engine::dispatch(operation* op)
+{
+    const io_request& r = op->request;
+    if (r.op != io_op::read && r.op != io_op::write)
+    {
+        io_worker_pool::dispatch(op);
+        return;
+    }
+
+    if (r.offset > file_->size() || r.length > file_->size() - r.offset)
+    {
+        complete(op, EINVAL);
+        return;
+    }
+    if (r.op == io_op::read)
+    {
+        memcpy(r.data, file_->data() + r.offset, r.length);
+    }
+    else
+    {
+        memcpy(file_->data() + r.offset, r.data, r.length);
+    }
+    op->transferred = r.length;
+    complete(op, 0);
+}
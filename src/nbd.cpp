@@ -5,6 +5,7 @@ const uint64_t optmagic = 0x49484156454F5054; // 'IHAVEOPT';
 const uint64_t negotiation_replymagic = 0x3e889045565a9; 
 const uint32_t NBD_REQUEST_MAGIC = 0x25609513;
 const uint32_t NBD_REPLY_MAGIC = 0x67446698;
+const uint32_t NBD_STRUCTURED_REPLY_MAGIC = 0x668e33ef;
 
 // handshake_flags 
 const uint16_t NBD_FLAG_FIXED_NEWSTYLE = 0x1; // Must be set by servers that support the fixed newstyle protocol
@@ -15,23 +16,61 @@ const uint32_t NBD_FLAG_C_FIXED_NEWSTYLE = 1<<0; // Should be set by clients tha
 const uint32_t NBD_FLAG_C_NO_ZEROES = 1<<1;
 
 // option types
+const uint32_t NBD_OPT_ABORT = 2;
+const uint32_t NBD_OPT_LIST = 3;
 const uint32_t NBD_OPT_INFO = 6;
 const uint32_t NBD_OPT_GO = 7;
+const uint32_t NBD_OPT_STRUCTURED_REPLY = 8;
+const uint32_t NBD_OPT_LIST_META_CONTEXT = 9;
+const uint32_t NBD_OPT_SET_META_CONTEXT = 10;
 
 // Reply types (Used in the "reply type field sent by the server during option haggling")
 const uint32_t NBD_REP_ACK = 1;
+const uint32_t NBD_REP_SERVER = 2;
 const uint32_t NBD_REP_INFO = 3;
+const uint32_t NBD_REP_META_CONTEXT = 4;
+const uint32_t NBD_REP_ERR_UNSUP = (1u<<31) + 1;
+const uint32_t NBD_REP_ERR_INVALID = (1u<<31) + 3;
+const uint32_t NBD_REP_ERR_UNKNOWN = (1u<<31) + 6;
+const uint32_t NBD_REP_ERR_TOO_BIG = (1u<<31) + 9;
 
 // For use with NBD_REP_INFO
 const uint16_t NBD_INFO_EXPORT = 0;
+const uint16_t NBD_INFO_BLOCK_SIZE = 3;
 
 // Transmission flags
 const uint16_t NBD_FLAG_HAS_FLAGS = 0x01; // Must always be 1
 const uint16_t NBD_FLAG_READ_ONLY = 1<<1;
 const uint16_t NBD_FLAG_SEND_FLUSH = 1<<2; 
+const uint16_t NBD_FLAG_SEND_FUA = 1<<3;
+const uint16_t NBD_FLAG_SEND_TRIM = 1<<5;
+const uint16_t NBD_FLAG_SEND_WRITE_ZEROES = 1<<6;
+const uint16_t NBD_FLAG_CAN_MULTI_CONN = 1<<8;
 
 // Request types
 extern const uint16_t NBD_CMD_READ = 0;
 extern const uint16_t NBD_CMD_WRITE = 1;
 extern const uint16_t NBD_CMD_DISC = 2; // A disconnect request. The server must handle outstanding requests, shut down the TLS session, and close the TCP session
-// ect. 
\ No newline at end of file
+extern const uint16_t NBD_CMD_FLUSH = 3;
+extern const uint16_t NBD_CMD_TRIM = 4;
+extern const uint16_t NBD_CMD_WRITE_ZEROES = 6;
+extern const uint16_t NBD_CMD_BLOCK_STATUS = 7;
+// ect.
+
+// Command flags
+const uint16_t NBD_CMD_FLAG_FUA = 1<<0;
+const uint16_t NBD_CMD_FLAG_NO_HOLE = 1<<1;
+const uint16_t NBD_CMD_FLAG_REQ_ONE = 1<<3;
+
+// Structured reply flags and types
+const uint16_t NBD_REPLY_FLAG_DONE = 1<<0;
+const uint16_t NBD_REPLY_TYPE_NONE = 0;
+const uint16_t NBD_REPLY_TYPE_OFFSET_DATA = 1;
+const uint16_t NBD_REPLY_TYPE_OFFSET_HOLE = 2;
+const uint16_t NBD_REPLY_TYPE_BLOCK_STATUS = 5;
+const uint16_t NBD_REPLY_TYPE_ERROR = (1<<15) + 1;
+
+// The base:allocation meta context
+const char* const NBD_META_BASE_ALLOCATION = "base:allocation";
+const uint32_t NBD_STATE_HOLE = 1<<0;
+const uint32_t NBD_STATE_ZERO = 1<<1; 
\ No newline at end of file
@@ -0,0 +1,269 @@
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/endian/conversion.hpp>
+
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#include "nbd.hpp"
+#include "nbd_client.hpp"
+
+namespace
+{
+
+bool send_option(int sock, uint32_t option, const std::vector<char>& data)
+{
+    client_option header;
+    header.optmagic = boost::endian::native_to_big(optmagic);
+    header.option = boost::endian::native_to_big(option);
+    header.length_of_data = boost::endian::native_to_big(static_cast<uint32_t>(data.size()));
+    return send_all(sock, &header, sizeof(header)) && send_all(sock, data.data(), data.size());
+}
+
+bool receive_option_reply(int sock, uint32_t& type, std::vector<char>& payload)
+{
+    server_negotiation_response response;
+    if (!recv_all(sock, &response, sizeof(response)))
+    {
+        return false;
+    }
+    type = boost::endian::big_to_native(response.reply_type);
+    payload.resize(boost::endian::big_to_native(response.reply_length));
+    return recv_all(sock, payload.data(), payload.size());
+}
+
+void append_u32(std::vector<char>& data, uint32_t value)
+{
+    value = boost::endian::native_to_big(value);
+    const char* p = reinterpret_cast<const char*>(&value);
+    data.insert(data.end(), p, p + sizeof(value));
+}
+
+std::string describe(uint32_t option, uint32_t reply)
+{
+    std::ostringstream s;
+    s << "The server refused option " << option << " (reply type 0x" << std::hex << reply << ")";
+    return s.str();
+}
+
+// Negotiates the options wanted before NBD_OPT_GO, then that, filling in info.
+bool negotiate(int sock, const nbd_client_options& opts, nbd_export_info& info, std::string& error)
+{
+    uint32_t type;
+    std::vector<char> payload;
+    if (opts.structured_replies)
+    {
+        if (!send_option(sock, NBD_OPT_STRUCTURED_REPLY, {}) || !receive_option_reply(sock, type, payload))
+        {
+            error = "Connection lost asking for structured replies";
+            return false;
+        }
+        if (type != NBD_REP_ACK)
+        {
+            error = describe(NBD_OPT_STRUCTURED_REPLY, type);
+            return false;
+        }
+    }
+
+    if (opts.base_allocation)
+    {
+        std::vector<char> data;
+        append_u32(data, opts.export_name.size());
+        data.insert(data.end(), opts.export_name.begin(), opts.export_name.end());
+        append_u32(data, 1);
+        append_u32(data, strlen(NBD_META_BASE_ALLOCATION));
+        data.insert(data.end(), NBD_META_BASE_ALLOCATION, NBD_META_BASE_ALLOCATION + strlen(NBD_META_BASE_ALLOCATION));
+        if (!send_option(sock, NBD_OPT_SET_META_CONTEXT, data))
+        {
+            error = "Connection lost asking for base:allocation";
+            return false;
+        }
+
+        // The context's ID comes in its own reply, before the ACK.
+        bool found = false;
+        for (;;)
+        {
+            if (!receive_option_reply(sock, type, payload))
+            {
+                error = "Connection lost asking for base:allocation";
+                return false;
+            }
+            if (type == NBD_REP_META_CONTEXT && payload.size() >= sizeof(uint32_t))
+            {
+                uint32_t id;
+                memcpy(&id, payload.data(), sizeof(id));
+                info.base_allocation_id = boost::endian::big_to_native(id);
+                found = true;
+            }
+            else if (type == NBD_REP_ACK)
+            {
+                break;
+            }
+            else
+            {
+                error = describe(NBD_OPT_SET_META_CONTEXT, type);
+                return false;
+            }
+        }
+        if (!found)
+        {
+            error = "The server doesn't have base:allocation";
+            return false;
+        }
+    }
+
+    // No information requests. The server sends what it likes.
+    std::vector<char> data;
+    append_u32(data, opts.export_name.size());
+    data.insert(data.end(), opts.export_name.begin(), opts.export_name.end());
+    data.push_back(0);
+    data.push_back(0);
+    if (!send_option(sock, NBD_OPT_GO, data))
+    {
+        error = "Connection lost choosing the export";
+        return false;
+    }
+    for (;;)
+    {
+        if (!receive_option_reply(sock, type, payload))
+        {
+            error = "Connection lost choosing the export";
+            return false;
+        }
+        uint16_t information_type = 0;
+        if (type == NBD_REP_INFO && payload.size() >= sizeof(information_type))
+        {
+            memcpy(&information_type, payload.data(), sizeof(information_type));
+            information_type = boost::endian::big_to_native(information_type);
+        }
+
+        if (type == NBD_REP_INFO && information_type == NBD_INFO_EXPORT && payload.size() >= sizeof(nbd_info_export))
+        {
+            nbd_info_export export_info;
+            memcpy(&export_info, payload.data(), sizeof(export_info));
+            info.size = boost::endian::big_to_native(export_info.size_of_export_in_bytes);
+            info.flags = boost::endian::big_to_native(export_info.transmission_flags);
+        }
+        else if (type == NBD_REP_INFO && information_type == NBD_INFO_BLOCK_SIZE && payload.size() >= sizeof(nbd_info_block_size))
+        {
+            nbd_info_block_size block_size;
+            memcpy(&block_size, payload.data(), sizeof(block_size));
+            info.max_block_size = boost::endian::big_to_native(block_size.maximum_block_size);
+        }
+        else if (type == NBD_REP_ACK)
+        {
+            return true;
+        }
+        else if (type != NBD_REP_INFO)
+        {
+            error = describe(NBD_OPT_GO, type);
+            return false;
+        }
+    }
+}
+
+}
+
+bool send_all(int sock, const void* data, size_t length)
+{
+    const char* p = static_cast<const char*>(data);
+    while (length > 0)
+    {
+        ssize_t res = send(sock, p, length, MSG_NOSIGNAL);
+        if (res <= 0)
+        {
+            return false;
+        }
+        p += res;
+        length -= res;
+    }
+    return true;
+}
+
+bool recv_all(int sock, void* data, size_t length)
+{
+    char* p = static_cast<char*>(data);
+    while (length > 0)
+    {
+        ssize_t res = recv(sock, p, length, 0);
+        if (res <= 0)
+        {
+            return false;
+        }
+        p += res;
+        length -= res;
+    }
+    return true;
+}
+
+int nbd_connect(const nbd_client_options& opts, nbd_export_info& info, std::string& error)
+{
+    addrinfo hints = {};
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses;
+    if (getaddrinfo(opts.host.c_str(), opts.port.c_str(), &hints, &addresses) != 0)
+    {
+        error = "Can't resolve " + opts.host;
+        return -1;
+    }
+    int sock = socket(addresses->ai_family, SOCK_STREAM, 0);
+    if (sock >= 0 && connect(sock, addresses->ai_addr, addresses->ai_addrlen) != 0)
+    {
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addresses);
+    if (sock < 0)
+    {
+        error = "Can't connect to " + opts.host + ":" + opts.port;
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    initial_message initial;
+    uint32_t client_flags = boost::endian::native_to_big(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES);
+    if (!recv_all(sock, &initial, sizeof(initial)) || !send_all(sock, &client_flags, sizeof(client_flags)))
+    {
+        error = "Connection lost in the handshake";
+        close(sock);
+        return -1;
+    }
+    if (boost::endian::big_to_native(initial.nbdmagic) != nbdmagic || boost::endian::big_to_native(initial.optmagic) != optmagic)
+    {
+        error = "Not a newstyle NBD server";
+        close(sock);
+        return -1;
+    }
+
+    if (!negotiate(sock, opts, info, error))
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+bool nbd_send_request(int sock, uint16_t type, uint16_t flags, uint64_t handle, uint64_t offset, uint32_t length,
+    const void* data)
+{
+    request_message request;
+    request.nbd_request_magic = boost::endian::native_to_big(NBD_REQUEST_MAGIC);
+    request.command_flags = boost::endian::native_to_big(flags);
+    request.type = boost::endian::native_to_big(type);
+    request.handle = handle; // Sent as is, and handed back as is
+    request.offset = boost::endian::native_to_big(offset);
+    request.length = boost::endian::native_to_big(length);
+    return send_all(sock, &request, sizeof(request)) && (type != NBD_CMD_WRITE || send_all(sock, data, length));
+}
+
+void nbd_disconnect(int sock)
+{
+    nbd_send_request(sock, NBD_CMD_DISC, 0, 0, 0, 0);
+    close(sock);
+}
@@ -0,0 +1,439 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+
+#include "io_worker_pool.hpp"
+#include "overlay_image.hpp"
+
+namespace
+{
+
+const char map_magic[8] = {'M', 'N', 'D', 'B', 'C', 'O', 'W', '1'};
+
+// The header gets a page to itself, so the bitmap after it is page-aligned.
+const uint64_t header_size = 4096;
+
+struct map_header
+{
+    char magic[8];
+    uint64_t cluster_size;
+    uint64_t size; // Of the image, which has to match the base's
+};
+
+bool read_header(const std::string& path, map_header& header)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    bool ok = pread(fd, &header, sizeof(header), 0) == sizeof(header) && memcmp(header.magic, map_magic, sizeof(map_magic)) == 0;
+    close(fd);
+    return ok;
+}
+
+void sync_directory(const std::string& directory)
+{
+    // Without this, a new layer's files might not survive a crash even once they're synced.
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd != -1)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+int positional_io(io_op op, int fd, uint64_t offset, uint64_t length, const char* data)
+{
+    return io_worker_pool::positional_io(io_request{op, fd, offset, length, const_cast<char*>(data), nullptr});
+}
+
+}
+
+overlay_image::layer::~layer()
+{
+    map.reset();
+    if (map_fd != -1)
+    {
+        close(map_fd);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+overlay_image::overlay_image(const std::string& base_path, const std::string& directory, const options& opts)
+    : directory_(directory)
+{
+    std::unique_ptr<layer> base(new layer);
+    base->fd = open(base_path.c_str(), O_RDONLY);
+    if (base->fd == -1)
+    {
+        throw std::runtime_error("Unable to open " + base_path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(base->fd, &st) != 0)
+    {
+        throw std::runtime_error("Unable to stat " + base_path + ": " + strerror(errno));
+    }
+    size_ = st.st_size;
+    layers_.push_back(std::move(base));
+
+    boost::system::error_code error;
+    boost::filesystem::create_directories(directory_, error);
+    if (error)
+    {
+        throw std::runtime_error("Unable to create " + directory_ + ": " + error.message());
+    }
+
+    // The first layer decides the cluster size for all of them.
+    map_header first;
+    bool existing = read_header(layer_path(1, "map"), first);
+    cluster_size_ = existing ? first.cluster_size : opts.cluster_size;
+    if (cluster_size_ < 4096 || (cluster_size_ & (cluster_size_ - 1)) != 0)
+    {
+        throw std::runtime_error("Overlay cluster size has to be a power of two, at least 4096: " + directory_);
+    }
+    clusters_ = (size_ + cluster_size_ - 1) / cluster_size_;
+
+    for (size_t number = 1; existing && boost::filesystem::exists(layer_path(number, "map")); number++)
+    {
+        if (number > UINT16_MAX)
+        {
+            throw std::runtime_error("Too many overlay layers in " + directory_);
+        }
+        layers_.push_back(open_layer(number, false));
+    }
+    if (layers_.size() == 1)
+    {
+        layers_.push_back(open_layer(1, true));
+        sync_directory(directory_);
+    }
+
+    // Higher layers win, so they're applied last.
+    index_.reset(new std::atomic<uint16_t>[clusters_]);
+    for (uint64_t c = 0; c < clusters_; c++)
+    {
+        index_[c].store(0, std::memory_order_relaxed);
+    }
+    for (size_t number = 1; number < layers_.size(); number++)
+    {
+        const uint8_t* bits = layers_[number]->bits;
+        for (uint64_t c = 0; c < clusters_; c++)
+        {
+            if (bits[c / 8] & (1 << (c % 8)))
+            {
+                index_[c].store(static_cast<uint16_t>(number), std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+overlay_image::~overlay_image()
+{
+    sync_top();
+}
+
+std::string overlay_image::layer_path(size_t number, const char* extension) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "layer-%04zu.%s", number, extension);
+    return (boost::filesystem::path(directory_) / name).string();
+}
+
+std::unique_ptr<overlay_image::layer> overlay_image::open_layer(size_t number, bool create)
+{
+    std::unique_ptr<layer> l(new layer);
+    std::string data_path = layer_path(number, "data");
+    std::string map_path = layer_path(number, "map");
+    int flags = create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR;
+    uint64_t map_size = header_size + (clusters_ + 7) / 8;
+
+    l->fd = open(data_path.c_str(), flags, 0644);
+    if (l->fd == -1)
+    {
+        throw std::runtime_error("Unable to open " + data_path + ": " + strerror(errno));
+    }
+    l->map_fd = open(map_path.c_str(), flags, 0644);
+    if (l->map_fd == -1)
+    {
+        throw std::runtime_error("Unable to open " + map_path + ": " + strerror(errno));
+    }
+
+    if (create)
+    {
+        // Both start out as holes, so a new layer costs nothing however big the image is.
+        map_header header;
+        memcpy(header.magic, map_magic, sizeof(map_magic));
+        header.cluster_size = cluster_size_;
+        header.size = size_;
+        if (ftruncate(l->fd, size_) != 0 || ftruncate(l->map_fd, map_size) != 0
+            || pwrite(l->map_fd, &header, sizeof(header), 0) != sizeof(header)
+            || fsync(l->fd) != 0 || fsync(l->map_fd) != 0)
+        {
+            throw std::runtime_error("Unable to create overlay layer " + map_path + ": " + strerror(errno));
+        }
+    }
+    else
+    {
+        map_header header;
+        struct stat st;
+        if (pread(l->map_fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, map_magic, sizeof(map_magic)) != 0
+            || header.cluster_size != cluster_size_ || header.size != size_
+            || fstat(l->map_fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < map_size)
+        {
+            throw std::runtime_error("Overlay layer " + map_path + " doesn't match its base or the other layers");
+        }
+    }
+
+    mapped_file::options mapping;
+    l->map.reset(new mapped_file(l->map_fd, map_size, false, mapping));
+    l->bits = reinterpret_cast<uint8_t*>(l->map->data() + header_size);
+    return l;
+}
+
+size_t overlay_image::layers() const
+{
+    std::shared_lock<std::shared_mutex> lock(layers_mutex_);
+    return layers_.size() - 1;
+}
+
+template <typename F>
+int overlay_image::for_each_run(uint64_t offset, uint64_t length, F f)
+{
+    if (offset > size_ || length > size_ - offset)
+    {
+        return EINVAL;
+    }
+
+    uint64_t end = offset + length;
+    while (offset < end)
+    {
+        uint64_t cluster = offset / cluster_size_;
+        uint16_t from = index_[cluster].load(std::memory_order_acquire);
+        uint64_t run_end = std::min((cluster + 1) * cluster_size_, end);
+        while (run_end < end && index_[run_end / cluster_size_].load(std::memory_order_acquire) == from)
+        {
+            run_end = std::min(run_end + cluster_size_, end);
+        }
+
+        int error = f(layers_[from]->fd, offset, run_end - offset);
+        if (error)
+        {
+            return error;
+        }
+        offset = run_end;
+    }
+    return 0;
+}
+
+int overlay_image::read(uint64_t offset, uint64_t length, char* data)
+{
+    std::shared_lock<std::shared_mutex> lock(layers_mutex_);
+    return for_each_run(offset, length, [offset, data](int fd, uint64_t at, uint64_t n)
+    {
+        return positional_io(io_op::read, fd, at, n, data + (at - offset));
+    });
+}
+
+int overlay_image::prefetch(uint64_t offset, uint64_t length)
+{
+    std::shared_lock<std::shared_mutex> lock(layers_mutex_);
+    return for_each_run(offset, length, [](int fd, uint64_t at, uint64_t n)
+    {
+        return posix_fadvise(fd, at, n, POSIX_FADV_WILLNEED);
+    });
+}
+
+int overlay_image::write(uint64_t offset, uint64_t length, const char* data)
+{
+    if (offset > size_ || length > size_ - offset)
+    {
+        return EINVAL;
+    }
+
+    std::shared_lock<std::shared_mutex> lock(layers_mutex_);
+    uint16_t top = static_cast<uint16_t>(layers_.size() - 1);
+    uint64_t end = offset + length;
+    uint64_t position = offset;
+    while (position < end)
+    {
+        uint64_t cluster = position / cluster_size_;
+        uint64_t run_end = std::min((cluster + 1) * cluster_size_, end);
+        if (index_[cluster].load(std::memory_order_acquire) != top)
+        {
+            int error = copy_up(cluster, position, run_end - position, data + (position - offset));
+            if (error)
+            {
+                return error;
+            }
+            position = run_end;
+            continue;
+        }
+
+        // Clusters already in the top layer are written in place, as many at once as are
+        // next to each other.
+        while (run_end < end && index_[run_end / cluster_size_].load(std::memory_order_acquire) == top)
+        {
+            run_end = std::min(run_end + cluster_size_, end);
+        }
+        int error = positional_io(io_op::write, layers_[top]->fd, position, run_end - position, data + (position - offset));
+        if (error)
+        {
+            return error;
+        }
+        position = run_end;
+    }
+    return 0;
+}
+
+int overlay_image::copy_up(uint64_t cluster, uint64_t offset, uint64_t length, const char* data)
+{
+    uint16_t top = static_cast<uint16_t>(layers_.size() - 1);
+    int fd = layers_[top]->fd;
+    uint64_t start = cluster * cluster_size_;
+    uint64_t n = std::min(cluster_size_, size_ - start);
+
+    std::lock_guard<std::mutex> lock(cluster_locks_[cluster % cluster_locks_.size()]);
+    uint16_t from = index_[cluster].load(std::memory_order_acquire);
+    if (from == top || (offset == start && length == n))
+    {
+        // Either another write brought it up while we waited, or there's nothing to copy.
+        int error = positional_io(io_op::write, fd, offset, length, data);
+        if (!error && from != top)
+        {
+            allocate(cluster, top);
+        }
+        return error;
+    }
+
+    std::vector<char> buffer(n);
+    int error = positional_io(io_op::read, layers_[from]->fd, start, n, buffer.data());
+    if (error)
+    {
+        return error;
+    }
+    memcpy(buffer.data() + (offset - start), data, length);
+    error = positional_io(io_op::write, fd, start, n, buffer.data());
+    if (error)
+    {
+        return error;
+    }
+    allocate(cluster, top);
+    return 0;
+}
+
+void overlay_image::allocate(uint64_t cluster, uint16_t top)
+{
+    // Reads see the cluster in the top layer from now on, but the bitmap only gets it once
+    // it's been synced.
+    index_[cluster].store(top, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_.push_back(cluster);
+}
+
+int overlay_image::zero(uint64_t offset, uint64_t length)
+{
+    if (offset > size_ || length > size_ - offset)
+    {
+        return EINVAL;
+    }
+
+    // Whole clusters, from the first boundary at or after offset to the last one before the
+    // end (or the end of the image, which may not be on a boundary).
+    uint64_t end = offset + length;
+    uint64_t first = std::min((offset + cluster_size_ - 1) / cluster_size_ * cluster_size_, end);
+    uint64_t last = end == size_ ? end : std::max(end / cluster_size_ * cluster_size_, first);
+
+    std::vector<char> zeroes(std::min(cluster_size_, length));
+    for (auto part : {std::make_pair(offset, first), std::make_pair(last, end)})
+    {
+        if (part.second > part.first)
+        {
+            int error = write(part.first, part.second - part.first, zeroes.data());
+            if (error)
+            {
+                return error;
+            }
+        }
+    }
+
+    std::shared_lock<std::shared_mutex> lock(layers_mutex_);
+    uint16_t top = static_cast<uint16_t>(layers_.size() - 1);
+    for (uint64_t start = first; start < last; start += cluster_size_)
+    {
+        uint64_t cluster = start / cluster_size_;
+        std::lock_guard<std::mutex> cluster_lock(cluster_locks_[cluster % cluster_locks_.size()]);
+        int error = zero_range(layers_[top]->fd, start, std::min(cluster_size_, last - start), true);
+        if (error)
+        {
+            return error;
+        }
+        if (index_[cluster].load(std::memory_order_acquire) != top)
+        {
+            allocate(cluster, top);
+        }
+    }
+    return 0;
+}
+
+int overlay_image::sync()
+{
+    std::shared_lock<std::shared_mutex> lock(layers_mutex_);
+    return sync_top();
+}
+
+int overlay_image::sync_top()
+{
+    // Clusters brought up after this point wait for the next sync, since their data might
+    // not be covered by this one.
+    std::vector<uint64_t> synced;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        synced.swap(pending_);
+    }
+
+    layer& top = *layers_.back();
+    if (fdatasync(top.fd) != 0)
+    {
+        int error = errno;
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        pending_.insert(pending_.end(), synced.begin(), synced.end());
+        return error;
+    }
+    if (synced.empty())
+    {
+        return 0;
+    }
+    for (uint64_t c : synced)
+    {
+        __atomic_fetch_or(&top.bits[c / 8], static_cast<uint8_t>(1 << (c % 8)), __ATOMIC_RELAXED);
+    }
+    return top.map->sync();
+}
+
+size_t overlay_image::snapshot()
+{
+    std::unique_lock<std::shared_mutex> lock(layers_mutex_);
+    if (layers_.size() > UINT16_MAX)
+    {
+        throw std::runtime_error("Too many overlay layers in " + directory_);
+    }
+    int error = sync_top();
+    if (error)
+    {
+        throw std::runtime_error("Unable to sync the top overlay layer: " + std::string(strerror(error)));
+    }
+    layers_.push_back(open_layer(layers_.size(), true));
+    sync_directory(directory_);
+    return layers_.size() - 1;
+}
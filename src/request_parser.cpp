@@ -0,0 +1,71 @@
+#include <boost/endian/conversion.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+#include "nbd.hpp"
+#include "request_parser.hpp"
+
+request_parser::request_parser(size_t buffer_size)
+    : buffer_(std::max(buffer_size, sizeof(request_message)))
+{
+}
+
+boost::asio::mutable_buffer request_parser::prepare()
+{
+    if (begin_ == end_)
+    {
+        begin_ = end_ = 0;
+    }
+    else if (buffer_.size() - end_ < sizeof(request_message))
+    {
+        // Not even room for a header, so move the partial request back to the front.
+        memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+    return boost::asio::buffer(buffer_.data() + end_, buffer_.size() - end_);
+}
+
+void request_parser::commit(size_t bytes)
+{
+    end_ += bytes;
+}
+
+request_parser::result request_parser::parse(request& out)
+{
+    if (end_ - begin_ < sizeof(request_message))
+    {
+        return result::need_more;
+    }
+
+    request_message header;
+    memcpy(&header, buffer_.data() + begin_, sizeof(header));
+    if (boost::endian::big_to_native(header.nbd_request_magic) != NBD_REQUEST_MAGIC)
+    {
+        return result::bad_magic;
+    }
+    begin_ += sizeof(header);
+
+    out.flags = boost::endian::big_to_native(header.command_flags);
+    out.type = boost::endian::big_to_native(header.type);
+    out.handle = header.handle;
+    out.offset = boost::endian::big_to_native(header.offset);
+    out.length = boost::endian::big_to_native(header.length);
+    return result::request;
+}
+
+size_t request_parser::take(char* dest, size_t max_bytes)
+{
+    size_t n = std::min(max_bytes, end_ - begin_);
+    memcpy(dest, buffer_.data() + begin_, n);
+    begin_ += n;
+    return n;
+}
+
+size_t request_parser::skip(size_t max_bytes)
+{
+    size_t n = std::min(max_bytes, end_ - begin_);
+    begin_ += n;
+    return n;
+}
@@ -0,0 +1,115 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "log.hpp"
+#include "shard_pool.hpp"
+
+std::vector<int> shard_pool::parse_cpu_list(const std::string& list)
+{
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < list.size())
+    {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+        {
+            end = list.size();
+        }
+        std::string range = list.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t dash = range.find('-');
+        try
+        {
+            size_t used = 0;
+            int first = std::stoi(range, &used);
+            int last = first;
+            if (dash != std::string::npos && used == dash)
+            {
+                std::string rest = range.substr(dash + 1);
+                last = std::stoi(rest, &used);
+                used += dash + 1;
+            }
+            if (used != range.size() || first < 0 || last < first || last >= CPU_SETSIZE)
+            {
+                throw std::invalid_argument(range);
+            }
+            for (int cpu = first; cpu <= last; cpu++)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        catch (std::logic_error&)
+        {
+            throw std::invalid_argument("Bad CPU list: " + list);
+        }
+    }
+    return cpus;
+}
+
+shard_pool::shard_pool(const options& opts)
+    : options_(opts)
+{
+    for (size_t i = 0; i < std::max<size_t>(opts.shards, 1); i++)
+    {
+        shard s;
+        s.io_service = std::make_shared<boost::asio::io_service>(1);
+        s.work.reset(new boost::asio::io_service::work(*s.io_service));
+        shards_.push_back(std::move(s));
+    }
+}
+
+shard_pool::~shard_pool()
+{
+    stop();
+    for (auto& thread : threads_)
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+}
+
+void shard_pool::run()
+{
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+        threads_.emplace_back([this, i]
+        {
+            shards_[i].io_service->run();
+        });
+
+        if (!options_.cpus.empty())
+        {
+            // A CPU we can't have isn't fatal. The shard just runs wherever the scheduler puts it.
+            int cpu = options_.cpus[i % options_.cpus.size()];
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            int error = pthread_setaffinity_np(threads_.back().native_handle(), sizeof(set), &set);
+            if (error)
+            {
+                LOG_WARN("Couldn't pin shard {} to CPU {}: {}", i, cpu, strerror(error));
+            }
+        }
+    }
+
+    for (auto& thread : threads_)
+    {
+        thread.join();
+    }
+}
+
+void shard_pool::stop()
+{
+    for (auto& s : shards_)
+    {
+        s.work.reset();
+        s.io_service->stop();
+    }
+}
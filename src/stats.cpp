@@ -0,0 +1,105 @@
+#include <algorithm>
+
+#include "stats.hpp"
+
+void latency_histogram::snapshot::add(const latency_histogram& h)
+{
+    for (size_t i = 0; i < bucket_count; i++)
+    {
+        buckets[i] += h.buckets_[i].get();
+    }
+    count += h.count_.get();
+    sum += h.sum_.get();
+}
+
+uint64_t latency_histogram::snapshot::quantile(double q) const
+{
+    // The buckets are read one at a time while they're being written, so they might not add
+    // up to count exactly. Going by what's in them keeps the answer inside what was recorded.
+    uint64_t recorded = 0;
+    for (uint64_t b : buckets)
+    {
+        recorded += b;
+    }
+    if (recorded == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * recorded + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+        {
+            return lowest(i) + width(i) / 2;
+        }
+    }
+    return lowest(bucket_count - 1);
+}
+
+uint64_t latency_histogram::lowest(size_t index)
+{
+    if (index < (1u << sub_bucket_bits))
+    {
+        return index;
+    }
+    size_t shift = (index >> sub_bucket_bits) - 1;
+    uint64_t sub = index & ((1u << sub_bucket_bits) - 1);
+    return ((1u << sub_bucket_bits) + sub) << shift;
+}
+
+uint64_t latency_histogram::width(size_t index)
+{
+    if (index < (1u << sub_bucket_bits))
+    {
+        return 1;
+    }
+    return uint64_t(1) << ((index >> sub_bucket_bits) - 1);
+}
+
+export_stats::shard& export_stats::local()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::thread::id self = std::this_thread::get_id();
+    for (auto& s : shards_)
+    {
+        if (s.first == self)
+        {
+            return *s.second;
+        }
+    }
+    shards_.emplace_back(self, std::unique_ptr<shard>(new shard()));
+    return *shards_.back().second;
+}
+
+std::unique_ptr<export_stats::totals> export_stats::collect() const
+{
+    std::unique_ptr<totals> t(new totals());
+    t->connections = connections.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& s : shards_)
+    {
+        for (size_t i = 0; i < op_count; i++)
+        {
+            const op& o = s.second->ops[i];
+            t->ops[i].count += o.count.get();
+            t->ops[i].errors += o.errors.get();
+            t->ops[i].bytes += o.bytes.get();
+            t->ops[i].backing.add(o.backing);
+            t->ops[i].total.add(o.total);
+        }
+        t->bytes_in += s.second->bytes_in.get();
+        t->bytes_out += s.second->bytes_out.get();
+        t->read_ahead_bytes += s.second->read_ahead_bytes.get();
+        t->admission_waits += s.second->admission_waits.get();
+        t->throttled += s.second->throttled.get();
+        t->zero_bytes_punched += s.second->zero_bytes_punched.get();
+        t->zero_bytes_skipped += s.second->zero_bytes_skipped.get();
+        t->inflight += s.second->inflight.load(std::memory_order_relaxed);
+        t->outbox += s.second->outbox.load(std::memory_order_relaxed);
+    }
+    return t;
+}
@@ -0,0 +1,356 @@
+#include <csignal>
+#include <cstdio>
+#include <functional>
+
+#include "log.hpp"
+#include "stats_endpoint.hpp"
+
+namespace
+{
+
+// Indexed by NBD command type. Empty for commands that don't get replies of their own.
+const char* const op_names[export_stats::op_count] = {"read", "write", "", "flush", "trim", "cache", "write_zeroes", "block_status"};
+
+const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+// How long an HTTP client gets to send its request.
+const std::chrono::seconds request_timeout(5);
+
+std::string label(const std::string& value)
+{
+    std::string escaped;
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if (c == '\n')
+        {
+            escaped += "\\n";
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+void family(std::string& out, const char* name, const char* type, const char* help)
+{
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void sample(std::string& out, const char* name, const std::string& labels, double value)
+{
+    char number[32];
+    snprintf(number, sizeof(number), "%.9g", value);
+    out += name;
+    out += '{';
+    out += labels;
+    out += "} ";
+    out += number;
+    out += '\n';
+}
+
+// An HTTP request we're waiting on. Whatever it is, it gets the stats.
+struct session
+    : std::enable_shared_from_this<session>
+{
+    session(boost::asio::io_service& io_service, const export_registry& exports)
+        : socket(io_service)
+        , timer(io_service)
+        , request(8192)
+        , exports(exports)
+    {
+    }
+
+    void start()
+    {
+        auto self(shared_from_this());
+        timer.expires_after(request_timeout);
+        timer.async_wait([this, self](const boost::system::error_code& error)
+        {
+            if (!error)
+            {
+                boost::system::error_code ignored;
+                socket.close(ignored);
+            }
+        });
+
+        boost::asio::async_read_until(socket, request, "\r\n\r\n",
+            [this, self](const boost::system::error_code& error, size_t)
+        {
+            timer.cancel();
+            if (error)
+            {
+                return;
+            }
+            std::string body = stats_endpoint::prometheus_text(exports);
+            response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                + std::to_string(body.size()) + "\r\n\r\n" + body;
+            boost::asio::async_write(socket, boost::asio::buffer(response),
+                [this, self](const boost::system::error_code&, size_t)
+            {
+                boost::system::error_code ignored;
+                socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                socket.close(ignored);
+            });
+        });
+    }
+
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::steady_timer timer;
+    boost::asio::streambuf request;
+    std::string response;
+    const export_registry& exports;
+};
+
+}
+
+stats_endpoint::stats_endpoint(boost::asio::io_service& io_service, const export_registry& exports, unsigned short port)
+    : io_service_(io_service)
+    , exports_(exports)
+    , signals_(io_service, SIGUSR1)
+{
+    if (port != 0)
+    {
+        boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), port);
+        acceptor_.reset(new boost::asio::ip::tcp::acceptor(io_service, endpoint));
+        start_accept();
+    }
+    wait_for_signal();
+}
+
+void stats_endpoint::start_accept()
+{
+    auto s = std::make_shared<session>(io_service_, exports_);
+    acceptor_->async_accept(s->socket, [this, s](const boost::system::error_code& error)
+    {
+        if (!error)
+        {
+            s->start();
+        }
+        start_accept();
+    });
+}
+
+void stats_endpoint::wait_for_signal()
+{
+    signals_.async_wait([this](const boost::system::error_code& error, int)
+    {
+        if (error)
+        {
+            return;
+        }
+
+        // Straight to stdout, but after anything already logged, so it isn't split up.
+        std::string text = prometheus_text(exports_);
+        logger::instance().flush();
+        fwrite(text.data(), 1, text.size(), stdout);
+        fflush(stdout);
+        wait_for_signal();
+    });
+}
+
+std::string stats_endpoint::prometheus_text(const export_registry& exports)
+{
+    std::vector<std::pair<std::string, std::unique_ptr<export_stats::totals>>> all;
+    std::vector<group_commit::stats> commits;
+    for (auto& e : exports.list())
+    {
+        all.emplace_back("export=\"" + label(e->name) + "\"", e->stats->collect());
+        commits.push_back(e->commits->get_stats());
+    }
+
+    // Prometheus wants each family's samples together, so we go family by family.
+    std::string out;
+    auto per_op = [&](const char* name, const char* type, const char* help,
+        std::function<double(const export_stats::totals::op_totals&)> value)
+    {
+        family(out, name, type, help);
+        for (auto& e : all)
+        {
+            for (size_t i = 0; i < export_stats::op_count; i++)
+            {
+                if (*op_names[i])
+                {
+                    sample(out, name, e.first + ",op=\"" + op_names[i] + "\"", value(e.second->ops[i]));
+                }
+            }
+        }
+    };
+    per_op("mndb_requests_total", "counter", "Requests replied to.",
+        [](const export_stats::totals::op_totals& o) { return o.count; });
+    per_op("mndb_request_errors_total", "counter", "Requests that failed.",
+        [](const export_stats::totals::op_totals& o) { return o.errors; });
+    per_op("mndb_request_bytes_total", "counter", "Bytes the requests covered.",
+        [](const export_stats::totals::op_totals& o) { return o.bytes; });
+
+    const char* latency = "mndb_request_latency_seconds";
+    family(out, latency, "summary",
+        "Time from parsing a request to its backing I/O completing (stage=backing) and to its reply being written (stage=total).");
+    for (auto& e : all)
+    {
+        for (size_t i = 0; i < export_stats::op_count; i++)
+        {
+            if (!*op_names[i])
+            {
+                continue;
+            }
+            for (auto stage : {std::make_pair("backing", &export_stats::totals::op_totals::backing),
+                    std::make_pair("total", &export_stats::totals::op_totals::total)})
+            {
+                const latency_histogram::snapshot& h = e.second->ops[i].*stage.second;
+                std::string labels = e.first + ",op=\"" + op_names[i] + "\",stage=\"" + stage.first + "\"";
+                for (double q : quantiles)
+                {
+                    char quantile[16];
+                    snprintf(quantile, sizeof(quantile), "%g", q);
+                    sample(out, latency, labels + ",quantile=\"" + quantile + "\"", h.quantile(q) / 1e9);
+                }
+                sample(out, "mndb_request_latency_seconds_sum", labels, h.sum / 1e9);
+                sample(out, "mndb_request_latency_seconds_count", labels, h.count);
+            }
+        }
+    }
+
+    family(out, "mndb_network_bytes_total", "counter", "Bytes received from and sent to clients.");
+    for (auto& e : all)
+    {
+        sample(out, "mndb_network_bytes_total", e.first + ",direction=\"in\"", e.second->bytes_in);
+        sample(out, "mndb_network_bytes_total", e.first + ",direction=\"out\"", e.second->bytes_out);
+    }
+
+    family(out, "mndb_read_ahead_bytes_total", "counter", "Bytes prefetched ahead of sequential and strided reads.");
+    for (auto& e : all)
+    {
+        sample(out, "mndb_read_ahead_bytes_total", e.first, e.second->read_ahead_bytes);
+    }
+
+    family(out, "mndb_admission_waits_total", "counter", "Requests that waited for room under the in-flight limits.");
+    for (auto& e : all)
+    {
+        sample(out, "mndb_admission_waits_total", e.first, e.second->admission_waits);
+    }
+
+    family(out, "mndb_throttled_total", "counter", "Requests delayed by the IOPS and bandwidth limits.");
+    for (auto& e : all)
+    {
+        sample(out, "mndb_throttled_total", e.first, e.second->throttled);
+    }
+
+    family(out, "mndb_zero_write_bytes_total", "counter",
+        "Zero blocks in writes to sparse exports, punched out as holes or skipped as holes already.");
+    for (auto& e : all)
+    {
+        sample(out, "mndb_zero_write_bytes_total", e.first + ",action=\"punched\"", e.second->zero_bytes_punched);
+        sample(out, "mndb_zero_write_bytes_total", e.first + ",action=\"skipped\"", e.second->zero_bytes_skipped);
+    }
+
+    auto gauge = [&](const char* name, const char* help, std::function<double(const export_stats::totals&)> value)
+    {
+        family(out, name, "gauge", help);
+        for (auto& e : all)
+        {
+            sample(out, name, e.first, value(*e.second));
+        }
+    };
+    gauge("mndb_connections", "Connections in transmission.",
+        [](const export_stats::totals& t) { return t.connections; });
+    gauge("mndb_inflight_commands", "Requests received and not yet replied to.",
+        [](const export_stats::totals& t) { return t.inflight; });
+    gauge("mndb_outbox_depth", "Replies waiting to be written.",
+        [](const export_stats::totals& t) { return t.outbox; });
+
+    family(out, "mndb_flushes_total", "counter", "FLUSH requests and FUA writes.");
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        sample(out, "mndb_flushes_total", all[i].first, commits[i].flushes);
+    }
+    family(out, "mndb_syncs_total", "counter", "fdatasync calls made for them.");
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        sample(out, "mndb_syncs_total", all[i].first, commits[i].syncs);
+    }
+
+    // Only mirrored exports have these.
+    std::vector<std::pair<std::string, write_mirror::stats>> mirrors;
+    for (auto& e : exports.list())
+    {
+        if (e->mirror)
+        {
+            mirrors.emplace_back("export=\"" + label(e->name) + "\"", e->mirror->get_stats());
+        }
+    }
+    auto mirror_metric = [&](const char* name, const char* type, const char* help, std::function<double(const write_mirror::stats&)> value)
+    {
+        family(out, name, type, help);
+        for (auto& m : mirrors)
+        {
+            sample(out, name, m.first, value(m.second));
+        }
+    };
+    if (!mirrors.empty())
+    {
+        mirror_metric("mndb_mirror_connected", "gauge", "Whether the export's replica is reachable.",
+            [](const write_mirror::stats& m) { return m.connected ? 1 : 0; });
+        mirror_metric("mndb_mirror_lag_bytes", "gauge", "Bytes written to the export and queued for its replica.",
+            [](const write_mirror::stats& m) { return m.lag_bytes; });
+        mirror_metric("mndb_mirror_dirty_bytes", "gauge", "Bytes the replica missed, waiting to be copied across from the export.",
+            [](const write_mirror::stats& m) { return m.dirty_bytes; });
+        mirror_metric("mndb_mirror_replicated_bytes_total", "counter", "Bytes of writes and zeroes sent to the replica.",
+            [](const write_mirror::stats& m) { return m.replicated_bytes; });
+        mirror_metric("mndb_mirror_resynced_bytes_total", "counter", "Bytes copied to the replica from the export to catch it up.",
+            [](const write_mirror::stats& m) { return m.resynced_bytes; });
+        mirror_metric("mndb_mirror_disconnects_total", "counter", "Times the replica was lost.",
+            [](const write_mirror::stats& m) { return m.disconnects; });
+    }
+
+    // Deduplicated exports all share one store, so apart from what each one maps, these
+    // are the server's.
+    std::shared_ptr<dedup_store> store;
+    uint64_t mapped = 0;
+    for (auto& e : exports.list())
+    {
+        if (e->dedup)
+        {
+            if (!store)
+            {
+                family(out, "mndb_dedup_mapped_bytes", "gauge", "Bytes of a deduplicated export that aren't zeroes.");
+            }
+            store = e->dedup->store();
+            mapped += e->dedup->mapped_blocks();
+            sample(out, "mndb_dedup_mapped_bytes", "export=\"" + label(e->name) + "\"",
+                e->dedup->mapped_blocks() * store->block_size());
+        }
+    }
+    if (store)
+    {
+        dedup_store::stats d = store->get_stats();
+        family(out, "mndb_dedup_stored_bytes", "gauge", "Bytes of distinct blocks in the deduplicating store.");
+        sample(out, "mndb_dedup_stored_bytes", "", d.chunks * store->block_size());
+        family(out, "mndb_dedup_ratio", "gauge", "Bytes mapped by every deduplicated export over bytes stored.");
+        sample(out, "mndb_dedup_ratio", "", d.chunks ? static_cast<double>(mapped) / d.chunks : 1);
+        family(out, "mndb_dedup_written_bytes_total", "counter",
+            "Blocks written to the store, as new data, duplicates of stored blocks, or zeroes.");
+        sample(out, "mndb_dedup_written_bytes_total", "result=\"unique\"", d.unique_blocks * store->block_size());
+        sample(out, "mndb_dedup_written_bytes_total", "result=\"duplicate\"", d.duplicate_blocks * store->block_size());
+        sample(out, "mndb_dedup_written_bytes_total", "result=\"zero\"", d.zero_blocks * store->block_size());
+        family(out, "mndb_dedup_write_seconds_total", "counter", "Time spent hashing and storing the blocks written.");
+        sample(out, "mndb_dedup_write_seconds_total", "", d.put_nanoseconds / 1e9);
+        family(out, "mndb_dedup_hash_collisions_total", "counter", "Blocks whose hash matched a stored block with other data.");
+        sample(out, "mndb_dedup_hash_collisions_total", "", d.collisions);
+    }
+    return out;
+}
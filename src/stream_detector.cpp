@@ -0,0 +1,154 @@
+#include <algorithm>
+
+#include "stream_detector.hpp"
+
+namespace
+{
+
+// The most strided ranges read ahead of a stream at once, since each is its own request.
+const uint64_t max_strided_ahead = 32;
+
+}
+
+stream_detector::stream_detector(const options& opts, uint64_t size)
+    : options_(opts)
+    , size_(size)
+    , streams_(std::max<size_t>(opts.streams, 1))
+{
+}
+
+stream_detector::prefetch stream_detector::on_read(uint64_t offset, uint64_t length)
+{
+    stats_.reads++;
+    if (length == 0)
+    {
+        return prefetch();
+    }
+
+    stream* found = nullptr;
+    for (auto& s : streams_)
+    {
+        uint64_t stride = s.stride ? s.stride : s.candidate_stride;
+        if (s.used && (offset == s.last_offset + s.last_length
+            || (stride && offset == s.last_offset + stride && length == s.last_length)))
+        {
+            found = &s;
+            break;
+        }
+    }
+
+    recent_ = recent_ << 1 | (found ? 1 : 0);
+    if (found)
+    {
+        stats_.stream_reads++;
+        uint64_t window_reads = std::min<uint64_t>(stats_.reads, 64);
+        bool throttled = __builtin_popcountll(recent_) * 100 < options_.min_stream_percent * window_reads;
+        return advance(*found, offset, length, throttled);
+    }
+
+    // A new stream, in place of the least recently used one. If it's the same length as
+    // a recent read a little way before it, it might turn out to be the next in a strided
+    // stream, which the read after it will confirm.
+    uint64_t candidate = 0;
+    stream* victim = &streams_[0];
+    for (auto& s : streams_)
+    {
+        if (s.used && s.last_length == length && offset > s.last_offset + s.last_length
+            && offset - s.last_offset <= options_.max_window && (!candidate || offset - s.last_offset < candidate))
+        {
+            candidate = offset - s.last_offset;
+        }
+        if (!s.used || (victim->used && s.last_used < victim->last_used))
+        {
+            victim = &s;
+        }
+    }
+
+    stream& s = *victim;
+    s.used = true;
+    s.last_offset = offset;
+    s.last_length = length;
+    s.stride = 0;
+    s.candidate_stride = candidate;
+    s.ahead = offset + length;
+    s.window = options_.min_window;
+    s.last_used = stats_.reads;
+    return prefetch();
+}
+
+stream_detector::prefetch stream_detector::advance(stream& s, uint64_t offset, uint64_t length, bool throttled)
+{
+    uint64_t end = offset + length;
+    bool sequential = offset == s.last_offset + s.last_length;
+    bool changed = sequential != (s.stride == 0);
+    s.stride = sequential ? 0 : s.stride ? s.stride : s.candidate_stride;
+    s.candidate_stride = 0;
+    s.last_offset = offset;
+    s.last_length = length;
+    s.last_used = stats_.reads;
+    if (changed)
+    {
+        // It's switched between sequential and strided, so what was read ahead doesn't apply.
+        s.ahead = sequential ? end : offset + s.stride;
+    }
+
+    bool hit = !changed && end <= s.ahead;
+    if (hit)
+    {
+        stats_.hits++;
+    }
+    if (throttled)
+    {
+        s.window = std::max(s.window / 2, options_.min_window);
+        s.ahead = std::max(s.ahead, end);
+        return prefetch();
+    }
+
+    prefetch p;
+    if (sequential)
+    {
+        // Ask for more once the reads have got halfway into what's been read ahead.
+        s.ahead = std::max(s.ahead, end);
+        uint64_t to = std::min(end + s.window, size_);
+        if (s.ahead - end > s.window / 2 || to <= s.ahead)
+        {
+            return p;
+        }
+        if (hit)
+        {
+            // The last round was used, so the next one can be bigger.
+            s.window = std::min(s.window * 2, options_.max_window);
+            to = std::min(end + s.window, size_);
+        }
+        p.offset = s.ahead;
+        p.length = to - s.ahead;
+        p.count = 1;
+        s.ahead = to;
+        stats_.prefetched_bytes += p.length;
+        return p;
+    }
+
+    // Strided, where ahead is the start of the first range that hasn't been read ahead.
+    if (s.ahead <= offset)
+    {
+        s.ahead = offset + s.stride;
+    }
+    uint64_t wanted = std::max<uint64_t>(std::min(s.window / length, max_strided_ahead), 1);
+    uint64_t already = (s.ahead - offset) / s.stride - 1;
+    if (already > wanted / 2 || s.ahead + length > size_)
+    {
+        return p;
+    }
+    if (hit)
+    {
+        s.window = std::min(s.window * 2, options_.max_window);
+        wanted = std::max<uint64_t>(std::min(s.window / length, max_strided_ahead), 1);
+    }
+    p.offset = s.ahead;
+    p.length = length;
+    p.stride = s.stride;
+    p.count = std::min(wanted - already, (size_ - length - s.ahead) / s.stride + 1);
+    s.ahead += p.count * s.stride;
+    stats_.prefetched_bytes += p.count * length;
+    return p;
+}
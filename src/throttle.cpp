@@ -0,0 +1,38 @@
+#include <algorithm>
+
+#include "throttle.hpp"
+
+throttle::throttle(const options& opts)
+    : last_(std::chrono::steady_clock::now())
+{
+    double burst = std::chrono::duration<double>(opts.burst).count();
+    for (auto b : {std::make_pair(&requests_, opts.iops), std::make_pair(&bytes_, opts.bytes_per_second)})
+    {
+        b.first->rate = static_cast<double>(b.second);
+        // Enough for at least one request's worth at a time, or nothing would ever get through
+        // without waiting.
+        b.first->capacity = std::max(b.first->rate * burst, 1.0);
+        b.first->tokens = b.first->capacity;
+    }
+}
+
+double throttle::take(bucket& b, double elapsed, double n)
+{
+    if (b.rate == 0)
+    {
+        return 0;
+    }
+    b.tokens = std::min(b.tokens + elapsed * b.rate, b.capacity) - n;
+    return b.tokens >= 0 ? 0 : -b.tokens / b.rate;
+}
+
+std::chrono::nanoseconds throttle::take(uint64_t length)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - last_).count();
+    last_ = now;
+
+    double wait = std::max(take(requests_, elapsed, 1), take(bytes_, elapsed, static_cast<double>(length)));
+    return std::chrono::nanoseconds(static_cast<int64_t>(wait * 1e9));
+}
@@ -0,0 +1,475 @@
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "uring_io_engine.hpp"
+
+namespace
+{
+
+// There's no liburing dependency, so we talk to the kernel directly.
+int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+// user_data for the eventfd read. Operations use their own address, which is never 0.
+const uint64_t wakeup_tag = 0;
+
+// Set in user_data for vectored submissions, whose address is otherwise aligned.
+const uint64_t vectored_tag = 1;
+
+// Keep single transfers well inside the 32-bit length field.
+const uint64_t max_transfer = 1 << 30;
+
+}
+
+uring_io_engine::uring_io_engine(const options& opts)
+{
+    memset(&params_, 0, sizeof(params_));
+    if (opts.sqpoll)
+    {
+        params_.flags |= IORING_SETUP_SQPOLL;
+        params_.sq_thread_idle = opts.sqpoll_idle_ms;
+    }
+
+    ring_fd_ = io_uring_setup(opts.queue_depth, &params_);
+    if (ring_fd_ < 0)
+    {
+        throw std::runtime_error(std::string("io_uring_setup failed: ") + strerror(errno));
+    }
+
+    sq_ring_size_ = params_.sq_off.array + params_.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params_.cq_off.cqes + params_.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params_.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+    {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED)
+    {
+        close(ring_fd_);
+        throw std::runtime_error("Unable to map the io_uring submission ring");
+    }
+    if (single_mmap)
+    {
+        cq_ring_ = sq_ring_;
+    }
+    else
+    {
+        cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED)
+        {
+            munmap(sq_ring_, sq_ring_size_);
+            close(ring_fd_);
+            throw std::runtime_error("Unable to map the io_uring completion ring");
+        }
+    }
+
+    sqes_size_ = params_.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        if (!single_mmap)
+        {
+            munmap(cq_ring_, cq_ring_size_);
+        }
+        munmap(sq_ring_, sq_ring_size_);
+        close(ring_fd_);
+        throw std::runtime_error("Unable to map the io_uring submission entries");
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.ring_mask);
+    sq_flags_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.flags);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.array);
+
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params_.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params_.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params_.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params_.cq_off.cqes);
+
+    event_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (event_fd_ == -1)
+    {
+        munmap(sqes_, sqes_size_);
+        if (!single_mmap)
+        {
+            munmap(cq_ring_, cq_ring_size_);
+        }
+        munmap(sq_ring_, sq_ring_size_);
+        close(ring_fd_);
+        throw std::runtime_error("Unable to create the io_uring wakeup eventfd");
+    }
+
+    thread_ = std::thread(&uring_io_engine::run, this);
+}
+
+uring_io_engine::~uring_io_engine()
+{
+    stop();
+
+    munmap(sqes_, sqes_size_);
+    if (cq_ring_ != sq_ring_)
+    {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    munmap(sq_ring_, sq_ring_size_);
+    close(ring_fd_);
+    close(event_fd_);
+}
+
+void uring_io_engine::register_buffers(const std::vector<iovec>& buffers)
+{
+    if (io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) < 0)
+    {
+        throw std::runtime_error(std::string("Unable to register io_uring buffers: ") + strerror(errno));
+    }
+    registered_ = buffers;
+}
+
+void uring_io_engine::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake();
+
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+}
+
+void uring_io_engine::dispatch(operation* op)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back(op);
+    }
+    wake();
+}
+
+void uring_io_engine::wake()
+{
+    uint64_t one = 1;
+    ssize_t res = write(event_fd_, &one, sizeof(one));
+    (void)res; // The counter can't overflow in practice, and a pending wakeup is as good as a new one.
+}
+
+bool uring_io_engine::has_room() const
+{
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    unsigned tail = *sq_tail_;
+    // Leave a slot in each ring for re-arming the wakeup read.
+    return tail - head + 1 < params_.sq_entries && in_kernel_ + 1 < params_.cq_entries;
+}
+
+io_uring_sqe* uring_io_engine::next_sqe()
+{
+    io_uring_sqe* sqe = &sqes_[*sq_tail_ & *sq_mask_];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void uring_io_engine::push_sqe()
+{
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & *sq_mask_;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    to_submit_++;
+}
+
+void uring_io_engine::prepare(operation* op)
+{
+    const io_request& r = op->request;
+    io_uring_sqe* sqe = next_sqe();
+    sqe->fd = r.fd;
+    sqe->user_data = reinterpret_cast<uint64_t>(op);
+
+    if (r.op == io_op::sync)
+    {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+    else if (r.op == io_op::prefetch)
+    {
+        sqe->opcode = IORING_OP_FADVISE;
+        sqe->off = r.offset;
+        sqe->len = static_cast<uint32_t>(std::min<uint64_t>(r.length, UINT32_MAX));
+        sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+    }
+    else if (r.op == io_op::discard || r.op == io_op::write_zeroes)
+    {
+        // fallocate takes its length in addr and its mode in len.
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->off = r.offset;
+        sqe->addr = r.length;
+        sqe->len = FALLOC_FL_KEEP_SIZE | (r.op == io_op::discard ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE);
+    }
+    else
+    {
+        char* data = r.data + op->transferred;
+        uint64_t length = std::min(r.length - op->transferred, max_transfer);
+
+        sqe->opcode = r.op == io_op::read ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->off = r.offset + op->transferred;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = static_cast<uint32_t>(length);
+
+        for (size_t i = 0; i < registered_.size(); i++)
+        {
+            char* base = static_cast<char*>(registered_[i].iov_base);
+            if (data >= base && data + length <= base + registered_[i].iov_len)
+            {
+                sqe->opcode = r.op == io_op::read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                sqe->buf_index = static_cast<uint16_t>(i);
+                break;
+            }
+        }
+    }
+
+    push_sqe();
+    in_kernel_++;
+}
+
+void uring_io_engine::prepare_vectored(std::vector<operation*> ops)
+{
+    // Owned by the submission until it completes
+    vectored* v = new vectored;
+    v->ops = std::move(ops);
+    for (operation* op : v->ops)
+    {
+        v->buffers.push_back(iovec{op->request.data, op->request.length});
+    }
+
+    const io_request& r = v->ops.front()->request;
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = r.op == io_op::read ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->fd = r.fd;
+    sqe->off = r.offset;
+    sqe->addr = reinterpret_cast<uint64_t>(v->buffers.data());
+    sqe->len = static_cast<uint32_t>(v->buffers.size());
+    sqe->user_data = reinterpret_cast<uint64_t>(v) | vectored_tag;
+
+    push_sqe();
+    in_kernel_++;
+}
+
+void uring_io_engine::prepare_wakeup()
+{
+    // There's always room for this since the loop reserves a slot for it.
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = event_fd_;
+    sqe->addr = reinterpret_cast<uint64_t>(&event_count_);
+    sqe->len = sizeof(event_count_);
+    sqe->user_data = wakeup_tag;
+    push_sqe();
+}
+
+void uring_io_engine::handle_completion(const io_uring_cqe& cqe)
+{
+    if (cqe.user_data & vectored_tag)
+    {
+        handle_vectored_completion(reinterpret_cast<vectored*>(cqe.user_data & ~vectored_tag), cqe.res);
+        return;
+    }
+
+    operation* op = reinterpret_cast<operation*>(cqe.user_data);
+    in_kernel_--;
+
+    if (cqe.res == -EAGAIN || cqe.res == -EINTR)
+    {
+        backlog_.push_back(op);
+        return;
+    }
+    if (op->request.op == io_op::discard || op->request.op == io_op::write_zeroes)
+    {
+        if (cqe.res == -EOPNOTSUPP || cqe.res == -EINVAL)
+        {
+            // The filesystem (or an older kernel's io_uring) can't do it. zero_range() knows
+            // the fallbacks; it blocks the ring, but only on filesystems we don't expect.
+            complete(op, zero_range(op->request.fd, op->request.offset, op->request.length,
+                op->request.op == io_op::discard));
+            return;
+        }
+        complete(op, cqe.res < 0 ? -cqe.res : 0);
+        return;
+    }
+    if (cqe.res < 0 || op->request.op == io_op::sync || op->request.op == io_op::prefetch)
+    {
+        complete(op, cqe.res < 0 ? -cqe.res : 0);
+        return;
+    }
+    if (cqe.res == 0)
+    {
+        // Ran off the end of the backing file
+        complete(op, EIO);
+        return;
+    }
+
+    op->transferred += cqe.res;
+    if (op->transferred < op->request.length)
+    {
+        // Short read or write, so go around again for the rest.
+        backlog_.push_back(op);
+        return;
+    }
+    complete(op, 0);
+}
+
+void uring_io_engine::handle_vectored_completion(vectored* v, int res)
+{
+    std::unique_ptr<vectored> owner(v);
+    in_kernel_--;
+
+    if (res == -EAGAIN || res == -EINTR)
+    {
+        backlog_.insert(backlog_.end(), v->ops.begin(), v->ops.end());
+        return;
+    }
+    if (res <= 0)
+    {
+        // 0 means it ran off the end of the backing file.
+        for (operation* op : v->ops)
+        {
+            complete(op, res < 0 ? -res : EIO);
+        }
+        return;
+    }
+
+    // A short transfer finishes the operations it covers. The rest go around again, the one it
+    // ended part way into on its own from where it got to.
+    uint64_t done = res;
+    for (operation* op : v->ops)
+    {
+        if (done >= op->request.length)
+        {
+            done -= op->request.length;
+            complete(op, 0);
+        }
+        else
+        {
+            op->transferred = done;
+            done = 0;
+            backlog_.push_back(op);
+        }
+    }
+}
+
+void uring_io_engine::run()
+{
+    // The eventfd read is always outstanding so dispatch() can interrupt our wait.
+    prepare_wakeup();
+
+    for (;;)
+    {
+        bool stopping;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping = stopping_;
+            backlog_.insert(backlog_.end(), pending_.begin(), pending_.end());
+            pending_.clear();
+        }
+
+        while (!backlog_.empty() && has_room())
+        {
+            operation* op = backlog_.front();
+            backlog_.pop_front();
+            std::vector<operation*> ops = take_adjacent(op, backlog_);
+            if (ops.size() == 1)
+            {
+                prepare(op);
+            }
+            else
+            {
+                prepare_vectored(std::move(ops));
+            }
+        }
+
+        if (stopping && in_kernel_ == 0 && backlog_.empty())
+        {
+            return;
+        }
+
+        unsigned flags = IORING_ENTER_GETEVENTS;
+        if (params_.flags & IORING_SETUP_SQPOLL)
+        {
+            // The poller thread picks submissions up by itself unless it's gone idle.
+            if (__atomic_load_n(sq_flags_, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+            {
+                flags |= IORING_ENTER_SQ_WAKEUP;
+            }
+        }
+
+        int res = io_uring_enter(ring_fd_, to_submit_, 1, flags);
+        if (res < 0)
+        {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                // Nothing sensible left to do but fail everything that's waiting.
+                while (!backlog_.empty())
+                {
+                    operation* op = backlog_.front();
+                    backlog_.pop_front();
+                    complete(op, EIO);
+                }
+            }
+        }
+        else if (params_.flags & IORING_SETUP_SQPOLL)
+        {
+            to_submit_ = 0;
+        }
+        else
+        {
+            to_submit_ -= std::min<unsigned>(to_submit_, res);
+        }
+
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            io_uring_cqe cqe = cqes_[head & *cq_mask_];
+            head++;
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+            if (cqe.user_data == wakeup_tag)
+            {
+                prepare_wakeup();
+            }
+            else
+            {
+                handle_completion(cqe);
+            }
+        }
+    }
+}
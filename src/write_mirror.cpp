@@ -0,0 +1,704 @@
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/endian/conversion.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+
+#include "io_worker_pool.hpp"
+#include "log.hpp"
+#include "nbd.hpp"
+#include "write_mirror.hpp"
+#include "zero_scan.hpp"
+
+namespace
+{
+
+// A replica that stops answering for this long is taken for dead.
+const int reply_timeout_seconds = 30;
+
+struct replica_op
+{
+    io_op op;
+    uint64_t offset;
+    uint64_t length;
+    const char* data;
+};
+
+class replica
+{
+public:
+
+    virtual ~replica() {}
+
+    // Does every op, and returns 0 or an errno value. Anything that failed has to be sent
+    // again, and the replica isn't used again after it has.
+    virtual int apply(const std::vector<replica_op>& ops) = 0;
+};
+
+class file_replica
+    : public replica
+{
+public:
+
+    explicit file_replica(int fd)
+        : fd_(fd)
+    {
+    }
+
+    ~file_replica()
+    {
+        close(fd_);
+    }
+
+    int apply(const std::vector<replica_op>& ops) override
+    {
+        for (auto& op : ops)
+        {
+            int error = 0;
+            switch (op.op)
+            {
+            case io_op::write:
+                error = io_worker_pool::positional_io({io_op::write, fd_, op.offset, op.length, const_cast<char*>(op.data), nullptr});
+                break;
+            case io_op::write_zeroes:
+                error = zero_range(fd_, op.offset, op.length, true);
+                break;
+            default:
+                error = fdatasync(fd_) == 0 ? 0 : errno;
+                break;
+            }
+            if (error)
+            {
+                return error;
+            }
+        }
+        return 0;
+    }
+
+private:
+
+    const int fd_;
+};
+
+bool send_all(int sock, const void* data, size_t length)
+{
+    const char* p = static_cast<const char*>(data);
+    while (length > 0)
+    {
+        ssize_t res = send(sock, p, length, MSG_NOSIGNAL);
+        if (res <= 0)
+        {
+            return false;
+        }
+        p += res;
+        length -= res;
+    }
+    return true;
+}
+
+bool recv_all(int sock, void* data, size_t length)
+{
+    char* p = static_cast<char*>(data);
+    while (length > 0)
+    {
+        ssize_t res = recv(sock, p, length, 0);
+        if (res <= 0)
+        {
+            return false;
+        }
+        p += res;
+        length -= res;
+    }
+    return true;
+}
+
+// An export on an NBD server. Each batch is sent in one go and then the replies are read, so
+// the server sees it all at once.
+class nbd_replica
+    : public replica
+{
+public:
+
+    nbd_replica(int sock, uint16_t flags)
+        : sock_(sock)
+        , flags_(flags)
+    {
+    }
+
+    ~nbd_replica()
+    {
+        request_message disconnect = request(NBD_CMD_DISC, 0, 0, 0);
+        send_all(sock_, &disconnect, sizeof(disconnect));
+        close(sock_);
+    }
+
+    int apply(const std::vector<replica_op>& ops) override
+    {
+        uint64_t sent = 0;
+        for (auto& op : ops)
+        {
+            if (op.op == io_op::sync)
+            {
+                // Servers that don't take flushes write everything through anyway.
+                if (flags_ & NBD_FLAG_SEND_FLUSH)
+                {
+                    request_message r = request(NBD_CMD_FLUSH, sent++, 0, 0);
+                    if (!send_all(sock_, &r, sizeof(r)))
+                    {
+                        return EIO;
+                    }
+                }
+                continue;
+            }
+
+            // Without WRITE_ZEROES, zeroes have to be sent as data.
+            bool zeroes = op.op == io_op::write_zeroes;
+            uint64_t chunk = zeroes && (flags_ & NBD_FLAG_SEND_WRITE_ZEROES) ? UINT32_MAX : zeroes ? zero_chunk : op.length;
+            for (uint64_t done = 0; done < op.length; done += chunk)
+            {
+                uint32_t length = static_cast<uint32_t>(std::min(chunk, op.length - done));
+                if (zeroes && (flags_ & NBD_FLAG_SEND_WRITE_ZEROES))
+                {
+                    request_message r = request(NBD_CMD_WRITE_ZEROES, sent++, op.offset + done, length);
+                    if (!send_all(sock_, &r, sizeof(r)))
+                    {
+                        return EIO;
+                    }
+                    continue;
+                }
+                if (zeroes && zero_buffer_.empty())
+                {
+                    zero_buffer_.resize(zero_chunk);
+                }
+                request_message r = request(NBD_CMD_WRITE, sent++, op.offset + done, length);
+                if (!send_all(sock_, &r, sizeof(r)) || !send_all(sock_, zeroes ? zero_buffer_.data() : op.data + done, length))
+                {
+                    return EIO;
+                }
+            }
+        }
+
+        // The replies can come in any order, but there's one for each, and nothing was read.
+        int error = 0;
+        for (uint64_t i = 0; i < sent; i++)
+        {
+            reply_message reply;
+            if (!recv_all(sock_, &reply, sizeof(reply)) || boost::endian::big_to_native(reply.nbd_reply_magic) != NBD_REPLY_MAGIC)
+            {
+                return EIO;
+            }
+            if (!error && reply.error)
+            {
+                error = boost::endian::big_to_native(reply.error);
+            }
+        }
+        return error;
+    }
+
+private:
+
+    static const uint64_t zero_chunk = 1 << 20;
+
+    static request_message request(uint16_t type, uint64_t handle, uint64_t offset, uint32_t length)
+    {
+        request_message r;
+        r.nbd_request_magic = boost::endian::native_to_big(NBD_REQUEST_MAGIC);
+        r.command_flags = 0;
+        r.type = boost::endian::native_to_big(type);
+        r.handle = handle;
+        r.offset = boost::endian::native_to_big(offset);
+        r.length = boost::endian::native_to_big(length);
+        return r;
+    }
+
+    const int sock_;
+    const uint16_t flags_;
+    std::vector<char> zero_buffer_;
+};
+
+std::unique_ptr<replica> open_file(const std::string& path, uint64_t size)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        LOG_WARN("Unable to open replica {}: {}", path, strerror(errno));
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (static_cast<uint64_t>(st.st_size) < size && ftruncate(fd, size) != 0))
+    {
+        LOG_WARN("Unable to size replica {}: {}", path, strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+    return std::unique_ptr<replica>(new file_replica(fd));
+}
+
+// Connects to nbd://host[:port]/name and negotiates with NBD_OPT_GO.
+std::unique_ptr<replica> open_nbd(const std::string& target, uint64_t size)
+{
+    std::string rest = target.substr(strlen("nbd://"));
+    size_t slash = rest.find('/');
+    std::string name = slash == std::string::npos ? std::string() : rest.substr(slash + 1);
+    std::string host = rest.substr(0, slash);
+    std::string port = "10809";
+    size_t colon = host.rfind(':');
+    if (colon != std::string::npos)
+    {
+        port = host.substr(colon + 1);
+        host.resize(colon);
+    }
+
+    addrinfo hints = {};
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+    {
+        LOG_WARN("Unable to resolve replica {}", target);
+        return nullptr;
+    }
+    int sock = socket(addresses->ai_family, SOCK_STREAM, 0);
+    if (sock >= 0 && connect(sock, addresses->ai_addr, addresses->ai_addrlen) != 0)
+    {
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addresses);
+    if (sock < 0)
+    {
+        LOG_DEBUG("Unable to connect to replica {}: {}", target, strerror(errno));
+        return nullptr;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    timeval timeout = {reply_timeout_seconds, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    auto fail = [&](const char* why)
+    {
+        LOG_WARN("Replica {}: {}", target, why);
+        close(sock);
+        return nullptr;
+    };
+
+    initial_message initial;
+    uint32_t client_flags = boost::endian::native_to_big(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES);
+    if (!recv_all(sock, &initial, sizeof(initial)) || boost::endian::big_to_native(initial.nbdmagic) != nbdmagic
+        || !send_all(sock, &client_flags, sizeof(client_flags)))
+    {
+        return fail("not an NBD server");
+    }
+
+    std::vector<char> data(4 + name.size() + 2, 0);
+    uint32_t name_length = boost::endian::native_to_big(static_cast<uint32_t>(name.size()));
+    memcpy(data.data(), &name_length, 4);
+    memcpy(data.data() + 4, name.data(), name.size());
+
+    client_option option;
+    option.optmagic = boost::endian::native_to_big(optmagic);
+    option.option = boost::endian::native_to_big(NBD_OPT_GO);
+    option.length_of_data = boost::endian::native_to_big(static_cast<uint32_t>(data.size()));
+    if (!send_all(sock, &option, sizeof(option)) || !send_all(sock, data.data(), data.size()))
+    {
+        return fail("negotiation failed");
+    }
+
+    uint64_t replica_size = 0;
+    uint16_t flags = 0;
+    for (;;)
+    {
+        server_negotiation_response response;
+        if (!recv_all(sock, &response, sizeof(response)))
+        {
+            return fail("negotiation failed");
+        }
+        uint32_t type = boost::endian::big_to_native(response.reply_type);
+        std::vector<char> payload(boost::endian::big_to_native(response.reply_length));
+        if (!recv_all(sock, payload.data(), payload.size()))
+        {
+            return fail("negotiation failed");
+        }
+        if (type == NBD_REP_INFO && payload.size() >= sizeof(nbd_info_export))
+        {
+            nbd_info_export info;
+            memcpy(&info, payload.data(), sizeof(info));
+            if (boost::endian::big_to_native(info.information_type) == NBD_INFO_EXPORT)
+            {
+                replica_size = boost::endian::big_to_native(info.size_of_export_in_bytes);
+                flags = boost::endian::big_to_native(info.transmission_flags);
+            }
+        }
+        else if (type == NBD_REP_ACK)
+        {
+            break;
+        }
+        else
+        {
+            return fail("no such export");
+        }
+    }
+    if (flags & NBD_FLAG_READ_ONLY)
+    {
+        return fail("the export is read-only");
+    }
+    if (replica_size < size)
+    {
+        return fail("the export is too small");
+    }
+    return std::unique_ptr<replica>(new nbd_replica(sock, flags));
+}
+
+// Returns null, having logged why, if the target can't be reached.
+std::unique_ptr<replica> open_replica(const std::string& target, uint64_t size)
+{
+    return target.compare(0, strlen("nbd://"), "nbd://") == 0 ? open_nbd(target, size) : open_file(target, size);
+}
+
+}
+
+write_mirror::mode write_mirror::parse_mode(const std::string& name)
+{
+    if (name == "sync")
+    {
+        return mode::sync;
+    }
+    if (name == "async")
+    {
+        return mode::async;
+    }
+    throw std::runtime_error("Unknown mirror mode: " + name);
+}
+
+write_mirror::write_mirror(const std::string& target, io_engine& engine, int fd, uint64_t size, const options& opts)
+    : target_(target)
+    , engine_(engine)
+    , fd_(fd)
+    , size_(size)
+    , options_(opts)
+{
+    // Everything starts out dirty, since there's no telling what the replica has.
+    dirty_regions_ = (size_ + options_.region_size - 1) / options_.region_size;
+    dirty_.assign((dirty_regions_ + 63) / 64, ~uint64_t(0));
+    if (dirty_regions_ % 64)
+    {
+        dirty_.back() = (uint64_t(1) << (dirty_regions_ % 64)) - 1;
+    }
+    thread_ = std::thread(&write_mirror::run, this);
+}
+
+write_mirror::~write_mirror()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    thread_.join();
+}
+
+void write_mirror::write(uint64_t offset, uint64_t length, const char* data, handler on_done)
+{
+    item i{io_op::write, offset, length, data, {}, std::move(on_done)};
+    enqueue(std::move(i));
+}
+
+void write_mirror::zero(uint64_t offset, uint64_t length, handler on_done)
+{
+    item i{io_op::write_zeroes, offset, length, nullptr, {}, std::move(on_done)};
+    enqueue(std::move(i));
+}
+
+void write_mirror::flush(handler on_done)
+{
+    if (!sync_mode())
+    {
+        on_done();
+        return;
+    }
+    item i{io_op::sync, 0, 0, nullptr, {}, std::move(on_done)};
+    enqueue(std::move(i));
+}
+
+void write_mirror::enqueue(item i)
+{
+    handler done;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!connected_ || stopping_)
+        {
+            // It'll be picked up by the resync once the replica's back.
+            if (i.op != io_op::sync)
+            {
+                mark_dirty(i.offset, i.length);
+            }
+            done = std::move(i.on_done);
+        }
+        else
+        {
+            if (!sync_mode())
+            {
+                if (i.data)
+                {
+                    i.copy.assign(i.data, i.data + i.length);
+                    i.data = i.copy.data();
+                }
+                if (lag_bytes_ == 0 || lag_bytes_ + i.length <= options_.max_lag)
+                {
+                    done = std::move(i.on_done);
+                    i.on_done = nullptr;
+                }
+            }
+            lag_bytes_ += i.length;
+            queue_.push_back(std::move(i));
+        }
+    }
+    wake_.notify_one();
+    if (done)
+    {
+        done();
+    }
+}
+
+void write_mirror::mark_dirty(uint64_t offset, uint64_t length)
+{
+    if (length == 0 || offset >= size_)
+    {
+        return;
+    }
+    uint64_t last = std::min(offset + length, size_) - 1;
+    for (uint64_t region = offset / options_.region_size; region <= last / options_.region_size; region++)
+    {
+        uint64_t bit = uint64_t(1) << (region % 64);
+        if (!(dirty_[region / 64] & bit))
+        {
+            dirty_[region / 64] |= bit;
+            dirty_regions_++;
+        }
+    }
+}
+
+std::vector<write_mirror::item> write_mirror::take_dirty(size_t count, std::vector<std::vector<char>>& buffers)
+{
+    std::vector<uint64_t> regions;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t total = (size_ + options_.region_size - 1) / options_.region_size;
+        for (uint64_t n = 0; n < total && regions.size() < count && dirty_regions_ > 0; n++)
+        {
+            uint64_t region = (resync_cursor_ + n) % total;
+            uint64_t& word = dirty_[region / 64];
+            if (word == 0)
+            {
+                // Skip the rest of an empty word, but not past the end.
+                n += std::min(63 - region % 64, total - 1 - region);
+                continue;
+            }
+            uint64_t bit = uint64_t(1) << (region % 64);
+            if (word & bit)
+            {
+                word &= ~bit;
+                dirty_regions_--;
+                regions.push_back(region);
+                resync_cursor_ = region + 1;
+            }
+        }
+    }
+
+    // Read them all at once. The engine puts each read after any write to it that's already
+    // been submitted, so they see at least everything the replica missed.
+    buffers.resize(regions.size());
+    std::vector<std::promise<int>> reads(regions.size());
+    for (size_t i = 0; i < regions.size(); i++)
+    {
+        uint64_t offset = regions[i] * options_.region_size;
+        buffers[i].resize(std::min(options_.region_size, size_ - offset));
+        std::promise<int>* read = &reads[i];
+        engine_.submit({io_op::read, fd_, offset, buffers[i].size(), buffers[i].data(),
+            [read](int error)
+            {
+                read->set_value(error);
+            }});
+    }
+
+    std::vector<item> result;
+    for (size_t i = 0; i < regions.size(); i++)
+    {
+        uint64_t offset = regions[i] * options_.region_size;
+        int error = reads[i].get_future().get();
+        if (error)
+        {
+            LOG_WARN("Unable to read {} at {} to resync its replica: {}", target_, offset, strerror(error));
+            std::lock_guard<std::mutex> lock(mutex_);
+            mark_dirty(offset, buffers[i].size());
+            continue;
+        }
+        bool zeroes = is_zero(buffers[i].data(), buffers[i].size());
+        item r{zeroes ? io_op::write_zeroes : io_op::write, offset, buffers[i].size(), zeroes ? nullptr : buffers[i].data(), {}, nullptr, true};
+        result.push_back(std::move(r));
+    }
+    return result;
+}
+
+void write_mirror::run()
+{
+    std::unique_ptr<replica> target;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_)
+    {
+        if (!target)
+        {
+            lock.unlock();
+            target = open_replica(target_, size_);
+            lock.lock();
+            if (!target)
+            {
+                wake_.wait_for(lock, options_.retry, [this] { return stopping_; });
+                continue;
+            }
+            connected_ = true;
+            LOG_INFO("Mirroring to {}, with {} regions to resync", target_, dirty_regions_);
+        }
+
+        if (queue_.empty() && dirty_regions_ == 0)
+        {
+            wake_.wait(lock, [this] { return stopping_ || !queue_.empty() || dirty_regions_ > 0; });
+            continue;
+        }
+
+        // New writes go before resyncing. A batch stops short of anything that overlaps what's
+        // already in it, since a server can do the requests it has in any order, and a flush
+        // goes on its own, as it only covers what's already been done.
+        std::vector<item> batch;
+        std::vector<std::vector<char>> buffers;
+        if (!queue_.empty())
+        {
+            while (!queue_.empty() && batch.size() < options_.batch)
+            {
+                const item& next = queue_.front();
+                bool overlaps = next.op == io_op::sync ? !batch.empty() : false;
+                for (auto& i : batch)
+                {
+                    overlaps = overlaps || i.op == io_op::sync
+                        || (next.offset < i.offset + i.length && i.offset < next.offset + next.length);
+                }
+                if (overlaps)
+                {
+                    break;
+                }
+                batch.push_back(std::move(queue_.front()));
+                queue_.pop_front();
+            }
+        }
+        else
+        {
+            lock.unlock();
+            batch = take_dirty(options_.batch, buffers);
+            lock.lock();
+        }
+
+        lock.unlock();
+        std::vector<replica_op> ops;
+        for (auto& i : batch)
+        {
+            ops.push_back({i.op, i.offset, i.length, i.data});
+        }
+        int error = ops.empty() ? 0 : target->apply(ops);
+        lock.lock();
+
+        std::vector<handler> done;
+        for (auto& i : batch)
+        {
+            if (!i.resync)
+            {
+                lag_bytes_ -= i.length;
+            }
+            if (error && i.op != io_op::sync)
+            {
+                mark_dirty(i.offset, i.length);
+            }
+            else if (i.resync)
+            {
+                resynced_bytes_ += i.length;
+            }
+            else
+            {
+                replicated_bytes_ += i.length;
+            }
+            if (i.on_done)
+            {
+                done.push_back(std::move(i.on_done));
+            }
+        }
+        if (error)
+        {
+            // Everything still queued waits for the resync instead, and nothing waits for it.
+            LOG_WARN("Lost replica {}: {}", target_, strerror(error));
+            for (auto& i : queue_)
+            {
+                lag_bytes_ -= i.length;
+                if (i.op != io_op::sync)
+                {
+                    mark_dirty(i.offset, i.length);
+                }
+                if (i.on_done)
+                {
+                    done.push_back(std::move(i.on_done));
+                }
+            }
+            queue_.clear();
+            connected_ = false;
+            disconnects_++;
+            lock.unlock();
+            target.reset();
+            lock.lock();
+        }
+
+        lock.unlock();
+        for (auto& h : done)
+        {
+            h();
+        }
+        lock.lock();
+    }
+
+    // Nobody's left to wait for the replica.
+    std::vector<handler> done;
+    for (auto& i : queue_)
+    {
+        if (i.on_done)
+        {
+            done.push_back(std::move(i.on_done));
+        }
+    }
+    queue_.clear();
+    connected_ = false;
+    lock.unlock();
+    for (auto& h : done)
+    {
+        h();
+    }
+}
+
+write_mirror::stats write_mirror::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats s;
+    s.connected = connected_;
+    s.lag_bytes = lag_bytes_;
+    s.dirty_bytes = std::min(dirty_regions_ * options_.region_size, size_);
+    s.replicated_bytes = replicated_bytes_;
+    s.resynced_bytes = resynced_bytes_;
+    s.disconnects = disconnects_;
+    return s;
+}
@@ -0,0 +1,133 @@
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MNDB_ZERO_SCAN_X86 1
+#endif
+
+#include "zero_scan.hpp"
+
+namespace
+{
+
+// Each scanner ORs this much together between checks, so a long run of zeroes costs one
+// branch every few cache lines, and data that isn't zero is still caught soon enough.
+const size_t stride = 256;
+
+// Whatever's left after the strides, and the whole lot where there's nothing better.
+bool scan_portable(const char* data, size_t length)
+{
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        uint64_t words[8];
+        memcpy(words, data + i, sizeof(words));
+        uint64_t any = 0;
+        for (uint64_t w : words)
+        {
+            any |= w;
+        }
+        if (any != 0)
+        {
+            return false;
+        }
+    }
+    for (; i < length; i++)
+    {
+        if (data[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+#if MNDB_ZERO_SCAN_X86
+
+__attribute__((target("sse2")))
+bool scan_sse2(const char* data, size_t length)
+{
+    size_t i = 0;
+    for (; i + stride <= length; i += stride)
+    {
+        __m128i any = _mm_setzero_si128();
+        for (size_t j = 0; j < stride; j += 16)
+        {
+            any = _mm_or_si128(any, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + j)));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF)
+        {
+            return false;
+        }
+    }
+    return scan_portable(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+bool scan_avx2(const char* data, size_t length)
+{
+    size_t i = 0;
+    for (; i + stride <= length; i += stride)
+    {
+        __m256i any = _mm256_setzero_si256();
+        for (size_t j = 0; j < stride; j += 32)
+        {
+            any = _mm256_or_si256(any, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + j)));
+        }
+        if (!_mm256_testz_si256(any, any))
+        {
+            return false;
+        }
+    }
+    return scan_portable(data + i, length - i);
+}
+
+__attribute__((target("avx512f")))
+bool scan_avx512(const char* data, size_t length)
+{
+    size_t i = 0;
+    for (; i + stride <= length; i += stride)
+    {
+        __m512i any = _mm512_setzero_si512();
+        for (size_t j = 0; j < stride; j += 64)
+        {
+            any = _mm512_or_si512(any, _mm512_loadu_si512(data + i + j));
+        }
+        if (_mm512_test_epi64_mask(any, any) != 0)
+        {
+            return false;
+        }
+    }
+    return scan_portable(data + i, length - i);
+}
+
+#endif
+
+}
+
+std::vector<zero_scanner> zero_scanners()
+{
+    std::vector<zero_scanner> result{{"portable", scan_portable}};
+#if MNDB_ZERO_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+    {
+        result.push_back({"sse2", scan_sse2});
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        result.push_back({"avx2", scan_avx2});
+    }
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        result.push_back({"avx512", scan_avx512});
+    }
+#endif
+    return result;
+}
+
+const zero_scanner& best_zero_scanner()
+{
+    static const zero_scanner best = zero_scanners().back();
+    return best;
+}
@@ -0,0 +1,375 @@
+// Runs mndb-server on loopback against a scratch image and talks NBD to it with mndb-bench's
+// client, checking the replies to each kind of request.
+
+#define BOOST_TEST_MODULE protocol
+#include <boost/test/unit_test.hpp>
+
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/endian/conversion.hpp>
+#include <boost/filesystem.hpp>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nbd.hpp"
+#include "nbd_client.hpp"
+
+namespace
+{
+
+const uint64_t image_size = 16 * 1024 * 1024;
+
+// A port nothing's listening on, as far as we can tell. The server's given it a moment later.
+std::string free_port()
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    BOOST_REQUIRE(bind(sock, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+    BOOST_REQUIRE(getsockname(sock, reinterpret_cast<sockaddr*>(&address), &length) == 0);
+    close(sock);
+    return std::to_string(ntohs(address.sin_port));
+}
+
+// A server of its own for each test, exporting a sparse image of image_size as "test".
+struct server
+{
+    server()
+        : image(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("mndb-test-%%%%-%%%%.img"))
+        , port(free_port())
+    {
+        std::ofstream(image.string()).close();
+        boost::filesystem::resize_file(image, image_size);
+
+        std::string export_arg = "test=" + image.string();
+        pid = fork();
+        BOOST_REQUIRE(pid >= 0);
+        if (pid == 0)
+        {
+            execl(MNDB_SERVER_PATH, MNDB_SERVER_PATH, "--export", export_arg.c_str(), "--port", port.c_str(),
+                "--log-level", "warn", static_cast<char*>(nullptr));
+            _exit(127);
+        }
+
+        options.port = port;
+        options.export_name = "test";
+    }
+
+    ~server()
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+        boost::filesystem::remove(image);
+    }
+
+    // Keeps trying while the server starts up.
+    int connect(const nbd_client_options& opts, nbd_export_info& info)
+    {
+        std::string error;
+        auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        for (;;)
+        {
+            int sock = nbd_connect(opts, info, error);
+            if (sock >= 0 || std::chrono::steady_clock::now() > give_up)
+            {
+                BOOST_REQUIRE_MESSAGE(sock >= 0, error);
+                return sock;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+
+    int connect()
+    {
+        return connect(options, info);
+    }
+
+    boost::filesystem::path image;
+    std::string port;
+    pid_t pid;
+    nbd_client_options options;
+    nbd_export_info info;
+};
+
+std::vector<char> noise(size_t length)
+{
+    std::mt19937 rng(static_cast<unsigned>(length));
+    std::vector<char> data(length);
+    for (auto& c : data)
+    {
+        c = static_cast<char>(rng());
+    }
+    return data;
+}
+
+// Waits for a simple reply to handle, and for a read's data into data if it succeeded.
+// Returns its error.
+uint32_t simple_reply(int sock, uint64_t handle, std::vector<char>* data = nullptr)
+{
+    reply_message reply;
+    BOOST_REQUIRE(recv_all(sock, &reply, sizeof(reply)));
+    BOOST_REQUIRE_EQUAL(boost::endian::big_to_native(reply.nbd_reply_magic), NBD_REPLY_MAGIC);
+    BOOST_REQUIRE_EQUAL(reply.handle, handle);
+    uint32_t error = boost::endian::big_to_native(reply.error);
+    if (data && error == 0)
+    {
+        BOOST_REQUIRE(recv_all(sock, data->data(), data->size()));
+    }
+    return error;
+}
+
+uint32_t request(int sock, uint16_t type, uint64_t offset, uint32_t length, const void* data = nullptr, uint16_t flags = 0)
+{
+    static uint64_t handle = 0;
+    handle++;
+    BOOST_REQUIRE(nbd_send_request(sock, type, flags, handle, offset, length, data));
+    return simple_reply(sock, handle);
+}
+
+std::vector<char> read_back(int sock, uint64_t offset, uint32_t length)
+{
+    std::vector<char> data(length);
+    BOOST_REQUIRE(nbd_send_request(sock, NBD_CMD_READ, 0, 1, offset, length));
+    BOOST_REQUIRE_EQUAL(simple_reply(sock, 1, &data), 0u);
+    return data;
+}
+
+struct chunk
+{
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    std::vector<char> payload;
+};
+
+chunk structured_reply(int sock)
+{
+    structured_reply_chunk header;
+    BOOST_REQUIRE(recv_all(sock, &header, sizeof(header)));
+    BOOST_REQUIRE_EQUAL(boost::endian::big_to_native(header.nbd_structured_reply_magic), NBD_STRUCTURED_REPLY_MAGIC);
+    chunk c{boost::endian::big_to_native(header.flags), boost::endian::big_to_native(header.type), header.handle,
+        std::vector<char>(boost::endian::big_to_native(header.length))};
+    BOOST_REQUIRE(recv_all(sock, c.payload.data(), c.payload.size()));
+    return c;
+}
+
+template <typename T>
+T big_endian_at(const std::vector<char>& payload, size_t offset)
+{
+    T value;
+    BOOST_REQUIRE(offset + sizeof(value) <= payload.size());
+    memcpy(&value, payload.data() + offset, sizeof(value));
+    return boost::endian::big_to_native(value);
+}
+
+}
+
+BOOST_FIXTURE_TEST_SUITE(protocol, server)
+
+BOOST_AUTO_TEST_CASE(handshake_and_go)
+{
+    int sock = connect();
+    BOOST_CHECK_EQUAL(info.size, image_size);
+    BOOST_CHECK(info.flags & NBD_FLAG_HAS_FLAGS);
+    BOOST_CHECK(!(info.flags & NBD_FLAG_READ_ONLY));
+    BOOST_CHECK(info.flags & NBD_FLAG_SEND_FLUSH);
+    BOOST_CHECK(info.flags & NBD_FLAG_SEND_FUA);
+    BOOST_CHECK(info.flags & NBD_FLAG_SEND_TRIM);
+    BOOST_CHECK(info.flags & NBD_FLAG_SEND_WRITE_ZEROES);
+    BOOST_CHECK_EQUAL(info.max_block_size, 32u * 1024 * 1024);
+    nbd_disconnect(sock);
+
+    // An export that isn't there is refused, and the server carries on.
+    nbd_client_options unknown = options;
+    unknown.export_name = "missing";
+    std::string error;
+    nbd_export_info ignored;
+    BOOST_CHECK_EQUAL(nbd_connect(unknown, ignored, error), -1);
+    nbd_disconnect(connect());
+}
+
+BOOST_AUTO_TEST_CASE(read_after_write)
+{
+    int sock = connect();
+    auto data = noise(64 * 1024 + 100);
+    uint64_t offset = 3 * 4096 + 512;
+    BOOST_REQUIRE_EQUAL(request(sock, NBD_CMD_WRITE, offset, data.size(), data.data()), 0u);
+    BOOST_CHECK(read_back(sock, offset, data.size()) == data);
+
+    // Pipelined, the read is still ordered after the write it overlaps.
+    auto more = noise(8192);
+    BOOST_REQUIRE(nbd_send_request(sock, NBD_CMD_WRITE, 0, 10, offset, more.size(), more.data()));
+    BOOST_REQUIRE(nbd_send_request(sock, NBD_CMD_READ, 0, 11, offset, more.size()));
+    BOOST_CHECK_EQUAL(simple_reply(sock, 10), 0u);
+    std::vector<char> got(more.size());
+    BOOST_CHECK_EQUAL(simple_reply(sock, 11, &got), 0u);
+    BOOST_CHECK(got == more);
+    nbd_disconnect(sock);
+}
+
+BOOST_AUTO_TEST_CASE(out_of_range)
+{
+    int sock = connect();
+    auto data = noise(8192);
+    BOOST_CHECK_EQUAL(request(sock, NBD_CMD_READ, image_size - 4096, 8192), static_cast<uint32_t>(EINVAL));
+    BOOST_CHECK_EQUAL(request(sock, NBD_CMD_READ, image_size + 4096, 4096), static_cast<uint32_t>(EINVAL));
+    BOOST_CHECK_EQUAL(request(sock, NBD_CMD_WRITE, image_size - 4096, data.size(), data.data()), static_cast<uint32_t>(EINVAL));
+    BOOST_CHECK_EQUAL(request(sock, NBD_CMD_TRIM, image_size - 4096, 8192), static_cast<uint32_t>(EINVAL));
+
+    // A write that's too long has its payload thrown away, and the connection carries on.
+    std::vector<char> too_long(info.max_block_size + 4096);
+    BOOST_CHECK_EQUAL(request(sock, NBD_CMD_WRITE, 0, too_long.size(), too_long.data()), static_cast<uint32_t>(EINVAL));
+    BOOST_CHECK_EQUAL(request(sock, NBD_CMD_READ, 0, too_long.size()), static_cast<uint32_t>(EINVAL));
+
+    // None of those wrote anything.
+    BOOST_CHECK(read_back(sock, image_size - 8192, 8192) == std::vector<char>(8192));
+    nbd_disconnect(sock);
+}
+
+BOOST_AUTO_TEST_CASE(trim_reads_back_zeroes)
+{
+    int sock = connect();
+    auto data = noise(256 * 1024);
+    BOOST_REQUIRE_EQUAL(request(sock, NBD_CMD_WRITE, 0, data.size(), data.data()), 0u);
+    BOOST_REQUIRE_EQUAL(request(sock, NBD_CMD_TRIM, 64 * 1024, 128 * 1024), 0u);
+
+    auto expected = data;
+    std::fill(expected.begin() + 64 * 1024, expected.begin() + 192 * 1024, 0);
+    BOOST_CHECK(read_back(sock, 0, data.size()) == expected);
+
+    // WRITE_ZEROES with NO_HOLE, and not on block boundaries.
+    BOOST_REQUIRE_EQUAL(request(sock, NBD_CMD_WRITE_ZEROES, 1000, 3000, nullptr, NBD_CMD_FLAG_NO_HOLE), 0u);
+    std::fill(expected.begin() + 1000, expected.begin() + 4000, 0);
+    BOOST_CHECK(read_back(sock, 0, data.size()) == expected);
+    nbd_disconnect(sock);
+}
+
+BOOST_AUTO_TEST_CASE(flush)
+{
+    int sock = connect();
+    auto data = noise(16 * 1024);
+    BOOST_REQUIRE_EQUAL(request(sock, NBD_CMD_WRITE, 0, data.size(), data.data()), 0u);
+    BOOST_CHECK_EQUAL(request(sock, NBD_CMD_FLUSH, 0, 0), 0u);
+    BOOST_CHECK_EQUAL(request(sock, NBD_CMD_WRITE, 1024 * 1024, data.size(), data.data(), NBD_CMD_FLAG_FUA), 0u);
+    nbd_disconnect(sock);
+
+    // Flushed and FUA writes are in the file itself.
+    std::ifstream file(image.string(), std::ios::binary);
+    std::vector<char> on_disk(data.size());
+    file.read(on_disk.data(), on_disk.size());
+    BOOST_CHECK(on_disk == data);
+    file.seekg(1024 * 1024);
+    file.read(on_disk.data(), on_disk.size());
+    BOOST_CHECK(on_disk == data);
+}
+
+BOOST_AUTO_TEST_CASE(structured_read_holes)
+{
+    nbd_client_options structured = options;
+    structured.structured_replies = true;
+    int sock = connect(structured, info);
+
+    // 4 KiB of data in the middle of 1 MiB that's otherwise never been written.
+    uint64_t offset = 4 * 1024 * 1024;
+    uint32_t length = 1024 * 1024;
+    auto data = noise(4096);
+    BOOST_REQUIRE(nbd_send_request(sock, NBD_CMD_WRITE, 0, 1, offset + 512 * 1024, data.size(), data.data()));
+    BOOST_REQUIRE_EQUAL(simple_reply(sock, 1), 0u);
+
+    BOOST_REQUIRE(nbd_send_request(sock, NBD_CMD_READ, 0, 2, offset, length));
+    std::vector<char> got(length, 'x');
+    uint64_t covered = 0;
+    uint64_t hole_bytes = 0;
+    for (;;)
+    {
+        chunk c = structured_reply(sock);
+        BOOST_REQUIRE_EQUAL(c.handle, 2u);
+        if (c.type == NBD_REPLY_TYPE_OFFSET_DATA)
+        {
+            uint64_t at = big_endian_at<uint64_t>(c.payload, 0) - offset;
+            BOOST_REQUIRE(at + c.payload.size() - 8 <= length);
+            std::copy(c.payload.begin() + 8, c.payload.end(), got.begin() + at);
+            covered += c.payload.size() - 8;
+        }
+        else if (c.type == NBD_REPLY_TYPE_OFFSET_HOLE)
+        {
+            uint64_t at = big_endian_at<uint64_t>(c.payload, 0) - offset;
+            uint32_t size = big_endian_at<uint32_t>(c.payload, 8);
+            BOOST_REQUIRE(at + size <= length);
+            std::fill(got.begin() + at, got.begin() + at + size, 0);
+            covered += size;
+            hole_bytes += size;
+        }
+        else
+        {
+            BOOST_FAIL("Unexpected chunk type " << c.type);
+        }
+        if (c.flags & NBD_REPLY_FLAG_DONE)
+        {
+            break;
+        }
+    }
+
+    std::vector<char> expected(length);
+    std::copy(data.begin(), data.end(), expected.begin() + 512 * 1024);
+    BOOST_CHECK_EQUAL(covered, length);
+    BOOST_CHECK(got == expected);
+    BOOST_CHECK_EQUAL(hole_bytes, length - data.size());
+
+    // Errors come as an error chunk.
+    BOOST_REQUIRE(nbd_send_request(sock, NBD_CMD_READ, 0, 3, image_size, 4096));
+    chunk c = structured_reply(sock);
+    BOOST_CHECK_EQUAL(c.type, NBD_REPLY_TYPE_ERROR);
+    BOOST_CHECK(c.flags & NBD_REPLY_FLAG_DONE);
+    BOOST_CHECK_EQUAL(big_endian_at<uint32_t>(c.payload, 0), static_cast<uint32_t>(EINVAL));
+    nbd_disconnect(sock);
+}
+
+BOOST_AUTO_TEST_CASE(block_status)
+{
+    nbd_client_options allocation = options;
+    allocation.structured_replies = true;
+    allocation.base_allocation = true;
+    int sock = connect(allocation, info);
+
+    auto data = noise(64 * 1024);
+    BOOST_REQUIRE(nbd_send_request(sock, NBD_CMD_WRITE, 0, 1, 0, data.size(), data.data()));
+    BOOST_REQUIRE_EQUAL(simple_reply(sock, 1), 0u);
+
+    BOOST_REQUIRE(nbd_send_request(sock, NBD_CMD_BLOCK_STATUS, 0, 2, 0, 1024 * 1024));
+    chunk c = structured_reply(sock);
+    BOOST_REQUIRE_EQUAL(c.type, NBD_REPLY_TYPE_BLOCK_STATUS);
+    BOOST_CHECK(c.flags & NBD_REPLY_FLAG_DONE);
+    BOOST_CHECK_EQUAL(c.handle, 2u);
+    BOOST_CHECK_EQUAL(big_endian_at<uint32_t>(c.payload, 0), info.base_allocation_id);
+
+    // Data where we wrote, then a hole, as far as the reply goes.
+    size_t descriptors = (c.payload.size() - 4) / sizeof(block_descriptor);
+    BOOST_REQUIRE_EQUAL(descriptors, 2u);
+    BOOST_CHECK_EQUAL(big_endian_at<uint32_t>(c.payload, 4), data.size());
+    BOOST_CHECK_EQUAL(big_endian_at<uint32_t>(c.payload, 8), 0u);
+    BOOST_CHECK_EQUAL(big_endian_at<uint32_t>(c.payload, 12), 1024 * 1024 - data.size());
+    BOOST_CHECK_EQUAL(big_endian_at<uint32_t>(c.payload, 16), NBD_STATE_HOLE | NBD_STATE_ZERO);
+
+    // REQ_ONE gets just the first extent.
+    BOOST_REQUIRE(nbd_send_request(sock, NBD_CMD_BLOCK_STATUS, NBD_CMD_FLAG_REQ_ONE, 3, 0, 1024 * 1024));
+    c = structured_reply(sock);
+    BOOST_REQUIRE_EQUAL(c.type, NBD_REPLY_TYPE_BLOCK_STATUS);
+    BOOST_CHECK_EQUAL(c.payload.size(), 4 + sizeof(block_descriptor));
+    nbd_disconnect(sock);
+}
+
+BOOST_AUTO_TEST_SUITE_END()